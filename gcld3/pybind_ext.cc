@@ -15,11 +15,16 @@ PYBIND11_MODULE(pybind_ext, py_module) {
   py::class_<NNetLanguageIdentifier>(py_module, "NNetLanguageIdentifier")
       .def(py::init<const int, const int>(), py::arg("min_num_bytes"),
            py::arg("max_num_bytes"))
-      .def("FindLanguage", &NNetLanguageIdentifier::FindLanguage,
+      .def("FindLanguage",
+           static_cast<NNetLanguageIdentifier::Result (
+               NNetLanguageIdentifier::*)(const std::string &)>(
+               &NNetLanguageIdentifier::FindLanguage),
            py::arg("text"))
       .def("FindTopNMostFreqLangs",
-           &NNetLanguageIdentifier::FindTopNMostFreqLangs, py::arg("text"),
-           py::arg("num_langs"))
+           static_cast<std::vector<NNetLanguageIdentifier::Result> (
+               NNetLanguageIdentifier::*)(const std::string &, int)>(
+               &NNetLanguageIdentifier::FindTopNMostFreqLangs),
+           py::arg("text"), py::arg("num_langs"))
       .def_readonly_static("kUnknown", &NNetLanguageIdentifier::kUnknown)
       .def_readonly_static("kMinNumBytesToConsider",
                            &NNetLanguageIdentifier::kMinNumBytesToConsider)
@@ -22,16 +22,27 @@ SRCS = [
     'src/base.cc',
     'src/embedding_feature_extractor.cc',
     'src/embedding_network.cc',
+    'src/embedding_reordering.cc',
+    'src/executor.cc',
     'src/feature_extractor.cc',
     'src/feature_types.cc',
     'src/fml_parser.cc',
+    'src/int8_quantized_nn_params.cc',
     'src/lang_id_nn_params.cc',
+    'src/language_id_model.cc',
     'src/language_identifier_features.cc',
     'src/language_identifier_main.cc',
+    'src/mmap_embedding_network_params.cc',
+    'src/model_file.cc',
+    'src/model_replicas.cc',
     'src/nnet_language_identifier.cc',
     'src/registry.cc',
     'src/relevant_script_feature.cc',
+    'src/result_cache.cc',
+    'src/script_languages.cc',
     'src/sentence_features.cc',
+    'src/simd_adders.cc',
+    'src/streaming_language_detector.cc',
     'src/task_context.cc',
     'src/task_context_params.cc',
     'src/unicodetext.cc',
@@ -61,6 +61,7 @@ typedef unsigned int uint32;
 
 #ifndef SWIG
 typedef int int32;
+typedef signed char int8;      // NOLINT
 typedef unsigned char uint8;    // NOLINT
 typedef unsigned short uint16;  // NOLINT
 
@@ -73,8 +74,10 @@ typedef signed int char32;
 
 #ifdef COMPILER_MSVC
 typedef __int64 int64;
+typedef unsigned __int64 uint64;
 #else
-typedef long long int64;  // NOLINT
+typedef long long int64;            // NOLINT
+typedef unsigned long long uint64;  // NOLINT
 #endif  // COMPILER_MSVC
 
 #if defined(__GNUC__) && \
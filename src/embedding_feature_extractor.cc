@@ -46,6 +46,16 @@ void GenericEmbeddingFeatureExtractor::Setup(TaskContext *context) {
   }
 }
 
+void GenericEmbeddingFeatureExtractor::SetupFromDescriptors(
+    const std::vector<FeatureExtractorDescriptor> &descriptors,
+    const std::vector<int> &embedding_dims, TaskContext *context) {
+  CLD3_CHECK(descriptors.size() == embedding_dims.size());
+  embedding_fml_.clear();
+  embedding_names_.clear();
+  add_strings_ = false;
+  embedding_dims_ = embedding_dims;
+}
+
 void GenericEmbeddingFeatureExtractor::Init(TaskContext *context) {}
 
 }  // namespace chrome_lang_id
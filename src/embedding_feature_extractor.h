@@ -51,6 +51,13 @@ class GenericEmbeddingFeatureExtractor {
   virtual void Setup(TaskContext *context);
   virtual void Init(TaskContext *context);
 
+  // Same as Setup(), but from pre-parsed feature descriptors, one per
+  // embedding space, and the dimensions of the embedding spaces, instead of
+  // the FML and dimensions in context.
+  virtual void SetupFromDescriptors(
+      const std::vector<FeatureExtractorDescriptor> &descriptors,
+      const std::vector<int> &embedding_dims, TaskContext *context);
+
   // Requests workspace for the underlying feature extractors. This is
   // implemented in the typed class.
   virtual void RequestWorkspaces(WorkspaceRegistry *registry) = 0;
@@ -128,6 +135,19 @@ class EmbeddingFeatureExtractor : public GenericEmbeddingFeatureExtractor {
     }
   }
 
+  // Same as Setup(), from pre-parsed feature descriptors.
+  void SetupFromDescriptors(
+      const std::vector<FeatureExtractorDescriptor> &descriptors,
+      const std::vector<int> &embedding_dims, TaskContext *context) override {
+    GenericEmbeddingFeatureExtractor::SetupFromDescriptors(
+        descriptors, embedding_dims, context);
+    feature_extractors_.resize(descriptors.size());
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+      feature_extractors_[i].InitFromDescriptor(descriptors[i]);
+      feature_extractors_[i].Setup(context);
+    }
+  }
+
   // Initializes resources needed by the feature extractors.
   void Init(TaskContext *context) override {
     GenericEmbeddingFeatureExtractor::Init(context);
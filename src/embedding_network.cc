@@ -15,9 +15,13 @@ limitations under the License.
 
 #include "embedding_network.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "base.h"
 #include "embedding_network_params.h"
 #include "float16.h"
+#include "simd_adders.h"
 #include "simple_adder.h"
 
 namespace chrome_lang_id {
@@ -47,34 +51,181 @@ void FillMatrixParams(const EmbeddingNetworkParams::Matrix source_matrix,
 }
 
 // Computes y = weights * Relu(x) + b where Relu is optionally applied.
+//
+// x holds batch_size input vectors, one after the other, and on return y holds
+// the batch_size corresponding output vectors.  The loop over the batch is the
+// inner one: each row of weights is loaded once and applied to all inputs,
+// which is the cache-friendly way to compute the matrix-matrix product.
 template <typename ScaleAdderClass>
 void SparseReluProductPlusBias(bool apply_relu,
                                const EmbeddingNetwork::Matrix &weights,
                                const EmbeddingNetwork::VectorWrapper &b,
                                const EmbeddingNetwork::Vector &x,
-                               EmbeddingNetwork::Vector *y) {
-  y->assign(b.data(), b.data() + b.size());
-  ScaleAdderClass adder(y->data(), y->size());
+                               int batch_size, EmbeddingNetwork::Vector *y) {
+  const int x_size = weights.size();
+  const int y_size = b.size();
+  CLD3_DCHECK(static_cast<int>(x.size()) == batch_size * x_size);
+  y->resize(batch_size * y_size);
+  for (int n = 0; n < batch_size; ++n) {
+    std::copy(b.data(), b.data() + y_size, y->data() + n * y_size);
+  }
 
-  const int x_size = x.size();
   for (int i = 0; i < x_size; ++i) {
-    const float &scale = x[i];
-    if (apply_relu) {
-      if (scale > 0) {
-        adder.LazyScaleAdd(weights[i].data(), scale);
+    const float *weights_row = weights[i].data();
+    for (int n = 0; n < batch_size; ++n) {
+      const float scale = x[n * x_size + i];
+      if (apply_relu && !(scale > 0)) {
+        continue;
       }
-    } else {
-      adder.LazyScaleAdd(weights[i].data(), scale);
+      ScaleAdderClass::ScaleAddImpl(weights_row, y_size, scale,
+                                    y->data() + n * y_size);
+    }
+  }
+}
+
+// Same as SparseReluProductPlusBias, but for int8 weights (see
+// QuantizationType::INT8).  Each input vector is multiplied by the per-row
+// weight scales and quantized to int8 with a single scale, once per layer, so
+// that each output is the int32 dot product of a column of weights and the
+// quantized input; the result is dequantized once, at the end.  columns holds
+// the weights in column-major order (see TransposeInt8Weights).
+//
+// The intermediate buffers are taken from scratch.
+template <typename ScaleAdderClass>
+void Int8ReluProductPlusBias(bool apply_relu,
+                             const EmbeddingNetworkParams::Matrix &weights,
+                             const std::vector<int8> &columns,
+                             const EmbeddingNetwork::VectorWrapper &b,
+                             const EmbeddingNetwork::Vector &x, int batch_size,
+                             EmbeddingNetwork::Scratch *scratch,
+                             EmbeddingNetwork::Vector *y) {
+  const int x_size = weights.rows;
+  const int y_size = weights.cols;
+  CLD3_DCHECK(b.size() == y_size);
+  CLD3_DCHECK(static_cast<int>(x.size()) == batch_size * x_size);
+
+  // Quantize the inputs.
+  std::vector<int8> &quant_x = scratch->quant_input;
+  std::vector<float> &x_scales = scratch->input_scales;
+  EmbeddingNetwork::Vector &scaled_x = scratch->scaled_input;
+  quant_x.resize(batch_size * x_size);
+  x_scales.resize(batch_size);
+  scaled_x.resize(x_size);
+  for (int n = 0; n < batch_size; ++n) {
+    float max_abs = 0.0f;
+    for (int i = 0; i < x_size; ++i) {
+      const float value = x[n * x_size + i];
+      scaled_x[i] = (apply_relu && !(value > 0))
+                        ? 0.0f
+                        : value * Float16To32(weights.quant_scales[i]);
+      max_abs = std::max(max_abs, std::abs(scaled_x[i]));
+    }
+    x_scales[n] = max_abs / 127.0f;
+    const float inverse_scale = (max_abs > 0.0f) ? 127.0f / max_abs : 0.0f;
+
+    // Round half away from zero, without a call per element.
+    for (int i = 0; i < x_size; ++i) {
+      const float value = scaled_x[i] * inverse_scale;
+      quant_x[n * x_size + i] =
+          static_cast<int8>(value + ((value >= 0.0f) ? 0.5f : -0.5f));
+    }
+  }
+
+  // Integer matrix-matrix product, dequantized and added to the bias.  Each
+  // column of weights is loaded once and applied to all inputs.
+  y->resize(batch_size * y_size);
+  for (int j = 0; j < y_size; ++j) {
+    const int8 *column = columns.data() + j * x_size;
+    for (int n = 0; n < batch_size; ++n) {
+      const int32 dot = ScaleAdderClass::Int8DotImpl(
+          column, quant_x.data() + n * x_size, x_size);
+      (*y)[n * y_size + j] = b.data()[j] + x_scales[n] * dot;
+    }
+  }
+}
+
+// Computes y = weights * Relu(x) + b, using int8_weights (and their
+// int8_columns) if they are quantized, and weights otherwise.
+template <typename ScaleAdderClass>
+void ReluProductPlusBias(bool apply_relu,
+                         const EmbeddingNetwork::Matrix &weights,
+                         const EmbeddingNetworkParams::Matrix &int8_weights,
+                         const std::vector<int8> &int8_columns,
+                         const EmbeddingNetwork::VectorWrapper &b,
+                         const EmbeddingNetwork::Vector &x, int batch_size,
+                         EmbeddingNetwork::Scratch *scratch,
+                         EmbeddingNetwork::Vector *y) {
+  if (int8_weights.quant_type == QuantizationType::INT8) {
+    Int8ReluProductPlusBias<ScaleAdderClass>(apply_relu, int8_weights,
+                                             int8_columns, b, x, batch_size,
+                                             scratch, y);
+  } else {
+    SparseReluProductPlusBias<ScaleAdderClass>(apply_relu, weights, b, x,
+                                               batch_size, y);
+  }
+}
+
+// Sets *columns to the int8 weights of int8_mat in column-major order: column
+// c of int8_mat starts at index c * int8_mat.rows.
+void TransposeInt8Weights(const EmbeddingNetworkParams::Matrix &int8_mat,
+                          std::vector<int8> *columns) {
+  const int8 *weights = reinterpret_cast<const int8 *>(int8_mat.elements);
+  columns->resize(int8_mat.rows * int8_mat.cols);
+  for (int r = 0; r < int8_mat.rows; ++r) {
+    for (int c = 0; c < int8_mat.cols; ++c) {
+      (*columns)[c * int8_mat.rows + r] = weights[r * int8_mat.cols + c];
     }
   }
-  adder.Finalize();
 }
-}  // namespace
 
-void EmbeddingNetwork::ConcatEmbeddings(
-    const std::vector<FeatureVector> &feature_vectors, Vector *concat) const {
-  concat->resize(model_->concat_layer_size());
+// Sets either *mat (for float weights) or *int8_mat and *int8_columns (for
+// int8 weights) from source_matrix.  In the first case, int8_mat->quant_type
+// is set to NONE and int8_columns is left empty; in the second one, mat is
+// left empty.
+void FillLayerParams(const EmbeddingNetworkParams::Matrix source_matrix,
+                     EmbeddingNetwork::Matrix *mat,
+                     EmbeddingNetworkParams::Matrix *int8_mat,
+                     std::vector<int8> *int8_columns) {
+  *int8_mat = source_matrix;
+  if (source_matrix.quant_type == QuantizationType::INT8) {
+    CLD3_CHECK(source_matrix.quant_scales != nullptr);
+    mat->clear();
+    TransposeInt8Weights(source_matrix, int8_columns);
+  } else {
+    int8_mat->quant_type = QuantizationType::NONE;
+    int8_columns->clear();
+    FillMatrixParams(source_matrix, mat);
+  }
+}
+
+// Returns the float value of the weight at row r, column c of int8_mat.
+inline float GetInt8Weight(const EmbeddingNetworkParams::Matrix &int8_mat,
+                           int r, int c) {
+  return reinterpret_cast<const int8 *>(int8_mat.elements)[r * int8_mat.cols +
+                                                           c] *
+         Float16To32(int8_mat.quant_scales[r]);
+}
+
+// Decodes the fi-th feature from feature_vector: sets *id to the vocabulary
+// element and *weight to the weight of its embedding.
+void GetFeatureIdAndWeight(const FeatureVector &feature_vector, int fi,
+                           int *id, float *weight) {
+  const FeatureValue feature_value = feature_vector.value(fi);
+  if (feature_vector.type(fi)->is_continuous()) {
+    // Continuous features (encoded as FloatFeatureValue).
+    FloatFeatureValue float_feature_value(feature_value);
+    *id = float_feature_value.value.id;
+    *weight = float_feature_value.value.weight;
+  } else {
+    // Discrete features: every present feature has implicit value 1.0.
+    *id = feature_value;
+    *weight = 1.0f;
+  }
+}
+}  // namespace
 
+void EmbeddingNetwork::AddEmbeddings(
+    const std::vector<FeatureVector> &feature_vectors, float *concat) const {
   // "es_index" stands for "embedding space index".
   for (size_t es_index = 0; es_index < feature_vectors.size(); ++es_index) {
     const int concat_offset = model_->concat_offset(es_index);
@@ -92,28 +243,21 @@ void EmbeddingNetwork::ConcatEmbeddings(
       const FeatureType *feature_type = feature_vector.type(fi);
       int feature_offset = concat_offset + feature_type->base() * embedding_dim;
       CLD3_DCHECK(feature_offset + embedding_dim <=
-                  static_cast<int>(concat->size()));
+                  model_->concat_layer_size());
 
       // Weighted embeddings will be added starting from this address.
-      float *concat_ptr = concat->data() + feature_offset;
+      float *concat_ptr = concat + feature_offset;
 
       // Pointer to float / uint8 weights for relevant embedding.
       const void *embedding_data;
 
       // Multiplier for each embedding weight.
       float multiplier;
-      const FeatureValue feature_value = feature_vector.value(fi);
-      if (feature_type->is_continuous()) {
-        // Continuous features (encoded as FloatFeatureValue).
-        FloatFeatureValue float_feature_value(feature_value);
-        const int id = float_feature_value.value.id;
-        embedding_matrix.get_embedding(id, &embedding_data, &multiplier);
-        multiplier *= float_feature_value.value.weight;
-      } else {
-        // Discrete features: every present feature has implicit value 1.0.
-        embedding_matrix.get_embedding(feature_value, &embedding_data,
-                                       &multiplier);
-      }
+      int id;
+      float weight;
+      GetFeatureIdAndWeight(feature_vector, fi, &id, &weight);
+      embedding_matrix.get_embedding(id, &embedding_data, &multiplier);
+      multiplier *= weight;
 
       if (is_quantized) {
         const uint8 *quant_weights =
@@ -133,49 +277,167 @@ void EmbeddingNetwork::ConcatEmbeddings(
 }
 
 template <typename ScaleAdderClass>
-void EmbeddingNetwork::FinishComputeFinalScores(const Vector &concat,
-                                                Vector *scores) const {
-  Vector h0(hidden_bias_[0].size());
-  SparseReluProductPlusBias<ScaleAdderClass>(false, hidden_weights_[0],
-                                             hidden_bias_[0], concat, &h0);
+void EmbeddingNetwork::ComputeFinalScoresImpl(
+    const std::vector<FeatureVector> *features, int batch_size,
+    Scratch *scratch, const OutputSubset *subset, Vector *scores) const {
+  const int concat_size = model_->concat_layer_size();
+  Vector &concat = scratch->concat;
+  concat.assign(batch_size * concat_size, 0.0f);
+  for (int n = 0; n < batch_size; ++n) {
+    AddEmbeddings(features[n], concat.data() + n * concat_size);
+  }
+  ReluProductPlusBias<ScaleAdderClass>(
+      false, hidden_weights_[0], hidden_int8_weights_[0],
+      hidden_int8_columns_[0], hidden_bias_[0], concat, batch_size, scratch,
+      &scratch->h0);
+  FinishComputeFinalScores<ScaleAdderClass>(batch_size, scratch, subset,
+                                            scores);
+}
 
+template <typename ScaleAdderClass>
+void EmbeddingNetwork::FinishComputeFinalScores(int batch_size,
+                                                Scratch *scratch,
+                                                const OutputSubset *subset,
+                                                Vector *scores) const {
   CLD3_DCHECK((hidden_weights_.size() == 1) || (hidden_weights_.size() == 2));
-  if (hidden_weights_.size() == 1) {  // 1 hidden layer
-    SparseReluProductPlusBias<ScaleAdderClass>(true, softmax_weights_,
-                                               softmax_bias_, h0, scores);
-  } else if (hidden_weights_.size() == 2) {  // 2 hidden layers
-    Vector h1(hidden_bias_[1].size());
-    SparseReluProductPlusBias<ScaleAdderClass>(true, hidden_weights_[1],
-                                               hidden_bias_[1], h0, &h1);
-    SparseReluProductPlusBias<ScaleAdderClass>(true, softmax_weights_,
-                                               softmax_bias_, h1, scores);
+  const Vector *softmax_input = &scratch->h0;
+  if (hidden_weights_.size() == 2) {  // 2 hidden layers
+    ReluProductPlusBias<ScaleAdderClass>(
+        true, hidden_weights_[1], hidden_int8_weights_[1],
+        hidden_int8_columns_[1], hidden_bias_[1], scratch->h0, batch_size,
+        scratch, &scratch->h1);
+    softmax_input = &scratch->h1;
+  }
+  if (subset != nullptr) {
+    SparseReluProductPlusBias<ScaleAdderClass>(
+        true, subset->weight_rows_,
+        VectorWrapper(subset->bias_.data(), subset->size()), *softmax_input,
+        batch_size, scores);
+  } else {
+    ReluProductPlusBias<ScaleAdderClass>(
+        true, softmax_weights_, softmax_int8_weights_, softmax_int8_columns_,
+        softmax_bias_, *softmax_input, batch_size, scratch, scores);
   }
 }
 
 void EmbeddingNetwork::ComputeFinalScores(
     const std::vector<FeatureVector> &features, Vector *scores) const {
-  Vector concat;
-  ConcatEmbeddings(features, &concat);
+  Scratch scratch;
+  ComputeFinalScores(features, &scratch, scores);
+}
+
+void EmbeddingNetwork::ComputeFinalScores(
+    const std::vector<FeatureVector> &features, Scratch *scratch,
+    Vector *scores) const {
+  ComputeFinalScores(features, scratch, /*subset=*/nullptr, scores);
+}
+
+void EmbeddingNetwork::ComputeFinalScores(
+    const std::vector<FeatureVector> &features, Scratch *scratch,
+    const OutputSubset *subset, Vector *scores) const {
+  (this->*compute_final_scores_)(&features, /*batch_size=*/1, scratch, subset,
+                                 scores);
+}
 
-  scores->resize(softmax_bias_.size());
-  FinishComputeFinalScores<SimpleAdder>(concat, scores);
+void EmbeddingNetwork::ComputeFinalScoresBatch(
+    const std::vector<std::vector<FeatureVector>> &features,
+    Vector *scores) const {
+  Scratch scratch;
+  ComputeFinalScoresBatch(features, &scratch, scores);
+}
+
+void EmbeddingNetwork::ComputeFinalScoresBatch(
+    const std::vector<std::vector<FeatureVector>> &features, Scratch *scratch,
+    Vector *scores) const {
+  ComputeFinalScoresBatch(features, scratch, /*subset=*/nullptr, scores);
+}
+
+void EmbeddingNetwork::ComputeFinalScoresBatch(
+    const std::vector<std::vector<FeatureVector>> &features, Scratch *scratch,
+    const OutputSubset *subset, Vector *scores) const {
+  (this->*compute_final_scores_)(features.data(), features.size(), scratch,
+                                 subset, scores);
+}
+
+EmbeddingNetwork::OutputSubset::OutputSubset(const EmbeddingNetwork &network,
+                                             const std::vector<int> &classes)
+    : classes_(classes) {
+  const int num_classes = classes_.size();
+  const EmbeddingNetworkParams::Matrix &int8_weights =
+      network.softmax_int8_weights_;
+  const bool is_int8 = int8_weights.quant_type == QuantizationType::INT8;
+  const int num_inputs =
+      is_int8 ? int8_weights.rows : network.softmax_weights_.size();
+  bias_.resize(num_classes);
+  weights_.resize(num_inputs * num_classes);
+  for (int j = 0; j < num_classes; ++j) {
+    const int class_id = classes_[j];
+    CLD3_CHECK(class_id >= 0);
+    CLD3_CHECK(class_id < network.num_classes());
+    bias_[j] = network.softmax_bias_.data()[class_id];
+    for (int i = 0; i < num_inputs; ++i) {
+      weights_[i * num_classes + j] =
+          is_int8 ? GetInt8Weight(int8_weights, i, class_id)
+                  : network.softmax_weights_[i].data()[class_id];
+    }
+  }
+  weight_rows_.resize(num_inputs);
+  for (int i = 0; i < num_inputs; ++i) {
+    weight_rows_[i] =
+        VectorWrapper(weights_.data() + i * num_classes, num_classes);
+  }
+}
+
+bool EmbeddingNetwork::OutputSubset::Contains(int class_id) const {
+  return std::find(classes_.begin(), classes_.end(), class_id) !=
+         classes_.end();
 }
 
 EmbeddingNetwork::EmbeddingNetwork(const EmbeddingNetworkParams *model)
-    : model_(model) {
+    : EmbeddingNetwork(model, GetBestAdderType()) {}
+
+EmbeddingNetwork::EmbeddingNetwork(const EmbeddingNetworkParams *model,
+                                   AdderType adder_type)
+    : model_(model), adder_type_(adder_type) {
+  CLD3_CHECK(IsAdderTypeSupported(adder_type_));
+  switch (adder_type_) {
+#if defined(CLD3_HAVE_X86_SIMD_ADDERS)
+    case AdderType::AVX512:
+      compute_final_scores_ =
+          &EmbeddingNetwork::ComputeFinalScoresImpl<Avx512Adder>;
+      break;
+    case AdderType::AVX2:
+      compute_final_scores_ =
+          &EmbeddingNetwork::ComputeFinalScoresImpl<Avx2Adder>;
+      break;
+    case AdderType::SSE42:
+      compute_final_scores_ =
+          &EmbeddingNetwork::ComputeFinalScoresImpl<SseAdder>;
+      break;
+#endif  // defined(CLD3_HAVE_X86_SIMD_ADDERS)
+    default:
+      compute_final_scores_ =
+          &EmbeddingNetwork::ComputeFinalScoresImpl<SimpleAdder>;
+      break;
+  }
+
   int offset_sum = 0;
   for (int i = 0; i < model_->embedding_dim_size(); ++i) {
     CLD3_DCHECK(offset_sum == model_->concat_offset(i));
     offset_sum += model_->embedding_dim(i) * model_->embedding_num_features(i);
     (void)offset_sum;  // Avoid compiler warning for "unused" variable.
-    embedding_matrices_.emplace_back(model_->GetEmbeddingMatrix(i));
+    embedding_matrices_.emplace_back(model_->GetEmbeddingMatrix(i),
+                                     model_->embeddings_row_remap(i));
   }
 
   CLD3_DCHECK(model_->hidden_size() == model_->hidden_bias_size());
   hidden_weights_.resize(model_->hidden_size());
+  hidden_int8_weights_.resize(model_->hidden_size());
+  hidden_int8_columns_.resize(model_->hidden_size());
   hidden_bias_.resize(model_->hidden_size());
   for (int i = 0; i < model_->hidden_size(); ++i) {
-    FillMatrixParams(model_->GetHiddenLayerMatrix(i), &hidden_weights_[i]);
+    FillLayerParams(model_->GetHiddenLayerMatrix(i), &hidden_weights_[i],
+                    &hidden_int8_weights_[i], &hidden_int8_columns_[i]);
     EmbeddingNetworkParams::Matrix bias = model_->GetHiddenLayerBias(i);
     CLD3_DCHECK(1 == bias.cols);
     CheckNoQuantization(bias);
@@ -184,7 +446,8 @@ EmbeddingNetwork::EmbeddingNetwork(const EmbeddingNetworkParams *model)
   }
 
   CLD3_DCHECK(model_->HasSoftmax());
-  FillMatrixParams(model_->GetSoftmaxMatrix(), &softmax_weights_);
+  FillLayerParams(model_->GetSoftmaxMatrix(), &softmax_weights_,
+                  &softmax_int8_weights_, &softmax_int8_columns_);
 
   EmbeddingNetworkParams::Matrix softmax_bias = model_->GetSoftmaxBias();
   CLD3_DCHECK(1 == softmax_bias.cols);
@@ -21,6 +21,7 @@ limitations under the License.
 #include "embedding_network_params.h"
 #include "feature_extractor.h"
 #include "float16.h"
+#include "simd_adders.h"
 
 namespace chrome_lang_id {
 
@@ -40,6 +41,10 @@ namespace chrome_lang_id {
 // an unnormalized score for each possible class.  Note: there is always a
 // softmax layer.
 //
+// The weights of the hidden and softmax layers can be floats or int8 (see
+// QuantizationType::INT8).  Int8 layers quantize their input on the fly and
+// accumulate the products in int32.
+//
 // NOTE(salcianu): current code can easily be changed to allow more than two
 // hidden layers.  Feel free to do so if you have a genuine need for that.
 class EmbeddingNetwork {
@@ -48,13 +53,17 @@ class EmbeddingNetwork {
   // a vocabulary element.  Number of columns = number of embedding dimensions.
   class EmbeddingMatrix {
    public:
-    explicit EmbeddingMatrix(const EmbeddingNetworkParams::Matrix source_matrix)
+    // row_remap, if not nullptr, maps the vocabulary elements to the rows of
+    // source_matrix (see EmbeddingNetworkParams::embeddings_row_remap()).
+    EmbeddingMatrix(const EmbeddingNetworkParams::Matrix source_matrix,
+                    const int32 *row_remap)
         : rows_(source_matrix.rows),
           cols_(source_matrix.cols),
           quant_type_(source_matrix.quant_type),
           data_(source_matrix.elements),
           row_size_in_bytes_(GetRowSizeInBytes(cols_, quant_type_)),
-          quant_scales_(source_matrix.quant_scales) {}
+          quant_scales_(source_matrix.quant_scales),
+          row_remap_(row_remap) {}
 
     // Returns vocabulary size; one embedding for each vocabulary element.
     int size() const { return rows_; }
@@ -71,11 +80,12 @@ class EmbeddingNetwork {
     void get_embedding(int k, const void **data, float *scale) const {
       CLD3_CHECK(k >= 0);
       CLD3_CHECK(k < size());
-      *data = reinterpret_cast<const char *>(data_) + k * row_size_in_bytes_;
+      const int row = (row_remap_ != nullptr) ? row_remap_[k] : k;
+      *data = reinterpret_cast<const char *>(data_) + row * row_size_in_bytes_;
       if (quant_type_ == QuantizationType::NONE) {
         *scale = 1.0;
       } else {
-        *scale = Float16To32(quant_scales_[k]);
+        *scale = Float16To32(quant_scales_[row]);
       }
     }
 
@@ -107,8 +117,12 @@ class EmbeddingNetwork {
     int row_size_in_bytes_;
 
     // Pointer to quantization scales.  nullptr if no quantization.  Otherwise,
-    // quant_scales_[i] is scale for embedding of i-th vocabulary element.
+    // quant_scales_[i] is scale for row i.
     const float16 *quant_scales_;
+
+    // Row of each vocabulary element, or nullptr if vocabulary element k is in
+    // row k.  Not owned.
+    const int32 *row_remap_;
   };
 
   // An immutable vector that doesn't own the memory that stores the underlying
@@ -138,35 +152,162 @@ class EmbeddingNetwork {
   typedef std::vector<VectorWrapper> Matrix;
   typedef std::vector<float> Vector;
 
+  // Buffers for the intermediate results of ComputeFinalScores.  Passing the
+  // same Scratch to successive calls avoids heap allocations once the buffers
+  // have reached their final size.  Not thread-safe: each thread should use
+  // its own Scratch.
+  struct Scratch {
+    // Concatenation layer.
+    Vector concat;
+
+    // First and second hidden layers.
+    Vector h0;
+    Vector h1;
+
+    // Scaled and quantized inputs of the int8 layers, and their scales.
+    Vector scaled_input;
+    std::vector<int8> quant_input;
+    std::vector<float> input_scales;
+  };
+
+  // A subset of the output classes, with a copy of the softmax weights and
+  // biases of these classes, so that ComputeFinalScores can compute the scores
+  // of these classes only.  Int8 softmax weights are dequantized in the copy.
+  // An OutputSubset is immutable once constructed, and can be shared by any
+  // number of threads.
+  class OutputSubset {
+   public:
+    // Creates the subset of the classes of network in classes, which should
+    // be distinct.  The scores are computed in the order of classes.
+    OutputSubset(const EmbeddingNetwork &network,
+                 const std::vector<int> &classes);
+
+    // Returns the number of classes in the subset.
+    int size() const { return classes_.size(); }
+
+    // Returns the class of network whose score is the i-th score for the
+    // subset.
+    int class_id(int i) const { return classes_[i]; }
+
+    // Returns true if class_id is in the subset.
+    bool Contains(int class_id) const;
+
+   private:
+    friend class EmbeddingNetwork;
+
+    std::vector<int> classes_;
+
+    // Softmax weights of the classes, row-major: one row of size() weights
+    // per input of the softmax layer, and views of these rows.
+    Vector weights_;
+    Matrix weight_rows_;
+
+    // Softmax biases of the classes.
+    Vector bias_;
+  };
+
   // Constructs an embedding network using the parameters from model.
   //
   // Note: model should stay alive for at least the lifetime of this
   // EmbeddingNetwork object.  TODO(salcianu): remove this constraint: we should
   // copy all necessary data (except, of course, the static weights) at
   // construction time and use that, instead of relying on model.
+  //
+  // The hidden and softmax layers are computed using the fastest adder (see
+  // simd_adders.h) supported by the CPU, as detected at construction time.
   explicit EmbeddingNetwork(const EmbeddingNetworkParams *model);
 
+  // Same as above, but uses the adder specified by adder_type, which must be
+  // supported by the CPU (see IsAdderTypeSupported()).  Useful for tests and
+  // benchmarks.
+  EmbeddingNetwork(const EmbeddingNetworkParams *model, AdderType adder_type);
+
   virtual ~EmbeddingNetwork() {}
 
+  // Returns the type of the adder used for the hidden and softmax layers.
+  AdderType adder_type() const { return adder_type_; }
+
   // Runs forward computation to fill scores with unnormalized output unit
   // scores. This is useful for making predictions.
   void ComputeFinalScores(const std::vector<FeatureVector> &features,
                           Vector *scores) const;
 
+  // Same as above, but uses the buffers from scratch instead of allocating new
+  // ones.
+  void ComputeFinalScores(const std::vector<FeatureVector> &features,
+                          Scratch *scratch, Vector *scores) const;
+
+  // Same as above, but if subset is not nullptr, only computes the scores of
+  // the classes of subset: on return, (*scores)[i] is the score of class
+  // subset->class_id(i).
+  void ComputeFinalScores(const std::vector<FeatureVector> &features,
+                          Scratch *scratch, const OutputSubset *subset,
+                          Vector *scores) const;
+
+  // Batched version of ComputeFinalScores: features[n] holds the features for
+  // the n-th input.  On return, scores is a features.size() x num_classes()
+  // matrix in row-major order, i.e., the unnormalized score of class c for the
+  // n-th input is (*scores)[n * num_classes() + c].
+  //
+  // The hidden and softmax layers are computed as matrix-matrix products: each
+  // row of weights is loaded once per batch and applied to all inputs, instead
+  // of once per input.
+  void ComputeFinalScoresBatch(
+      const std::vector<std::vector<FeatureVector>> &features,
+      Vector *scores) const;
+
+  // Same as above, but uses the buffers from scratch instead of allocating new
+  // ones.
+  void ComputeFinalScoresBatch(
+      const std::vector<std::vector<FeatureVector>> &features,
+      Scratch *scratch, Vector *scores) const;
+
+  // Same as above, but with rows of subset->size() scores if subset is not
+  // nullptr, as ComputeFinalScores does.
+  void ComputeFinalScoresBatch(
+      const std::vector<std::vector<FeatureVector>> &features,
+      Scratch *scratch, const OutputSubset *subset, Vector *scores) const;
+
+  // Returns the number of output classes (size of the softmax layer).
+  int num_classes() const { return softmax_bias_.size(); }
+
  private:
-  // Computes the softmax scores (prior to normalization) from the concatenated
-  // representation.
+  // Computes the unnormalized scores for batch_size inputs: features[n] holds
+  // the features for the n-th input.  On return, scores holds batch_size rows
+  // of scores, for all the classes or, if subset is not nullptr, for the
+  // classes of subset.
+  template <typename ScaleAdderClass>
+  void ComputeFinalScoresImpl(const std::vector<FeatureVector> *features,
+                              int batch_size, Scratch *scratch,
+                              const OutputSubset *subset,
+                              Vector *scores) const;
+
+  // Computes the softmax scores (prior to normalization) from the first hidden
+  // layer (prior to Relu), stored in scratch->h0.  h0 holds batch_size hidden
+  // layers, one after the other; on return, scores holds batch_size rows of
+  // scores, as for ComputeFinalScoresImpl.
   template <typename ScaleAdderClass>
-  void FinishComputeFinalScores(const Vector &concat, Vector *scores) const;
+  void FinishComputeFinalScores(int batch_size, Scratch *scratch,
+                                const OutputSubset *subset,
+                                Vector *scores) const;
 
-  // Constructs the concatenated input embedding vector in place in output
-  // vector concat.
-  void ConcatEmbeddings(const std::vector<FeatureVector> &features,
-                        Vector *concat) const;
+  // Adds the weighted embeddings for features to the concat_layer_size()
+  // floats starting at concat.
+  void AddEmbeddings(const std::vector<FeatureVector> &features,
+                     float *concat) const;
 
   // Pointer to the model object passed to the constructor.  Not owned.
   const EmbeddingNetworkParams *model_;
 
+  // Adder used for the hidden and softmax layers.
+  AdderType adder_type_;
+
+  // Instantiation of ComputeFinalScoresImpl for adder_type_.  Selected once,
+  // at construction time.
+  void (EmbeddingNetwork::*compute_final_scores_)(
+      const std::vector<FeatureVector> *features, int batch_size,
+      Scratch *scratch, const OutputSubset *subset, Vector *scores) const;
+
   // Network parameters.
 
   // One weight matrix for each embedding.
@@ -179,6 +320,19 @@ class EmbeddingNetwork {
   // Weight matrix and bias vector for the softmax layer.
   Matrix softmax_weights_;
   VectorWrapper softmax_bias_;
+
+  // Int8 weight matrices (see QuantizationType::INT8) for the hidden layers
+  // and the softmax layer.  For each layer, only one of the float matrix above
+  // and the int8 matrix here is used: if the quant_type of the int8 matrix is
+  // NONE, the layer uses float weights.
+  std::vector<EmbeddingNetworkParams::Matrix> hidden_int8_weights_;
+  EmbeddingNetworkParams::Matrix softmax_int8_weights_;
+
+  // The same int8 weights, transposed (see TransposeInt8Weights in the .cc
+  // file), so that each output of an int8 layer is the dot product of a
+  // contiguous column and the quantized input.  Empty for float layers.
+  std::vector<std::vector<int8>> hidden_int8_columns_;
+  std::vector<int8> softmax_int8_columns_;
 };
 
 }  // namespace chrome_lang_id
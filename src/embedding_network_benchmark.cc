@@ -0,0 +1,217 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Micro-benchmark for EmbeddingNetwork: measures the time to compute the scores
+// for one input, for each supported adder, with float and int8 hidden / softmax
+// layers, and with the weights read from a model file on regular or huge
+// pages, and reports the memory used by the weights.
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "base.h"
+#include "embedding_network.h"
+#include "feature_extractor.h"
+#include "int8_quantized_nn_params.h"
+#include "lang_id_nn_params.h"
+#include "language_identifier_features.h"
+#include "mmap_embedding_network_params.h"
+#include "model_file.h"
+#include "simd_adders.h"
+
+namespace chrome_lang_id {
+namespace embedding_network_benchmark {
+
+// Number of inputs in the benchmark corpus.
+const int kNumInputs = 256;
+
+// Number of passes over the corpus.
+const int kNumPasses = 40;
+
+// Model file written for the benchmark, in the working directory.
+const char kModelPath[] = "embedding_network_benchmark.cld3";
+
+// Approximate number of unique features, per embedding space, extracted from a
+// 700-byte snippet by the features in TaskContextParams.  The order is the one
+// of the embedding spaces: bigrams, quadgrams, relevant-scripts, text-script,
+// trigrams, unigrams.
+const int kNumFeaturesPerSpace[] = {120, 160, 1, 1, 150, 30};
+
+// Builds kNumInputs random inputs shaped like the ones produced by the
+// language identification feature extractor.
+class Corpus {
+ public:
+  explicit Corpus(const EmbeddingNetworkParams &model) : inputs_(kNumInputs) {
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> weight_dist(0.0f, 0.02f);
+    const int num_spaces = model.embedding_dim_size();
+    for (int es = 0; es < num_spaces; ++es) {
+      // The text-script feature (space #3) is the only discrete one.
+      const string name = (es == 3) ? "script" : "continuous-feature";
+      feature_types_.emplace_back(
+          new NumericFeatureType(name, model.embeddings_num_rows(es)));
+    }
+    for (std::vector<FeatureVector> &input : inputs_) {
+      input = std::vector<FeatureVector>(num_spaces);
+      for (int es = 0; es < num_spaces; ++es) {
+        std::uniform_int_distribution<int> id_dist(
+            0, model.embeddings_num_rows(es) - 1);
+        for (int k = 0; k < kNumFeaturesPerSpace[es]; ++k) {
+          FeatureType *type = feature_types_[es].get();
+          if (type->is_continuous()) {
+            FloatFeatureValue value(id_dist(rng), weight_dist(rng));
+            input[es].add(type, value.discrete_value);
+          } else {
+            input[es].add(type, id_dist(rng));
+          }
+        }
+      }
+    }
+  }
+
+  const std::vector<std::vector<FeatureVector>> &inputs() const {
+    return inputs_;
+  }
+
+ private:
+  std::vector<std::unique_ptr<FeatureType>> feature_types_;
+  std::vector<std::vector<FeatureVector>> inputs_;
+};
+
+// Returns the average time, in microseconds, to score one input of corpus.
+double TimeComputeFinalScores(const EmbeddingNetwork &network,
+                              const Corpus &corpus) {
+  EmbeddingNetwork::Vector scores;
+  float checksum = 0.0f;
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < kNumPasses; ++pass) {
+    for (const std::vector<FeatureVector> &input : corpus.inputs()) {
+      network.ComputeFinalScores(input, &scores);
+      checksum += scores[0];
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  if (checksum == 12345.0f) std::cout << "";  // Keep the work alive.
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         (kNumPasses * kNumInputs);
+}
+
+// Same as above, but scores the whole corpus with one batched call.
+double TimeComputeFinalScoresBatch(const EmbeddingNetwork &network,
+                                   const Corpus &corpus) {
+  EmbeddingNetwork::Vector scores;
+  float checksum = 0.0f;
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < kNumPasses; ++pass) {
+    network.ComputeFinalScoresBatch(corpus.inputs(), &scores);
+    checksum += scores[0];
+  }
+  const auto end = std::chrono::steady_clock::now();
+  if (checksum == 12345.0f) std::cout << "";  // Keep the work alive.
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         (kNumPasses * kNumInputs);
+}
+
+// Returns the number of bytes used by the embedding matrices of model.
+size_t EmbeddingBytes(const EmbeddingNetworkParams &model) {
+  size_t num_bytes = 0;
+  for (int i = 0; i < model.embeddings_size(); ++i) {
+    const size_t element_size =
+        (model.embeddings_quant_type(i) == QuantizationType::NONE)
+            ? sizeof(float)
+            : sizeof(uint8);
+    num_bytes += static_cast<size_t>(model.embeddings_num_rows(i)) *
+                 model.embeddings_num_cols(i) * element_size;
+    if (model.embeddings_quant_type(i) != QuantizationType::NONE) {
+      num_bytes += model.embeddings_num_rows(i) * sizeof(float16);
+    }
+  }
+  return num_bytes;
+}
+
+void RunBenchmarks() {
+  LangIdNNParams params;
+  Int8QuantizedNNParams int8_params(&params);
+  Corpus corpus(params);
+
+  std::cout << "EmbeddingNetwork benchmark: " << kNumInputs << " inputs x "
+            << kNumPasses << " passes" << std::endl;
+  for (AdderType adder_type : {AdderType::SIMPLE, AdderType::SSE42,
+                               AdderType::AVX2, AdderType::AVX512}) {
+    if (!IsAdderTypeSupported(adder_type)) continue;
+    const EmbeddingNetwork network(&params, adder_type);
+    const EmbeddingNetwork int8_network(&int8_params, adder_type);
+    std::cout << "  adder=" << AdderTypeName(adder_type) << std::endl
+              << "    regular:             "
+              << TimeComputeFinalScores(network, corpus) << " us/input"
+              << std::endl
+              << "    regular, batched:    "
+              << TimeComputeFinalScoresBatch(network, corpus) << " us/input"
+              << std::endl
+              << "    int8:                "
+              << TimeComputeFinalScores(int8_network, corpus) << " us/input"
+              << std::endl
+              << "    int8, batched:       "
+              << TimeComputeFinalScoresBatch(int8_network, corpus)
+              << " us/input" << std::endl;
+  }
+
+  // The same network, with the weights in a model file.
+  string error;
+  if (model_file::WriteModelFile(params, model_file::GetBuiltInModelSpec(),
+                                 kModelPath, &error)) {
+    using HugePages = MmapEmbeddingNetworkParams::HugePages;
+    std::cout << "  model file" << std::endl;
+    for (HugePages huge_pages :
+         {HugePages::NONE, HugePages::TRANSPARENT, HugePages::EXPLICIT}) {
+      MmapEmbeddingNetworkParams::LoadOptions options;
+      options.huge_pages = huge_pages;
+      const std::unique_ptr<MmapEmbeddingNetworkParams> file_params =
+          MmapEmbeddingNetworkParams::Open(kModelPath, options, &error);
+      const char *name = (huge_pages == HugePages::NONE)
+                             ? "    mapped:              "
+                             : (huge_pages == HugePages::TRANSPARENT)
+                                   ? "    transparent huge:    "
+                                   : "    explicit huge:       ";
+      if (file_params == nullptr) {
+        std::cout << name << error << std::endl;
+        continue;
+      }
+      const EmbeddingNetwork file_network(file_params.get());
+      std::cout << name << TimeComputeFinalScores(file_network, corpus)
+                << " us/input" << std::endl;
+    }
+    std::remove(kModelPath);
+  }
+
+  std::cout << "Memory:" << std::endl
+            << "  embedding matrices:  " << EmbeddingBytes(params)
+            << " bytes" << std::endl
+            << "  hidden + softmax:    " << int8_params.source_size_in_bytes()
+            << " bytes (float), " << int8_params.quantized_size_in_bytes()
+            << " bytes (int8)" << std::endl;
+}
+
+}  // namespace embedding_network_benchmark
+}  // namespace chrome_lang_id
+
+int main(int argc, char **argv) {
+  chrome_lang_id::embedding_network_benchmark::RunBenchmarks();
+  return 0;
+}
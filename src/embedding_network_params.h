@@ -23,7 +23,11 @@ limitations under the License.
 
 namespace chrome_lang_id {
 
-enum class QuantizationType { NONE = 0, UINT8 };
+// UINT8: uint8 weights with bias 128 and one float16 scale per row; used for
+// the embedding matrices.  INT8: int8 weights with one float16 scale per row;
+// used for the hidden and softmax weight matrices.  In both cases, the real
+// value of the weight stored as q in row r is (q - bias) * scale[r].
+enum class QuantizationType { NONE = 0, UINT8, INT8 };
 
 // API for accessing parameters from a statically-linked EmbeddingNetworkProto.
 class EmbeddingNetworkParams {
@@ -74,10 +78,9 @@ class EmbeddingNetworkParams {
     Matrix matrix;
     matrix.rows = hidden_num_rows(i);
     matrix.cols = hidden_num_cols(i);
-
-    // Quantization not supported here.
-    matrix.quant_type = QuantizationType::NONE;
+    matrix.quant_type = hidden_quant_type(i);
     matrix.elements = hidden_weights(i);
+    matrix.quant_scales = hidden_quant_scales(i);
     return matrix;
   }
 
@@ -94,6 +97,7 @@ class EmbeddingNetworkParams {
     // Quantization not supported here.
     matrix.quant_type = QuantizationType::NONE;
     matrix.elements = hidden_bias_weights(i);
+    matrix.quant_scales = nullptr;
     return matrix;
   }
 
@@ -109,10 +113,9 @@ class EmbeddingNetworkParams {
     Matrix matrix;
     matrix.rows = softmax_num_rows(0);
     matrix.cols = softmax_num_cols(0);
-
-    // Quantization not supported here.
-    matrix.quant_type = QuantizationType::NONE;
+    matrix.quant_type = softmax_quant_type(0);
     matrix.elements = softmax_weights(0);
+    matrix.quant_scales = softmax_quant_scales(0);
     return matrix;
   }
 
@@ -128,6 +131,7 @@ class EmbeddingNetworkParams {
     // Quantization not supported here.
     matrix.quant_type = QuantizationType::NONE;
     matrix.elements = softmax_bias_weights(0);
+    matrix.quant_scales = nullptr;
     return matrix;
   }
 
@@ -166,6 +170,14 @@ class EmbeddingNetworkParams {
     return nullptr;
   }
 
+  // Returns nullptr if the rows of embedding matrix i are in the order of the
+  // feature ids, i.e., the embedding of id k is row k.  Otherwise, returns an
+  // array of embeddings_num_rows(i) row indices, a permutation, such that the
+  // embedding of id k is row remap[k], e.g., with the frequent ids first so
+  // that they share cache lines (see embedding_reordering.h).  Not part of
+  // the original proto.
+  virtual const int32 *embeddings_row_remap(int i) const { return nullptr; }
+
   // ** Access methods for repeated MatrixParams hidden.
   //
   // Returns embedding_network_proto.hidden_size().
@@ -181,6 +193,15 @@ class EmbeddingNetworkParams {
   // embedding_network_proto.hidden(i).
   virtual const void *hidden_weights(int i) const = 0;
 
+  // Returns the quantization type of hidden_weights(i): NONE (floats) or INT8.
+  virtual QuantizationType hidden_quant_type(int i) const {
+    return QuantizationType::NONE;
+  }
+
+  // Returns one scale for each row of hidden_weights(i), or nullptr if
+  // hidden_quant_type(i) is NONE.
+  virtual const float16 *hidden_quant_scales(int i) const { return nullptr; }
+
   // ** Access methods for repeated MatrixParams hidden_bias.
   //
   // Returns proto.hidden_bias_size().
@@ -210,6 +231,16 @@ class EmbeddingNetworkParams {
   // order.
   virtual const void *softmax_weights(int i) const = 0;
 
+  // Returns the quantization type of softmax_weights(i): NONE (floats) or
+  // INT8.
+  virtual QuantizationType softmax_quant_type(int i) const {
+    return QuantizationType::NONE;
+  }
+
+  // Returns one scale for each row of softmax_weights(i), or nullptr if
+  // softmax_quant_type(i) is NONE.
+  virtual const float16 *softmax_quant_scales(int i) const { return nullptr; }
+
   // ** Access methods for optional MatrixParams softmax_bias.
   //
   // Returns 1 if proto has optional field softmax_bias, 0 otherwise.
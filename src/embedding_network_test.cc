@@ -0,0 +1,350 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "embedding_network.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "base.h"
+#include "feature_extractor.h"
+#include "float16.h"
+#include "int8_quantized_nn_params.h"
+#include "lang_id_nn_params.h"
+#include "language_identifier_features.h"
+
+// Number of calls to the global operator new, used to check that the network
+// does not allocate memory when given a warmed-up Scratch.
+static int num_allocations = 0;
+
+void *operator new(size_t size) {
+  ++num_allocations;
+  void *ptr = malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+namespace chrome_lang_id {
+namespace embedding_network_test {
+
+bool PrintAndReturnStatus(bool status) {
+  if (status) {
+    std::cout << "  Success" << std::endl;
+    return true;
+  } else {
+    std::cout << "  Failure" << std::endl;
+    return false;
+  }
+}
+
+// Generates random inputs for the network defined by a model: one continuous
+// feature type per embedding space, with a few random (id, weight) features
+// each.
+class RandomFeatureGenerator {
+ public:
+  explicit RandomFeatureGenerator(const EmbeddingNetworkParams &model)
+      : model_(model), rng_(1234) {
+    for (int i = 0; i < model_.embedding_dim_size(); ++i) {
+      feature_types_.emplace_back(new NumericFeatureType(
+          "continuous-feature-" + std::to_string(i),
+          model_.embeddings_num_rows(i)));
+    }
+  }
+
+  // Fills features (which should have one FeatureVector for each embedding
+  // space) with random features.
+  void Generate(std::vector<FeatureVector> *features) {
+    std::uniform_real_distribution<float> weight_dist(0.0f, 1.0f);
+    for (size_t es = 0; es < features->size(); ++es) {
+      FeatureVector &feature_vector = (*features)[es];
+      feature_vector.clear();
+      std::uniform_int_distribution<int> id_dist(
+          0, model_.embeddings_num_rows(es) - 1);
+      for (int k = 0; k < 5; ++k) {
+        FloatFeatureValue value(id_dist(rng_), weight_dist(rng_));
+        feature_vector.add(feature_types_[es].get(), value.discrete_value);
+      }
+    }
+  }
+
+ private:
+  const EmbeddingNetworkParams &model_;
+  std::mt19937 rng_;
+  std::vector<std::unique_ptr<FeatureType>> feature_types_;
+};
+
+// Returns true if a and b have the same size and are element-wise within
+// tolerance of each other.
+bool ScoresNear(const float *a, const float *b, int size, float tolerance) {
+  for (int i = 0; i < size; ++i) {
+    if (std::abs(a[i] - b[i]) > tolerance) {
+      std::cout << "  Element " << i << ": " << a[i] << " vs " << b[i]
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks that ComputeFinalScoresBatch gives the same results as running
+// ComputeFinalScores on each input separately.
+bool TestBatchMatchesSingle() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  EmbeddingNetwork network(&params);
+  RandomFeatureGenerator generator(params);
+
+  const int kBatchSize = 7;
+  std::vector<std::vector<FeatureVector>> batch(kBatchSize);
+  for (auto &features : batch) {
+    features = std::vector<FeatureVector>(params.embedding_dim_size());
+    generator.Generate(&features);
+  }
+
+  EmbeddingNetwork::Vector batch_scores;
+  network.ComputeFinalScoresBatch(batch, &batch_scores);
+  const int num_classes = network.num_classes();
+  if (static_cast<int>(batch_scores.size()) != kBatchSize * num_classes) {
+    return PrintAndReturnStatus(false);
+  }
+
+  bool test_successful = true;
+  for (int n = 0; n < kBatchSize; ++n) {
+    EmbeddingNetwork::Vector scores;
+    network.ComputeFinalScores(batch[n], &scores);
+    test_successful &= ScoresNear(scores.data(),
+                                  batch_scores.data() + n * num_classes,
+                                  num_classes, /*tolerance=*/1e-5f);
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that every adder supported by the CPU gives the same scores as
+// SimpleAdder.
+bool TestAdderTypesAgree() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  EmbeddingNetwork reference(&params, AdderType::SIMPLE);
+  RandomFeatureGenerator generator(params);
+  std::vector<FeatureVector> features(params.embedding_dim_size());
+  generator.Generate(&features);
+  EmbeddingNetwork::Vector expected;
+  reference.ComputeFinalScores(features, &expected);
+
+  bool test_successful = true;
+  for (AdderType adder_type : {AdderType::SSE42, AdderType::AVX2,
+                               AdderType::AVX512}) {
+    if (!IsAdderTypeSupported(adder_type)) continue;
+    EmbeddingNetwork network(&params, adder_type);
+    EmbeddingNetwork::Vector actual;
+    network.ComputeFinalScores(features, &actual);
+    test_successful &= ScoresNear(expected.data(), actual.data(),
+                                  expected.size(), /*tolerance=*/1e-4f);
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that QuantizeMatrixToInt8 reconstructs each weight within half a
+// quantization step.
+bool TestQuantizeMatrixToInt8() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  const EmbeddingNetworkParams::Matrix source = params.GetSoftmaxMatrix();
+  std::vector<int8> weights;
+  std::vector<float16> scales;
+  QuantizeMatrixToInt8(source, &weights, &scales);
+  if (static_cast<int>(weights.size()) != source.rows * source.cols ||
+      static_cast<int>(scales.size()) != source.rows) {
+    return PrintAndReturnStatus(false);
+  }
+
+  const float *source_weights = reinterpret_cast<const float *>(source.elements);
+  bool test_successful = true;
+  for (int r = 0; r < source.rows && test_successful; ++r) {
+    const float scale = Float16To32(scales[r]);
+    for (int c = 0; c < source.cols; ++c) {
+      const float expected = source_weights[r * source.cols + c];
+      const float actual = weights[r * source.cols + c] * scale;
+
+      // Half a step, plus the float16 rounding of the scale.
+      const float tolerance = 0.51f * scale + 0.01f * std::abs(expected);
+      if (std::abs(expected - actual) > tolerance) {
+        std::cout << "  Row " << r << ", column " << c << ": " << expected
+                  << " vs " << actual << std::endl;
+        test_successful = false;
+        break;
+      }
+    }
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that the network with int8 hidden and softmax layers gives scores
+// close to the float network, and (barring near ties) the same top class.
+bool TestInt8MatchesFloat() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  Int8QuantizedNNParams int8_params(&params);
+  EmbeddingNetwork network(&params);
+  EmbeddingNetwork int8_network(&int8_params);
+  RandomFeatureGenerator generator(params);
+
+  const int kBatchSize = 20;
+  std::vector<std::vector<FeatureVector>> batch(kBatchSize);
+  for (auto &features : batch) {
+    features = std::vector<FeatureVector>(params.embedding_dim_size());
+    generator.Generate(&features);
+  }
+  EmbeddingNetwork::Vector expected;
+  EmbeddingNetwork::Vector actual;
+  network.ComputeFinalScoresBatch(batch, &expected);
+  int8_network.ComputeFinalScoresBatch(batch, &actual);
+  if (actual.size() != expected.size()) {
+    return PrintAndReturnStatus(false);
+  }
+
+  const int num_classes = network.num_classes();
+  bool test_successful = true;
+  for (int n = 0; n < kBatchSize; ++n) {
+    const float *expected_row = expected.data() + n * num_classes;
+    const float *actual_row = actual.data() + n * num_classes;
+    float max_abs = 0.0f;
+    for (int c = 0; c < num_classes; ++c) {
+      max_abs = std::max(max_abs, std::abs(expected_row[c]));
+    }
+    const float tolerance = 0.05f * max_abs;
+    test_successful &=
+        ScoresNear(expected_row, actual_row, num_classes, tolerance);
+
+    // The top class may differ only in case of a near tie.
+    const int int8_top_class =
+        std::max_element(actual_row, actual_row + num_classes) - actual_row;
+    test_successful &=
+        expected_row[int8_top_class] >=
+        *std::max_element(expected_row, expected_row + num_classes) - tolerance;
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that the scores computed for a subset of the classes are the scores
+// of these classes among all the classes, for single and batched inputs, and
+// for both float and int8 softmax layers.
+bool TestOutputSubsetMatchesFullScores() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  Int8QuantizedNNParams int8_params(&params);
+  RandomFeatureGenerator generator(params);
+  const int kBatchSize = 5;
+  std::vector<std::vector<FeatureVector>> batch(kBatchSize);
+  for (auto &features : batch) {
+    features = std::vector<FeatureVector>(params.embedding_dim_size());
+    generator.Generate(&features);
+  }
+  bool test_successful = true;
+  for (const EmbeddingNetworkParams *model :
+       {static_cast<const EmbeddingNetworkParams *>(&params),
+        static_cast<const EmbeddingNetworkParams *>(&int8_params)}) {
+    EmbeddingNetwork network(model);
+    const int num_classes = network.num_classes();
+    const std::vector<int> classes = {num_classes - 1, 0, 7, 3};
+    const EmbeddingNetwork::OutputSubset subset(network, classes);
+    test_successful &= (subset.size() == 4) && (subset.class_id(2) == 7);
+    test_successful &= subset.Contains(3) && !subset.Contains(1);
+
+    EmbeddingNetwork::Scratch scratch;
+    EmbeddingNetwork::Vector expected;
+    EmbeddingNetwork::Vector scores;
+    network.ComputeFinalScoresBatch(batch, &scratch, &expected);
+    network.ComputeFinalScoresBatch(batch, &scratch, &subset, &scores);
+    if (scores.size() != kBatchSize * classes.size()) {
+      return PrintAndReturnStatus(false);
+    }
+    for (int n = 0; n < kBatchSize; ++n) {
+      const float *expected_row = expected.data() + n * num_classes;
+      float max_abs = 0.0f;
+      for (int c = 0; c < num_classes; ++c) {
+        max_abs = std::max(max_abs, std::abs(expected_row[c]));
+      }
+
+      // The int8 layer quantizes its input, but the subset does not.
+      const float tolerance =
+          ((model == &params) ? 1e-5f : 0.05f) * max_abs;
+      std::vector<float> expected_subset;
+      for (int c : classes) expected_subset.push_back(expected_row[c]);
+      test_successful &=
+          ScoresNear(expected_subset.data(), scores.data() + n * classes.size(),
+                     classes.size(), tolerance);
+
+      EmbeddingNetwork::Vector single_scores;
+      network.ComputeFinalScores(batch[n], &scratch, &subset, &single_scores);
+      test_successful &= ScoresNear(expected_subset.data(),
+                                    single_scores.data(), classes.size(),
+                                    tolerance);
+    }
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that, once a Scratch has been used, subsequent calls with inputs of
+// the same size do not allocate memory, for both float and int8 layers.
+bool TestScratchAvoidsAllocations() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  Int8QuantizedNNParams int8_params(&params);
+  RandomFeatureGenerator generator(params);
+  std::vector<FeatureVector> features(params.embedding_dim_size());
+  bool test_successful = true;
+  for (const EmbeddingNetworkParams *model :
+       {static_cast<const EmbeddingNetworkParams *>(&params),
+        static_cast<const EmbeddingNetworkParams *>(&int8_params)}) {
+    EmbeddingNetwork network(model);
+    EmbeddingNetwork::Scratch scratch;
+    EmbeddingNetwork::Vector expected;
+    EmbeddingNetwork::Vector scores;
+    generator.Generate(&features);
+    network.ComputeFinalScores(features, &expected);
+    network.ComputeFinalScores(features, &scratch, &scores);
+
+    const int num_allocations_before = num_allocations;
+    network.ComputeFinalScores(features, &scratch, &scores);
+    test_successful &= (num_allocations == num_allocations_before);
+    test_successful &= (scores == expected);
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+}  // namespace embedding_network_test
+}  // namespace chrome_lang_id
+
+// Runs the embedding network tests.
+int main(int argc, char **argv) {
+  const bool tests_successful =
+      chrome_lang_id::embedding_network_test::TestBatchMatchesSingle() &&
+      chrome_lang_id::embedding_network_test::TestAdderTypesAgree() &&
+      chrome_lang_id::embedding_network_test::TestQuantizeMatrixToInt8() &&
+      chrome_lang_id::embedding_network_test::TestInt8MatchesFloat() &&
+      chrome_lang_id::embedding_network_test::
+          TestOutputSubsetMatchesFullScores() &&
+      chrome_lang_id::embedding_network_test::TestScratchAvoidsAllocations();
+  return tests_successful ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Offline tool that rewrites a model file (see model_file.h) with the rows of
+// its embedding matrices sorted by how often the texts of a calibration corpus
+// look them up (see embedding_reordering.h):
+//
+//   embedding_reorder_main calibration.txt input.cld3 output.cld3 [eval.txt]
+//
+// The corpora have one text per line, and should look like the traffic the
+// model serves; the texts without features (e.g., without letters) are
+// skipped.  The tool reports, for the evaluation corpus, or for the
+// calibration corpus itself if there is none, the miss rate of a simulated
+// cache on the embedding lookups, the number of cache lines of the embeddings
+// each text reads, and the time of the network per text, before and after the
+// reordering.  Numbers measured on the calibration corpus are optimistic,
+// since the order fits these very texts.  The predictions of both files are
+// the same.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "embedding_network.h"
+#include "embedding_reordering.h"
+#include "language_id_model.h"
+#include "mmap_embedding_network_params.h"
+#include "model_file.h"
+#include "nnet_language_identifier.h"
+
+namespace chrome_lang_id {
+namespace embedding_reorder_main {
+
+// Size of the simulated cache, that of a typical L1 data cache.
+const int kCacheSize = 32 * 1024;
+
+// Number of passes over the corpus to time the network.
+const int kNumTimingPasses = 20;
+
+// Returns the time, in microseconds per input, of the network of params on
+// inputs.
+double TimeNetwork(const EmbeddingNetworkParams &params,
+                   const std::vector<std::vector<FeatureVector>> &inputs) {
+  const EmbeddingNetwork network(&params);
+  EmbeddingNetwork::Scratch scratch;
+  EmbeddingNetwork::Vector scores;
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < kNumTimingPasses; ++pass) {
+    for (const std::vector<FeatureVector> &features : inputs) {
+      network.ComputeFinalScores(features, &scratch, &scores);
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         (kNumTimingPasses * inputs.size());
+}
+
+void Report(const char *name, const EmbeddingNetworkParams &params,
+            const std::vector<std::vector<FeatureVector>> &inputs) {
+  const EmbeddingCacheStats stats =
+      SimulateEmbeddingCache(params, inputs, kCacheSize);
+  std::cout << "  " << name << ": miss rate " << 100.0 * stats.miss_rate()
+            << "% (" << stats.num_misses << " of " << stats.num_accesses
+            << "), " << stats.lines_per_input << " lines per input, "
+            << TimeNetwork(params, inputs) << " us per input" << std::endl;
+}
+
+// Stores in *inputs the features of the texts of the corpus at path, one per
+// line, except for the texts without features, which are counted in
+// *num_skipped.  Returns false if the corpus cannot be read.
+bool ReadCorpus(const string &path, const NNetLanguageIdentifier &lang_id,
+                InferenceScratch *scratch,
+                std::vector<std::vector<FeatureVector>> *inputs,
+                int *num_skipped) {
+  std::ifstream corpus(path);
+  if (!corpus) {
+    std::cerr << "Error: cannot read " << path << std::endl;
+    return false;
+  }
+  *num_skipped = 0;
+  string text;
+  while (std::getline(corpus, text)) {
+    inputs->emplace_back();
+    lang_id.ExtractFeatures(text.data(), text.size(), scratch, &inputs->back());
+    bool has_features = false;
+    for (const FeatureVector &feature_vector : inputs->back()) {
+      has_features |= (feature_vector.size() > 0);
+    }
+    if (!has_features) {
+      inputs->pop_back();
+      ++*num_skipped;
+    }
+  }
+  return true;
+}
+
+int Run(const string &corpus_path, const string &input_path,
+        const string &output_path, const string &eval_corpus_path) {
+  string error;
+  const std::unique_ptr<MmapEmbeddingNetworkParams> params =
+      MmapEmbeddingNetworkParams::Open(input_path, &error);
+  if (params == nullptr) {
+    std::cerr << "Error: cannot read " << input_path << ": " << error
+              << std::endl;
+    return 1;
+  }
+
+  // Features of each text of the corpus, and the lookups they make.  Even
+  // short texts make lookups, so there is no minimum size.
+  const NNetLanguageIdentifier lang_id(
+      std::make_shared<LanguageIdModel>(*params), /*min_num_bytes=*/0,
+      NNetLanguageIdentifier::kMaxNumBytesToConsider);
+  InferenceScratch scratch;
+  std::vector<std::vector<FeatureVector>> inputs;
+  int num_skipped = 0;
+  if (!ReadCorpus(corpus_path, lang_id, &scratch, &inputs, &num_skipped)) {
+    return 1;
+  }
+  EmbeddingLookupCounts counts(params->embeddings_size());
+  for (int i = 0; i < params->embeddings_size(); ++i) {
+    counts[i].resize(params->embeddings_num_rows(i));
+  }
+  int64 num_lookups = 0;
+  for (const std::vector<FeatureVector> &features : inputs) {
+    CountEmbeddingLookups(features, &counts);
+    for (const FeatureVector &feature_vector : features) {
+      num_lookups += feature_vector.size();
+    }
+  }
+  std::cout << inputs.size() << " calibration texts, " << num_skipped
+            << " skipped without features" << std::endl;
+  if (num_lookups == 0) {
+    std::cerr << "Error: no embedding lookups in " << corpus_path
+              << std::endl;
+    return 1;
+  }
+
+  const ReorderedEmbeddingsNNParams reordered(params.get(), counts);
+  model_file::ModelSpec spec;
+  params->GetModelSpec(&spec);
+  if (!model_file::WriteModelFile(reordered, spec, output_path, &error)) {
+    std::cerr << "Error: " << error << std::endl;
+    return 1;
+  }
+  const std::unique_ptr<MmapEmbeddingNetworkParams> written =
+      MmapEmbeddingNetworkParams::Open(output_path, &error);
+  if (written == nullptr) {
+    std::cerr << "Error: cannot read back " << output_path << ": " << error
+              << std::endl;
+    return 1;
+  }
+
+  // Measure on the evaluation corpus if there is one.
+  if (!eval_corpus_path.empty()) {
+    inputs.clear();
+    if (!ReadCorpus(eval_corpus_path, lang_id, &scratch, &inputs,
+                    &num_skipped)) {
+      return 1;
+    }
+    std::cout << inputs.size() << " evaluation texts, " << num_skipped
+              << " skipped without features" << std::endl;
+    if (inputs.empty()) {
+      std::cerr << "Error: no text with features in " << eval_corpus_path
+                << std::endl;
+      return 1;
+    }
+  }
+  std::cout << "On the "
+            << (eval_corpus_path.empty() ? "calibration corpus itself"
+                                         : "evaluation corpus")
+            << ", " << kCacheSize / 1024 << " KB simulated cache:"
+            << std::endl;
+  Report("before", *params, inputs);
+  Report("after ", *written, inputs);
+  return 0;
+}
+
+}  // namespace embedding_reorder_main
+}  // namespace chrome_lang_id
+
+int main(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " calibration_corpus input_file output_file"
+              << " [evaluation_corpus]" << std::endl;
+    return 1;
+  }
+  return chrome_lang_id::embedding_reorder_main::Run(
+      argv[1], argv[2], argv[3], (argc == 5) ? argv[4] : "");
+}
@@ -0,0 +1,191 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "embedding_reordering.h"
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "feature_types.h"
+
+namespace chrome_lang_id {
+namespace {
+
+// Size of a cache line, in bytes.
+const int kCacheLineSize = 64;
+
+// Returns the id that feature fi of feature_vector looks up, as
+// EmbeddingNetwork does.
+int GetFeatureId(const FeatureVector &feature_vector, int fi) {
+  const FeatureValue feature_value = feature_vector.value(fi);
+  if (feature_vector.type(fi)->is_continuous()) {
+    return FloatFeatureValue(feature_value).value.id;
+  }
+  return feature_value;
+}
+
+int GetRowSizeInBytes(const EmbeddingNetworkParams &params, int i) {
+  CLD3_CHECK((params.embeddings_quant_type(i) == QuantizationType::NONE) ||
+             (params.embeddings_quant_type(i) == QuantizationType::UINT8));
+  const int element_size =
+      (params.embeddings_quant_type(i) == QuantizationType::NONE)
+          ? sizeof(float)
+          : sizeof(uint8);
+  return params.embeddings_num_cols(i) * element_size;
+}
+
+// Fully associative cache with least recently used replacement.  A line is
+// identified by a key that combines the matrix, the array (weights or scales)
+// and the index of the line in that array.
+class LruCache {
+ public:
+  explicit LruCache(int num_lines) : num_lines_(num_lines) {}
+
+  // Reads the line with the given key.  Returns false on a miss.
+  bool Access(uint64 key) {
+    const auto it = positions_.find(key);
+    if (it != positions_.end()) {
+      lines_.splice(lines_.begin(), lines_, it->second);
+      return true;
+    }
+    if (static_cast<int>(lines_.size()) == num_lines_) {
+      positions_.erase(lines_.back());
+      lines_.pop_back();
+    }
+    lines_.push_front(key);
+    positions_[key] = lines_.begin();
+    return false;
+  }
+
+ private:
+  const int num_lines_;
+
+  // Keys of the cached lines, from the most to the least recently used.
+  std::list<uint64> lines_;
+  std::unordered_map<uint64, std::list<uint64>::iterator> positions_;
+};
+
+}  // namespace
+
+void CountEmbeddingLookups(const std::vector<FeatureVector> &features,
+                           EmbeddingLookupCounts *counts) {
+  CLD3_DCHECK(features.size() == counts->size());
+  for (size_t es_index = 0; es_index < features.size(); ++es_index) {
+    std::vector<int64> &matrix_counts = (*counts)[es_index];
+    const FeatureVector &feature_vector = features[es_index];
+    for (int fi = 0; fi < feature_vector.size(); ++fi) {
+      const int id = GetFeatureId(feature_vector, fi);
+      CLD3_CHECK(id >= 0);
+      CLD3_CHECK(id < static_cast<int>(matrix_counts.size()));
+      ++matrix_counts[id];
+    }
+  }
+}
+
+EmbeddingCacheStats SimulateEmbeddingCache(
+    const EmbeddingNetworkParams &params,
+    const std::vector<std::vector<FeatureVector>> &inputs, int cache_size) {
+  LruCache cache(std::max(cache_size / kCacheLineSize, 1));
+  EmbeddingCacheStats stats;
+  int64 num_distinct_lines = 0;
+  std::unordered_set<uint64> lines_of_input;
+  std::vector<uint64> keys;
+  for (const std::vector<FeatureVector> &features : inputs) {
+    CLD3_DCHECK(static_cast<int>(features.size()) == params.embeddings_size());
+    lines_of_input.clear();
+    for (size_t i = 0; i < features.size(); ++i) {
+      const int32 *row_remap = params.embeddings_row_remap(i);
+      const int row_size = GetRowSizeInBytes(params, i);
+      const bool has_scales =
+          params.embeddings_quant_type(i) != QuantizationType::NONE;
+      const FeatureVector &feature_vector = features[i];
+      for (int fi = 0; fi < feature_vector.size(); ++fi) {
+        const int id = GetFeatureId(feature_vector, fi);
+        const int64 row = (row_remap != nullptr) ? row_remap[id] : id;
+
+        // Lines of the weights (array 0) and of the scale (array 1) of the
+        // row; a row may straddle two lines.
+        keys.clear();
+        const int64 first_byte = row * row_size;
+        for (int64 line = first_byte / kCacheLineSize;
+             line <= (first_byte + row_size - 1) / kCacheLineSize; ++line) {
+          keys.push_back((static_cast<uint64>(i) << 56) | line);
+        }
+        if (has_scales) {
+          const int64 line = row * sizeof(float16) / kCacheLineSize;
+          keys.push_back((static_cast<uint64>(i) << 56) | (1ULL << 48) | line);
+        }
+        for (const uint64 key : keys) {
+          ++stats.num_accesses;
+          if (!cache.Access(key)) ++stats.num_misses;
+          lines_of_input.insert(key);
+        }
+      }
+    }
+    num_distinct_lines += lines_of_input.size();
+  }
+  if (!inputs.empty()) {
+    stats.lines_per_input =
+        static_cast<double>(num_distinct_lines) / inputs.size();
+  }
+  return stats;
+}
+
+ReorderedEmbeddingsNNParams::ReorderedEmbeddingsNNParams(
+    const EmbeddingNetworkParams *source, const EmbeddingLookupCounts &counts)
+    : source_(source) {
+  CLD3_CHECK(static_cast<int>(counts.size()) == source_->embeddings_size());
+  for (int i = 0; i < source_->embeddings_size(); ++i) {
+    const int num_rows = source_->embeddings_num_rows(i);
+    const std::vector<int64> &matrix_counts = counts[i];
+    CLD3_CHECK(static_cast<int>(matrix_counts.size()) == num_rows);
+
+    // Ids in their new order: by decreasing counts, then by id.
+    std::vector<int32> ids(num_rows);
+    for (int k = 0; k < num_rows; ++k) ids[k] = k;
+    std::stable_sort(ids.begin(), ids.end(),
+                     [&matrix_counts](int32 a, int32 b) {
+                       return matrix_counts[a] > matrix_counts[b];
+                     });
+
+    const int row_size = GetRowSizeInBytes(*source_, i);
+    const uint8 *source_weights =
+        reinterpret_cast<const uint8 *>(source_->embeddings_weights(i));
+    const float16 *source_scales = source_->embeddings_quant_scales(i);
+    const int32 *source_remap = source_->embeddings_row_remap(i);
+    std::vector<uint8> weights(static_cast<size_t>(num_rows) * row_size);
+    std::vector<float16> scales;
+    if (source_scales != nullptr) scales.resize(num_rows);
+    std::vector<int32> row_remap(num_rows);
+    for (int row = 0; row < num_rows; ++row) {
+      const int32 id = ids[row];
+      const int source_row = (source_remap != nullptr) ? source_remap[id] : id;
+      memcpy(weights.data() + static_cast<size_t>(row) * row_size,
+             source_weights + static_cast<size_t>(source_row) * row_size,
+             row_size);
+      if (source_scales != nullptr) scales[row] = source_scales[source_row];
+      row_remap[id] = row;
+    }
+    embeddings_weights_.push_back(std::move(weights));
+    embeddings_quant_scales_.push_back(std::move(scales));
+    row_remaps_.push_back(std::move(row_remap));
+  }
+}
+
+}  // namespace chrome_lang_id
@@ -0,0 +1,224 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef EMBEDDING_REORDERING_H_
+#define EMBEDDING_REORDERING_H_
+
+#include <vector>
+
+#include "base.h"
+#include "embedding_network_params.h"
+#include "feature_extractor.h"
+#include "float16.h"
+
+namespace chrome_lang_id {
+
+// Layout of the embedding matrices by frequency of use.  The ngram features
+// hash the ngrams to ids, so the lookups for one text hit rows all over the
+// matrices.  With the rows that a calibration corpus looks up most often put
+// first, the frequent ids share cache lines, and the row remap of the matrices
+// (see EmbeddingNetworkParams::embeddings_row_remap()) finds the row of each
+// id.  See embedding_reorder_main.cc for a tool that writes such a model file.
+
+// Number of lookups of each row: counts[i][k] is the number of lookups of id k
+// in embedding matrix i.
+typedef std::vector<std::vector<int64>> EmbeddingLookupCounts;
+
+// Adds to *counts the lookups that the network makes for features, which has
+// one feature vector per embedding space.  counts should have one vector per
+// embedding matrix, with one count per row.
+void CountEmbeddingLookups(const std::vector<FeatureVector> &features,
+                           EmbeddingLookupCounts *counts);
+
+// Statistics of a simulated cache for the embedding lookups.
+struct EmbeddingCacheStats {
+  // Number of cache lines read, for the weights and the scales of the rows.
+  int64 num_accesses = 0;
+  int64 num_misses = 0;
+
+  // Average number of distinct cache lines read per input.
+  double lines_per_input = 0.0;
+
+  double miss_rate() const {
+    return (num_accesses > 0) ? static_cast<double>(num_misses) / num_accesses
+                              : 0.0;
+  }
+};
+
+// Replays the embedding lookups of the network of params for inputs, in order,
+// on a fully associative, least recently used cache of cache_size bytes with
+// 64-byte lines, and returns its statistics.  Each matrix starts on a cache
+// line, as in a model file.
+EmbeddingCacheStats SimulateEmbeddingCache(
+    const EmbeddingNetworkParams &params,
+    const std::vector<std::vector<FeatureVector>> &inputs, int cache_size);
+
+// EmbeddingNetworkParams with the rows of the embedding matrices of another
+// model sorted by decreasing counts (by id for equal counts), and the row
+// remaps that map the ids to them.  Everything else is read from that other
+// model, which should stay alive for at least the lifetime of this object.
+class ReorderedEmbeddingsNNParams : public EmbeddingNetworkParams {
+ public:
+  ReorderedEmbeddingsNNParams(const EmbeddingNetworkParams *source,
+                              const EmbeddingLookupCounts &counts);
+  ~ReorderedEmbeddingsNNParams() override {}
+
+  // Access methods for embeddings:
+  int embeddings_size() const override { return source_->embeddings_size(); }
+  int embeddings_num_rows(int i) const override {
+    return source_->embeddings_num_rows(i);
+  }
+  int embeddings_num_cols(int i) const override {
+    return source_->embeddings_num_cols(i);
+  }
+  const void *embeddings_weights(int i) const override {
+    return embeddings_weights_[i].data();
+  }
+  QuantizationType embeddings_quant_type(int i) const override {
+    return source_->embeddings_quant_type(i);
+  }
+  const float16 *embeddings_quant_scales(int i) const override {
+    return embeddings_quant_scales_[i].empty()
+               ? nullptr
+               : embeddings_quant_scales_[i].data();
+  }
+  const int32 *embeddings_row_remap(int i) const override {
+    return row_remaps_[i].data();
+  }
+
+  // Access methods for hidden:
+  int hidden_size() const override { return source_->hidden_size(); }
+  int hidden_num_rows(int i) const override {
+    return source_->hidden_num_rows(i);
+  }
+  int hidden_num_cols(int i) const override {
+    return source_->hidden_num_cols(i);
+  }
+  const void *hidden_weights(int i) const override {
+    return source_->hidden_weights(i);
+  }
+  QuantizationType hidden_quant_type(int i) const override {
+    return source_->hidden_quant_type(i);
+  }
+  const float16 *hidden_quant_scales(int i) const override {
+    return source_->hidden_quant_scales(i);
+  }
+
+  // Access methods for hidden_bias:
+  int hidden_bias_size() const override { return source_->hidden_bias_size(); }
+  int hidden_bias_num_rows(int i) const override {
+    return source_->hidden_bias_num_rows(i);
+  }
+  int hidden_bias_num_cols(int i) const override {
+    return source_->hidden_bias_num_cols(i);
+  }
+  const void *hidden_bias_weights(int i) const override {
+    return source_->hidden_bias_weights(i);
+  }
+
+  // Access methods for softmax:
+  int softmax_size() const override { return source_->softmax_size(); }
+  int softmax_num_rows(int i) const override {
+    return source_->softmax_num_rows(i);
+  }
+  int softmax_num_cols(int i) const override {
+    return source_->softmax_num_cols(i);
+  }
+  const void *softmax_weights(int i) const override {
+    return source_->softmax_weights(i);
+  }
+  QuantizationType softmax_quant_type(int i) const override {
+    return source_->softmax_quant_type(i);
+  }
+  const float16 *softmax_quant_scales(int i) const override {
+    return source_->softmax_quant_scales(i);
+  }
+
+  // Access methods for softmax_bias:
+  int softmax_bias_size() const override {
+    return source_->softmax_bias_size();
+  }
+  int softmax_bias_num_rows(int i) const override {
+    return source_->softmax_bias_num_rows(i);
+  }
+  int softmax_bias_num_cols(int i) const override {
+    return source_->softmax_bias_num_cols(i);
+  }
+  const void *softmax_bias_weights(int i) const override {
+    return source_->softmax_bias_weights(i);
+  }
+
+  // Access methods for embedding_dim:
+  int embedding_dim_size() const override {
+    return source_->embedding_dim_size();
+  }
+  int32 embedding_dim(int i) const override {
+    return source_->embedding_dim(i);
+  }
+
+  // Access methods for embedding_num_features:
+  int embedding_num_features_size() const override {
+    return source_->embedding_num_features_size();
+  }
+  int32 embedding_num_features(int i) const override {
+    return source_->embedding_num_features(i);
+  }
+
+  // Access methods for embedding_features_domain_size:
+  int embedding_features_domain_size_size() const override {
+    return source_->embedding_features_domain_size_size();
+  }
+  int32 embedding_features_domain_size(int i) const override {
+    return source_->embedding_features_domain_size(i);
+  }
+
+  // Access methods for concat_offset:
+  int concat_offset_size() const override {
+    return source_->concat_offset_size();
+  }
+  int32 concat_offset(int i) const override {
+    return source_->concat_offset(i);
+  }
+
+  // Access methods for concat_layer_size:
+  bool has_concat_layer_size() const override {
+    return source_->has_concat_layer_size();
+  }
+  int32 concat_layer_size() const override {
+    return source_->concat_layer_size();
+  }
+
+  // Access methods for is_precomputed:
+  bool has_is_precomputed() const override {
+    return source_->has_is_precomputed();
+  }
+  bool is_precomputed() const override { return source_->is_precomputed(); }
+
+ private:
+  // Model with the original layout.  Not owned.
+  const EmbeddingNetworkParams *source_;
+
+  // Reordered weights (as bytes) and scales (empty if not quantized), and row
+  // of each id, one entry for each embedding matrix.
+  std::vector<std::vector<uint8>> embeddings_weights_;
+  std::vector<std::vector<float16>> embeddings_quant_scales_;
+  std::vector<std::vector<int32>> row_remaps_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(ReorderedEmbeddingsNNParams);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // EMBEDDING_REORDERING_H_
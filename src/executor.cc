@@ -0,0 +1,153 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "executor.h"
+
+#include <algorithm>
+
+namespace chrome_lang_id {
+namespace {
+
+// A worker takes 1 / kChunkDivisor of the items left in its range at a time.
+const int kChunkDivisor = 4;
+
+int DefaultNumWorkers() {
+  const int num_hardware_threads =
+      static_cast<int>(std::thread::hardware_concurrency());
+  return std::max(1, num_hardware_threads);
+}
+
+}  // namespace
+
+Executor::Executor(int num_workers)
+    : num_workers_((num_workers > 0) ? num_workers : DefaultNumWorkers()),
+      ranges_(new WorkRange[num_workers_]) {
+  threads_.reserve(num_workers_ - 1);
+  for (int worker = 1; worker < num_workers_; ++worker) {
+    threads_.emplace_back(&Executor::WorkerLoop, this, worker);
+  }
+}
+
+Executor::~Executor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_cv_.notify_all();
+  for (std::thread &thread : threads_) thread.join();
+}
+
+void Executor::ParallelFor(
+    int num_items, const std::function<void(int worker, int index)> &fn) {
+  if (num_items <= 0) return;
+  if (num_workers_ == 1 || num_items == 1) {
+    for (int index = 0; index < num_items; ++index) fn(0, index);
+    return;
+  }
+
+  std::lock_guard<std::mutex> loop_lock(loop_mutex_);
+  for (int worker = 0; worker < num_workers_; ++worker) {
+    WorkRange &range = ranges_[worker];
+    std::lock_guard<std::mutex> range_lock(range.mutex);
+    range.begin = static_cast<int>(static_cast<int64>(num_items) * worker /
+                                   num_workers_);
+    range.end = static_cast<int>(static_cast<int64>(num_items) *
+                                 (worker + 1) / num_workers_);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fn_ = &fn;
+    num_busy_threads_ = num_workers_ - 1;
+    ++num_loops_;
+  }
+  start_cv_.notify_all();
+
+  RunWorker(0, fn);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return num_busy_threads_ == 0; });
+  fn_ = nullptr;
+}
+
+void Executor::WorkerLoop(int worker) {
+  int64 num_loops_seen = 0;
+  while (true) {
+    const std::function<void(int, int)> *fn;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, [this, num_loops_seen] {
+        return stopping_ || num_loops_ != num_loops_seen;
+      });
+      if (stopping_) return;
+      num_loops_seen = num_loops_;
+      fn = fn_;
+    }
+
+    RunWorker(worker, *fn);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--num_busy_threads_ == 0) done_cv_.notify_one();
+  }
+}
+
+void Executor::RunWorker(int worker, const std::function<void(int, int)> &fn) {
+  int begin;
+  int end;
+  while (true) {
+    if (!TakeChunk(worker, &begin, &end)) {
+      if (!Steal(worker)) return;
+      continue;
+    }
+    for (int index = begin; index < end; ++index) fn(worker, index);
+  }
+}
+
+bool Executor::TakeChunk(int worker, int *begin, int *end) {
+  WorkRange &range = ranges_[worker];
+  std::lock_guard<std::mutex> lock(range.mutex);
+  const int num_left = range.end - range.begin;
+  if (num_left <= 0) return false;
+  *begin = range.begin;
+  *end = range.begin + std::max(1, num_left / kChunkDivisor);
+  range.begin = *end;
+  return true;
+}
+
+bool Executor::Steal(int worker) {
+  for (int i = 1; i < num_workers_; ++i) {
+    WorkRange &victim = ranges_[(worker + i) % num_workers_];
+    int begin;
+    int end;
+    {
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      const int num_left = victim.end - victim.begin;
+      if (num_left <= 0) continue;
+      begin = victim.begin + num_left / 2;
+      end = victim.end;
+      victim.end = begin;
+    }
+
+    // The stolen items are in no range until they are added to the range of
+    // worker, but only this thread can take them, so none is lost.
+    WorkRange &range = ranges_[worker];
+    std::lock_guard<std::mutex> lock(range.mutex);
+    range.begin = begin;
+    range.end = end;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace chrome_lang_id
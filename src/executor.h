@@ -0,0 +1,122 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+
+namespace chrome_lang_id {
+
+// A fixed pool of worker threads running parallel loops over item indices.
+//
+// Each loop starts by giving every worker an equal contiguous range of the
+// items.  A worker takes chunks from the front of its own range, a quarter of
+// what is left each time, so that chunks start large (few synchronizations)
+// and shrink to single items as the range runs out.  A worker whose range is
+// empty steals the back half of the range of another worker.  This keeps all
+// the workers busy when the costs of the items are skewed, e.g., when a few
+// documents are much longer than the others.
+//
+// The thread calling ParallelFor is worker #0, so an Executor with
+// num_workers() == n starts n - 1 threads.
+class Executor {
+ public:
+  // Creates an executor with num_workers workers.  If num_workers <= 0, uses
+  // one worker per hardware thread.
+  explicit Executor(int num_workers);
+  ~Executor();
+
+  // Returns the number of workers, including the calling thread.
+  int num_workers() const { return num_workers_; }
+
+  // Calls fn(worker, index) for each index in [0, num_items), and returns once
+  // all the calls have returned.  worker is in [0, num_workers()), and the
+  // calls for the same worker are never concurrent, so fn can use per-worker
+  // state indexed by worker without locking.  Concurrent calls to ParallelFor
+  // on the same Executor are serialized; fn must not call ParallelFor on this
+  // Executor.
+  void ParallelFor(int num_items,
+                   const std::function<void(int worker, int index)> &fn);
+
+ private:
+  // The range of item indices [begin, end) left to a worker.
+  struct WorkRange {
+    std::mutex mutex;
+    int begin = 0;
+    int end = 0;
+  };
+
+  // Main loop of the thread of worker #worker.
+  void WorkerLoop(int worker);
+
+  // Calls fn on the items of the current loop for worker #worker, until there
+  // are no items left to take or steal.
+  void RunWorker(int worker, const std::function<void(int, int)> &fn);
+
+  // Takes a chunk [*begin, *end) from the front of the range of worker
+  // #worker.  Returns false if the range is empty.
+  bool TakeChunk(int worker, int *begin, int *end);
+
+  // Moves the back half of the range of another worker to the (empty) range
+  // of worker #worker.  Returns false if all the ranges are empty.
+  bool Steal(int worker);
+
+  const int num_workers_;
+
+  // ranges_[w] is the range of items left to worker #w.
+  std::unique_ptr<WorkRange[]> ranges_;
+
+  // Threads of the workers #1 to #num_workers_ - 1.
+  std::vector<std::thread> threads_;
+
+  // Serializes the calls to ParallelFor.
+  std::mutex loop_mutex_;
+
+  // Guards the fields below.
+  std::mutex mutex_;
+
+  // Signaled when a loop starts or the executor is being destroyed.
+  std::condition_variable start_cv_;
+
+  // Signaled when the last thread finishes its part of a loop.
+  std::condition_variable done_cv_;
+
+  // Function of the current loop.
+  const std::function<void(int, int)> *fn_ = nullptr;
+
+  // Number of loops started so far; a thread joins a loop when it sees this
+  // number change.
+  int64 num_loops_ = 0;
+
+  // Number of threads still working on the current loop.
+  int num_busy_threads_ = 0;
+
+  // Whether the threads should exit.
+  bool stopping_ = false;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(Executor);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // EXECUTOR_H_
@@ -0,0 +1,144 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "executor.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+
+namespace chrome_lang_id {
+namespace executor_test {
+
+bool PrintAndReturnStatus(bool status) {
+  if (status) {
+    std::cout << "  Success" << std::endl;
+    return true;
+  } else {
+    std::cout << "  Failure" << std::endl;
+    return false;
+  }
+}
+
+// Runs a loop over num_items items on executor, and checks that each item is
+// processed exactly once and that the calls for a worker are not concurrent.
+// The items whose index is a multiple of slow_item_period take much longer
+// than the others.
+bool RunLoopAndCheck(Executor *executor, int num_items, int slow_item_period) {
+  std::vector<int> num_calls(num_items, 0);
+  std::unique_ptr<std::atomic<int>[]> num_running(
+      new std::atomic<int>[executor->num_workers()]);
+  for (int w = 0; w < executor->num_workers(); ++w) num_running[w] = 0;
+  std::atomic<int> num_overlaps(0);
+  executor->ParallelFor(num_items, [&](int worker, int index) {
+    if (num_running[worker]++ != 0) ++num_overlaps;
+    ++num_calls[index];
+    if (index % slow_item_period == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    --num_running[worker];
+  });
+
+  bool test_successful = (num_overlaps == 0);
+  for (int i = 0; i < num_items; ++i) {
+    if (num_calls[i] != 1) {
+      std::cout << "  Item " << i << ": " << num_calls[i] << " calls"
+                << std::endl;
+      test_successful = false;
+    }
+  }
+  return test_successful;
+}
+
+// Checks ParallelFor on loops of various sizes, including loops with fewer
+// items than workers and loops where a few items are much slower than the
+// others.
+bool TestParallelFor() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  bool test_successful = true;
+  for (int num_workers : {1, 2, 5}) {
+    Executor executor(num_workers);
+    test_successful &= (executor.num_workers() == num_workers);
+    for (int num_items : {0, 1, 3, 17, 1000}) {
+      test_successful &= RunLoopAndCheck(&executor, num_items,
+                                         /*slow_item_period=*/num_items + 1);
+    }
+    test_successful &=
+        RunLoopAndCheck(&executor, /*num_items=*/200, /*slow_item_period=*/50);
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that all the workers take part when the slow items are all in the
+// range initially given to one worker.
+bool TestWorkStealing() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const int kNumWorkers = 4;
+  const int kNumItems = 64;
+  Executor executor(kNumWorkers);
+  std::vector<int> worker_of_item(kNumItems, -1);
+  executor.ParallelFor(kNumItems, [&](int worker, int index) {
+    worker_of_item[index] = worker;
+    if (index < kNumItems / kNumWorkers) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  });
+
+  // The slow items are the range of worker #0, so the other workers should
+  // steal some of them.
+  bool stolen = false;
+  for (int i = 0; i < kNumItems / kNumWorkers; ++i) {
+    stolen |= (worker_of_item[i] != 0);
+  }
+  return PrintAndReturnStatus(stolen);
+}
+
+// Checks that concurrent loops on the same executor are all run to
+// completion.
+bool TestConcurrentLoops() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  Executor executor(3);
+  const int kNumThreads = 4;
+  std::vector<int> results(kNumThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&executor, &results, t]() {
+      results[t] = RunLoopAndCheck(&executor, /*num_items=*/100,
+                                   /*slow_item_period=*/10) ? 1 : 0;
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  bool test_successful = true;
+  for (int result : results) test_successful &= (result == 1);
+  return PrintAndReturnStatus(test_successful);
+}
+
+}  // namespace executor_test
+}  // namespace chrome_lang_id
+
+// Runs the executor tests.
+int main(int argc, char **argv) {
+  const bool tests_successful =
+      chrome_lang_id::executor_test::TestParallelFor() &&
+      chrome_lang_id::executor_test::TestWorkStealing() &&
+      chrome_lang_id::executor_test::TestConcurrentLoops();
+  return tests_successful ? 0 : 1;
+}
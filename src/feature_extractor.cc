@@ -47,6 +47,12 @@ void GenericFeatureExtractor::Parse(const string &source) {
   InitializeFeatureFunctions();
 }
 
+void GenericFeatureExtractor::InitFromDescriptor(
+    const FeatureExtractorDescriptor &descriptor) {
+  *mutable_descriptor() = descriptor;
+  InitializeFeatureFunctions();
+}
+
 void GenericFeatureExtractor::InitializeFeatureTypes() {
   // Register all feature types.
   GetFeatureTypes(&feature_types_);
@@ -136,6 +136,10 @@ class GenericFeatureExtractor {
   // to using the default language supplied.
   void Parse(const string &source);
 
+  // Same as Parse(), but from a descriptor parsed beforehand, e.g., read from
+  // a model file, so no feature specification is parsed.
+  void InitFromDescriptor(const FeatureExtractorDescriptor &descriptor);
+
   // Returns the feature extractor descriptor.
   const FeatureExtractorDescriptor &descriptor() const { return descriptor_; }
   FeatureExtractorDescriptor *mutable_descriptor() { return &descriptor_; }
@@ -0,0 +1,91 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "int8_quantized_nn_params.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace chrome_lang_id {
+
+void QuantizeMatrixToInt8(const EmbeddingNetworkParams::Matrix &source,
+                          std::vector<int8> *weights,
+                          std::vector<float16> *scales) {
+  CLD3_CHECK(source.quant_type == QuantizationType::NONE);
+  const float *source_weights = reinterpret_cast<const float *>(source.elements);
+  weights->resize(source.rows * source.cols);
+  scales->resize(source.rows);
+  for (int r = 0; r < source.rows; ++r) {
+    const float *row = source_weights + r * source.cols;
+    float max_abs = 0.0f;
+    for (int c = 0; c < source.cols; ++c) {
+      max_abs = std::max(max_abs, std::abs(row[c]));
+    }
+
+    // The scale is stored as a float16, which may be slightly smaller than
+    // max_abs / 127: quantize using the stored value, and clamp.
+    (*scales)[r] = Float32To16(max_abs / 127.0f);
+    const float scale = Float16To32((*scales)[r]);
+    const float inverse_scale = (scale > 0.0f) ? 1.0f / scale : 0.0f;
+    for (int c = 0; c < source.cols; ++c) {
+      const float value = std::round(row[c] * inverse_scale);
+      (*weights)[r * source.cols + c] =
+          static_cast<int8>(std::max(-127.0f, std::min(127.0f, value)));
+    }
+  }
+}
+
+Int8QuantizedNNParams::Int8QuantizedNNParams(
+    const EmbeddingNetworkParams *source)
+    : source_(source) {
+  hidden_weights_.resize(source_->hidden_size());
+  hidden_quant_scales_.resize(source_->hidden_size());
+  for (int i = 0; i < source_->hidden_size(); ++i) {
+    QuantizeMatrixToInt8(source_->GetHiddenLayerMatrix(i), &hidden_weights_[i],
+                         &hidden_quant_scales_[i]);
+  }
+  softmax_weights_.resize(source_->softmax_size());
+  softmax_quant_scales_.resize(source_->softmax_size());
+  if (source_->HasSoftmax()) {
+    QuantizeMatrixToInt8(source_->GetSoftmaxMatrix(), &softmax_weights_[0],
+                         &softmax_quant_scales_[0]);
+  }
+}
+
+size_t Int8QuantizedNNParams::quantized_size_in_bytes() const {
+  size_t num_bytes = 0;
+  for (size_t i = 0; i < hidden_weights_.size(); ++i) {
+    num_bytes += hidden_weights_[i].size() * sizeof(int8) +
+                 hidden_quant_scales_[i].size() * sizeof(float16);
+  }
+  for (size_t i = 0; i < softmax_weights_.size(); ++i) {
+    num_bytes += softmax_weights_[i].size() * sizeof(int8) +
+                 softmax_quant_scales_[i].size() * sizeof(float16);
+  }
+  return num_bytes;
+}
+
+size_t Int8QuantizedNNParams::source_size_in_bytes() const {
+  size_t num_bytes = 0;
+  for (size_t i = 0; i < hidden_weights_.size(); ++i) {
+    num_bytes += hidden_weights_[i].size() * sizeof(float);
+  }
+  for (size_t i = 0; i < softmax_weights_.size(); ++i) {
+    num_bytes += softmax_weights_[i].size() * sizeof(float);
+  }
+  return num_bytes;
+}
+
+}  // namespace chrome_lang_id
@@ -0,0 +1,208 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef INT8_QUANTIZED_NN_PARAMS_H_
+#define INT8_QUANTIZED_NN_PARAMS_H_
+
+#include <vector>
+
+#include "base.h"
+#include "embedding_network_params.h"
+#include "float16.h"
+
+namespace chrome_lang_id {
+
+// Quantizes the float matrix source to QuantizationType::INT8.  On return,
+// *weights holds the source.rows x source.cols int8 weights, in row-major
+// order, and *scales holds one scale for each row: the largest absolute value
+// of each row is mapped to (approximately) 127.
+void QuantizeMatrixToInt8(const EmbeddingNetworkParams::Matrix &source,
+                          std::vector<int8> *weights,
+                          std::vector<float16> *scales);
+
+// EmbeddingNetworkParams that uses int8 weights for the hidden and softmax
+// layers: the weights are quantized, at construction time, from the float
+// weights of another model.  Everything else (embeddings, biases, etc.) is
+// read from that other model, which should stay alive for at least the
+// lifetime of this object.
+//
+// The int8 matrices take a quarter of the bytes of the float ones; this is
+// mainly a size option.  Without AVX-512 VNNI, the int8 products are no
+// cheaper than the float ones, and the layers also quantize their input on
+// each call and cannot skip the inputs that Relu zeroes: on
+// embedding_network_benchmark, inference is slightly faster than with float
+// weights with the SSE4.2 and AVX2 adders, but about 10% slower with the
+// AVX-512 adder and 15% slower without SIMD.  See model_converter_main.cc for
+// a tool that writes them to a model file.
+class Int8QuantizedNNParams : public EmbeddingNetworkParams {
+ public:
+  explicit Int8QuantizedNNParams(const EmbeddingNetworkParams *source);
+  ~Int8QuantizedNNParams() override {}
+
+  // Returns the number of bytes used by the int8 weights and scales of the
+  // hidden and softmax layers.
+  size_t quantized_size_in_bytes() const;
+
+  // Returns the number of bytes used by the float weights of the hidden and
+  // softmax layers of the source model.
+  size_t source_size_in_bytes() const;
+
+  // Access methods for embeddings:
+  int embeddings_size() const override { return source_->embeddings_size(); }
+  int embeddings_num_rows(int i) const override {
+    return source_->embeddings_num_rows(i);
+  }
+  int embeddings_num_cols(int i) const override {
+    return source_->embeddings_num_cols(i);
+  }
+  const void *embeddings_weights(int i) const override {
+    return source_->embeddings_weights(i);
+  }
+  QuantizationType embeddings_quant_type(int i) const override {
+    return source_->embeddings_quant_type(i);
+  }
+  const float16 *embeddings_quant_scales(int i) const override {
+    return source_->embeddings_quant_scales(i);
+  }
+  const int32 *embeddings_row_remap(int i) const override {
+    return source_->embeddings_row_remap(i);
+  }
+
+  // Access methods for hidden:
+  int hidden_size() const override { return source_->hidden_size(); }
+  int hidden_num_rows(int i) const override {
+    return source_->hidden_num_rows(i);
+  }
+  int hidden_num_cols(int i) const override {
+    return source_->hidden_num_cols(i);
+  }
+  const void *hidden_weights(int i) const override {
+    return hidden_weights_[i].data();
+  }
+  QuantizationType hidden_quant_type(int i) const override {
+    return QuantizationType::INT8;
+  }
+  const float16 *hidden_quant_scales(int i) const override {
+    return hidden_quant_scales_[i].data();
+  }
+
+  // Access methods for hidden_bias:
+  int hidden_bias_size() const override { return source_->hidden_bias_size(); }
+  int hidden_bias_num_rows(int i) const override {
+    return source_->hidden_bias_num_rows(i);
+  }
+  int hidden_bias_num_cols(int i) const override {
+    return source_->hidden_bias_num_cols(i);
+  }
+  const void *hidden_bias_weights(int i) const override {
+    return source_->hidden_bias_weights(i);
+  }
+
+  // Access methods for softmax:
+  int softmax_size() const override { return source_->softmax_size(); }
+  int softmax_num_rows(int i) const override {
+    return source_->softmax_num_rows(i);
+  }
+  int softmax_num_cols(int i) const override {
+    return source_->softmax_num_cols(i);
+  }
+  const void *softmax_weights(int i) const override {
+    return softmax_weights_[i].data();
+  }
+  QuantizationType softmax_quant_type(int i) const override {
+    return QuantizationType::INT8;
+  }
+  const float16 *softmax_quant_scales(int i) const override {
+    return softmax_quant_scales_[i].data();
+  }
+
+  // Access methods for softmax_bias:
+  int softmax_bias_size() const override {
+    return source_->softmax_bias_size();
+  }
+  int softmax_bias_num_rows(int i) const override {
+    return source_->softmax_bias_num_rows(i);
+  }
+  int softmax_bias_num_cols(int i) const override {
+    return source_->softmax_bias_num_cols(i);
+  }
+  const void *softmax_bias_weights(int i) const override {
+    return source_->softmax_bias_weights(i);
+  }
+
+  // Access methods for embedding_dim:
+  int embedding_dim_size() const override {
+    return source_->embedding_dim_size();
+  }
+  int32 embedding_dim(int i) const override {
+    return source_->embedding_dim(i);
+  }
+
+  // Access methods for embedding_num_features:
+  int embedding_num_features_size() const override {
+    return source_->embedding_num_features_size();
+  }
+  int32 embedding_num_features(int i) const override {
+    return source_->embedding_num_features(i);
+  }
+
+  // Access methods for embedding_features_domain_size:
+  int embedding_features_domain_size_size() const override {
+    return source_->embedding_features_domain_size_size();
+  }
+  int32 embedding_features_domain_size(int i) const override {
+    return source_->embedding_features_domain_size(i);
+  }
+
+  // Access methods for concat_offset:
+  int concat_offset_size() const override {
+    return source_->concat_offset_size();
+  }
+  int32 concat_offset(int i) const override {
+    return source_->concat_offset(i);
+  }
+
+  // Access methods for concat_layer_size:
+  bool has_concat_layer_size() const override {
+    return source_->has_concat_layer_size();
+  }
+  int32 concat_layer_size() const override {
+    return source_->concat_layer_size();
+  }
+
+  // Access methods for is_precomputed:
+  bool has_is_precomputed() const override {
+    return source_->has_is_precomputed();
+  }
+  bool is_precomputed() const override { return source_->is_precomputed(); }
+
+ private:
+  // Model with the float weights.  Not owned.
+  const EmbeddingNetworkParams *source_;
+
+  // Int8 weights and per-row scales, one entry for each hidden layer.
+  std::vector<std::vector<int8>> hidden_weights_;
+  std::vector<std::vector<float16>> hidden_quant_scales_;
+
+  // Int8 weights and per-row scales, one entry for each softmax layer.
+  std::vector<std::vector<int8>> softmax_weights_;
+  std::vector<std::vector<float16>> softmax_quant_scales_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(Int8QuantizedNNParams);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // INT8_QUANTIZED_NN_PARAMS_H_
@@ -0,0 +1,252 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "language_id_model.h"
+
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "registry.h"
+#include "relevant_script_feature.h"
+#include "task_context_params.h"
+
+namespace chrome_lang_id {
+namespace {
+
+WholeSentenceFeature *cbog_factory() {
+  return new ContinuousBagOfNgramsFunction;
+}
+
+WholeSentenceFeature *rsf_factory() { return new RelevantScriptFeature; }
+
+WholeSentenceFeature *sf_factory() { return new ScriptFeature; }
+
+}  // namespace
+
+const string LanguageIdEmbeddingFeatureExtractor::ArgPrefix() const {
+  return "language_identifier";
+}
+
+LanguageIdModel::LanguageIdModel() : LanguageIdModel(/*nn_params=*/nullptr) {}
+
+LanguageIdModel::LanguageIdModel(const EmbeddingNetworkParams *nn_params)
+    : network_((nn_params != nullptr) ? nn_params : &nn_params_) {
+  RegisterFeaturesOnce();
+
+  // Get the model parameters, set up and initialize the model.
+  TaskContext context;
+  TaskContextParams::ToTaskContext(&context);
+  feature_extractor_.Setup(&context);
+  InitFeatureExtractor(&context);
+  for (int i = 0; i < TaskContextParams::GetNumLanguages(); ++i) {
+    language_names_.push_back(TaskContextParams::language_names(i));
+  }
+}
+
+LanguageIdModel::LanguageIdModel(const MmapEmbeddingNetworkParams &model_file)
+    : network_(&model_file) {
+  RegisterFeaturesOnce();
+
+  // The features and the dimensions of the embedding spaces are already
+  // parsed in the file, so the context stays empty.
+  std::vector<int> embedding_dims;
+  for (int i = 0; i < model_file.embedding_dim_size(); ++i) {
+    embedding_dims.push_back(model_file.embedding_dim(i));
+  }
+  TaskContext context;
+  feature_extractor_.SetupFromDescriptors(model_file.feature_descriptors(),
+                                          embedding_dims, &context);
+  InitFeatureExtractor(&context);
+  for (int i = 0; i < model_file.num_languages(); ++i) {
+    language_names_.push_back(model_file.language_name(i));
+  }
+  has_built_in_languages_ =
+      static_cast<int>(language_names_.size()) ==
+      TaskContextParams::GetNumLanguages();
+  for (int i = 0; has_built_in_languages_ && i < num_languages(); ++i) {
+    has_built_in_languages_ =
+        strcmp(language_names_[i], TaskContextParams::language_names(i)) == 0;
+  }
+}
+
+LanguageIdModel::~LanguageIdModel() {}
+
+std::shared_ptr<const LanguageIdModel> LanguageIdModel::BuiltIn() {
+  // Thread-safe initialization of function-level static (C++11).  The model
+  // is leaked on purpose, so that it outlives the sessions destroyed at exit.
+  static const std::shared_ptr<const LanguageIdModel> *const model =
+      new std::shared_ptr<const LanguageIdModel>(
+          std::make_shared<LanguageIdModel>());
+  return *model;
+}
+
+bool LanguageIdModel::GetFeatureSizes(
+    const std::vector<FeatureExtractorDescriptor> &descriptors,
+    const std::vector<int> &embedding_dims, std::vector<int> *num_features,
+    std::vector<int> *domain_sizes) {
+  RegisterFeaturesOnce();
+  for (const FeatureExtractorDescriptor &descriptor : descriptors) {
+    for (const FeatureFunctionDescriptor &feature : descriptor.feature()) {
+      if (feature.feature_size() != 0 ||
+          !WholeSentenceFeature::registry()->IsRegistered(
+              feature.type().c_str())) {
+        return false;
+      }
+    }
+  }
+  LanguageIdEmbeddingFeatureExtractor feature_extractor;
+  TaskContext context;
+  feature_extractor.SetupFromDescriptors(descriptors, embedding_dims,
+                                         &context);
+  feature_extractor.Init(&context);
+  num_features->clear();
+  domain_sizes->clear();
+  for (int i = 0; i < feature_extractor.NumEmbeddings(); ++i) {
+    num_features->push_back(feature_extractor.FeatureSize(i));
+    domain_sizes->push_back(feature_extractor.EmbeddingSize(i));
+  }
+  return true;
+}
+
+void LanguageIdModel::InitFeatureExtractor(TaskContext *context) {
+  feature_extractor_.Init(context);
+  feature_extractor_.RequestWorkspaces(&workspace_registry_);
+  script_workspace_index_ = workspace_registry_.Request<SingletonIntWorkspace>(
+      ScriptFeature::kScriptWorkspaceName);
+  running_counts_index_ = workspace_registry_.Request<SingletonIntWorkspace>(
+      kRunningCountsWorkspaceName);
+}
+
+void LanguageIdModel::RegisterFeaturesOnce() {
+  // Thread-safe initialization of function-level static (C++11), so that
+  // models can be constructed concurrently.
+  static const bool features_registered = (RegisterFeatures(), true);
+  CLD3_CHECK(features_registered);
+}
+
+void LanguageIdModel::RegisterFeatures() {
+  if (WholeSentenceFeature::registry() == nullptr) {
+    // Create registry for our WholeSentenceFeature(s).
+    RegisterableClass<WholeSentenceFeature>::CreateRegistry(
+        "sentence feature function", "WholeSentenceFeature", __FILE__,
+        __LINE__);
+  }
+
+  // Register our WholeSentenceFeature(s).
+  // Register ContinuousBagOfNgramsFunction feature function.
+  static WholeSentenceFeature::Registry::Registrar cbog_registrar(
+      WholeSentenceFeature::registry(), "continuous-bag-of-ngrams",
+      "ContinuousBagOfNgramsFunction", __FILE__, __LINE__, cbog_factory);
+
+  // Register RelevantScriptFeature feature function.
+  static WholeSentenceFeature::Registry::Registrar rsf_registrar(
+      WholeSentenceFeature::registry(), "continuous-bag-of-relevant-scripts",
+      "RelevantScriptFeature", __FILE__, __LINE__, rsf_factory);
+
+  // Register ScriptFeature feature function.
+  static WholeSentenceFeature::Registry::Registrar sf_registrar(
+      WholeSentenceFeature::registry(), "script", "ScriptFeature", __FILE__,
+      __LINE__, sf_factory);
+}
+
+void LanguageIdModel::GetFeatures(Sentence *sentence, CLD2::ULScript ulscript,
+                                  WorkspaceSet *workspaces,
+                                  std::vector<FeatureVector> *features) const {
+  // Keep the workspaces of the previous sentence for reuse, so that in steady
+  // state extracting the features does not allocate.
+  workspaces->Recycle(workspace_registry_);
+
+  // The script is only used if the text contains a letter, since otherwise the
+  // script feature would not find it either.
+  if (ulscript != CLD2::UNKNOWN_ULSCRIPT &&
+      sentence->text().find_first_not_of(' ') != string::npos) {
+    SingletonIntWorkspace *script =
+        workspaces->TakeSpare<SingletonIntWorkspace>(script_workspace_index_);
+    if (script != nullptr) {
+      script->set(ulscript);
+    } else {
+      script = new SingletonIntWorkspace(ulscript);
+    }
+    workspaces->Set(script_workspace_index_, script);
+  }
+  feature_extractor_.Preprocess(workspaces, sentence);
+  feature_extractor_.ExtractFeatures(*workspaces, *sentence, features);
+}
+
+void LanguageIdModel::ResetRunningFeatures(WorkspaceSet *workspaces) const {
+  // As in GetFeatures, keep the previous workspaces for reuse.
+  workspaces->Recycle(workspace_registry_);
+  SingletonIntWorkspace *running_counts =
+      workspaces->TakeSpare<SingletonIntWorkspace>(running_counts_index_);
+  if (running_counts != nullptr) {
+    running_counts->set(1);
+  } else {
+    running_counts = new SingletonIntWorkspace(1);
+  }
+  workspaces->Set(running_counts_index_, running_counts);
+}
+
+void LanguageIdModel::UpdateRunningFeatures(
+    Sentence *sentence, CLD2::ULScript ulscript, WorkspaceSet *workspaces,
+    std::vector<FeatureVector> *features) const {
+  CLD3_DCHECK(workspaces->Has<SingletonIntWorkspace>(running_counts_index_));
+
+  // The script may change as the text grows.
+  if (ulscript != CLD2::UNKNOWN_ULSCRIPT &&
+      sentence->text().find_first_not_of(' ') != string::npos) {
+    if (workspaces->Has<SingletonIntWorkspace>(script_workspace_index_)) {
+      workspaces->MutableGet<SingletonIntWorkspace>(script_workspace_index_)
+          ->set(ulscript);
+    } else {
+      SingletonIntWorkspace *script =
+          workspaces->TakeSpare<SingletonIntWorkspace>(script_workspace_index_);
+      if (script != nullptr) {
+        script->set(ulscript);
+      } else {
+        script = new SingletonIntWorkspace(ulscript);
+      }
+      workspaces->Set(script_workspace_index_, script);
+    }
+  } else {
+    workspaces->Set<SingletonIntWorkspace>(script_workspace_index_, nullptr);
+  }
+  feature_extractor_.Preprocess(workspaces, sentence);
+  feature_extractor_.ExtractFeatures(*workspaces, *sentence, features);
+}
+
+string LanguageIdModel::GetLanguageName(int language_id) const {
+  return GetLanguageCode(language_id);
+}
+
+const char *LanguageIdModel::GetLanguageCode(int language_id) const {
+  CLD3_CHECK(language_id >= 0);
+  CLD3_CHECK(language_id < num_languages());
+  return language_names_[language_id];
+}
+
+int LanguageIdModel::GetLanguageId(const char *language) const {
+  for (int language_id = 0; language_id < num_languages(); ++language_id) {
+    if (strcmp(language, language_names_[language_id]) == 0) {
+      return language_id;
+    }
+  }
+  return -1;
+}
+
+}  // namespace chrome_lang_id
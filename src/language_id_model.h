@@ -0,0 +1,181 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LANGUAGE_ID_MODEL_H_
+#define LANGUAGE_ID_MODEL_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "embedding_feature_extractor.h"
+#include "embedding_network.h"
+#include "embedding_network_params.h"
+#include "feature_extractor.h"
+#include "lang_id_nn_params.h"
+#include "language_identifier_features.h"
+#include "mmap_embedding_network_params.h"
+#include "script_span/generated_ulscript.h"
+#include "cld_3/protos/sentence.pb.h"
+#include "sentence_features.h"
+#include "task_context.h"
+#include "workspace.h"
+
+namespace chrome_lang_id {
+
+// Specialization of the EmbeddingFeatureExtractor for extracting from
+// (Sentence, int).
+class LanguageIdEmbeddingFeatureExtractor
+    : public EmbeddingFeatureExtractor<WholeSentenceExtractor, Sentence> {
+ public:
+  const string ArgPrefix() const override;
+};
+
+// The language identification model: the feature extractor set up from the
+// features in TaskContextParams or in a model file, the registry of its
+// workspaces, and the network.  A LanguageIdModel is immutable once
+// constructed, so a single instance can be shared by any number of threads,
+// each running NNetLanguageIdentifier sessions (or its own InferenceScratch)
+// on it.
+class LanguageIdModel {
+ public:
+  // Uses the built-in network parameters.
+  LanguageIdModel();
+
+  // Uses the network parameters from nn_params instead of the built-in ones,
+  // e.g., an Int8QuantizedNNParams.  nn_params should describe a network with
+  // the same features and languages as the built-in model, and should stay
+  // alive for at least the lifetime of this object.  If nn_params is nullptr,
+  // the built-in parameters are used.
+  explicit LanguageIdModel(const EmbeddingNetworkParams *nn_params);
+
+  // Uses the network, features and languages of a model file.  The feature
+  // extractor is set up from the pre-parsed features in the file, without
+  // parsing any FML.  model_file should stay alive for at least the lifetime
+  // of this object.
+  explicit LanguageIdModel(const MmapEmbeddingNetworkParams &model_file);
+  ~LanguageIdModel();
+
+  // Returns the model with the built-in parameters, set up on the first call
+  // and shared by all the callers afterwards.  It is never destroyed.
+  static std::shared_ptr<const LanguageIdModel> BuiltIn();
+
+  // Sets up the features of a model file as the model would, from descriptors
+  // and embedding_dims, and stores the number of features and the domain size
+  // of each embedding space in *num_features and *domain_sizes.  Returns false
+  // if the descriptors use feature functions that the model does not have, or
+  // nested features.
+  static bool GetFeatureSizes(
+      const std::vector<FeatureExtractorDescriptor> &descriptors,
+      const std::vector<int> &embedding_dims, std::vector<int> *num_features,
+      std::vector<int> *domain_sizes);
+
+  // Extracts features from sentence, using workspaces as the feature
+  // workspaces.  If ulscript is not UNKNOWN_ULSCRIPT, it is the script of the
+  // whole text, and the script feature uses it instead of scanning the text.
+  // features should have NumEmbeddings() elements.  On return,
+  // FeatureVector features[i] contains the features for the embedding space
+  // #i.
+  void GetFeatures(Sentence *sentence, CLD2::ULScript ulscript,
+                   WorkspaceSet *workspaces,
+                   std::vector<FeatureVector> *features) const;
+
+  // Prepares workspaces for UpdateRunningFeatures(), dropping any running
+  // counts they hold.
+  void ResetRunningFeatures(WorkspaceSet *workspaces) const;
+
+  // Same as GetFeatures, but for the text seen so far by a streaming caller:
+  // the text of sentence starts with its text at the previous call since
+  // ResetRunningFeatures(workspaces), and the feature functions only count the
+  // new text.
+  void UpdateRunningFeatures(Sentence *sentence, CLD2::ULScript ulscript,
+                             WorkspaceSet *workspaces,
+                             std::vector<FeatureVector> *features) const;
+
+  // Returns the number of embedding spaces, i.e., of feature vectors.
+  int NumEmbeddings() const { return feature_extractor_.NumEmbeddings(); }
+
+  // Returns the network that computes the language scores from the features.
+  const EmbeddingNetwork &network() const { return network_; }
+
+  // Returns the number of languages.
+  int num_languages() const { return language_names_.size(); }
+
+  // Returns true if the languages of the model, with their ids, are the ones
+  // of the built-in model (see TaskContextParams::kLanguageNames).
+  bool has_built_in_languages() const { return has_built_in_languages_; }
+
+  // Returns the language name corresponding to the given id.
+  string GetLanguageName(int language_id) const;
+
+  // Same as above, without copying the name: the returned string lives as
+  // long as this object.
+  const char *GetLanguageCode(int language_id) const;
+
+  // Returns the id of the language named language, or -1 if it is not one of
+  // the languages of the model.
+  int GetLanguageId(const char *language) const;
+  int GetLanguageId(const string &language) const {
+    return GetLanguageId(language.c_str());
+  }
+
+ private:
+  // Registers the feature functions of the model.  RegisterFeaturesOnce()
+  // only does it the first time it is called in the process.
+  static void RegisterFeaturesOnce();
+  static void RegisterFeatures();
+
+  // Initializes the feature extractor, once set up from context, and requests
+  // its workspaces.
+  void InitFeatureExtractor(TaskContext *context);
+
+  // Names of the languages, indexed by id.  They are either static or point
+  // into the model file.
+  std::vector<const char *> language_names_;
+
+  // Whether language_names_ matches TaskContextParams::kLanguageNames.
+  bool has_built_in_languages_ = true;
+
+  // Typed feature extractor for embeddings.
+  LanguageIdEmbeddingFeatureExtractor feature_extractor_;
+
+  // The registry of shared workspaces in the feature extractor.
+  WorkspaceRegistry workspace_registry_;
+
+  // Index of the workspace holding the known script of the text, for
+  // ScriptFeature.
+  int script_workspace_index_ = -1;
+
+  // Index of the workspace that turns on the running counts of the feature
+  // functions.
+  int running_counts_index_ = -1;
+
+  // Parameters for the neural networks.
+  LangIdNNParams nn_params_;
+
+  // Neural network to use for scoring.
+  EmbeddingNetwork network_;
+
+  // This feature function is not relevant to this class. Adding this variable
+  // ensures that the features are linked.
+  ContinuousBagOfNgramsFunction ngram_function_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(LanguageIdModel);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // LANGUAGE_ID_MODEL_H_
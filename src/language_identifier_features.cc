@@ -15,8 +15,11 @@ limitations under the License.
 
 #include "language_identifier_features.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
 #include <sstream>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -24,6 +27,7 @@ limitations under the License.
 #include "feature_extractor.h"
 #include "feature_types.h"
 #include "script_span/generated_ulscript.h"
+#include "script_languages.h"
 #include "script_span/getonescriptspan.h"
 #include "sentence_features.h"
 #include "task_context.h"
@@ -31,6 +35,466 @@ limitations under the License.
 #include "utils.h"
 
 namespace chrome_lang_id {
+namespace {
+
+// One char of the text processed by ContinuousBagOfNgramsFunction: either a
+// slice of the text, or one of the "^" / "$" token terminators.
+class CharSlice {
+ public:
+  CharSlice(const char *data, int size)
+      : data_(data), size_(size), is_terminator_(false) {}
+
+  static CharSlice BeginTerminator() { return CharSlice("^", 1, true); }
+  static CharSlice EndTerminator() { return CharSlice("$", 1, true); }
+
+  const char *data() const { return data_; }
+  int size() const { return size_; }
+  bool is_terminator() const { return is_terminator_; }
+  bool is_space() const {
+    return !is_terminator_ && size_ == 1 && *data_ == ' ';
+  }
+
+ private:
+  CharSlice(const char *data, int size, bool is_terminator)
+      : data_(data), size_(size), is_terminator_(is_terminator) {}
+
+  const char *data_;
+  int size_;
+  bool is_terminator_;
+};
+
+// Counts char ngrams in a flat open-addressing hash table keyed by the ngram
+// bytes.  The ngrams are reported in order of first occurrence, along with
+// their counts and their Hash32WithDefaultSeed values.  The buffers are kept
+// across Reset() calls, so in steady state counting does not allocate.
+class NgramCounter {
+ public:
+  // Prepares for counting at most max_num_ngrams distinct ngrams.
+  void Reset(size_t max_num_ngrams) {
+    slots_.assign(NumSlotsFor(max_num_ngrams), -1);
+    entries_.clear();
+    ngram_bytes_.clear();
+    num_present_ngrams_ = 0;
+  }
+
+  // Makes room for num_new_ngrams more distinct ngrams than the ones counted
+  // so far, keeping the counts.
+  void Reserve(size_t num_new_ngrams) {
+    const size_t num_slots = NumSlotsFor(entries_.size() + num_new_ngrams);
+    if (num_slots <= slots_.size()) return;
+    slots_.assign(num_slots, -1);
+    const size_t mask = num_slots - 1;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      size_t slot = entries_[i].hash & mask;
+      while (slots_[slot] >= 0) slot = (slot + 1) & mask;
+      slots_[slot] = i;
+    }
+  }
+
+  // Adds delta occurrences of the ngram made of the size chars starting at
+  // chars.  Unless has_terminator is true, these chars are consecutive in the
+  // text, so the ngram is hashed straight out of the text.  A negative delta
+  // removes occurrences of an ngram added before.
+  void Add(const CharSlice *chars, int size, bool has_terminator, int delta) {
+    const char *data;
+    int num_bytes;
+    if (has_terminator) {
+      ngram_.clear();
+      for (int i = 0; i < size; ++i) {
+        ngram_.append(chars[i].data(), chars[i].size());
+      }
+      data = ngram_.data();
+      num_bytes = ngram_.size();
+    } else {
+      data = chars[0].data();
+      num_bytes = chars[size - 1].data() + chars[size - 1].size() - data;
+    }
+
+    const uint32 hash = utils::Hash32(data, num_bytes, kNgramHashSeed);
+    const size_t mask = slots_.size() - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+      const int entry_index = slots_[slot];
+      if (entry_index < 0) {
+        CLD3_DCHECK(delta > 0);
+        slots_[slot] = entries_.size();
+        entries_.push_back({hash, static_cast<int>(ngram_bytes_.size()),
+                            num_bytes, delta});
+        ngram_bytes_.append(data, num_bytes);
+        ++num_present_ngrams_;
+        return;
+      }
+      Entry &entry = entries_[entry_index];
+      if (entry.hash == hash && entry.num_bytes == num_bytes &&
+          memcmp(ngram_bytes_.data() + entry.offset, data, num_bytes) == 0) {
+        if (entry.count == 0) ++num_present_ngrams_;
+        entry.count += delta;
+        CLD3_DCHECK(entry.count >= 0);
+        if (entry.count == 0) --num_present_ngrams_;
+        return;
+      }
+    }
+  }
+
+  // Returns the number of distinct ngrams added since the last Reset(),
+  // including the ones whose occurrences have all been removed since.
+  int num_ngrams() const { return entries_.size(); }
+
+  // Returns the number of distinct ngrams with a positive count.
+  int num_present_ngrams() const { return num_present_ngrams_; }
+
+  // Returns the hash and the count of the i-th distinct ngram.
+  uint32 hash(int i) const { return entries_[i].hash; }
+  int count(int i) const { return entries_[i].count; }
+
+ private:
+  // Seed used by utils::Hash32WithDefaultSeed.
+  static const uint32 kNgramHashSeed = 0xBEEF;
+
+  struct Entry {
+    uint32 hash;
+
+    // Position of the ngram bytes in ngram_bytes_.
+    int offset;
+    int num_bytes;
+
+    int count;
+  };
+
+  // Returns the number of slots needed to keep the table at most half full
+  // with num_ngrams ngrams.
+  static size_t NumSlotsFor(size_t num_ngrams) {
+    size_t num_slots = 16;
+    while (num_slots < 2 * num_ngrams) num_slots *= 2;
+    return num_slots;
+  }
+
+  // Open-addressing table with linear probing: each slot holds an index in
+  // entries_, or -1 if empty.  Always at most half full.
+  std::vector<int> slots_;
+
+  // Distinct ngrams, in order of first occurrence.
+  std::vector<Entry> entries_;
+
+  // Concatenated bytes of the distinct ngrams.
+  string ngram_bytes_;
+
+  // Number of entries with a positive count.
+  int num_present_ngrams_ = 0;
+
+  // Buffer for ngrams that contain terminators.
+  string ngram_;
+};
+
+// Char ngrams of a sentence, shared by the ContinuousBagOfNgramsFunction
+// instances that split the text the same way, i.e., that have the same
+// include_terminators and include_spaces parameters.  The text is split into
+// chars when the workspace is created.  Each function then requests its ngram
+// size in Preprocess(), and the first call to counter() counts the ngrams of
+// all the requested sizes in a single sweep over the chars.
+//
+// The buffers are thread-local and reused from sentence to sentence, so at most
+// one workspace per parameter combination may be in use at a time in a thread.
+// The workspace itself may be reused too, by re-aiming it with Reset().  A
+// workspace with running counts owns its buffers instead, since it lives as
+// long as the stream.
+class CharNgramsWorkspace : public Workspace {
+ public:
+  CharNgramsWorkspace(const string &text, bool include_terminators,
+                      bool include_spaces);
+
+  // Creates a workspace with running counts, initially of the empty text.
+  CharNgramsWorkspace(bool include_terminators, bool include_spaces);
+
+  // Returns true if Reset() can re-aim this workspace, i.e., if it does not
+  // have running counts and has the given parameters.
+  bool CanReset(bool include_terminators, bool include_spaces) const {
+    return own_buffers_ == nullptr &&
+           include_terminators == include_terminators_ &&
+           include_spaces == include_spaces_;
+  }
+
+  // Re-aims the workspace at text, as if it had just been created for it.
+  void Reset(const string &text);
+
+  // Same as CanReset(), for a workspace with running counts.
+  bool CanResetRunningCounts(bool include_terminators,
+                             bool include_spaces) const {
+    return own_buffers_ != nullptr &&
+           include_terminators == include_terminators_ &&
+           include_spaces == include_spaces_;
+  }
+
+  // Drops the running counts, as if the workspace had just been created, but
+  // keeps the storage of the buffers.
+  void ResetRunningCounts();
+
+  // Returns the name of this type of workspace.
+  static string TypeName() { return "CharNgrams"; }
+
+  // Returns the name of the workspace for the given parameters.
+  static string WorkspaceName(bool include_terminators, bool include_spaces) {
+    return string("char-ngrams(include_terminators=") +
+           (include_terminators ? "true" : "false") +
+           ",include_spaces=" + (include_spaces ? "true" : "false") + ")";
+  }
+
+  // Requests the counts of the ngrams of the given size.  With running counts,
+  // all the sizes must be requested before the first count.
+  void RequestNgramSize(int size);
+
+  // For a workspace with running counts, sets the text seen so far, which
+  // starts with the text of the previous call.  The text is not copied, and
+  // should stay alive until the counts are read.
+  void UpdateText(const string *text);
+
+  // Returns the counts of the ngrams of the given size, which must have been
+  // requested.
+  const NgramCounter &counter(int size) const {
+    CountNgrams();
+    return buffers_->counters[size];
+  }
+
+  // Returns the total number of ngrams of the given size, which must have been
+  // requested.
+  int count_sum(int size) const {
+    CountNgrams();
+    return buffers_->count_sums[size];
+  }
+
+ private:
+  struct Buffers {
+    // The workspace currently using these buffers.
+    const CharNgramsWorkspace *owner = nullptr;
+
+    // The chars of the text, including terminators if requested.
+    std::vector<CharSlice> chars;
+
+    // counters[size] counts the ngrams of the given size, and count_sums[size]
+    // is their total count, or -1 if this size has not been requested.
+    std::vector<NgramCounter> counters;
+    std::vector<int> count_sums;
+  };
+
+  // Returns the buffers of the current thread for the given parameters.
+  static Buffers *GetBuffers(bool include_terminators, bool include_spaces) {
+    static thread_local Buffers buffers[4];
+    return &buffers[(include_terminators ? 1 : 0) + (include_spaces ? 2 : 0)];
+  }
+
+  // Splits the text in [begin, end), which starts at the beginning of a token,
+  // into buffers_->chars.
+  void SplitIntoChars(const char *begin, const char *end) const;
+
+  // Adds delta to the counts of the ngrams of buffers_->chars, for all the
+  // requested sizes.
+  void AddNgramsOfChars(int delta) const;
+
+  // Counts the ngrams of all the requested sizes, unless already done.
+  void CountNgrams() const;
+
+  // Updates the running counts with the text set by UpdateText().
+  void UpdateRunningCounts() const;
+
+  const bool include_terminators_;
+  const bool include_spaces_;
+
+  // Buffers owned by a workspace with running counts.
+  std::unique_ptr<Buffers> own_buffers_;
+  Buffers *buffers_;
+
+  // Largest requested ngram size.
+  int max_ngram_size_ = 0;
+
+  // Whether CountNgrams() has run.  The counting is deferred to the first
+  // const access, once all the feature functions have requested their sizes.
+  mutable bool counted_ = false;
+
+  // With running counts: the text seen so far, the number of bytes of it that
+  // have been counted, and the offset of the last counted token, which is
+  // counted again when the text grows.
+  const string *running_text_ = nullptr;
+  mutable int num_counted_bytes_ = 0;
+  mutable int last_token_begin_ = 0;
+};
+
+CharNgramsWorkspace::CharNgramsWorkspace(const string &text,
+                                         bool include_terminators,
+                                         bool include_spaces)
+    : include_terminators_(include_terminators),
+      include_spaces_(include_spaces),
+      buffers_(nullptr) {
+  Reset(text);
+}
+
+CharNgramsWorkspace::CharNgramsWorkspace(bool include_terminators,
+                                         bool include_spaces)
+    : include_terminators_(include_terminators),
+      include_spaces_(include_spaces),
+      own_buffers_(new Buffers),
+      buffers_(own_buffers_.get()) {
+  buffers_->owner = this;
+}
+
+void CharNgramsWorkspace::Reset(const string &text) {
+  CLD3_DCHECK(own_buffers_ == nullptr);
+
+  // The workspace may have been created in another thread.
+  buffers_ = GetBuffers(include_terminators_, include_spaces_);
+  buffers_->owner = this;
+  buffers_->count_sums.assign(buffers_->count_sums.size(), -1);
+  max_ngram_size_ = 0;
+  counted_ = false;
+  SplitIntoChars(text.data(), text.data() + text.size());
+}
+
+void CharNgramsWorkspace::ResetRunningCounts() {
+  CLD3_DCHECK(own_buffers_ != nullptr);
+  buffers_->count_sums.assign(buffers_->count_sums.size(), -1);
+  max_ngram_size_ = 0;
+  counted_ = false;
+  running_text_ = nullptr;
+  num_counted_bytes_ = 0;
+  last_token_begin_ = 0;
+}
+
+void CharNgramsWorkspace::SplitIntoChars(const char *begin,
+                                         const char *end) const {
+  // Include terminators for each token: tokens are discovered by splitting the
+  // text on spaces.
+  std::vector<CharSlice> &chars = buffers_->chars;
+  chars.clear();
+  if (include_terminators_) {
+    chars.push_back(CharSlice::BeginTerminator());
+  }
+  const char *current = begin;
+  while (current < end) {
+    const int char_length = std::min(static_cast<int>(end - current),
+                                     utils::OneCharLen(current));
+    const CharSlice slice(current, char_length);
+    if (include_terminators_ && slice.is_space()) {
+      chars.push_back(CharSlice::EndTerminator());
+      chars.push_back(slice);
+      chars.push_back(CharSlice::BeginTerminator());
+    } else {
+      chars.push_back(slice);
+    }
+    current += char_length;
+  }
+  if (include_terminators_) {
+    chars.push_back(CharSlice::EndTerminator());
+  }
+}
+
+void CharNgramsWorkspace::RequestNgramSize(int size) {
+  CLD3_DCHECK(buffers_->owner == this);
+  CLD3_CHECK(size > 0);
+  if (own_buffers_ != nullptr && size < static_cast<int>(
+                                            buffers_->count_sums.size()) &&
+      buffers_->count_sums[size] >= 0) {
+    // Already requested for the running counts.
+    return;
+  }
+  CLD3_DCHECK(!counted_);
+  CLD3_CHECK(num_counted_bytes_ == 0);
+  if (static_cast<int>(buffers_->count_sums.size()) <= size) {
+    buffers_->counters.resize(size + 1);
+    buffers_->count_sums.resize(size + 1, -1);
+  }
+  buffers_->count_sums[size] = 0;
+  max_ngram_size_ = std::max(max_ngram_size_, size);
+}
+
+void CharNgramsWorkspace::UpdateText(const string *text) {
+  CLD3_DCHECK(own_buffers_ != nullptr);
+  CLD3_DCHECK(static_cast<int>(text->size()) >= num_counted_bytes_);
+  running_text_ = text;
+  if (static_cast<int>(text->size()) != num_counted_bytes_) counted_ = false;
+}
+
+void CharNgramsWorkspace::AddNgramsOfChars(int delta) const {
+  const std::vector<CharSlice> &chars = buffers_->chars;
+  std::vector<NgramCounter> &counters = buffers_->counters;
+  std::vector<int> &count_sums = buffers_->count_sums;
+
+  // Grow the ngram starting at each char one char at a time, and count it at
+  // each requested size, until it reaches a space (unless spaces are included)
+  // or the end of the text.
+  const int num_chars = chars.size();
+  for (int start = 0; start < num_chars; ++start) {
+    const int max_size = std::min(max_ngram_size_, num_chars - start);
+    bool has_terminator = false;
+    for (int size = 1; size <= max_size; ++size) {
+      const CharSlice &current_char = chars[start + size - 1];
+      if (current_char.is_space() && !include_spaces_) {
+        break;
+      }
+      has_terminator |= current_char.is_terminator();
+      if (count_sums[size] >= 0) {
+        counters[size].Add(chars.data() + start, size, has_terminator, delta);
+        count_sums[size] += delta;
+      }
+    }
+  }
+}
+
+void CharNgramsWorkspace::CountNgrams() const {
+  CLD3_DCHECK(buffers_->owner == this);
+  if (counted_) return;
+  counted_ = true;
+  if (own_buffers_ != nullptr) {
+    UpdateRunningCounts();
+    return;
+  }
+  for (int size = 1; size <= max_ngram_size_; ++size) {
+    if (buffers_->count_sums[size] >= 0) {
+      buffers_->counters[size].Reset(buffers_->chars.size());
+    }
+  }
+  AddNgramsOfChars(/*delta=*/1);
+}
+
+void CharNgramsWorkspace::UpdateRunningCounts() const {
+  if (running_text_ == nullptr) return;
+  const char *const text = running_text_->data();
+  const int text_size = running_text_->size();
+  std::vector<NgramCounter> &counters = buffers_->counters;
+  std::vector<int> &count_sums = buffers_->count_sums;
+  if (num_counted_bytes_ == 0 || include_spaces_) {
+    // Ngrams may span spaces, so start over.
+    for (int size = 1; size <= max_ngram_size_; ++size) {
+      if (count_sums[size] >= 0) {
+        counters[size].Reset(0);
+        count_sums[size] = 0;
+      }
+    }
+    last_token_begin_ = 0;
+  } else {
+    // The last token may continue in the new text: remove its ngrams.
+    SplitIntoChars(text + last_token_begin_, text + num_counted_bytes_);
+    AddNgramsOfChars(/*delta=*/-1);
+  }
+
+  SplitIntoChars(text + last_token_begin_, text + text_size);
+  for (int size = 1; size <= max_ngram_size_; ++size) {
+    if (count_sums[size] >= 0) {
+      counters[size].Reserve(buffers_->chars.size());
+    }
+  }
+  AddNgramsOfChars(/*delta=*/1);
+
+  for (int i = text_size - 1; i >= last_token_begin_; --i) {
+    if (text[i] == ' ') {
+      last_token_begin_ = i + 1;
+      break;
+    }
+  }
+  num_counted_bytes_ = text_size;
+}
+
+}  // namespace
+
+const char kRunningCountsWorkspaceName[] = "running-counts";
+
 NumericFeatureType::NumericFeatureType(const string &name, FeatureValue size)
     : FeatureType(name), size_(size) {}
 
@@ -53,78 +517,93 @@ void ContinuousBagOfNgramsFunction::Init(TaskContext *context) {
   set_feature_type(new NumericFeatureType(name(), ngram_id_dimension_));
 }
 
-void ContinuousBagOfNgramsFunction::Evaluate(const WorkspaceSet &workspaces,
-                                             const Sentence &sentence,
-                                             FeatureVector *result) const {
-  // Include terminators for each token. Tokens are discovered by splitting the
-  // text on spaces.
-  std::vector<string> chars;
-  utils::GetUTF8Chars(sentence.text(), &chars);
-  if (include_terminators_) {
-    std::vector<string> new_chars{"^"};
-    for (size_t index = 0; index < chars.size(); ++index) {
-      if (chars.at(index) == " ") {
-        new_chars.push_back("$");
-        new_chars.push_back(" ");
-        new_chars.push_back("^");
+void ContinuousBagOfNgramsFunction::RequestWorkspaces(
+    WorkspaceRegistry *registry) {
+  workspace_index_ = registry->Request<CharNgramsWorkspace>(
+      CharNgramsWorkspace::WorkspaceName(include_terminators_,
+                                         include_spaces_));
+  running_counts_index_ =
+      registry->Request<SingletonIntWorkspace>(kRunningCountsWorkspaceName);
+}
+
+void ContinuousBagOfNgramsFunction::Preprocess(WorkspaceSet *workspaces,
+                                               Sentence *sentence) const {
+  if (workspace_index_ < 0) return;
+  const bool running_counts =
+      workspaces->Has<SingletonIntWorkspace>(running_counts_index_);
+  if (!workspaces->Has<CharNgramsWorkspace>(workspace_index_)) {
+    // Re-aim the workspace of the previous sentence, if any, rather than
+    // allocating a new one.
+    std::unique_ptr<CharNgramsWorkspace> spare(
+        workspaces->TakeSpare<CharNgramsWorkspace>(workspace_index_));
+    CharNgramsWorkspace *ngrams;
+    if (running_counts) {
+      if (spare != nullptr &&
+          spare->CanResetRunningCounts(include_terminators_, include_spaces_)) {
+        ngrams = spare.release();
+        ngrams->ResetRunningCounts();
       } else {
-        new_chars.push_back(chars.at(index));
-      }
-    }
-    new_chars.push_back("$");
-    chars.swap(new_chars);
-  }
-
-  // Find the char ngram counts.
-  std::unordered_map<string, int> char_ngram_counts;
-  int count_sum = 0;
-  for (int start = 0; start <= static_cast<int>(chars.size()) - ngram_size_;
-       ++start) {
-    string char_ngram;
-    int index;
-    for (index = 0; index < ngram_size_; ++index) {
-      const string &current_char = chars.at(start + index);
-      if (current_char == " " && !include_spaces_) {
-        break;
+        ngrams = new CharNgramsWorkspace(include_terminators_, include_spaces_);
       }
-      char_ngram.append(current_char);
-    }
-    if (index == ngram_size_) {
-      char_ngram_counts[char_ngram]++;
-      ++count_sum;
+    } else if (spare != nullptr &&
+               spare->CanReset(include_terminators_, include_spaces_)) {
+      ngrams = spare.release();
+      ngrams->Reset(sentence->text());
+    } else {
+      ngrams = new CharNgramsWorkspace(sentence->text(), include_terminators_,
+                                       include_spaces_);
     }
+    workspaces->Set(workspace_index_, ngrams);
   }
+  CharNgramsWorkspace *ngrams =
+      workspaces->MutableGet<CharNgramsWorkspace>(workspace_index_);
+  ngrams->RequestNgramSize(ngram_size_);
+  if (running_counts) ngrams->UpdateText(&sentence->text());
+}
 
-  // Populate the feature vector.
-  const float equal_weight = 1.0 / char_ngram_counts.size();
-  const float norm = static_cast<float>(count_sum);
-  for (const auto &ngram_and_count : char_ngram_counts) {
-    const float weight =
-        use_equal_ngram_weight_ ? equal_weight : ngram_and_count.second / norm;
-    FloatFeatureValue value(
-        utils::Hash32WithDefaultSeed(ngram_and_count.first) %
-            ngram_id_dimension_,
-        weight);
+void ContinuousBagOfNgramsFunction::Evaluate(const WorkspaceSet &workspaces,
+                                             const Sentence &sentence,
+                                             FeatureVector *result) const {
+  // Without workspaces (i.e., if the caller skipped RequestWorkspaces() or
+  // Preprocess()), count the ngrams of this function alone.
+  const CharNgramsWorkspace *ngrams;
+  std::unique_ptr<CharNgramsWorkspace> own_ngrams;
+  if (workspace_index_ >= 0 &&
+      workspaces.Has<CharNgramsWorkspace>(workspace_index_)) {
+    ngrams = &workspaces.Get<CharNgramsWorkspace>(workspace_index_);
+  } else {
+    own_ngrams.reset(new CharNgramsWorkspace(
+        sentence.text(), include_terminators_, include_spaces_));
+    own_ngrams->RequestNgramSize(ngram_size_);
+    ngrams = own_ngrams.get();
+  }
+  const NgramCounter &counter = ngrams->counter(ngram_size_);
+
+  // Populate the feature vector.  Only running counts may drop to zero.
+  const float equal_weight = 1.0 / counter.num_present_ngrams();
+  const float norm = static_cast<float>(ngrams->count_sum(ngram_size_));
+  for (int i = 0; i < counter.num_ngrams(); ++i) {
+    if (counter.count(i) == 0) continue;
+    const float weight = use_equal_ngram_weight_
+                             ? equal_weight
+                             : counter.count(i) / norm;
+    FloatFeatureValue value(counter.hash(i) % ngram_id_dimension_, weight);
     result->add(feature_type(), value.discrete_value);
   }
 }
 
-FeatureValue ScriptFeature::Compute(const WorkspaceSet &workspaces,
-                                    const Sentence &sentence,
-                                    const FeatureVector *result) const {
-  const string &text = sentence.text();
-  CLD2::ScriptScanner ss(text.c_str(), text.size(),
-                         /*is_plain_text=*/true);
+const char ScriptFeature::kScriptWorkspaceName[] = "ulscript";
 
-  // GetOneScriptSpan() is called only once because of the assumption that the
-  // input contains one script. This function also cleans up the input (e.g.,
-  // removes digits, punctuation).
-  // TODO(abakalov): Extract the clean-up and script detection code out of
-  // GetOneScriptSpan() because we don't have to iterate over the whole text,
-  // just look at the first codepoint after clean-up.
-  CLD2::LangSpan script_span;
-  ss.GetOneScriptSpan(&script_span);
-  const CLD2::ULScript ulscript = script_span.ulscript;
+void ScriptFeature::RequestWorkspaces(WorkspaceRegistry *registry) {
+  workspace_index_ =
+      registry->Request<SingletonIntWorkspace>(kScriptWorkspaceName);
+}
+
+namespace {
+
+// Returns the value of the script feature for text, of script ulscript.
+FeatureValue GetScriptFeatureValue(CLD2::ULScript ulscript, const char *text,
+                                   int text_bytes) {
   if (ulscript != CLD2::ULScript_Hani) {
     return ulscript;
   } else {
@@ -133,7 +612,7 @@ FeatureValue ScriptFeature::Compute(const WorkspaceSet &workspaces,
     int num_hangul = 0;
     int num_non_hangul = 0;
     UnicodeText unicode_text;
-    unicode_text.PointToUTF8(script_span.text, script_span.text_bytes);
+    unicode_text.PointToUTF8(text, text_bytes);
     for (chrome_lang_id::char32 codepoint : unicode_text) {
       // If the current codepoint is space, continue.
       if (codepoint == 0x20) {
@@ -142,12 +621,7 @@ FeatureValue ScriptFeature::Compute(const WorkspaceSet &workspaces,
 
       // Check if the current codepoint is within the ranges associated with
       // Hangul.
-      if ((codepoint >= 0x1100 && codepoint <= 0x11FF) ||  // Hangul Jamo
-          (codepoint >= 0xA960 && codepoint <= 0xA97F) ||  // Jamo Extended A
-          (codepoint >= 0xD7B0 && codepoint <= 0xD7FF) ||  // Jamo Extended B
-          (codepoint >= 0x3130 && codepoint <= 0x318F) ||  // Compatibility Jamo
-          (codepoint >= 0xFFA0 && codepoint <= 0xFFDC) ||  // Halfwidth Jamo
-          (codepoint >= 0xAC00 && codepoint <= 0xD7AF)) {  // Hangul Syllables
+      if (IsHangul(codepoint)) {
         num_hangul++;
       } else {
         num_non_hangul++;
@@ -155,11 +629,38 @@ FeatureValue ScriptFeature::Compute(const WorkspaceSet &workspaces,
     }
 
     if (num_hangul > num_non_hangul) {
-      return static_cast<FeatureValue>(CLD2::NUM_ULSCRIPTS);
+      return static_cast<FeatureValue>(kHangulScript);
     } else {
       return static_cast<FeatureValue>(CLD2::ULScript_Hani);
     }
   }
 }
 
+}  // namespace
+
+FeatureValue ScriptFeature::Compute(const WorkspaceSet &workspaces,
+                                    const Sentence &sentence,
+                                    const FeatureVector *result) const {
+  const string &text = sentence.text();
+  if (workspace_index_ >= 0 &&
+      workspaces.Has<SingletonIntWorkspace>(workspace_index_)) {
+    // The script is known, and the whole text is in this script.
+    const CLD2::ULScript ulscript = static_cast<CLD2::ULScript>(
+        workspaces.Get<SingletonIntWorkspace>(workspace_index_).get());
+    return GetScriptFeatureValue(ulscript, text.data(), text.size());
+  }
+
+  // The scanner takes its buffers from a per-thread pool, so this does not
+  // allocate in steady state.
+  CLD2::ScriptScanner ss(text.c_str(), text.size(), /*is_plain_text=*/true);
+
+  // GetOneScriptSpan() is called only once because of the assumption that the
+  // input contains one script. This function also cleans up the input (e.g.,
+  // removes digits, punctuation).
+  CLD2::LangSpan script_span;
+  ss.GetOneScriptSpan(&script_span);
+  return GetScriptFeatureValue(script_span.ulscript, script_span.text,
+                               script_span.text_bytes);
+}
+
 }  // namespace chrome_lang_id
@@ -44,6 +44,13 @@ class NumericFeatureType : public FeatureType {
   FeatureValue size_;
 };
 
+// Name of the SingletonIntWorkspace that, when set, tells the feature functions
+// that support it to keep running counts: the text of the sentence is the text
+// seen so far by a streaming caller, it only grows (by whole UTF8 chars) from
+// one Preprocess() call to the next, and the workspaces are kept between the
+// calls, so the functions only need to count the new text.
+extern const char kRunningCountsWorkspaceName[];
+
 // Class for computing continuous char ngram features.
 // Feature function descriptor parameters:
 //   include_terminators(bool, false):
@@ -60,11 +67,29 @@ class NumericFeatureType : public FeatureType {
 //     Hash32WithDefaultSeed(char ngram) % id_dim.
 //   size(int, 3):
 //     Only ngrams of this size will be extracted.
+//
+// The functions that split the text the same way (same include_terminators and
+// include_spaces) share a workspace: the text is split into chars once per
+// sentence, and the ngrams of all their sizes are counted in a single sweep.
+//
+// If the kRunningCountsWorkspaceName workspace is set, the workspace keeps
+// running counts instead.  Unless include_spaces is true (in which case the
+// whole text is counted again), only the last token of the previous text,
+// which the new text may extend, is counted again.
 class ContinuousBagOfNgramsFunction : public WholeSentenceFeature {
  public:
   void Setup(TaskContext *context) override;
   void Init(TaskContext *context) override;
 
+  // Requests the char ngrams workspace shared with the other functions that
+  // have the same include_terminators and include_spaces parameters.
+  void RequestWorkspaces(WorkspaceRegistry *registry) override;
+
+  // Splits the text into chars, unless another function already did, and
+  // requests the ngrams of size ngram_size_.  With running counts, also passes
+  // the grown text to the workspace.
+  void Preprocess(WorkspaceSet *workspaces, Sentence *sentence) const override;
+
   // Appends the features computed from the focus to the feature vector.
   void Evaluate(const WorkspaceSet &workspaces, const Sentence &sentence,
                 FeatureVector *result) const override;
@@ -88,6 +113,14 @@ class ContinuousBagOfNgramsFunction : public WholeSentenceFeature {
 
   // Only ngrams of size ngram_size_ will be extracted.
   int ngram_size_;
+
+  // Index of the char ngrams workspace, or -1 if RequestWorkspaces() has not
+  // been called.
+  int workspace_index_ = -1;
+
+  // Index of the kRunningCountsWorkspaceName workspace, or -1 if
+  // RequestWorkspaces() has not been called.
+  int running_counts_index_ = -1;
 };
 
 // Class for detecting the script of a piece of text. The list of supported
@@ -97,8 +130,16 @@ class ContinuousBagOfNgramsFunction : public WholeSentenceFeature {
 // ULScript_Hani. In the latter case, the function emits NUM_ULSCRIPTS. The
 // class assumes that the input is (1) interchange valid UTF8, and (2) contains
 // only one chrome_lang_id::CLD2::ULScript.
+//
+// Callers that already know the ULScript of the text (e.g., because they got
+// the text from a ScriptScanner) can set it in the SingletonIntWorkspace named
+// kScriptWorkspaceName before extracting the features. The function then skips
+// scanning the text, except for the Hani / Hangul split.
 class ScriptFeature : public WholeSentenceFeature {
  public:
+  // Name of the SingletonIntWorkspace holding the known ULScript of the text.
+  static const char kScriptWorkspaceName[];
+
   void Init(TaskContext *context) override {
     // The dimension is incremented by 1 because ULScript_Hani is split into two
     // as mentioned in the class description.
@@ -106,9 +147,17 @@ class ScriptFeature : public WholeSentenceFeature {
         name(), chrome_lang_id::CLD2::NUM_ULSCRIPTS + 1));
   }
 
+  // Requests the workspace holding the known ULScript of the text.
+  void RequestWorkspaces(WorkspaceRegistry *registry) override;
+
   // Computes the feature and saves it in the feature vector.
   FeatureValue Compute(const WorkspaceSet &workspaces, const Sentence &sentence,
                        const FeatureVector *result) const override;
+
+ private:
+  // Index of the known ULScript workspace, or -1 if RequestWorkspaces() has
+  // not been called.
+  int workspace_index_ = -1;
 };
 
 }  // namespace chrome_lang_id
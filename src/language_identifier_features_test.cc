@@ -13,16 +13,21 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
-#include <vector>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "base.h"
 #include "feature_extractor.h"
 #include "language_identifier_features.h"
 #include "nnet_language_identifier.h"
 #include "script_span/generated_ulscript.h"
+#include "script_span/getonescriptspan.h"
 #include "cld_3/protos/sentence.pb.h"
 #include "task_context.h"
 #include "utils.h"
@@ -61,16 +66,47 @@ class FeatureIdWeightCalculator {
 
     feature_extractor_.Setup(context);
     feature_extractor_.Init(context);
+    feature_extractor_.RequestWorkspaces(&workspace_registry_);
   }
 
-  // Assumes that a single feature is specified and extracts it.
-  void ExtractOnlyFeature(Sentence *sentence,
-                          std::vector<FeatureVector> *features) {
-    CLD3_CHECK(features->size() == 1);
+  // Extracts the features, one FeatureVector per ';'-separated feature.  If
+  // known_ulscript is not UNKNOWN_ULSCRIPT, passes it to ScriptFeature as the
+  // script of the text.
+  void ExtractFeatures(Sentence *sentence, std::vector<FeatureVector> *features,
+                       CLD2::ULScript known_ulscript = CLD2::UNKNOWN_ULSCRIPT) {
     WorkspaceSet workspace;
     workspace.Reset(workspace_registry_);
+    if (known_ulscript != CLD2::UNKNOWN_ULSCRIPT) {
+      workspace.Set(workspace_registry_.Request<SingletonIntWorkspace>(
+                        ScriptFeature::kScriptWorkspaceName),
+                    new SingletonIntWorkspace(known_ulscript));
+    }
     feature_extractor_.Preprocess(&workspace, sentence);
     feature_extractor_.ExtractFeatures(workspace, *sentence, features);
+  }
+
+  // Prepares *workspace for ExtractRunningFeatures(): the feature functions
+  // keep running counts in it (see kRunningCountsWorkspaceName).
+  void ResetRunningCounts(WorkspaceSet *workspace) {
+    workspace->Reset(workspace_registry_);
+    workspace->Set(workspace_registry_.Request<SingletonIntWorkspace>(
+                       kRunningCountsWorkspaceName),
+                   new SingletonIntWorkspace(1));
+  }
+
+  // Extracts the features of the text of sentence, which extends its text at
+  // the previous call with the same workspace.
+  void ExtractRunningFeatures(Sentence *sentence, WorkspaceSet *workspace,
+                              std::vector<FeatureVector> *features) {
+    feature_extractor_.Preprocess(workspace, sentence);
+    feature_extractor_.ExtractFeatures(*workspace, *sentence, features);
+  }
+
+  // Assumes that a single feature is specified and extracts it.
+  void ExtractOnlyFeature(Sentence *sentence,
+                          std::vector<FeatureVector> *features) {
+    CLD3_CHECK(features->size() == 1);
+    ExtractFeatures(sentence, features);
     CLD3_CHECK(features->size() == 1);
   }
 
@@ -203,6 +239,226 @@ bool TestExtractFeaturesWithNonEqualWeight() {
                                  expected_weights, &sentence);
 }
 
+// Reference implementation of ContinuousBagOfNgramsFunction, based on
+// std::vector<string> chars and std::unordered_map<string, int> counts.
+// Returns the sorted (id, weight) pairs of the features.
+std::vector<std::pair<int, float>> ReferenceNgramFeatures(
+    const string &text, int id_dim, int size, bool include_terminators,
+    bool include_spaces, bool use_equal_weight) {
+  std::vector<string> chars;
+  utils::GetUTF8Chars(text, &chars);
+  if (include_terminators) {
+    std::vector<string> new_chars{"^"};
+    for (const string &current_char : chars) {
+      if (current_char == " ") {
+        new_chars.push_back("$");
+        new_chars.push_back(" ");
+        new_chars.push_back("^");
+      } else {
+        new_chars.push_back(current_char);
+      }
+    }
+    new_chars.push_back("$");
+    chars.swap(new_chars);
+  }
+  std::unordered_map<string, int> char_ngram_counts;
+  int count_sum = 0;
+  for (int start = 0; start <= static_cast<int>(chars.size()) - size;
+       ++start) {
+    string char_ngram;
+    int index;
+    for (index = 0; index < size; ++index) {
+      if (chars.at(start + index) == " " && !include_spaces) break;
+      char_ngram.append(chars.at(start + index));
+    }
+    if (index == size) {
+      char_ngram_counts[char_ngram]++;
+      ++count_sum;
+    }
+  }
+  std::vector<std::pair<int, float>> id_weights;
+  const float equal_weight = 1.0 / char_ngram_counts.size();
+  const float norm = static_cast<float>(count_sum);
+  for (const auto &ngram_and_count : char_ngram_counts) {
+    id_weights.emplace_back(
+        utils::Hash32WithDefaultSeed(ngram_and_count.first) % id_dim,
+        use_equal_weight ? equal_weight : ngram_and_count.second / norm);
+  }
+  std::sort(id_weights.begin(), id_weights.end());
+  return id_weights;
+}
+
+// Returns the sorted (id, weight) pairs of the features in feature_vector.
+std::vector<std::pair<int, float>> SortedIdsAndWeights(
+    const FeatureVector &feature_vector) {
+  std::vector<std::pair<int, float>> id_weights;
+  for (int i = 0; i < feature_vector.size(); ++i) {
+    const FloatFeatureValue value(feature_vector.value(i));
+    id_weights.emplace_back(value.value.id, value.value.weight);
+  }
+  std::sort(id_weights.begin(), id_weights.end());
+  return id_weights;
+}
+
+// Checks that the ids and weights of the ngram features are bit-identical to
+// the ones of the reference implementation above, for all combinations of
+// parameters, on texts with multi-byte chars and consecutive spaces.
+bool TestNgramFeaturesMatchReference() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<string> texts = {
+      "", "a", " ", "aa aab", "  leading and trailing  ", "a  b   c",
+      " this is some english text ", " текст на български ",
+      " 中文字符 한국어 ", " ħello wörld ħello wörld "};
+  const int id_dim = 1000;
+  bool test_successful = true;
+  for (int size = 1; size <= 4; ++size) {
+    for (int flags = 0; flags < 8; ++flags) {
+      const bool include_terminators = flags & 1;
+      const bool include_spaces = flags & 2;
+      const bool use_equal_weight = flags & 4;
+      TaskContext context;
+      context.SetParameter(
+          "language_identifier_features",
+          "continuous-bag-of-ngrams(id_dim=" + std::to_string(id_dim) +
+              ",size=" + std::to_string(size) + ",include_terminators=" +
+              (include_terminators ? "true" : "false") + ",include_spaces=" +
+              (include_spaces ? "true" : "false") + ",use_equal_weight=" +
+              (use_equal_weight ? "true" : "false") + ")");
+      FeatureIdWeightCalculator calc(&context);
+      for (const string &text : texts) {
+        Sentence sentence;
+        sentence.set_text(text);
+        std::vector<FeatureVector> feature_vectors(1);
+        calc.ExtractOnlyFeature(&sentence, &feature_vectors);
+        if (SortedIdsAndWeights(feature_vectors[0]) !=
+            ReferenceNgramFeatures(text, id_dim, size, include_terminators,
+                                   include_spaces, use_equal_weight)) {
+          std::cout << "  Failure for input \"" << text << "\", size " << size
+                    << ", flags " << flags << std::endl;
+          test_successful = false;
+        }
+      }
+    }
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  }
+  return test_successful;
+}
+
+// Checks that ngram functions sharing a char ngrams workspace (all sizes, in
+// any order, mixed with functions that split the text differently) each give
+// the same features as the reference implementation.
+bool TestSharedNgramWorkspace() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  struct NgramParams {
+    int size;
+    int id_dim;
+    bool include_terminators;
+    bool include_spaces;
+  };
+  const std::vector<NgramParams> params = {
+      {2, 1000, true, false}, {4, 5000, true, false}, {1, 100, false, false},
+      {3, 5000, true, false}, {1, 100, true, false},  {3, 5000, false, true},
+      {5, 5000, true, false}, {2, 1000, true, false}};
+  string features;
+  for (const NgramParams &p : params) {
+    if (!features.empty()) features += ";";
+    features += "continuous-bag-of-ngrams(id_dim=" + std::to_string(p.id_dim) +
+                ",size=" + std::to_string(p.size) + ",include_terminators=" +
+                (p.include_terminators ? "true" : "false") +
+                ",include_spaces=" + (p.include_spaces ? "true" : "false") +
+                ")";
+  }
+  TaskContext context;
+  context.SetParameter("language_identifier_features", features);
+  FeatureIdWeightCalculator calc(&context);
+
+  bool test_successful = true;
+  for (const char *text :
+       {"", "a", " this is some english text ", " текст на български ",
+        " 中文字符 한국어 ", "a  b   c"}) {
+    Sentence sentence;
+    sentence.set_text(text);
+    std::vector<FeatureVector> feature_vectors(params.size());
+    calc.ExtractFeatures(&sentence, &feature_vectors);
+    for (size_t i = 0; i < params.size(); ++i) {
+      const NgramParams &p = params[i];
+      if (SortedIdsAndWeights(feature_vectors[i]) !=
+          ReferenceNgramFeatures(text, p.id_dim, p.size, p.include_terminators,
+                                 p.include_spaces,
+                                 /*use_equal_weight=*/false)) {
+        std::cout << "  Failure for input \"" << text << "\", feature " << i
+                  << std::endl;
+        test_successful = false;
+      }
+    }
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  }
+  return test_successful;
+}
+
+// Checks that, with running counts, the ngram features of a text that grows
+// one char at a time, including within tokens and with runs of spaces, are the
+// same as the features of the reference implementation on the whole text.
+bool TestRunningNgramCounts() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  struct NgramParams {
+    int size;
+    int id_dim;
+    bool include_terminators;
+    bool include_spaces;
+  };
+  const std::vector<NgramParams> params = {
+      {1, 100, true, false}, {2, 1000, true, false}, {3, 5000, true, false},
+      {4, 5000, true, false}, {2, 1000, false, false}, {3, 5000, false, true}};
+  string features;
+  for (const NgramParams &p : params) {
+    if (!features.empty()) features += ";";
+    features += "continuous-bag-of-ngrams(id_dim=" + std::to_string(p.id_dim) +
+                ",size=" + std::to_string(p.size) + ",include_terminators=" +
+                (p.include_terminators ? "true" : "false") +
+                ",include_spaces=" + (p.include_spaces ? "true" : "false") +
+                ")";
+  }
+  TaskContext context;
+  context.SetParameter("language_identifier_features", features);
+  FeatureIdWeightCalculator calc(&context);
+
+  bool test_successful = true;
+  for (const char *text :
+       {" this is some english text, this is ", " текст на  български ",
+        "中文字符 한국어  aaaa aaaa"}) {
+    std::vector<string> chars;
+    utils::GetUTF8Chars(text, &chars);
+    WorkspaceSet workspace;
+    calc.ResetRunningCounts(&workspace);
+    Sentence sentence;
+    for (const string &current_char : chars) {
+      sentence.mutable_text()->append(current_char);
+      std::vector<FeatureVector> feature_vectors(params.size());
+      calc.ExtractRunningFeatures(&sentence, &workspace, &feature_vectors);
+      for (size_t i = 0; i < params.size(); ++i) {
+        const NgramParams &p = params[i];
+        if (SortedIdsAndWeights(feature_vectors[i]) !=
+            ReferenceNgramFeatures(sentence.text(), p.id_dim, p.size,
+                                   p.include_terminators, p.include_spaces,
+                                   /*use_equal_weight=*/false)) {
+          std::cout << "  Failure for input \"" << sentence.text()
+                    << "\", feature " << i << std::endl;
+          test_successful = false;
+        }
+      }
+    }
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  }
+  return test_successful;
+}
+
 // Tests the feature Script.
 bool TestScriptFeature() {
   std::cout << "Running " << __FUNCTION__ << std::endl;
@@ -246,6 +502,47 @@ bool TestScriptFeature() {
   return test_successful;
 }
 
+// Checks that, on the spans produced by a ScriptScanner, the feature Script
+// gives the same value when told the script of the span as when it scans the
+// span itself.
+bool TestScriptFeatureWithKnownScript() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+
+  bool test_successful = true;
+  TaskContext context;
+  context.SetParameter("language_identifier_features", "script");
+  FeatureIdWeightCalculator calc(&context);
+  const string text =
+      "Food, FOOD and ÉCOLE! Текст НА Български. 中文字符 워드 한국어 단어 "
+      "字 ελληνικά ΚΕΊΜΕΝΟ עברית 123 العربية हिन्दी ไทย ქართული";
+  CLD2::ScriptScanner ss(text.c_str(), text.size(), /*is_plain_text=*/true);
+  CLD2::LangSpan script_span;
+  int num_spans = 0;
+  while (ss.GetOneScriptSpanLower(&script_span)) {
+    Sentence sentence;
+    sentence.set_text(string(script_span.text, script_span.text_bytes));
+    std::vector<FeatureVector> scanned(1);
+    std::vector<FeatureVector> known(1);
+    calc.ExtractFeatures(&sentence, &scanned);
+    calc.ExtractFeatures(&sentence, &known, script_span.ulscript);
+    if (scanned[0].size() != 1 || known[0].size() != 1 ||
+        scanned[0].value(0) != known[0].value(0)) {
+      test_successful = false;
+      std::cout << "  Failure for input: " << sentence.text() << std::endl;
+    }
+    ++num_spans;
+  }
+  if (num_spans < 8) {
+    test_successful = false;
+    std::cout << "  Failure: only " << num_spans << " spans" << std::endl;
+  }
+
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  }
+  return test_successful;
+}
+
 }  // namespace language_identifier_features_test
 }  // namespace chrome_lang_id
 
@@ -256,6 +553,14 @@ int main(int argc, char **argv) {
           TestExtractFeaturesWithEqualWeight() &&
       chrome_lang_id::language_identifier_features_test::
           TestExtractFeaturesWithNonEqualWeight() &&
-      chrome_lang_id::language_identifier_features_test::TestScriptFeature();
+      chrome_lang_id::language_identifier_features_test::
+          TestNgramFeaturesMatchReference() &&
+      chrome_lang_id::language_identifier_features_test::
+          TestSharedNgramWorkspace() &&
+      chrome_lang_id::language_identifier_features_test::
+          TestRunningNgramCounts() &&
+      chrome_lang_id::language_identifier_features_test::TestScriptFeature() &&
+      chrome_lang_id::language_identifier_features_test::
+          TestScriptFeatureWithKnownScript();
   return tests_successful ? 0 : 1;
 }
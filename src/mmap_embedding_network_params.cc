@@ -0,0 +1,483 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "mmap_embedding_network_params.h"
+
+#include <string.h>
+
+#include <string>
+
+#if defined(COMPILER_MSVC) || defined(_WIN32)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // defined(COMPILER_MSVC) || defined(_WIN32)
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif  // defined(__linux__)
+
+#include "language_id_model.h"
+
+namespace chrome_lang_id {
+namespace {
+
+using model_file::ElementType;
+using model_file::SectionHeader;
+using model_file::SectionType;
+
+// Sets *error, if error is not nullptr, to message, and returns false.
+bool Fail(const string &message, string *error) {
+  if (error != nullptr) *error = message;
+  return false;
+}
+
+// Returns true if a section of the given type may have elements of the given
+// type.  The embeddings may be quantized to uint8, and the hidden and softmax
+// layers to int8, as EmbeddingNetwork expects.
+bool IsValidElementType(SectionType type, ElementType element_type) {
+  switch (type) {
+    case SectionType::EMBEDDING_WEIGHTS:
+      return element_type == ElementType::FLOAT32 ||
+             element_type == ElementType::UINT8;
+    case SectionType::HIDDEN_WEIGHTS:
+    case SectionType::SOFTMAX_WEIGHTS:
+      return element_type == ElementType::FLOAT32 ||
+             element_type == ElementType::INT8;
+    case SectionType::EMBEDDING_QUANT_SCALES:
+    case SectionType::HIDDEN_QUANT_SCALES:
+    case SectionType::SOFTMAX_QUANT_SCALES:
+      return element_type == ElementType::FLOAT16;
+    case SectionType::HIDDEN_BIAS:
+    case SectionType::SOFTMAX_BIAS:
+      return element_type == ElementType::FLOAT32;
+    case SectionType::EMBEDDING_DIM:
+    case SectionType::EMBEDDING_NUM_FEATURES:
+    case SectionType::EMBEDDING_FEATURES_DOMAIN_SIZE:
+    case SectionType::CONCAT_OFFSET:
+    case SectionType::CONCAT_LAYER_SIZE:
+    case SectionType::IS_PRECOMPUTED:
+    case SectionType::EMBEDDING_ROW_REMAP:
+      return element_type == ElementType::INT32;
+    case SectionType::FEATURES:
+    case SectionType::EMBEDDING_NAMES:
+    case SectionType::EMBEDDING_DIMS:
+    case SectionType::LANGUAGE_NAMES:
+    case SectionType::FEATURE_DESCRIPTOR:
+      return element_type == ElementType::CHAR;
+  }
+  return false;
+}
+
+#if !defined(COMPILER_MSVC) && !defined(_WIN32)
+// Size of the huge pages used by MAP_HUGETLB without a size flag on the
+// common platforms.  The anonymous copies of the file are rounded up to it.
+const size_t kHugePageSize = 2 << 20;
+
+// Asks the kernel to allocate the pages of [data, data + size) on
+// numa_node, when it has free memory.  Returns false if the kernel does not
+// support it.  Calls mbind directly, to avoid a dependency on libnuma.
+bool BindToNumaNode(void *data, size_t size, int numa_node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  const int kMpolPreferred = 1;  // From linux/mempolicy.h.
+  const size_t kBitsPerWord = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> node_mask(numa_node / kBitsPerWord + 1, 0);
+  node_mask[numa_node / kBitsPerWord] |= 1UL << (numa_node % kBitsPerWord);
+
+  // The kernel reads one bit less than maxnode.
+  const unsigned long max_node = node_mask.size() * kBitsPerWord + 1;
+  return syscall(SYS_mbind, data, size, kMpolPreferred, node_mask.data(),
+                 max_node, 0) == 0;
+#else
+  return false;
+#endif  // defined(__linux__) && defined(SYS_mbind)
+}
+#endif  // !defined(COMPILER_MSVC) && !defined(_WIN32)
+
+// Returns true if the sections of the given type are matrices, i.e., may have
+// several rows.
+bool IsMatrix(SectionType type) {
+  return static_cast<uint32>(type) <=
+         static_cast<uint32>(SectionType::SOFTMAX_BIAS);
+}
+
+}  // namespace
+
+MmapEmbeddingNetworkParams::MmapEmbeddingNetworkParams() {}
+
+MmapEmbeddingNetworkParams::~MmapEmbeddingNetworkParams() {
+#if !defined(COMPILER_MSVC) && !defined(_WIN32)
+  if (mapped_size_ != 0) munmap(const_cast<char *>(data_), mapped_size_);
+#endif  // !defined(COMPILER_MSVC) && !defined(_WIN32)
+}
+
+std::unique_ptr<MmapEmbeddingNetworkParams> MmapEmbeddingNetworkParams::Open(
+    const string &path, string *error) {
+  return Open(path, LoadOptions(), error);
+}
+
+std::unique_ptr<MmapEmbeddingNetworkParams> MmapEmbeddingNetworkParams::Open(
+    const string &path, const LoadOptions &options, string *error) {
+  std::unique_ptr<MmapEmbeddingNetworkParams> params(
+      new MmapEmbeddingNetworkParams);
+  if (!params->Load(path, error) || !params->Place(options, error) ||
+      !params->Parse(error)) {
+    return nullptr;
+  }
+  return params;
+}
+
+#if defined(COMPILER_MSVC) || defined(_WIN32)
+bool MmapEmbeddingNetworkParams::Load(const string &path, string *error) {
+  std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+  if (!file) return Fail("cannot open " + path, error);
+  size_ = static_cast<size_t>(file.tellg());
+  buffer_.reset(new uint64[(size_ + sizeof(uint64) - 1) / sizeof(uint64)]);
+  file.seekg(0);
+  if (!file.read(reinterpret_cast<char *>(buffer_.get()), size_)) {
+    return Fail("cannot read " + path, error);
+  }
+  data_ = reinterpret_cast<const char *>(buffer_.get());
+  return true;
+}
+
+bool MmapEmbeddingNetworkParams::Place(const LoadOptions &options,
+                                       string *error) {
+  return true;
+}
+#else
+bool MmapEmbeddingNetworkParams::Load(const string &path, string *error) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return Fail("cannot open " + path, error);
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    return Fail("cannot read " + path, error);
+  }
+  size_ = static_cast<size_t>(file_stat.st_size);
+  void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return Fail("cannot map " + path, error);
+  data_ = static_cast<const char *>(data);
+  mapped_size_ = size_;
+  return true;
+}
+
+bool MmapEmbeddingNetworkParams::Place(const LoadOptions &options,
+                                       string *error) {
+  if (options.huge_pages == HugePages::NONE && options.numa_node < 0) {
+    return true;
+  }
+  const size_t copy_size =
+      (size_ + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_HUGETLB)
+  if (options.huge_pages == HugePages::EXPLICIT) flags |= MAP_HUGETLB;
+#else
+  if (options.huge_pages == HugePages::EXPLICIT) {
+    return Fail("no explicit huge pages on this platform", error);
+  }
+#endif  // defined(MAP_HUGETLB)
+  void *copy = mmap(nullptr, copy_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (copy == MAP_FAILED) {
+    return Fail((options.huge_pages == HugePages::EXPLICIT)
+                    ? "not enough explicit huge pages"
+                    : "cannot allocate a copy of the file",
+                error);
+  }
+
+  // The placement has to be requested before the pages are touched.
+  huge_pages_ = options.huge_pages;
+#if defined(MADV_HUGEPAGE)
+  if (options.huge_pages == HugePages::TRANSPARENT &&
+      madvise(copy, copy_size, MADV_HUGEPAGE) != 0) {
+    huge_pages_ = HugePages::NONE;
+  }
+#else
+  if (options.huge_pages == HugePages::TRANSPARENT) {
+    huge_pages_ = HugePages::NONE;
+  }
+#endif  // defined(MADV_HUGEPAGE)
+  if (options.numa_node >= 0 &&
+      BindToNumaNode(copy, copy_size, options.numa_node)) {
+    numa_node_ = options.numa_node;
+  }
+  memcpy(copy, data_, size_);
+  if (mprotect(copy, copy_size, PROT_READ) != 0) {
+    munmap(copy, copy_size);
+    return Fail("cannot protect the copy of the file", error);
+  }
+
+  munmap(const_cast<char *>(data_), mapped_size_);
+  data_ = static_cast<const char *>(copy);
+  mapped_size_ = copy_size;
+  return true;
+}
+#endif  // defined(COMPILER_MSVC) || defined(_WIN32)
+
+bool MmapEmbeddingNetworkParams::Parse(string *error) {
+  if (size_ < sizeof(model_file::FileHeader)) {
+    return Fail("file too small", error);
+  }
+  const model_file::FileHeader &header =
+      *reinterpret_cast<const model_file::FileHeader *>(data_);
+  if (memcmp(header.magic, model_file::kMagic, sizeof(header.magic)) != 0) {
+    return Fail("not a model file", error);
+  }
+  if (header.byte_order_mark != model_file::kByteOrderMark) {
+    return Fail("model file with another byte order", error);
+  }
+  if (header.version != model_file::kVersion) {
+    return Fail("unsupported model file version " +
+                    std::to_string(header.version),
+                error);
+  }
+  if (header.file_size != size_) return Fail("truncated model file", error);
+  if (header.num_sections >
+      (size_ - sizeof(header)) / sizeof(SectionHeader)) {
+    return Fail("too many sections", error);
+  }
+
+  // Index the sections, which should come in the order of their indices for
+  // each type.
+  const SectionHeader *section_headers =
+      reinterpret_cast<const SectionHeader *>(data_ + sizeof(header));
+  for (uint32 i = 0; i < header.num_sections; ++i) {
+    const SectionHeader &section = section_headers[i];
+    const string name = "section #" + std::to_string(i);
+    if (section.type == 0 || section.type >= model_file::kNumSectionTypes) {
+      return Fail(name + ": unknown type", error);
+    }
+    const SectionType type = static_cast<SectionType>(section.type);
+    const int element_size = model_file::ElementSize(section.element_type);
+    if (element_size == 0 ||
+        !IsValidElementType(type,
+                            static_cast<ElementType>(section.element_type))) {
+      return Fail(name + ": wrong element type", error);
+    }
+    if (!IsMatrix(type) && type != SectionType::LANGUAGE_NAMES &&
+        section.rows != 1) {
+      return Fail(name + ": should have one row", error);
+    }
+    const uint64 num_elements =
+        (type == SectionType::LANGUAGE_NAMES)
+            ? section.cols
+            : static_cast<uint64>(section.rows) * section.cols;
+    if (section.size != num_elements * element_size) {
+      return Fail(name + ": wrong size", error);
+    }
+    if (section.offset % model_file::kSectionAlignment != 0 ||
+        section.offset > size_ || section.size > size_ - section.offset) {
+      return Fail(name + ": out of bounds", error);
+    }
+    std::vector<const SectionHeader *> &sections = sections_[section.type];
+    if (section.index != sections.size()) {
+      return Fail(name + ": unexpected index", error);
+    }
+    sections.push_back(&section);
+  }
+
+  // Check that the sections fit together.
+  for (SectionType type :
+       {SectionType::EMBEDDING_DIM, SectionType::EMBEDDING_NUM_FEATURES,
+        SectionType::EMBEDDING_FEATURES_DOMAIN_SIZE, SectionType::CONCAT_OFFSET,
+        SectionType::FEATURES, SectionType::EMBEDDING_NAMES,
+        SectionType::EMBEDDING_DIMS, SectionType::LANGUAGE_NAMES}) {
+    if (NumSections(type) != 1) {
+      return Fail("missing section of type " +
+                      std::to_string(static_cast<uint32>(type)),
+                  error);
+    }
+  }
+  for (SectionType type :
+       {SectionType::CONCAT_LAYER_SIZE, SectionType::IS_PRECOMPUTED}) {
+    if (NumSections(type) > 1 || (NumSections(type) == 1 &&
+                                  Get(type, 0).cols != 1)) {
+      return Fail("bad section of type " +
+                      std::to_string(static_cast<uint32>(type)),
+                  error);
+    }
+  }
+  // EmbeddingNetwork supports one or two hidden layers.
+  if (hidden_size() < 1 || hidden_size() > 2 ||
+      hidden_bias_size() != hidden_size() ||
+      softmax_bias_size() != softmax_size() || softmax_size() != 1) {
+    return Fail("bad number of hidden or softmax layers", error);
+  }
+  const SectionType quantized_types[][2] = {
+      {SectionType::EMBEDDING_WEIGHTS, SectionType::EMBEDDING_QUANT_SCALES},
+      {SectionType::HIDDEN_WEIGHTS, SectionType::HIDDEN_QUANT_SCALES},
+      {SectionType::SOFTMAX_WEIGHTS, SectionType::SOFTMAX_QUANT_SCALES}};
+  for (const auto &types : quantized_types) {
+    int num_quantized = 0;
+    for (int i = 0; i < NumSections(types[0]); ++i) {
+      if (QuantType(types[0], i) == QuantizationType::NONE) continue;
+      if (i >= NumSections(types[1]) ||
+          Get(types[1], i).rows != Get(types[0], i).rows ||
+          Get(types[1], i).cols != 1) {
+        return Fail("missing or bad quantization scales", error);
+      }
+      ++num_quantized;
+    }
+    if (NumSections(types[1]) != num_quantized) {
+      return Fail("unexpected quantization scales", error);
+    }
+  }
+
+  // The embeddings make up the concat layer, which feeds the hidden layers and
+  // then the softmax layer.
+  const int num_embeddings = embedding_dim_size();
+  if (embeddings_size() != num_embeddings ||
+      embedding_num_features_size() != num_embeddings ||
+      embedding_features_domain_size_size() != num_embeddings ||
+      concat_offset_size() != num_embeddings) {
+    return Fail("wrong number of embedding spaces", error);
+  }
+  int64 layer_size = 0;
+  for (int i = 0; i < num_embeddings; ++i) {
+    const string name = "embedding #" + std::to_string(i);
+    if (embeddings_num_cols(i) != embedding_dim(i) ||
+        embedding_num_features(i) < 0) {
+      return Fail(name + ": wrong dimension", error);
+    }
+    if (concat_offset(i) != layer_size) {
+      return Fail(name + ": wrong concat offset", error);
+    }
+    layer_size += static_cast<int64>(embedding_dim(i)) *
+                  embedding_num_features(i);
+  }
+  if (!has_concat_layer_size() || concat_layer_size() != layer_size) {
+    return Fail("wrong concat layer size", error);
+  }
+  for (int i = 0; i < hidden_size(); ++i) {
+    if (hidden_num_rows(i) != layer_size ||
+        hidden_bias_num_rows(i) != hidden_num_cols(i) ||
+        hidden_bias_num_cols(i) != 1) {
+      return Fail("hidden layer #" + std::to_string(i) + ": wrong size",
+                  error);
+    }
+    layer_size = hidden_num_cols(i);
+  }
+  if (softmax_num_rows(0) != layer_size ||
+      softmax_bias_num_rows(0) != softmax_num_cols(0) ||
+      softmax_bias_num_cols(0) != 1) {
+    return Fail("softmax layer: wrong size", error);
+  }
+
+  // The row remaps, if any, should be permutations of the rows.
+  const int num_row_remaps = NumSections(SectionType::EMBEDDING_ROW_REMAP);
+  if (num_row_remaps != 0 && num_row_remaps != embeddings_size()) {
+    return Fail("wrong number of row remaps", error);
+  }
+  for (int i = 0; i < num_row_remaps; ++i) {
+    const int num_rows = embeddings_num_rows(i);
+    if (static_cast<int>(Get(SectionType::EMBEDDING_ROW_REMAP, i).cols) !=
+        num_rows) {
+      return Fail("row remap #" + std::to_string(i) + ": wrong size", error);
+    }
+    const int32 *row_remap = embeddings_row_remap(i);
+    std::vector<bool> is_used(num_rows, false);
+    for (int k = 0; k < num_rows; ++k) {
+      if (row_remap[k] < 0 || row_remap[k] >= num_rows ||
+          is_used[row_remap[k]]) {
+        return Fail("row remap #" + std::to_string(i) + ": not a permutation",
+                    error);
+      }
+      is_used[row_remap[k]] = true;
+    }
+  }
+
+  // Find the names of the languages, each followed by a null char.
+  const SectionHeader &names = Get(SectionType::LANGUAGE_NAMES, 0);
+  const char *names_begin = data_ + names.offset;
+  const char *names_end = names_begin + names.size;
+  for (const char *name = names_begin; name < names_end;
+       name += strlen(name) + 1) {
+    if (memchr(name, '\0', names_end - name) == nullptr) {
+      return Fail("unterminated language name", error);
+    }
+    language_names_.push_back(name);
+  }
+  if (language_names_.size() != names.rows ||
+      softmax_num_cols(0) != num_languages()) {
+    return Fail("wrong number of languages", error);
+  }
+
+  // Decode the features of the embedding spaces.
+  if (NumSections(SectionType::FEATURE_DESCRIPTOR) != embedding_dim_size()) {
+    return Fail("wrong number of feature descriptors", error);
+  }
+  feature_descriptors_.resize(embedding_dim_size());
+  for (int i = 0; i < embedding_dim_size(); ++i) {
+    if (!feature_descriptors_[i].ParseFromArray(
+            Data(SectionType::FEATURE_DESCRIPTOR, i),
+            Get(SectionType::FEATURE_DESCRIPTOR, i).size)) {
+      return Fail("bad feature descriptor #" + std::to_string(i), error);
+    }
+  }
+
+  // The features should fill the concat layer as the embedding sections say,
+  // and look up rows of the embedding matrices.
+  std::vector<int> embedding_dims;
+  for (int i = 0; i < embedding_dim_size(); ++i) {
+    embedding_dims.push_back(embedding_dim(i));
+  }
+  std::vector<int> num_features;
+  std::vector<int> domain_sizes;
+  if (!LanguageIdModel::GetFeatureSizes(feature_descriptors_, embedding_dims,
+                                        &num_features, &domain_sizes)) {
+    return Fail("unknown features", error);
+  }
+  for (int i = 0; i < embedding_dim_size(); ++i) {
+    const string name = "feature descriptor #" + std::to_string(i);
+    if (num_features[i] != embedding_num_features(i)) {
+      return Fail(name + ": wrong number of features", error);
+    }
+    if (domain_sizes[i] != embedding_features_domain_size(i) ||
+        domain_sizes[i] > embeddings_num_rows(i)) {
+      return Fail(name + ": wrong domain size", error);
+    }
+  }
+  return true;
+}
+
+void MmapEmbeddingNetworkParams::GetModelSpec(
+    model_file::ModelSpec *spec) const {
+  for (const auto &field :
+       {std::make_pair(SectionType::FEATURES, &spec->features),
+        std::make_pair(SectionType::EMBEDDING_NAMES, &spec->embedding_names),
+        std::make_pair(SectionType::EMBEDDING_DIMS, &spec->embedding_dims)}) {
+    field.second->assign(static_cast<const char *>(Data(field.first, 0)),
+                         Get(field.first, 0).size);
+  }
+  spec->language_names.assign(language_names_.begin(), language_names_.end());
+}
+
+QuantizationType MmapEmbeddingNetworkParams::QuantType(SectionType type,
+                                                       int index) const {
+  switch (static_cast<ElementType>(Get(type, index).element_type)) {
+    case ElementType::UINT8:
+      return QuantizationType::UINT8;
+    case ElementType::INT8:
+      return QuantizationType::INT8;
+    default:
+      return QuantizationType::NONE;
+  }
+}
+
+}  // namespace chrome_lang_id
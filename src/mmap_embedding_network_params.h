@@ -0,0 +1,332 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MMAP_EMBEDDING_NETWORK_PARAMS_H_
+#define MMAP_EMBEDDING_NETWORK_PARAMS_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "cld_3/protos/feature_extractor.pb.h"
+#include "embedding_network_params.h"
+#include "float16.h"
+#include "model_file.h"
+
+namespace chrome_lang_id {
+
+// EmbeddingNetworkParams read from a model file (see model_file.h).  The file
+// is mapped in memory, read-only, and the weights are used in place: the
+// processes that load the same file share one copy of it in the page cache.
+// On platforms without mmap, the file is read into memory instead.  The load
+// options can instead place a private copy of the weights on huge pages or on
+// a given NUMA node (see LoadOptions).
+//
+// The file also holds the parameters of the feature extractor, both as FML and
+// pre-parsed, and the names of the languages, which this class exposes as
+// well: LanguageIdModel can be set up from it without parsing any FML.
+class MmapEmbeddingNetworkParams : public EmbeddingNetworkParams {
+ public:
+  // Kinds of pages for the weights.
+  enum class HugePages {
+    // Regular pages.
+    NONE,
+
+    // Transparent huge pages, requested with madvise(MADV_HUGEPAGE).  The
+    // kernel grants them when it can, depending on its settings and on the
+    // fragmentation of the memory.
+    TRANSPARENT,
+
+    // Huge pages reserved by the administrator (MAP_HUGETLB, see
+    // /proc/sys/vm/nr_hugepages).  Open() fails if there are not enough.
+    EXPLICIT,
+  };
+
+  // Where to place the weights in memory.  With the default options, the
+  // file is mapped and its pages are shared with the page cache.  With any
+  // other option, the file is copied to private anonymous memory, since the
+  // page cache of a file is neither backed by huge pages nor bound to a node:
+  // the copy costs one read of the file and its size in memory per load.  The
+  // options are ignored on platforms without mmap.
+  struct LoadOptions {
+    HugePages huge_pages = HugePages::NONE;
+
+    // NUMA node on which to allocate the copy, or -1 for no preference.  The
+    // pages are allocated on the node when it has free memory, and elsewhere
+    // otherwise (MPOL_PREFERRED).
+    int numa_node = -1;
+  };
+
+  ~MmapEmbeddingNetworkParams() override;
+
+  // Maps the model file at path and checks its headers, the bounds and sizes
+  // of its sections, and that the layers they describe fit together.  Returns
+  // nullptr on failure, and then, if error is not nullptr, stores a
+  // description of the problem in *error.
+  static std::unique_ptr<MmapEmbeddingNetworkParams> Open(const string &path,
+                                                          string *error);
+
+  // Same as above, but places the weights as options says.
+  static std::unique_ptr<MmapEmbeddingNetworkParams> Open(
+      const string &path, const LoadOptions &options, string *error);
+
+  // Returns the kind of pages requested for the weights: huge_pages from the
+  // load options, or NONE if the kernel refused the request for transparent
+  // huge pages.
+  HugePages huge_pages() const { return huge_pages_; }
+
+  // Returns the NUMA node the weights are bound to, or -1 if they are not,
+  // e.g., if the load options did not ask for it or the kernel has no NUMA
+  // support.
+  int numa_node() const { return numa_node_; }
+
+  // Returns the size of the file, in bytes.
+  size_t size_in_bytes() const { return size_; }
+
+  // Returns the parameters of the feature extractor and the names of the
+  // languages, as given to model_file::WriteModelFile().
+  void GetModelSpec(model_file::ModelSpec *spec) const;
+
+  // Returns the number of languages and the name of the i-th one.
+  int num_languages() const { return language_names_.size(); }
+  const char *language_name(int i) const { return language_names_[i]; }
+
+  // Returns the features of each embedding space, decoded from the file.
+  const std::vector<FeatureExtractorDescriptor> &feature_descriptors() const {
+    return feature_descriptors_;
+  }
+
+  // Access methods for embeddings:
+  int embeddings_size() const override {
+    return NumSections(model_file::SectionType::EMBEDDING_WEIGHTS);
+  }
+  int embeddings_num_rows(int i) const override {
+    return Get(model_file::SectionType::EMBEDDING_WEIGHTS, i).rows;
+  }
+  int embeddings_num_cols(int i) const override {
+    return Get(model_file::SectionType::EMBEDDING_WEIGHTS, i).cols;
+  }
+  const void *embeddings_weights(int i) const override {
+    return Data(model_file::SectionType::EMBEDDING_WEIGHTS, i);
+  }
+  QuantizationType embeddings_quant_type(int i) const override {
+    return QuantType(model_file::SectionType::EMBEDDING_WEIGHTS, i);
+  }
+  const float16 *embeddings_quant_scales(int i) const override {
+    return QuantScales(model_file::SectionType::EMBEDDING_QUANT_SCALES, i);
+  }
+  const int32 *embeddings_row_remap(int i) const override {
+    return (NumSections(model_file::SectionType::EMBEDDING_ROW_REMAP) > 0)
+               ? static_cast<const int32 *>(
+                     Data(model_file::SectionType::EMBEDDING_ROW_REMAP, i))
+               : nullptr;
+  }
+
+  // Access methods for hidden:
+  int hidden_size() const override {
+    return NumSections(model_file::SectionType::HIDDEN_WEIGHTS);
+  }
+  int hidden_num_rows(int i) const override {
+    return Get(model_file::SectionType::HIDDEN_WEIGHTS, i).rows;
+  }
+  int hidden_num_cols(int i) const override {
+    return Get(model_file::SectionType::HIDDEN_WEIGHTS, i).cols;
+  }
+  const void *hidden_weights(int i) const override {
+    return Data(model_file::SectionType::HIDDEN_WEIGHTS, i);
+  }
+  QuantizationType hidden_quant_type(int i) const override {
+    return QuantType(model_file::SectionType::HIDDEN_WEIGHTS, i);
+  }
+  const float16 *hidden_quant_scales(int i) const override {
+    return QuantScales(model_file::SectionType::HIDDEN_QUANT_SCALES, i);
+  }
+
+  // Access methods for hidden_bias:
+  int hidden_bias_size() const override {
+    return NumSections(model_file::SectionType::HIDDEN_BIAS);
+  }
+  int hidden_bias_num_rows(int i) const override {
+    return Get(model_file::SectionType::HIDDEN_BIAS, i).rows;
+  }
+  int hidden_bias_num_cols(int i) const override {
+    return Get(model_file::SectionType::HIDDEN_BIAS, i).cols;
+  }
+  const void *hidden_bias_weights(int i) const override {
+    return Data(model_file::SectionType::HIDDEN_BIAS, i);
+  }
+
+  // Access methods for softmax:
+  int softmax_size() const override {
+    return NumSections(model_file::SectionType::SOFTMAX_WEIGHTS);
+  }
+  int softmax_num_rows(int i) const override {
+    return Get(model_file::SectionType::SOFTMAX_WEIGHTS, i).rows;
+  }
+  int softmax_num_cols(int i) const override {
+    return Get(model_file::SectionType::SOFTMAX_WEIGHTS, i).cols;
+  }
+  const void *softmax_weights(int i) const override {
+    return Data(model_file::SectionType::SOFTMAX_WEIGHTS, i);
+  }
+  QuantizationType softmax_quant_type(int i) const override {
+    return QuantType(model_file::SectionType::SOFTMAX_WEIGHTS, i);
+  }
+  const float16 *softmax_quant_scales(int i) const override {
+    return QuantScales(model_file::SectionType::SOFTMAX_QUANT_SCALES, i);
+  }
+
+  // Access methods for softmax_bias:
+  int softmax_bias_size() const override {
+    return NumSections(model_file::SectionType::SOFTMAX_BIAS);
+  }
+  int softmax_bias_num_rows(int i) const override {
+    return Get(model_file::SectionType::SOFTMAX_BIAS, i).rows;
+  }
+  int softmax_bias_num_cols(int i) const override {
+    return Get(model_file::SectionType::SOFTMAX_BIAS, i).cols;
+  }
+  const void *softmax_bias_weights(int i) const override {
+    return Data(model_file::SectionType::SOFTMAX_BIAS, i);
+  }
+
+  // Access methods for embedding_dim:
+  int embedding_dim_size() const override {
+    return Get(model_file::SectionType::EMBEDDING_DIM, 0).cols;
+  }
+  int32 embedding_dim(int i) const override {
+    return Int32Value(model_file::SectionType::EMBEDDING_DIM, i);
+  }
+
+  // Access methods for embedding_num_features:
+  int embedding_num_features_size() const override {
+    return Get(model_file::SectionType::EMBEDDING_NUM_FEATURES, 0).cols;
+  }
+  int32 embedding_num_features(int i) const override {
+    return Int32Value(model_file::SectionType::EMBEDDING_NUM_FEATURES, i);
+  }
+
+  // Access methods for embedding_features_domain_size:
+  int embedding_features_domain_size_size() const override {
+    return Get(model_file::SectionType::EMBEDDING_FEATURES_DOMAIN_SIZE, 0)
+        .cols;
+  }
+  int32 embedding_features_domain_size(int i) const override {
+    return Int32Value(model_file::SectionType::EMBEDDING_FEATURES_DOMAIN_SIZE,
+                      i);
+  }
+
+  // Access methods for concat_offset:
+  int concat_offset_size() const override {
+    return Get(model_file::SectionType::CONCAT_OFFSET, 0).cols;
+  }
+  int32 concat_offset(int i) const override {
+    return Int32Value(model_file::SectionType::CONCAT_OFFSET, i);
+  }
+
+  // Access methods for concat_layer_size:
+  bool has_concat_layer_size() const override {
+    return NumSections(model_file::SectionType::CONCAT_LAYER_SIZE) > 0;
+  }
+  int32 concat_layer_size() const override {
+    return Int32Value(model_file::SectionType::CONCAT_LAYER_SIZE, 0);
+  }
+
+  // Access methods for is_precomputed:
+  bool has_is_precomputed() const override {
+    return NumSections(model_file::SectionType::IS_PRECOMPUTED) > 0;
+  }
+  bool is_precomputed() const override {
+    return has_is_precomputed() &&
+           Int32Value(model_file::SectionType::IS_PRECOMPUTED, 0) != 0;
+  }
+
+ private:
+  MmapEmbeddingNetworkParams();
+
+  // Maps or reads the file at path.  Returns false on failure.
+  bool Load(const string &path, string *error);
+
+  // Copies the file to anonymous memory placed as options says, if options
+  // asks for any placement.  Returns false on failure.
+  bool Place(const LoadOptions &options, string *error);
+
+  // Checks the headers and the sections, and fills sections_,
+  // language_names_ and feature_descriptors_.  Returns false if the file is
+  // not a valid model file.
+  bool Parse(string *error);
+
+  // Returns the number of sections of the given type.
+  int NumSections(model_file::SectionType type) const {
+    return sections_[static_cast<int>(type)].size();
+  }
+
+  // Returns the header of the section of the given type and index.
+  const model_file::SectionHeader &Get(model_file::SectionType type,
+                                       int index) const {
+    CLD3_DCHECK(index >= 0 && index < NumSections(type));
+    return *sections_[static_cast<int>(type)][index];
+  }
+
+  // Returns the data of the section of the given type and index.
+  const void *Data(model_file::SectionType type, int index) const {
+    return data_ + Get(type, index).offset;
+  }
+
+  // Returns the quantization type of the weights of the given section.
+  QuantizationType QuantType(model_file::SectionType type, int index) const;
+
+  // Returns the scales of the given section, or nullptr if there is none.
+  const float16 *QuantScales(model_file::SectionType type, int index) const {
+    return (index < NumSections(type))
+               ? static_cast<const float16 *>(Data(type, index))
+               : nullptr;
+  }
+
+  // Returns the i-th value of the INT32 section of the given type.
+  int32 Int32Value(model_file::SectionType type, int i) const {
+    CLD3_DCHECK(i >= 0 && i < static_cast<int>(Get(type, 0).cols));
+    return static_cast<const int32 *>(Data(type, 0))[i];
+  }
+
+  // Contents of the file, and its size in bytes.  The contents are either
+  // mapped (if mapped_size_ is not 0), from the file or anonymous memory, or
+  // owned by buffer_.
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t mapped_size_ = 0;
+  std::unique_ptr<uint64[]> buffer_;
+
+  // Placement of the contents.
+  HugePages huge_pages_ = HugePages::NONE;
+  int numa_node_ = -1;
+
+  // sections_[t][i] is the header of the section of type t and index i.
+  std::vector<const model_file::SectionHeader *>
+      sections_[model_file::kNumSectionTypes];
+
+  // Names of the languages, pointing into the file.
+  std::vector<const char *> language_names_;
+
+  // Features of the embedding spaces.
+  std::vector<FeatureExtractorDescriptor> feature_descriptors_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(MmapEmbeddingNetworkParams);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // MMAP_EMBEDDING_NETWORK_PARAMS_H_
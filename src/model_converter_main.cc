@@ -0,0 +1,84 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Offline converter from the built-in model (lang_id_nn_params.cc and
+// task_context_params.cc) to a model file (see model_file.h), which
+// MmapEmbeddingNetworkParams maps in memory:
+//
+//   model_converter_main [--int8] model.cld3
+//
+// With --int8, the hidden and softmax weights are quantized to int8, as
+// Int8QuantizedNNParams does.  The file is read back to check it, and a
+// summary of its sections is written to stderr.
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "base.h"
+#include "int8_quantized_nn_params.h"
+#include "lang_id_nn_params.h"
+#include "mmap_embedding_network_params.h"
+#include "model_file.h"
+
+using chrome_lang_id::EmbeddingNetworkParams;
+using chrome_lang_id::Int8QuantizedNNParams;
+using chrome_lang_id::LangIdNNParams;
+using chrome_lang_id::MmapEmbeddingNetworkParams;
+
+int main(int argc, char **argv) {
+  bool int8 = false;
+  std::string path;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--int8") {
+      int8 = true;
+    } else {
+      path = arg;
+    }
+  }
+  if (path.empty()) {
+    std::cerr << "Usage: " << argv[0] << " [--int8] output_file" << std::endl;
+    return 1;
+  }
+
+  LangIdNNParams float_params;
+  std::unique_ptr<Int8QuantizedNNParams> int8_params;
+  const EmbeddingNetworkParams *params = &float_params;
+  if (int8) {
+    int8_params.reset(new Int8QuantizedNNParams(&float_params));
+    params = int8_params.get();
+  }
+
+  std::string error;
+  if (!chrome_lang_id::model_file::WriteModelFile(
+          *params, chrome_lang_id::model_file::GetBuiltInModelSpec(), path,
+          &error)) {
+    std::cerr << "Error: " << error << std::endl;
+    return 1;
+  }
+  const std::unique_ptr<MmapEmbeddingNetworkParams> written =
+      MmapEmbeddingNetworkParams::Open(path, &error);
+  if (written == nullptr) {
+    std::cerr << "Error: cannot read back " << path << ": " << error
+              << std::endl;
+    return 1;
+  }
+  std::cerr << path << ": " << written->size_in_bytes() << " bytes, "
+            << written->embeddings_size() << " embedding matrices, "
+            << written->hidden_size() << " hidden layer(s), "
+            << written->num_languages() << " languages" << std::endl;
+  return 0;
+}
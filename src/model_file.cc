@@ -0,0 +1,279 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "model_file.h"
+
+#include <string.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "cld_3/protos/feature_extractor.pb.h"
+#include "fml_parser.h"
+#include "task_context.h"
+#include "task_context_params.h"
+#include "utils.h"
+
+namespace chrome_lang_id {
+namespace model_file {
+namespace {
+
+static_assert(sizeof(FileHeader) == 32, "FileHeader is part of the format");
+static_assert(sizeof(SectionHeader) == 40,
+              "SectionHeader is part of the format");
+
+// A section to write: its header, without the offset, and its data.
+struct Section {
+  SectionHeader header;
+  string data;
+};
+
+// Appends to sections a section of rows x cols elements, copied from data.
+void AddSection(SectionType type, int index, ElementType element_type,
+                int rows, int cols, const void *data,
+                std::vector<Section> *sections) {
+  sections->emplace_back();
+  Section &section = sections->back();
+  memset(&section.header, 0, sizeof(section.header));
+  section.header.type = static_cast<uint32>(type);
+  section.header.index = index;
+  section.header.element_type = static_cast<uint32>(element_type);
+  section.header.rows = rows;
+  section.header.cols = cols;
+  section.header.size = static_cast<uint64>(rows) * cols *
+                        ElementSize(static_cast<uint32>(element_type));
+  section.data.assign(static_cast<const char *>(data), section.header.size);
+}
+
+// Appends to sections the weights of matrix, and its scales if it is
+// quantized.
+void AddMatrix(const EmbeddingNetworkParams::Matrix &matrix,
+               SectionType weights_type, SectionType scales_type, int index,
+               std::vector<Section> *sections) {
+  ElementType element_type = ElementType::FLOAT32;
+  if (matrix.quant_type == QuantizationType::UINT8) {
+    element_type = ElementType::UINT8;
+  } else if (matrix.quant_type == QuantizationType::INT8) {
+    element_type = ElementType::INT8;
+  }
+  AddSection(weights_type, index, element_type, matrix.rows, matrix.cols,
+             matrix.elements, sections);
+  if (matrix.quant_type != QuantizationType::NONE) {
+    AddSection(scales_type, index, ElementType::FLOAT16, matrix.rows, 1,
+               matrix.quant_scales, sections);
+  }
+}
+
+// Appends to sections an INT32 section with the values of the repeated
+// setting with the given number of values and getter.
+template <typename Getter>
+void AddInt32Array(SectionType type, int size, Getter getter,
+                   std::vector<Section> *sections) {
+  std::vector<int32> values;
+  for (int i = 0; i < size; ++i) values.push_back(getter(i));
+  AddSection(type, 0, ElementType::INT32, 1, size, values.data(), sections);
+}
+
+// Appends to sections a CHAR section with the bytes of text.
+void AddString(SectionType type, int index, const string &text,
+               std::vector<Section> *sections) {
+  AddSection(type, index, ElementType::CHAR, 1, text.size(), text.data(),
+             sections);
+}
+
+// Sets *error, if error is not nullptr, to message, and returns false.
+bool Fail(const string &message, string *error) {
+  if (error != nullptr) *error = message;
+  return false;
+}
+
+// Returns offset rounded up to a multiple of kSectionAlignment.
+uint64 Align(uint64 offset) {
+  return (offset + kSectionAlignment - 1) / kSectionAlignment *
+         kSectionAlignment;
+}
+
+}  // namespace
+
+const char kMagic[8] = {'C', 'L', 'D', '3', 'M', 'O', 'D', 'L'};
+
+int ElementSize(uint32 element_type) {
+  switch (static_cast<ElementType>(element_type)) {
+    case ElementType::FLOAT32:
+    case ElementType::INT32:
+      return 4;
+    case ElementType::FLOAT16:
+      return 2;
+    case ElementType::INT8:
+    case ElementType::UINT8:
+    case ElementType::CHAR:
+      return 1;
+  }
+  return 0;
+}
+
+ModelSpec GetBuiltInModelSpec() {
+  TaskContext context;
+  TaskContextParams::ToTaskContext(&context);
+  ModelSpec spec;
+  spec.features = context.GetParameter("language_identifier_features");
+  spec.embedding_names =
+      context.GetParameter("language_identifier_embedding_names");
+  spec.embedding_dims =
+      context.GetParameter("language_identifier_embedding_dims");
+  for (int i = 0; i < TaskContextParams::GetNumLanguages(); ++i) {
+    spec.language_names.push_back(TaskContextParams::language_names(i));
+  }
+  return spec;
+}
+
+bool WriteModelFile(const EmbeddingNetworkParams &params,
+                    const ModelSpec &spec, const string &path, string *error) {
+  const std::vector<string> features = utils::Split(spec.features, ';');
+  const std::vector<string> embedding_dims =
+      utils::Split(spec.embedding_dims, ';');
+  if (static_cast<int>(features.size()) != params.embedding_dim_size() ||
+      embedding_dims.size() != features.size()) {
+    return Fail("the spec and the network have different embedding spaces",
+                error);
+  }
+  for (size_t i = 0; i < embedding_dims.size(); ++i) {
+    if (utils::ParseUsing<int>(embedding_dims[i], utils::ParseInt32) !=
+        params.embedding_dim(i)) {
+      return Fail("embedding space #" + std::to_string(i) +
+                      " has different dimensions in the spec and the network",
+                  error);
+    }
+  }
+
+  std::vector<Section> sections;
+  for (int i = 0; i < params.embeddings_size(); ++i) {
+    AddMatrix(params.GetEmbeddingMatrix(i), SectionType::EMBEDDING_WEIGHTS,
+              SectionType::EMBEDDING_QUANT_SCALES, i, &sections);
+  }
+  bool has_row_remap = false;
+  for (int i = 0; i < params.embeddings_size(); ++i) {
+    has_row_remap |= (params.embeddings_row_remap(i) != nullptr);
+  }
+  for (int i = 0; has_row_remap && i < params.embeddings_size(); ++i) {
+    // The matrices without a remap get the identity.
+    std::vector<int32> row_remap(params.embeddings_num_rows(i));
+    for (size_t k = 0; k < row_remap.size(); ++k) {
+      row_remap[k] = (params.embeddings_row_remap(i) != nullptr)
+                         ? params.embeddings_row_remap(i)[k]
+                         : static_cast<int32>(k);
+    }
+    AddSection(SectionType::EMBEDDING_ROW_REMAP, i, ElementType::INT32, 1,
+               row_remap.size(), row_remap.data(), &sections);
+  }
+  for (int i = 0; i < params.hidden_size(); ++i) {
+    AddMatrix(params.GetHiddenLayerMatrix(i), SectionType::HIDDEN_WEIGHTS,
+              SectionType::HIDDEN_QUANT_SCALES, i, &sections);
+  }
+  for (int i = 0; i < params.hidden_bias_size(); ++i) {
+    AddMatrix(params.GetHiddenLayerBias(i), SectionType::HIDDEN_BIAS,
+              SectionType::HIDDEN_BIAS, i, &sections);
+  }
+  if (params.HasSoftmax()) {
+    AddMatrix(params.GetSoftmaxMatrix(), SectionType::SOFTMAX_WEIGHTS,
+              SectionType::SOFTMAX_QUANT_SCALES, 0, &sections);
+    AddMatrix(params.GetSoftmaxBias(), SectionType::SOFTMAX_BIAS,
+              SectionType::SOFTMAX_BIAS, 0, &sections);
+  }
+
+  AddInt32Array(SectionType::EMBEDDING_DIM, params.embedding_dim_size(),
+                [&params](int i) { return params.embedding_dim(i); },
+                &sections);
+  AddInt32Array(SectionType::EMBEDDING_NUM_FEATURES,
+                params.embedding_num_features_size(),
+                [&params](int i) { return params.embedding_num_features(i); },
+                &sections);
+  AddInt32Array(
+      SectionType::EMBEDDING_FEATURES_DOMAIN_SIZE,
+      params.embedding_features_domain_size_size(),
+      [&params](int i) { return params.embedding_features_domain_size(i); },
+      &sections);
+  AddInt32Array(SectionType::CONCAT_OFFSET, params.concat_offset_size(),
+                [&params](int i) { return params.concat_offset(i); },
+                &sections);
+  if (params.has_concat_layer_size()) {
+    AddInt32Array(SectionType::CONCAT_LAYER_SIZE, 1,
+                  [&params](int i) { return params.concat_layer_size(); },
+                  &sections);
+  }
+  if (params.has_is_precomputed()) {
+    AddInt32Array(SectionType::IS_PRECOMPUTED, 1,
+                  [&params](int i) { return params.is_precomputed() ? 1 : 0; },
+                  &sections);
+  }
+
+  AddString(SectionType::FEATURES, 0, spec.features, &sections);
+  AddString(SectionType::EMBEDDING_NAMES, 0, spec.embedding_names, &sections);
+  AddString(SectionType::EMBEDDING_DIMS, 0, spec.embedding_dims, &sections);
+  string language_names;
+  for (const string &language : spec.language_names) {
+    language_names.append(language);
+    language_names.push_back('\0');
+  }
+  AddString(SectionType::LANGUAGE_NAMES, 0, language_names, &sections);
+  sections.back().header.rows = spec.language_names.size();
+  for (size_t i = 0; i < features.size(); ++i) {
+    FeatureExtractorDescriptor descriptor;
+    FMLParser parser;
+    parser.Parse(features[i], &descriptor);
+    AddString(SectionType::FEATURE_DESCRIPTOR, i,
+              descriptor.SerializeAsString(), &sections);
+  }
+
+  // Lay out the sections after the headers.
+  const uint64 headers_size =
+      sizeof(FileHeader) + sections.size() * sizeof(SectionHeader);
+  uint64 offset = headers_size;
+  for (Section &section : sections) {
+    offset = Align(offset);
+    section.header.offset = offset;
+    offset += section.header.size;
+  }
+  FileHeader file_header;
+  memset(&file_header, 0, sizeof(file_header));
+  memcpy(file_header.magic, kMagic, sizeof(kMagic));
+  file_header.byte_order_mark = kByteOrderMark;
+  file_header.version = kVersion;
+  file_header.num_sections = sections.size();
+  file_header.file_size = offset;
+
+  std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+  if (!file) return Fail("cannot open " + path + " for writing", error);
+  file.write(reinterpret_cast<const char *>(&file_header),
+             sizeof(file_header));
+  for (const Section &section : sections) {
+    file.write(reinterpret_cast<const char *>(&section.header),
+               sizeof(section.header));
+  }
+  uint64 position = headers_size;
+  for (const Section &section : sections) {
+    const string padding(section.header.offset - position, '\0');
+    file.write(padding.data(), padding.size());
+    file.write(section.data.data(), section.data.size());
+    position = section.header.offset + section.header.size;
+  }
+  file.close();
+  if (!file) return Fail("cannot write " + path, error);
+  return true;
+}
+
+}  // namespace model_file
+}  // namespace chrome_lang_id
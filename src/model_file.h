@@ -0,0 +1,166 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MODEL_FILE_H_
+#define MODEL_FILE_H_
+
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "embedding_network_params.h"
+
+namespace chrome_lang_id {
+
+// Binary file format for the parameters of a model, designed to be mapped in
+// memory and used in place (see MmapEmbeddingNetworkParams):
+//
+//   FileHeader
+//   SectionHeader[num_sections]
+//   the data of the sections, each at an offset multiple of kSectionAlignment
+//
+// Each section holds one array: the weights or the quantization scales of a
+// matrix, a bias, a list of int32 network settings, or a string.  A section is
+// identified by its type and, for the types that have several instances
+// (e.g., one embedding matrix per embedding space), by its index.  The
+// integers and floats are stored in the byte order of the machine that wrote
+// the file, which is recorded in FileHeader::byte_order_mark.
+namespace model_file {
+
+// First bytes of a model file.
+extern const char kMagic[8];
+
+// Version of the format.  Readers reject files with another version.
+const uint32 kVersion = 1;
+
+// Value of FileHeader::byte_order_mark in the byte order of the machine.
+const uint32 kByteOrderMark = 0x01020304;
+
+// Alignment, in bytes, of the offset of each section in the file: one cache
+// line, so that the rows of the matrices are laid out as in the built-in
+// tables.
+const int kSectionAlignment = 64;
+
+// Types of the sections.  The values are part of the format.
+enum class SectionType : uint32 {
+  // Matrices, one of each per instance: the weights in row-major order, and
+  // for the quantized weights, one float16 scale per row.
+  EMBEDDING_WEIGHTS = 1,
+  EMBEDDING_QUANT_SCALES = 2,
+  HIDDEN_WEIGHTS = 3,
+  HIDDEN_QUANT_SCALES = 4,
+  HIDDEN_BIAS = 5,
+  SOFTMAX_WEIGHTS = 6,
+  SOFTMAX_QUANT_SCALES = 7,
+  SOFTMAX_BIAS = 8,
+
+  // Arrays of int32 with the repeated settings of the network, and arrays of
+  // one int32 with its optional settings, present only if they are set.
+  EMBEDDING_DIM = 9,
+  EMBEDDING_NUM_FEATURES = 10,
+  EMBEDDING_FEATURES_DOMAIN_SIZE = 11,
+  CONCAT_OFFSET = 12,
+  CONCAT_LAYER_SIZE = 13,
+  IS_PRECOMPUTED = 14,
+
+  // Strings with the parameters of the feature extractor, in the format of
+  // TaskContextParams, and the names of the languages, in the order of the
+  // network classes, each followed by a null char.
+  FEATURES = 15,
+  EMBEDDING_NAMES = 16,
+  EMBEDDING_DIMS = 17,
+  LANGUAGE_NAMES = 18,
+
+  // The features of each embedding space, parsed from FEATURES: a serialized
+  // FeatureExtractorDescriptor, so readers do not need to parse the FML.
+  FEATURE_DESCRIPTOR = 19,
+
+  // Optional, one per embedding matrix if any: the int32 row of each feature
+  // id in the matrix (see EmbeddingNetworkParams::embeddings_row_remap()).
+  EMBEDDING_ROW_REMAP = 20,
+};
+
+// Number of section types, plus one.
+const int kNumSectionTypes = 21;
+
+// Types of the elements of a section.  The type of the weights of a matrix
+// gives its QuantizationType: FLOAT32 for NONE, UINT8 and INT8 for the types
+// of the same name.
+enum class ElementType : uint32 {
+  FLOAT32 = 1,
+  FLOAT16 = 2,
+  INT8 = 3,
+  UINT8 = 4,
+  INT32 = 5,
+  CHAR = 6,
+};
+
+struct FileHeader {
+  char magic[8];
+  uint32 byte_order_mark;
+  uint32 version;
+  uint32 num_sections;
+  uint32 reserved;
+
+  // Size of the whole file, in bytes.
+  uint64 file_size;
+};
+
+struct SectionHeader {
+  uint32 type;          // A SectionType.
+  uint32 index;         // Instance of the type, starting from 0.
+  uint32 element_type;  // An ElementType.
+
+  // Dimensions of the array: a matrix is rows x cols, and any other section
+  // is one row of cols elements, except that the rows of LANGUAGE_NAMES is
+  // the number of languages.
+  uint32 rows;
+  uint32 cols;
+  uint32 reserved;
+
+  // Position of the data in the file, and size in bytes.
+  uint64 offset;
+  uint64 size;
+};
+
+// Returns the size in bytes of an element of the given type, or 0 if the type
+// is not one of ElementType.
+int ElementSize(uint32 element_type);
+
+// Everything in a model file besides the network parameters: the parameters
+// of the feature extractor (see TaskContextParams::ToTaskContext()), and the
+// names of the languages.
+struct ModelSpec {
+  string features;
+  string embedding_names;
+  string embedding_dims;
+  std::vector<string> language_names;
+};
+
+// Returns the spec of the built-in model, from TaskContextParams.
+ModelSpec GetBuiltInModelSpec();
+
+// Writes the model with the given parameters and spec to the file at path.
+// spec.features should have one FML specification per embedding space of
+// params, with the dimensions in spec.embedding_dims.  Returns true on
+// success.  Otherwise, returns false and, if error is not nullptr, stores a
+// description of the problem in *error.
+bool WriteModelFile(const EmbeddingNetworkParams &params,
+                    const ModelSpec &spec, const string &path, string *error);
+
+}  // namespace model_file
+}  // namespace chrome_lang_id
+
+#endif  // MODEL_FILE_H_
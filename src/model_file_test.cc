@@ -0,0 +1,691 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "model_file.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base.h"
+#include "cld_3/protos/feature_extractor.pb.h"
+#include "embedding_network_params.h"
+#include "embedding_reordering.h"
+#include "fml_parser.h"
+#include "int8_quantized_nn_params.h"
+#include "lang_id_nn_params.h"
+#include "language_id_model.h"
+#include "mmap_embedding_network_params.h"
+#include "model_replicas.h"
+#include "nnet_language_identifier.h"
+#include "utils.h"
+
+namespace chrome_lang_id {
+namespace model_file_test {
+
+// Files written by the tests, in the working directory.
+const char kModelPath[] = "model_file_test.cld3";
+const char kBadModelPath[] = "model_file_test_bad.cld3";
+
+bool PrintAndReturnStatus(bool status) {
+  if (status) {
+    std::cout << "  Success" << std::endl;
+    return true;
+  } else {
+    std::cout << "  Failure" << std::endl;
+    return false;
+  }
+}
+
+// Returns true if the two matrices have the same shape, type and contents, and
+// if the elements of actual are aligned on a cache line.
+bool SameMatrix(const EmbeddingNetworkParams::Matrix &expected,
+                const EmbeddingNetworkParams::Matrix &actual,
+                int element_size) {
+  if (expected.rows != actual.rows || expected.cols != actual.cols ||
+      expected.quant_type != actual.quant_type ||
+      reinterpret_cast<uintptr_t>(actual.elements) %
+              model_file::kSectionAlignment !=
+          0) {
+    return false;
+  }
+  if (memcmp(expected.elements, actual.elements,
+             static_cast<size_t>(expected.rows) * expected.cols *
+                 element_size) != 0) {
+    return false;
+  }
+  if (expected.quant_type == QuantizationType::NONE) {
+    return actual.quant_scales == nullptr;
+  }
+  return memcmp(expected.quant_scales, actual.quant_scales,
+                expected.rows * sizeof(float16)) == 0;
+}
+
+// Returns true if expected and actual describe the same network.
+bool SameParams(const EmbeddingNetworkParams &expected,
+                const EmbeddingNetworkParams &actual) {
+  bool same = (expected.embeddings_size() == actual.embeddings_size()) &&
+              (expected.hidden_size() == actual.hidden_size()) &&
+              (expected.HasSoftmax() == actual.HasSoftmax());
+  for (int i = 0; same && i < expected.embeddings_size(); ++i) {
+    same &= SameMatrix(expected.GetEmbeddingMatrix(i),
+                       actual.GetEmbeddingMatrix(i), 1);
+  }
+  for (int i = 0; same && i < expected.hidden_size(); ++i) {
+    const int element_size =
+        (expected.hidden_quant_type(i) == QuantizationType::NONE) ? 4 : 1;
+    same &= SameMatrix(expected.GetHiddenLayerMatrix(i),
+                       actual.GetHiddenLayerMatrix(i), element_size);
+    same &= SameMatrix(expected.GetHiddenLayerBias(i),
+                       actual.GetHiddenLayerBias(i), 4);
+  }
+  if (same && expected.HasSoftmax()) {
+    const int element_size =
+        (expected.softmax_quant_type(0) == QuantizationType::NONE) ? 4 : 1;
+    same &= SameMatrix(expected.GetSoftmaxMatrix(), actual.GetSoftmaxMatrix(),
+                       element_size);
+    same &= SameMatrix(expected.GetSoftmaxBias(), actual.GetSoftmaxBias(), 4);
+  }
+  same &= (expected.embedding_dim_size() == actual.embedding_dim_size()) &&
+          (expected.concat_offset_size() == actual.concat_offset_size());
+  for (int i = 0; same && i < expected.embedding_dim_size(); ++i) {
+    same &= (expected.embedding_dim(i) == actual.embedding_dim(i)) &&
+            (expected.embedding_num_features(i) ==
+             actual.embedding_num_features(i)) &&
+            (expected.embedding_features_domain_size(i) ==
+             actual.embedding_features_domain_size(i)) &&
+            (expected.concat_offset(i) == actual.concat_offset(i));
+  }
+  same &= (expected.has_concat_layer_size() ==
+           actual.has_concat_layer_size()) &&
+          (expected.concat_layer_size() == actual.concat_layer_size()) &&
+          (expected.has_is_precomputed() == actual.has_is_precomputed()) &&
+          (expected.is_precomputed() == actual.is_precomputed());
+  return same;
+}
+
+// Checks that the built-in model, in float and int8, is read back from a model
+// file with the same parameters, spec and predictions.
+bool TestRoundTrip() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams float_params;
+  Int8QuantizedNNParams int8_params(&float_params);
+  const model_file::ModelSpec spec = model_file::GetBuiltInModelSpec();
+  const std::string text =
+      "This piece of text is in English, and it is long enough to be "
+      "classified with some confidence by the network.";
+  bool test_successful = true;
+  for (const EmbeddingNetworkParams *params :
+       {static_cast<const EmbeddingNetworkParams *>(&float_params),
+        static_cast<const EmbeddingNetworkParams *>(&int8_params)}) {
+    std::string error;
+    test_successful &=
+        model_file::WriteModelFile(*params, spec, kModelPath, &error);
+    const std::unique_ptr<MmapEmbeddingNetworkParams> mmap_params =
+        MmapEmbeddingNetworkParams::Open(kModelPath, &error);
+    if (mmap_params == nullptr) {
+      std::cout << "  " << error << std::endl;
+      return PrintAndReturnStatus(false);
+    }
+    test_successful &= SameParams(*params, *mmap_params);
+
+    model_file::ModelSpec read_spec;
+    mmap_params->GetModelSpec(&read_spec);
+    test_successful &= (read_spec.features == spec.features) &&
+                       (read_spec.embedding_names == spec.embedding_names) &&
+                       (read_spec.embedding_dims == spec.embedding_dims) &&
+                       (read_spec.language_names == spec.language_names);
+    test_successful &=
+        (mmap_params->num_languages() ==
+         static_cast<int>(spec.language_names.size())) &&
+        (mmap_params->language_name(0) == spec.language_names[0]);
+
+    NNetLanguageIdentifier lang_id(0, 1000, params);
+    NNetLanguageIdentifier mmap_lang_id(0, 1000, mmap_params.get());
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result result =
+        mmap_lang_id.FindLanguage(text);
+    test_successful &= (result.language == "en") &&
+                       (result.language == expected.language) &&
+                       (result.probability == expected.probability);
+  }
+  std::remove(kModelPath);
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that a LanguageIdModel set up from the pre-parsed features and the
+// languages of a model file behaves as the built-in one.
+bool TestModelFromFile() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  const model_file::ModelSpec spec = model_file::GetBuiltInModelSpec();
+  std::string error;
+  bool test_successful =
+      model_file::WriteModelFile(params, spec, kModelPath, &error);
+  const std::unique_ptr<MmapEmbeddingNetworkParams> mmap_params =
+      MmapEmbeddingNetworkParams::Open(kModelPath, &error);
+  std::remove(kModelPath);
+  if (mmap_params == nullptr) {
+    std::cout << "  " << error << std::endl;
+    return PrintAndReturnStatus(false);
+  }
+
+  // The descriptors in the file are the ones parsed from the FML.
+  const std::vector<string> features = utils::Split(spec.features, ';');
+  test_successful &=
+      mmap_params->feature_descriptors().size() == features.size();
+  for (size_t i = 0; test_successful && i < features.size(); ++i) {
+    FeatureExtractorDescriptor descriptor;
+    FMLParser parser;
+    parser.Parse(features[i], &descriptor);
+    test_successful &=
+        mmap_params->feature_descriptors()[i].SerializeAsString() ==
+        descriptor.SerializeAsString();
+  }
+
+  const std::shared_ptr<const LanguageIdModel> built_in_model =
+      std::make_shared<LanguageIdModel>();
+  const std::shared_ptr<const LanguageIdModel> file_model =
+      std::make_shared<LanguageIdModel>(*mmap_params);
+  test_successful &=
+      (file_model->num_languages() == built_in_model->num_languages()) &&
+      (file_model->NumEmbeddings() == built_in_model->NumEmbeddings());
+  for (int i = 0; test_successful && i < file_model->num_languages(); ++i) {
+    test_successful &= strcmp(file_model->GetLanguageCode(i),
+                              built_in_model->GetLanguageCode(i)) == 0;
+  }
+  test_successful &= (file_model->GetLanguageId("en") ==
+                      built_in_model->GetLanguageId("en")) &&
+                     file_model->has_built_in_languages();
+
+  NNetLanguageIdentifier lang_id(built_in_model, 0, 1000);
+  NNetLanguageIdentifier file_lang_id(file_model, 0, 1000);
+  test_successful &= file_lang_id.EnableScriptFastPath(
+      NNetLanguageIdentifier::kDefaultScriptDominanceThreshold);
+  file_lang_id.DisableScriptFastPath();
+  for (const std::string text :
+       {"This piece of text is in English, and it is long enough.",
+        "Это текст на русском языке, достаточно длинный для сети.",
+        "Ce texte est en français, mais il contient aussi some English.",
+        "日本語のテキストです。", "12345 !!"}) {
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result result =
+        file_lang_id.FindLanguage(text);
+    test_successful &= (result.language == expected.language) &&
+                       (result.probability == expected.probability) &&
+                       (result.is_reliable == expected.is_reliable);
+  }
+
+  // The script-only fast path is made for the languages of the built-in
+  // model, so it stays off on a model with other ones.
+  model_file::ModelSpec other_spec = spec;
+  std::swap(other_spec.language_names[0], other_spec.language_names[1]);
+  test_successful &=
+      model_file::WriteModelFile(params, other_spec, kModelPath, &error);
+  const std::unique_ptr<MmapEmbeddingNetworkParams> other_mmap_params =
+      MmapEmbeddingNetworkParams::Open(kModelPath, &error);
+  std::remove(kModelPath);
+  if (other_mmap_params == nullptr) {
+    std::cout << "  " << error << std::endl;
+    return PrintAndReturnStatus(false);
+  }
+  const std::shared_ptr<const LanguageIdModel> other_model =
+      std::make_shared<LanguageIdModel>(*other_mmap_params);
+  NNetLanguageIdentifier other_lang_id(other_model, 0, 1000);
+  test_successful &=
+      !other_model->has_built_in_languages() &&
+      !other_lang_id.EnableScriptFastPath(
+          NNetLanguageIdentifier::kDefaultScriptDominanceThreshold);
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that the weights placed on huge pages or on a NUMA node, and the
+// replicas of the model on each node, are the ones of the file.  Explicit
+// huge pages may not be reserved on the machine, in which case loading the
+// file with them should fail.
+bool TestPlacement() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  std::string error;
+  bool test_successful = model_file::WriteModelFile(
+      params, model_file::GetBuiltInModelSpec(), kModelPath, &error);
+  using HugePages = MmapEmbeddingNetworkParams::HugePages;
+  for (HugePages huge_pages :
+       {HugePages::NONE, HugePages::TRANSPARENT, HugePages::EXPLICIT}) {
+    MmapEmbeddingNetworkParams::LoadOptions options;
+    options.huge_pages = huge_pages;
+    options.numa_node = 0;
+    error.clear();
+    const std::unique_ptr<MmapEmbeddingNetworkParams> mmap_params =
+        MmapEmbeddingNetworkParams::Open(kModelPath, options, &error);
+    if (mmap_params == nullptr) {
+      test_successful &= (huge_pages == HugePages::EXPLICIT) && !error.empty();
+      continue;
+    }
+    test_successful &= SameParams(params, *mmap_params) &&
+                       (mmap_params->huge_pages() == huge_pages ||
+                        mmap_params->huge_pages() == HugePages::NONE) &&
+                       (mmap_params->numa_node() == 0 ||
+                        mmap_params->numa_node() == -1);
+  }
+
+  std::unique_ptr<ModelReplicas> replicas =
+      ModelReplicas::Open(kModelPath, HugePages::TRANSPARENT, &error);
+  std::remove(kModelPath);
+  if (replicas == nullptr) {
+    std::cout << "  " << error << std::endl;
+    return PrintAndReturnStatus(false);
+  }
+  test_successful &=
+      (replicas->num_replicas() == ModelReplicas::NumNumaNodes()) &&
+      (ModelReplicas::CurrentNumaNode() < ModelReplicas::NumNumaNodes());
+  const std::string text =
+      "This piece of text is in English, and it is long enough.";
+  NNetLanguageIdentifier lang_id(0, 1000);
+  const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+  for (int node = 0; node < replicas->num_replicas(); ++node) {
+    NNetLanguageIdentifier replica_lang_id(replicas->replica(node), 0, 1000);
+    const NNetLanguageIdentifier::Result result =
+        replica_lang_id.FindLanguage(text);
+    test_successful &= (result.language == expected.language) &&
+                       (result.probability == expected.probability);
+  }
+
+  // The sessions keep their replica alive.
+  NNetLanguageIdentifier local_lang_id(replicas->Local(), 0, 1000);
+  replicas.reset();
+  test_successful &=
+      local_lang_id.FindLanguage(text).probability == expected.probability;
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Returns the reordering of the embedding rows of source for the lookups of
+// the texts, and stores their features in *inputs.
+std::unique_ptr<ReorderedEmbeddingsNNParams> ReorderForTexts(
+    const EmbeddingNetworkParams *source, const std::vector<string> &texts,
+    std::vector<std::vector<FeatureVector>> *inputs) {
+  NNetLanguageIdentifier lang_id(0, 1000, source);
+  InferenceScratch scratch;
+  EmbeddingLookupCounts counts(source->embeddings_size());
+  for (int i = 0; i < source->embeddings_size(); ++i) {
+    counts[i].resize(source->embeddings_num_rows(i));
+  }
+  for (const string &text : texts) {
+    inputs->emplace_back();
+    lang_id.ExtractFeatures(text.data(), text.size(), &scratch,
+                            &inputs->back());
+    CountEmbeddingLookups(inputs->back(), &counts);
+  }
+  return std::unique_ptr<ReorderedEmbeddingsNNParams>(
+      new ReorderedEmbeddingsNNParams(source, counts));
+}
+
+// Checks that a model file with the embedding rows reordered by the lookups
+// of a calibration corpus stores the row remaps, makes the same predictions,
+// and reads fewer cache lines for the corpus.
+bool TestRowReordering() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<string> calibration_texts = {
+      "This piece of text is in English, and it is long enough.",
+      "Another English sentence, with some of the same words in it.",
+      "Это текст на русском языке, достаточно длинный для сети.",
+      "Ce texte est en français, mais il contient aussi some English."};
+  LangIdNNParams params;
+  std::vector<std::vector<FeatureVector>> inputs;
+  const std::unique_ptr<ReorderedEmbeddingsNNParams> reordered =
+      ReorderForTexts(&params, calibration_texts, &inputs);
+  std::string error;
+  bool test_successful = model_file::WriteModelFile(
+      *reordered, model_file::GetBuiltInModelSpec(), kModelPath, &error);
+  const std::unique_ptr<MmapEmbeddingNetworkParams> mmap_params =
+      MmapEmbeddingNetworkParams::Open(kModelPath, &error);
+  std::remove(kModelPath);
+  if (mmap_params == nullptr) {
+    std::cout << "  " << error << std::endl;
+    return PrintAndReturnStatus(false);
+  }
+
+  // Each remap is a permutation that finds the original row of each id.
+  for (int i = 0; test_successful && i < params.embeddings_size(); ++i) {
+    const int32 *row_remap = mmap_params->embeddings_row_remap(i);
+    const int num_rows = params.embeddings_num_rows(i);
+    const int row_size = params.embeddings_num_cols(i);
+    test_successful &= (row_remap != nullptr);
+    std::vector<bool> seen(num_rows, false);
+    for (int k = 0; test_successful && k < num_rows; ++k) {
+      const int32 row = row_remap[k];
+      test_successful &=
+          (row >= 0) && (row < num_rows) && !seen[row] &&
+          (memcmp(static_cast<const char *>(params.embeddings_weights(i)) +
+                      k * row_size,
+                  static_cast<const char *>(
+                      mmap_params->embeddings_weights(i)) +
+                      row * row_size,
+                  row_size) == 0) &&
+          (params.embeddings_quant_scales(i)[k] ==
+           mmap_params->embeddings_quant_scales(i)[row]);
+      if (test_successful) seen[row] = true;
+    }
+  }
+
+  NNetLanguageIdentifier lang_id(0, 1000, &params);
+  NNetLanguageIdentifier mmap_lang_id(0, 1000, mmap_params.get());
+  std::vector<string> texts = calibration_texts;
+  texts.push_back("Dieser Text ist nicht im Korpus, aber er ist lang genug.");
+  texts.push_back("日本語のテキストです。");
+  for (const string &text : texts) {
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result result =
+        mmap_lang_id.FindLanguage(text);
+    test_successful &= (result.language == expected.language) &&
+                       (result.probability == expected.probability);
+  }
+
+  const int cache_size = 4096;
+  const EmbeddingCacheStats before =
+      SimulateEmbeddingCache(params, inputs, cache_size);
+  const EmbeddingCacheStats after =
+      SimulateEmbeddingCache(*mmap_params, inputs, cache_size);
+  test_successful &= (after.num_accesses <= before.num_accesses) &&
+                     (after.num_misses < before.num_misses) &&
+                     (after.lines_per_input < before.lines_per_input);
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Writes params (or the built-in model, if params is nullptr) to a model file,
+// with spec (or the built-in one, if spec is nullptr), applies corrupt to its
+// bytes, and returns true if the corrupted file is rejected with an error
+// message.
+template <typename Corrupt>
+bool IsRejected(Corrupt corrupt, const EmbeddingNetworkParams *params = nullptr,
+                const model_file::ModelSpec *spec = nullptr) {
+  LangIdNNParams built_in_params;
+  std::string error;
+  if (!model_file::WriteModelFile(
+          (params != nullptr) ? *params : built_in_params,
+          (spec != nullptr) ? *spec : model_file::GetBuiltInModelSpec(),
+          kModelPath, &error)) {
+    return false;
+  }
+  std::ifstream in(kModelPath, std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  corrupt(&bytes);
+  std::ofstream out(kBadModelPath, std::ios::binary | std::ios::trunc);
+  out.write(bytes.data(), bytes.size());
+  out.close();
+  const bool rejected =
+      MmapEmbeddingNetworkParams::Open(kBadModelPath, &error) == nullptr &&
+      !error.empty();
+  std::remove(kModelPath);
+  std::remove(kBadModelPath);
+  return rejected;
+}
+
+// Checks that missing, truncated and corrupted files are rejected.
+bool TestRejectsBadFiles() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  std::string error;
+  bool test_successful =
+      MmapEmbeddingNetworkParams::Open("no_such_file.cld3", &error) ==
+          nullptr &&
+      !error.empty();
+  test_successful &= IsRejected([](std::string *bytes) { (*bytes)[0] = 'X'; });
+  test_successful &= IsRejected([](std::string *bytes) {
+    model_file::FileHeader *header =
+        reinterpret_cast<model_file::FileHeader *>(&(*bytes)[0]);
+    header->version = model_file::kVersion + 1;
+  });
+  test_successful &=
+      IsRejected([](std::string *bytes) { bytes->resize(bytes->size() / 2); });
+  test_successful &= IsRejected([](std::string *bytes) {
+    model_file::SectionHeader *section =
+        reinterpret_cast<model_file::SectionHeader *>(
+            &(*bytes)[sizeof(model_file::FileHeader)]);
+    section->offset = bytes->size() - model_file::kSectionAlignment;
+  });
+  test_successful &= IsRejected([](std::string *bytes) {
+    model_file::SectionHeader *section =
+        reinterpret_cast<model_file::SectionHeader *>(
+            &(*bytes)[sizeof(model_file::FileHeader)]);
+    section->rows += 1;
+  });
+  test_successful &= IsRejected([](std::string *bytes) {
+    const model_file::FileHeader *header =
+        reinterpret_cast<const model_file::FileHeader *>(bytes->data());
+    model_file::SectionHeader *sections =
+        reinterpret_cast<model_file::SectionHeader *>(
+            &(*bytes)[sizeof(model_file::FileHeader)]);
+    for (uint32 i = 0; i < header->num_sections; ++i) {
+      if (sections[i].type ==
+          static_cast<uint32>(model_file::SectionType::FEATURE_DESCRIPTOR)) {
+        memset(&(*bytes)[sections[i].offset], 0xff, sections[i].size);
+      }
+    }
+  });
+
+  // A row remap that is not a permutation.
+  LangIdNNParams params;
+  std::vector<std::vector<FeatureVector>> inputs;
+  const std::unique_ptr<ReorderedEmbeddingsNNParams> reordered =
+      ReorderForTexts(&params, {"This piece of text is in English."}, &inputs);
+  test_successful &= IsRejected(
+      [](std::string *bytes) {
+        const model_file::FileHeader *header =
+            reinterpret_cast<const model_file::FileHeader *>(bytes->data());
+        model_file::SectionHeader *sections =
+            reinterpret_cast<model_file::SectionHeader *>(
+                &(*bytes)[sizeof(model_file::FileHeader)]);
+        for (uint32 i = 0; i < header->num_sections; ++i) {
+          if (sections[i].type ==
+              static_cast<uint32>(
+                  model_file::SectionType::EMBEDDING_ROW_REMAP)) {
+            int32 *row_remap =
+                reinterpret_cast<int32 *>(&(*bytes)[sections[i].offset]);
+            row_remap[1] = row_remap[0];
+          }
+        }
+      },
+      reordered.get());
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Returns a corruption that adds delta to the int32 #index of the first section
+// of the given type or, if index is -1, to its number of rows, keeping its
+// size.
+std::function<void(std::string *)> AddToSection(model_file::SectionType type,
+                                                int index, int32 delta) {
+  return [type, index, delta](std::string *bytes) {
+    const model_file::FileHeader *header =
+        reinterpret_cast<const model_file::FileHeader *>(bytes->data());
+    model_file::SectionHeader *sections =
+        reinterpret_cast<model_file::SectionHeader *>(
+            &(*bytes)[sizeof(model_file::FileHeader)]);
+    for (uint32 i = 0; i < header->num_sections; ++i) {
+      if (sections[i].type != static_cast<uint32>(type)) continue;
+      if (index < 0) {
+        sections[i].cols *= sections[i].rows;
+        sections[i].rows += delta;
+        sections[i].cols /= sections[i].rows;
+      } else {
+        reinterpret_cast<int32 *>(&(*bytes)[sections[i].offset])[index] +=
+            delta;
+      }
+      return;
+    }
+  };
+}
+
+// Returns a corruption that sets the element type of the first section of the
+// given type, which should have elements of the same size.
+std::function<void(std::string *)> SetElementType(
+    model_file::SectionType type, model_file::ElementType element_type) {
+  return [type, element_type](std::string *bytes) {
+    const model_file::FileHeader *header =
+        reinterpret_cast<const model_file::FileHeader *>(bytes->data());
+    model_file::SectionHeader *sections =
+        reinterpret_cast<model_file::SectionHeader *>(
+            &(*bytes)[sizeof(model_file::FileHeader)]);
+    for (uint32 i = 0; i < header->num_sections; ++i) {
+      if (sections[i].type == static_cast<uint32>(type)) {
+        sections[i].element_type = static_cast<uint32>(element_type);
+        return;
+      }
+    }
+  };
+}
+
+// Checks that matrices quantized in a way EmbeddingNetwork does not support,
+// i.e., int8 embeddings or uint8 hidden and softmax layers, are rejected.
+bool TestRejectsUnsupportedQuantization() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams float_params;
+  Int8QuantizedNNParams int8_params(&float_params);
+
+  // The built-in embeddings are uint8, and the int8 layers have elements of
+  // the same size.
+  bool test_successful = IsRejected(
+      SetElementType(model_file::SectionType::EMBEDDING_WEIGHTS,
+                     model_file::ElementType::INT8));
+  test_successful &=
+      IsRejected(SetElementType(model_file::SectionType::HIDDEN_WEIGHTS,
+                                model_file::ElementType::UINT8),
+                 &int8_params);
+  test_successful &=
+      IsRejected(SetElementType(model_file::SectionType::SOFTMAX_WEIGHTS,
+                                model_file::ElementType::UINT8),
+                 &int8_params);
+  return PrintAndReturnStatus(test_successful);
+}
+
+// The built-in parameters, with num_hidden copies of the hidden layer.
+class HiddenLayersNNParams : public LangIdNNParams {
+ public:
+  explicit HiddenLayersNNParams(int num_hidden) : num_hidden_(num_hidden) {}
+
+  int hidden_size() const override { return num_hidden_; }
+  int hidden_num_rows(int i) const override {
+    return LangIdNNParams::hidden_num_rows(0);
+  }
+  int hidden_num_cols(int i) const override {
+    return LangIdNNParams::hidden_num_cols(0);
+  }
+  const void *hidden_weights(int i) const override {
+    return LangIdNNParams::hidden_weights(0);
+  }
+  int hidden_bias_size() const override { return num_hidden_; }
+  int hidden_bias_num_rows(int i) const override {
+    return LangIdNNParams::hidden_bias_num_rows(0);
+  }
+  int hidden_bias_num_cols(int i) const override {
+    return LangIdNNParams::hidden_bias_num_cols(0);
+  }
+  const void *hidden_bias_weights(int i) const override {
+    return LangIdNNParams::hidden_bias_weights(0);
+  }
+
+ private:
+  const int num_hidden_;
+};
+
+// Returns the built-in model spec, with the FML of the first embedding space
+// edited by replacing from with to.
+model_file::ModelSpec EditFirstFeatures(const std::string &from,
+                                        const std::string &to) {
+  model_file::ModelSpec spec = model_file::GetBuiltInModelSpec();
+  const size_t end = spec.features.find(';');
+  const size_t pos = spec.features.find(from);
+  CLD3_CHECK(pos < end);
+  spec.features.replace(pos, from.size(), to);
+  return spec;
+}
+
+// Checks that files whose sections do not fit together are rejected.
+bool TestRejectsInconsistentFiles() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams params;
+  const int last = params.embedding_dim_size() - 1;
+
+  // An embedding of another dimension.
+  bool test_successful =
+      IsRejected(AddToSection(model_file::SectionType::EMBEDDING_DIM, 0, 1));
+
+  // Misplaced embeddings in the concat layer.
+  test_successful &=
+      IsRejected(AddToSection(model_file::SectionType::CONCAT_OFFSET, 1, 1));
+  test_successful &= IsRejected(
+      AddToSection(model_file::SectionType::CONCAT_LAYER_SIZE, 0, 1));
+
+  // A concat layer larger than the input of the hidden layer.
+  test_successful &= IsRejected([&params, last](std::string *bytes) {
+    AddToSection(model_file::SectionType::EMBEDDING_NUM_FEATURES, last,
+                 1)(bytes);
+    AddToSection(model_file::SectionType::CONCAT_LAYER_SIZE, 0,
+                 params.embedding_dim(last))(bytes);
+  });
+
+  // Biases of another size than their layers, as a single column.
+  test_successful &=
+      IsRejected(AddToSection(model_file::SectionType::HIDDEN_BIAS, -1,
+                              1 - params.hidden_bias_num_rows(0)));
+  test_successful &=
+      IsRejected(AddToSection(model_file::SectionType::SOFTMAX_BIAS, -1,
+                              1 - params.softmax_bias_num_rows(0)));
+
+  // EmbeddingNetwork supports one or two hidden layers.
+  const auto no_corruption = [](std::string *bytes) {};
+  const HiddenLayersNNParams no_hidden_params(0);
+  const HiddenLayersNNParams three_hidden_params(3);
+  test_successful &= IsRejected(no_corruption, &no_hidden_params);
+  test_successful &= IsRejected(no_corruption, &three_hidden_params);
+
+  // Features that do not match the embedding sections: too many of them, a
+  // larger domain than the embedding matrix, and unknown ones.
+  const model_file::ModelSpec extra_feature_spec =
+      EditFirstFeatures(",size=2)", ",size=2) script");
+  const model_file::ModelSpec larger_domain_spec =
+      EditFirstFeatures("id_dim=1000", "id_dim=2000");
+  const model_file::ModelSpec unknown_feature_spec =
+      EditFirstFeatures("continuous-bag-of-ngrams", "no-such-feature");
+  test_successful &= IsRejected(no_corruption, nullptr, &extra_feature_spec);
+  test_successful &= IsRejected(no_corruption, nullptr, &larger_domain_spec);
+  test_successful &= IsRejected(no_corruption, nullptr, &unknown_feature_spec);
+  return PrintAndReturnStatus(test_successful);
+}
+
+}  // namespace model_file_test
+}  // namespace chrome_lang_id
+
+// Runs the model file tests.
+int main(int argc, char **argv) {
+  const bool tests_successful =
+      chrome_lang_id::model_file_test::TestRoundTrip() &&
+      chrome_lang_id::model_file_test::TestModelFromFile() &&
+      chrome_lang_id::model_file_test::TestPlacement() &&
+      chrome_lang_id::model_file_test::TestRowReordering() &&
+      chrome_lang_id::model_file_test::TestRejectsBadFiles() &&
+      chrome_lang_id::model_file_test::TestRejectsUnsupportedQuantization() &&
+      chrome_lang_id::model_file_test::TestRejectsInconsistentFiles();
+  return tests_successful ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "model_replicas.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#if defined(__linux__)
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // defined(__linux__)
+
+namespace chrome_lang_id {
+namespace {
+
+// A model together with the parameters it uses, so that a shared_ptr to the
+// model keeps the parameters alive.
+struct Replica {
+  explicit Replica(std::unique_ptr<MmapEmbeddingNetworkParams> replica_params)
+      : params(std::move(replica_params)), model(*params) {}
+
+  std::unique_ptr<MmapEmbeddingNetworkParams> params;
+  LanguageIdModel model;
+};
+
+}  // namespace
+
+std::unique_ptr<ModelReplicas> ModelReplicas::Open(
+    const string &path, MmapEmbeddingNetworkParams::HugePages huge_pages,
+    string *error) {
+  std::unique_ptr<ModelReplicas> replicas(new ModelReplicas);
+  const int num_nodes = NumNumaNodes();
+  for (int node = 0; node < num_nodes; ++node) {
+    MmapEmbeddingNetworkParams::LoadOptions options;
+    options.huge_pages = huge_pages;
+    options.numa_node = (num_nodes > 1) ? node : -1;
+    std::unique_ptr<MmapEmbeddingNetworkParams> params =
+        MmapEmbeddingNetworkParams::Open(path, options, error);
+    if (params == nullptr) return nullptr;
+    std::shared_ptr<Replica> replica =
+        std::make_shared<Replica>(std::move(params));
+    replicas->replicas_.emplace_back(replica, &replica->model);
+  }
+  return replicas;
+}
+
+const std::shared_ptr<const LanguageIdModel> &ModelReplicas::Local() const {
+  const int node = CurrentNumaNode();
+  return replicas_[(node < num_replicas()) ? node : 0];
+}
+
+int ModelReplicas::NumNumaNodes() {
+#if defined(__linux__)
+  // The nodes are numbered from 0; machines with holes in the numbering get
+  // replicas for the nodes before the first hole only.
+  int num_nodes = 0;
+  struct stat node_stat;
+  while (stat(("/sys/devices/system/node/node" + std::to_string(num_nodes))
+                  .c_str(),
+              &node_stat) == 0) {
+    ++num_nodes;
+  }
+  return (num_nodes > 0) ? num_nodes : 1;
+#else
+  return 1;
+#endif  // defined(__linux__)
+}
+
+int ModelReplicas::CurrentNumaNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) return node;
+#endif  // defined(__linux__) && defined(SYS_getcpu)
+  return 0;
+}
+
+}  // namespace chrome_lang_id
@@ -0,0 +1,78 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef MODEL_REPLICAS_H_
+#define MODEL_REPLICAS_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "language_id_model.h"
+#include "mmap_embedding_network_params.h"
+
+namespace chrome_lang_id {
+
+// One LanguageIdModel per NUMA node of the machine, each on a copy of a model
+// file allocated on its node.  The embedding tables are read at random, by
+// hashed ngram ids, so a session running on one socket is faster with the
+// weights in the memory of that socket.  A worker thread should create its
+// sessions on Local(), e.g.:
+//
+//   NNetLanguageIdentifier session(replicas->Local());
+//
+// and stay on the same node, e.g., by being pinned to its CPUs, for the reads
+// to remain local.  On a machine with a single node, or without NUMA support,
+// there is a single replica.
+class ModelReplicas {
+ public:
+  // Loads the model file at path once per NUMA node, on that node, with the
+  // given kind of pages.  Returns nullptr on failure, and then, if error is
+  // not nullptr, stores a description of the problem in *error.
+  static std::unique_ptr<ModelReplicas> Open(
+      const string &path, MmapEmbeddingNetworkParams::HugePages huge_pages,
+      string *error);
+
+  // Returns the number of replicas, i.e., of NUMA nodes.
+  int num_replicas() const { return replicas_.size(); }
+
+  // Returns the replica on the given node.  The model keeps its copy of the
+  // file alive, so it may outlive this object.
+  const std::shared_ptr<const LanguageIdModel> &replica(int node) const {
+    return replicas_[node];
+  }
+
+  // Returns the replica on the node of the CPU the calling thread runs on.
+  const std::shared_ptr<const LanguageIdModel> &Local() const;
+
+  // Returns the number of NUMA nodes of the machine, at least 1.
+  static int NumNumaNodes();
+
+  // Returns the NUMA node of the CPU the calling thread runs on, or 0 if it is
+  // not known.
+  static int CurrentNumaNode();
+
+ private:
+  ModelReplicas() {}
+
+  std::vector<std::shared_ptr<const LanguageIdModel>> replicas_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(ModelReplicas);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // MODEL_REPLICAS_H_
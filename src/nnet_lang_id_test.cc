@@ -13,28 +13,48 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <new>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "base.h"
+#include "executor.h"
+#include "int8_quantized_nn_params.h"
+#include "lang_id_nn_params.h"
+#include "language_id_model.h"
 #include "nnet_lang_id_test_data.h"
 #include "nnet_language_identifier.h"
+#include "result_cache.h"
+#include "script_languages.h"
+#include "streaming_language_detector.h"
+
+// Number of calls to the global operator new, used to check that predictions
+// do not allocate memory when given a warmed-up scratch.
+static std::atomic<int> num_allocations(0);
+
+void *operator new(size_t size) {
+  ++num_allocations;
+  void *ptr = malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
 
 namespace chrome_lang_id {
 namespace nnet_lang_id_test {
 
-// Tests the model on all supported languages. Returns "true" if the test is
-// successful and "false" otherwise.
-// TODO(abakalov): Add a test for random input that should be labeled as
-// "unknown" due to low confidence.
-bool TestPredictions() {
-  std::cout << "Running " << __FUNCTION__ << std::endl;
-
-  // (gold language, sample text) pairs used for testing.
-  const std::vector<std::pair<std::string, std::string>> gold_lang_text = {
+// Returns (gold language, sample text) pairs for all supported languages.
+std::vector<std::pair<std::string, std::string>> GetGoldLangText() {
+  return {
       {"af", NNetLangIdTestData::kTestStrAF},
       {"ar", NNetLangIdTestData::kTestStrAR},
       {"az", NNetLangIdTestData::kTestStrAZ},
@@ -125,6 +145,18 @@ bool TestPredictions() {
       {"yo", NNetLangIdTestData::kTestStrYO},
       {"zh", NNetLangIdTestData::kTestStrZH},
       {"zu", NNetLangIdTestData::kTestStrZU}};
+}
+
+// Tests the model on all supported languages. Returns "true" if the test is
+// successful and "false" otherwise.
+// TODO(abakalov): Add a test for random input that should be labeled as
+// "unknown" due to low confidence.
+bool TestPredictions() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+
+  // (gold language, sample text) pairs used for testing.
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
 
   NNetLanguageIdentifier lang_id(/*min_num_bytes=*/0,
                                  /*max_num_bytes=*/1000);
@@ -242,6 +274,893 @@ bool TestMultipleLanguagesInInput() {
   return true;
 }
 
+// Checks that FindLanguage and FindTopNMostFreqLangs give the same results
+// with and without a caller-owned InferenceScratch, when the same scratch is
+// reused across texts of different languages and sizes, and that FindLanguage
+// does not allocate memory once the scratch is warmed up for a text.
+bool TestInferenceScratch() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  NNetLanguageIdentifier lang_id(/*min_num_bytes=*/0,
+                                 /*max_num_bytes=*/1000);
+  InferenceScratch scratch;
+  for (const auto &test_instance : gold_lang_text) {
+    const std::string &text = test_instance.second;
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result actual =
+        lang_id.FindLanguage(text, &scratch);
+    if (actual.language != expected.language ||
+        actual.probability != expected.probability) {
+      std::cout << "  Failure" << std::endl;
+      std::cout << "  FindLanguage mismatch for " << test_instance.first
+                << std::endl;
+      return false;
+    }
+    const int num_allocations_before = num_allocations;
+    lang_id.FindLanguage(text, &scratch);
+    if (num_allocations != num_allocations_before) {
+      std::cout << "  Failure" << std::endl;
+      std::cout << "  FindLanguage of " << test_instance.first << " text: "
+                << num_allocations - num_allocations_before
+                << " allocations with a warmed-up scratch" << std::endl;
+      return false;
+    }
+
+    const std::vector<NNetLanguageIdentifier::Result> expected_top =
+        lang_id.FindTopNMostFreqLangs(text, /*num_langs=*/2);
+    const std::vector<NNetLanguageIdentifier::Result> actual_top =
+        lang_id.FindTopNMostFreqLangs(text, /*num_langs=*/2, &scratch);
+    for (size_t i = 0; i < expected_top.size(); ++i) {
+      if (actual_top[i].language != expected_top[i].language ||
+          actual_top[i].probability != expected_top[i].probability ||
+          actual_top[i].proportion != expected_top[i].proportion) {
+        std::cout << "  Failure" << std::endl;
+        std::cout << "  FindTopNMostFreqLangs mismatch for "
+                  << test_instance.first << std::endl;
+        return false;
+      }
+    }
+  }
+  std::cout << "  Success!" << std::endl;
+  return true;
+}
+
+// Tests that FindLanguage gives the same results on a (pointer, size) input as
+// on the equivalent string, including when the input is a prefix of a larger,
+// non-null-terminated buffer. Returns "true" if the test is successful and
+// "false" otherwise.
+bool TestFindLanguageOfCharBuffer() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  NNetLanguageIdentifier lang_id(/*min_num_bytes=*/0,
+                                 /*max_num_bytes=*/300);
+  for (size_t i = 0; i < gold_lang_text.size(); ++i) {
+    const std::string &text = gold_lang_text[i].second;
+
+    // The text, immediately followed by the text of another language.
+    const std::string buffer =
+        text + gold_lang_text[(i + 1) % gold_lang_text.size()].second;
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result actual =
+        lang_id.FindLanguage(buffer.data(), text.size());
+    if (actual.language != expected.language ||
+        actual.probability != expected.probability) {
+      std::cout << "  Failure" << std::endl;
+      std::cout << "  FindLanguage mismatch for " << gold_lang_text[i].first
+                << std::endl;
+      return false;
+    }
+  }
+  std::cout << "  Success!" << std::endl;
+  return true;
+}
+
+// Tests that several threads sharing one LanguageIdModel, through sessions of
+// their own or through a shared const session with their own InferenceScratch,
+// get the same results as a single-threaded identifier. Returns "true" if the
+// test is successful and "false" otherwise.
+bool TestSharedModelAcrossThreads() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  const int kMinNumBytes = 0;
+  const int kMaxNumBytes = 1000;
+  NNetLanguageIdentifier reference(kMinNumBytes, kMaxNumBytes);
+  std::vector<NNetLanguageIdentifier::Result> expected;
+  for (const auto &test_instance : gold_lang_text) {
+    expected.push_back(reference.FindLanguage(test_instance.second));
+  }
+
+  const std::shared_ptr<const LanguageIdModel> model =
+      std::make_shared<LanguageIdModel>();
+  const NNetLanguageIdentifier shared_session(model, kMinNumBytes,
+                                              kMaxNumBytes);
+  const int kNumThreads = 8;
+  std::vector<int> num_mismatches(kNumThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      NNetLanguageIdentifier session(model, kMinNumBytes, kMaxNumBytes);
+      InferenceScratch scratch;
+      for (size_t i = 0; i < gold_lang_text.size(); ++i) {
+        // Each thread starts at a different text.
+        const size_t index = (i + 11 * t) % gold_lang_text.size();
+        const std::string &text = gold_lang_text[index].second;
+        const NNetLanguageIdentifier::Result result =
+            (t % 2 == 0) ? session.FindLanguage(text)
+                         : shared_session.FindLanguage(text, &scratch);
+        if (result.language != expected[index].language ||
+            result.probability != expected[index].probability) {
+          ++num_mismatches[t];
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  for (int t = 0; t < kNumThreads; ++t) {
+    if (num_mismatches[t] != 0) {
+      std::cout << "  Failure" << std::endl;
+      std::cout << "  Thread " << t << ": " << num_mismatches[t]
+                << " mismatches" << std::endl;
+      return false;
+    }
+  }
+  std::cout << "  Success!" << std::endl;
+  return true;
+}
+
+// Tests that the sessions on the built-in model share it, and that a clone of
+// a session has its model and settings.  Returns "true" if the test is
+// successful and "false" otherwise.
+bool TestClone() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  LangIdNNParams nn_params;
+  NNetLanguageIdentifier lang_id;
+  const NNetLanguageIdentifier other_lang_id(0, 1000);
+  const NNetLanguageIdentifier own_model_lang_id(0, 1000, &nn_params);
+  bool test_successful =
+      (lang_id.model() == other_lang_id.model()) &&
+      (lang_id.model() == LanguageIdModel::BuiltIn()) &&
+      (own_model_lang_id.model() != lang_id.model());
+
+  lang_id.SetAllowedLanguages({"en", "fr", "de", "es", "ru", "el"});
+  lang_id.EnableScriptFastPath(
+      NNetLanguageIdentifier::kDefaultScriptDominanceThreshold);
+  lang_id.EnableEarlyExit(0.05f);
+  const std::unique_ptr<NNetLanguageIdentifier> clone = lang_id.Clone();
+  test_successful &= (clone->model() == lang_id.model());
+  for (const auto &lang_text : GetGoldLangText()) {
+    const NNetLanguageIdentifier::Result expected =
+        lang_id.FindLanguage(lang_text.second);
+    const NNetLanguageIdentifier::Result result =
+        clone->FindLanguage(lang_text.second);
+    if (result.language != expected.language ||
+        result.probability != expected.probability ||
+        result.is_reliable != expected.is_reliable) {
+      std::cout << "  Clone: " << result.language << " vs "
+                << expected.language << std::endl;
+      test_successful = false;
+    }
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests that FindLanguageBatch gives the same results, in the same order, as
+// FindLanguage on each text, both with and without an executor.  The batch
+// mixes texts of very different sizes.  Returns "true" if the test is
+// successful and "false" otherwise.
+bool TestFindLanguageBatch() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  std::vector<std::string> texts;
+  for (size_t i = 0; i < gold_lang_text.size(); ++i) {
+    const std::string &text = gold_lang_text[i].second;
+    if (i % 7 == 0) {
+      // A long document made of several copies of the text.
+      std::string long_text;
+      for (int k = 0; k < 20; ++k) long_text += text + " ";
+      texts.push_back(long_text);
+    } else if (i % 3 == 0) {
+      texts.push_back(text.substr(0, 30));
+    } else {
+      texts.push_back(text);
+    }
+  }
+  texts.push_back("");
+
+  NNetLanguageIdentifier lang_id;
+  std::vector<NNetLanguageIdentifier::Result> expected;
+  std::vector<StringPiece> text_pieces;
+  for (const std::string &text : texts) {
+    expected.push_back(lang_id.FindLanguage(text));
+    text_pieces.emplace_back(text.data(), text.size());
+  }
+
+  Executor executor(4);
+  bool test_successful = true;
+  for (Executor *batch_executor : {static_cast<Executor *>(nullptr),
+                                   &executor, &executor}) {
+    std::vector<NNetLanguageIdentifier::Result> results;
+    lang_id.FindLanguageBatch(text_pieces, &results, batch_executor);
+    if (results.size() != expected.size()) {
+      test_successful = false;
+      continue;
+    }
+    for (size_t i = 0; i < results.size(); ++i) {
+      if (results[i].language != expected[i].language ||
+          results[i].probability != expected[i].probability ||
+          results[i].is_reliable != expected[i].is_reliable) {
+        std::cout << "  Text " << i << ": " << results[i].language << " vs "
+                  << expected[i].language << std::endl;
+        test_successful = false;
+      }
+    }
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Returns true if the results of FindTopNMostFreqLangs in actual are the same
+// as the ones in expected, with probabilities within probability_tolerance.
+bool TopNResultsMatch(
+    const std::vector<NNetLanguageIdentifier::Result> &expected,
+    const std::vector<NNetLanguageIdentifier::Result> &actual,
+    float probability_tolerance) {
+  if (actual.size() != expected.size()) return false;
+  for (size_t i = 0; i < expected.size(); ++i) {
+    if (actual[i].language != expected[i].language ||
+        std::abs(actual[i].probability - expected[i].probability) >
+            probability_tolerance ||
+        actual[i].proportion != expected[i].proportion ||
+        actual[i].byte_ranges.size() != expected[i].byte_ranges.size()) {
+      return false;
+    }
+    for (size_t r = 0; r < expected[i].byte_ranges.size(); ++r) {
+      const NNetLanguageIdentifier::SpanInfo &expected_range =
+          expected[i].byte_ranges[r];
+      const NNetLanguageIdentifier::SpanInfo &actual_range =
+          actual[i].byte_ranges[r];
+      if (actual_range.start_index != expected_range.start_index ||
+          actual_range.end_index != expected_range.end_index ||
+          std::abs(actual_range.probability - expected_range.probability) >
+              probability_tolerance) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Tests that FindTopNMostFreqLangs gives the same results when the spans are
+// classified in parallel, or with one batched network call, as when they are
+// classified one after another, on inputs with many spans in various scripts.
+// Returns "true" if the test is successful and "false" otherwise.
+bool TestFindTopNWithCollectedSpans() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  std::vector<std::string> texts = {""};
+  for (size_t i = 0; i < gold_lang_text.size(); i += 9) {
+    // Several texts of languages in different scripts, e.g., "af", "ca" and
+    // "ar", alternating.
+    std::string text;
+    for (size_t k = 0; k < 6; ++k) {
+      text += gold_lang_text[(i + 13 * k) % gold_lang_text.size()].second;
+      text += " ";
+    }
+    texts.push_back(text);
+  }
+
+  NNetLanguageIdentifier lang_id(/*min_num_bytes=*/0,
+                                 /*max_num_bytes=*/1000);
+  Executor executor(3);
+  const int kNumLangs = 4;
+  for (const std::string &text : texts) {
+    const std::vector<NNetLanguageIdentifier::Result> expected =
+        lang_id.FindTopNMostFreqLangs(text, kNumLangs);
+    const std::vector<NNetLanguageIdentifier::Result> parallel =
+        lang_id.FindTopNMostFreqLangs(text, kNumLangs, &executor);
+    const std::vector<NNetLanguageIdentifier::Result> batched =
+        lang_id.FindTopNMostFreqLangs(text, kNumLangs, /*executor=*/nullptr);
+    if (!TopNResultsMatch(expected, parallel, /*probability_tolerance=*/0.0f) ||
+        !TopNResultsMatch(expected, batched,
+                          /*probability_tolerance=*/1e-5f)) {
+      std::cout << "  Failure" << std::endl;
+      std::cout << "  Mismatch for text: " << text.substr(0, 50) << std::endl;
+      return false;
+    }
+  }
+  std::cout << "  Success!" << std::endl;
+  return true;
+}
+
+// Feeds text to detector in chunks of chunk_size bytes (all of it at once if
+// chunk_size is 0), stopping early if Append returns true and stop_early is
+// true, and returns the result.
+NNetLanguageIdentifier::Result StreamText(const std::string &text,
+                                          size_t chunk_size, bool stop_early,
+                                          StreamingLanguageDetector *detector) {
+  detector->Reset();
+  if (chunk_size == 0) chunk_size = text.size();
+  for (size_t begin = 0; begin < text.size(); begin += chunk_size) {
+    const size_t size = std::min(chunk_size, text.size() - begin);
+    if (detector->Append(text.data() + begin, size) && stop_early) {
+      return detector->result();
+    }
+  }
+  detector->Finish();
+  return detector->result();
+}
+
+// Tests that StreamingLanguageDetector gives the same result however the input
+// is split into chunks, that it mostly agrees with FindLanguage, and that
+// Append tells the caller to stop once the result is reliable.  Returns "true"
+// if the test is successful and "false" otherwise.
+bool TestStreamingLanguageDetector() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  std::vector<std::string> texts = {"", "12345 !!!"};
+  for (size_t i = 0; i < gold_lang_text.size(); ++i) {
+    texts.push_back(gold_lang_text[i].second);
+  }
+  // A run without whitespace, longer than kMaxRunBytes.
+  std::string run;
+  for (int k = 0; k < 60; ++k) run += gold_lang_text[0].second.substr(0, 10);
+  texts.push_back(run);
+
+  auto model = std::make_shared<LanguageIdModel>();
+  NNetLanguageIdentifier lang_id(model);
+  StreamingLanguageDetector detector(model);
+  bool test_successful = true;
+  int num_different_languages = 0;
+  for (const std::string &text : texts) {
+    const NNetLanguageIdentifier::Result expected =
+        StreamText(text, /*chunk_size=*/0, /*stop_early=*/false, &detector);
+    for (size_t chunk_size : {1, 7, 64}) {
+      const NNetLanguageIdentifier::Result result =
+          StreamText(text, chunk_size, /*stop_early=*/false, &detector);
+      if (result.language != expected.language ||
+          result.probability != expected.probability ||
+          result.is_reliable != expected.is_reliable) {
+        std::cout << "  Chunks of " << chunk_size << " bytes: "
+                  << result.language << " vs " << expected.language
+                  << std::endl;
+        test_successful = false;
+      }
+    }
+    if (expected.language != lang_id.FindLanguage(text).language) {
+      ++num_different_languages;
+    }
+
+    // Once Append returns true, the result is reliable and stays so.
+    const NNetLanguageIdentifier::Result early =
+        StreamText(text, /*chunk_size=*/16, /*stop_early=*/true, &detector);
+    if (!detector.done() && !early.is_reliable) {
+      std::cout << "  Unreliable result after early stop" << std::endl;
+      test_successful = false;
+    }
+  }
+  if (num_different_languages > static_cast<int>(texts.size()) / 10) {
+    std::cout << "  " << num_different_languages
+              << " texts with a language different from FindLanguage"
+              << std::endl;
+    test_successful = false;
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests the progressive mode of FindLanguage on texts longer than
+// max_num_bytes: without an early exit, the predictions are the same as in the
+// default mode, and do not allocate memory once the scratch is warmed up, and
+// with one, they are still right.  Returns "true" if the test is successful
+// and "false" otherwise.
+bool TestEarlyExit() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  // The test texts are a few hundred bytes long, and repeating them would not
+  // help since they would be squeezed, so the snippets are made shorter.
+  auto model = std::make_shared<LanguageIdModel>();
+  const int kMinNumBytes = 0;
+  const int kMaxNumBytes = 200;
+  NNetLanguageIdentifier lang_id(model, kMinNumBytes, kMaxNumBytes);
+  NNetLanguageIdentifier full_lang_id(model, kMinNumBytes, kMaxNumBytes);
+  NNetLanguageIdentifier early_lang_id(model, kMinNumBytes, kMaxNumBytes);
+
+  // With a margin of 1, the probability never clears the threshold, so all
+  // the snippets are used.
+  full_lang_id.EnableEarlyExit(/*margin=*/1.0f);
+  early_lang_id.EnableEarlyExit(/*margin=*/0.1f);
+  bool test_successful = true;
+  int num_wrong = 0;
+  int num_wrong_early = 0;
+  InferenceScratch scratch;
+  for (const auto &lang_text : gold_lang_text) {
+    const std::string &text = lang_text.second;
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result full = full_lang_id.FindLanguage(text);
+    full_lang_id.FindLanguage(text, &scratch);
+    const int num_allocations_before = num_allocations;
+    full_lang_id.FindLanguage(text, &scratch);
+    if (num_allocations != num_allocations_before) {
+      std::cout << "  " << lang_text.first << ": "
+                << num_allocations - num_allocations_before
+                << " allocations with a warmed-up scratch" << std::endl;
+      test_successful = false;
+    }
+    const NNetLanguageIdentifier::Result early =
+        early_lang_id.FindLanguage(text);
+    if (full.language != expected.language ||
+        std::abs(full.probability - expected.probability) > 1e-5f ||
+        full.is_reliable != expected.is_reliable) {
+      std::cout << "  " << lang_text.first << ": " << full.language << " vs "
+                << expected.language << std::endl;
+      test_successful = false;
+    }
+    num_wrong += (expected.language != lang_text.first);
+    num_wrong_early += (early.language != lang_text.first);
+  }
+  if (num_wrong_early > num_wrong + 1) {
+    std::cout << "  " << num_wrong_early << " wrong predictions with early exit"
+              << " vs " << num_wrong << std::endl;
+    test_successful = false;
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests that the predictions through a ResultCache are the same as without
+// it, and that inputs that only differ in what the cleanup removes hit the
+// cache.  Returns "true" if the test is successful and "false" otherwise.
+bool TestResultCache() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  auto model = std::make_shared<LanguageIdModel>();
+  NNetLanguageIdentifier lang_id(model);
+  NNetLanguageIdentifier cached_lang_id(model);
+  ResultCache cache(/*capacity=*/1000, /*num_shards=*/0);
+  cached_lang_id.set_result_cache(&cache);
+
+  bool test_successful = true;
+  for (const auto &lang_text : gold_lang_text) {
+    const std::string &text = lang_text.second;
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    for (const std::string &input :
+         {text, "12, (" + text + ")!", text + " 2016..."}) {
+      const NNetLanguageIdentifier::Result result =
+          cached_lang_id.FindLanguage(input);
+      if (result.language != expected.language ||
+          result.probability != expected.probability ||
+          result.is_reliable != expected.is_reliable ||
+          result.proportion != expected.proportion) {
+        std::cout << "  " << lang_text.first << ": " << result.language
+                  << " vs " << expected.language << std::endl;
+        test_successful = false;
+      }
+    }
+  }
+  // The texts too short for a prediction do not reach the cache.  The others
+  // miss once and then hit twice.
+  if (cache.num_misses() == 0 ||
+      cache.num_hits() != 2 * cache.num_misses()) {
+    std::cout << "  " << cache.num_hits() << " hits, " << cache.num_misses()
+              << " misses" << std::endl;
+    test_successful = false;
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests the table of kScriptLanguages against the model, and checks that the
+// script-only fast path of FindLanguage agrees with the network on the texts
+// in these scripts with calibrated probabilities, needs enough letters, and
+// does not change the other predictions.  Returns "true" if the test is
+// successful and "false" otherwise.
+bool TestScriptFastPath() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  auto model = std::make_shared<LanguageIdModel>();
+  bool test_successful = true;
+  for (int i = 0; i < kNumScriptLanguages; ++i) {
+    const ScriptLanguage &entry = kScriptLanguages[i];
+    bool in_model = false;
+    for (int id = 0; id < model->num_languages(); ++id) {
+      in_model |= (model->GetLanguageName(id) == entry.language);
+    }
+    if (!in_model || GetScriptLanguage(entry.script) != entry.language) {
+      std::cout << "  Bad table entry: " << entry.language << std::endl;
+      test_successful = false;
+    }
+  }
+
+  NNetLanguageIdentifier lang_id(model);
+  NNetLanguageIdentifier fast_lang_id(model);
+  fast_lang_id.EnableScriptFastPath(
+      NNetLanguageIdentifier::kDefaultScriptDominanceThreshold);
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  std::vector<std::string> texts;
+  for (const auto &lang_text : gold_lang_text) {
+    texts.push_back(lang_text.second);
+  }
+
+  // Greek text with too much English for the fast path.
+  texts.push_back(std::string(NNetLangIdTestData::kTestStrEL).substr(0, 200) +
+                  " " + NNetLangIdTestData::kTestStrEN);
+  int num_fast_predictions = 0;
+  for (const std::string &text : texts) {
+    const NNetLanguageIdentifier::Result expected = lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result result =
+        fast_lang_id.FindLanguage(text);
+    bool is_script_language = false;
+    for (int i = 0; i < kNumScriptLanguages; ++i) {
+      is_script_language |= (expected.language == kScriptLanguages[i].language);
+    }
+    if (is_script_language && result.probability != expected.probability) {
+      ++num_fast_predictions;
+      // The calibrated probabilities are at least 0.98.
+      if (result.language != expected.language || !result.is_reliable ||
+          result.probability < 0.98f || result.probability > 1.0f) {
+        std::cout << "  Fast path: " << result.language << " vs "
+                  << expected.language << std::endl;
+        test_successful = false;
+      }
+    } else if (result.language != expected.language ||
+               result.probability != expected.probability) {
+      std::cout << "  Changed prediction: " << result.language << " vs "
+                << expected.language << std::endl;
+      test_successful = false;
+    }
+  }
+  if (num_fast_predictions < kNumScriptLanguages - 2) {
+    std::cout << "  Only " << num_fast_predictions << " fast predictions"
+              << std::endl;
+    test_successful = false;
+  }
+
+  // Three letters of a script are too few for the fast path, six are enough.
+  NNetLanguageIdentifier short_lang_id(model, 0, 1000);
+  NNetLanguageIdentifier short_fast_lang_id(model, 0, 1000);
+  short_fast_lang_id.EnableScriptFastPath(
+      NNetLanguageIdentifier::kDefaultScriptDominanceThreshold);
+  const NNetLanguageIdentifier::Result too_short_expected =
+      short_lang_id.FindLanguage("Ελλ");
+  const NNetLanguageIdentifier::Result too_short_result =
+      short_fast_lang_id.FindLanguage("Ελλ");
+  const NNetLanguageIdentifier::Result long_enough_result =
+      short_fast_lang_id.FindLanguage("Ελλάδα");
+  if (too_short_result.language != too_short_expected.language ||
+      too_short_result.probability != too_short_expected.probability ||
+      long_enough_result.language != "el" ||
+      long_enough_result.probability != 0.98f ||
+      !long_enough_result.is_reliable) {
+    std::cout << "  Bad fast path on short texts" << std::endl;
+    test_successful = false;
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests that the predictions restricted to a set of languages are in the set,
+// are normalized over it, and agree with the unrestricted ones on the texts
+// in these languages.
+bool TestAllowedLanguages() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  NNetLanguageIdentifier lang_id;
+  NNetLanguageIdentifier restricted_lang_id;
+  const std::vector<std::string> allowed = {"en", "es", "pt", "fr", "en"};
+  bool test_successful = !restricted_lang_id.SetAllowedLanguages({});
+  test_successful &= !restricted_lang_id.SetAllowedLanguages({"en", "xx"});
+  test_successful &= restricted_lang_id.SetAllowedLanguages(allowed);
+
+  for (const auto &lang_text : gold_lang_text) {
+    const NNetLanguageIdentifier::Result expected =
+        lang_id.FindLanguage(lang_text.second);
+    const NNetLanguageIdentifier::Result result =
+        restricted_lang_id.FindLanguage(lang_text.second);
+    bool is_consistent =
+        result.language == NNetLanguageIdentifier::kUnknown ||
+        std::find(allowed.begin(), allowed.end(), result.language) !=
+            allowed.end();
+    if (std::find(allowed.begin(), allowed.end(), expected.language) !=
+        allowed.end()) {
+      // The probability of the same class is only normalized over fewer ones.
+      is_consistent &= (result.language == expected.language) &&
+                       (result.probability >= expected.probability - 1e-6f);
+    }
+    if (!is_consistent) {
+      std::cout << "  Restricted prediction: " << result.language << " ("
+                << result.probability << ") vs " << expected.language << " ("
+                << expected.probability << ")" << std::endl;
+      test_successful = false;
+    }
+  }
+
+  // Restricting the predictions to a single language makes them certain.
+  test_successful &= restricted_lang_id.SetAllowedLanguages({"de"});
+  const NNetLanguageIdentifier::Result result =
+      restricted_lang_id.FindLanguage(NNetLangIdTestData::kTestStrFR);
+  test_successful &= (result.language == "de") && (result.probability == 1.0f);
+
+  restricted_lang_id.ClearAllowedLanguages();
+  const NNetLanguageIdentifier::Result cleared_result =
+      restricted_lang_id.FindLanguage(NNetLangIdTestData::kTestStrFR);
+  test_successful &= (cleared_result.language == "fr");
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests that the compact results are the same as the regular ones, and that,
+// once the scratch is warmed up, making them and aggregating them by language
+// does not allocate memory.
+bool TestCompactResults() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  auto model = std::make_shared<LanguageIdModel>();
+  NNetLanguageIdentifier lang_id(model, /*min_num_bytes=*/0,
+                                 /*max_num_bytes=*/1000);
+  InferenceScratch scratch;
+  bool test_successful = (model->GetLanguageId("xx") == -1);
+  for (int id = 0; id < model->num_languages(); ++id) {
+    test_successful &= (model->GetLanguageId(model->GetLanguageCode(id)) == id);
+  }
+
+  std::vector<std::string> texts = {
+      "", "This piece of text is in English. Този текст е на Български."};
+  for (const auto &lang_text : gold_lang_text) {
+    texts.push_back(lang_text.second);
+  }
+  const int kNumLangs = 3;
+  NNetLanguageIdentifier::CompactResult top_results[kNumLangs];
+  NNetLanguageIdentifier::SpanInfo byte_ranges[4];
+  for (const std::string &text : texts) {
+    const NNetLanguageIdentifier::Result expected =
+        lang_id.FindLanguage(text, &scratch);
+    const NNetLanguageIdentifier::CompactResult result =
+        lang_id.FindLanguageCompact(text.data(), text.size(), &scratch);
+    test_successful &= (expected.language == result.language) &&
+                       (expected.probability == result.probability) &&
+                       (expected.is_reliable == result.is_reliable);
+    test_successful &=
+        (result.language_id ==
+         ((expected.language == NNetLanguageIdentifier::kUnknown)
+              ? NNetLanguageIdentifier::kUnknownLanguageId
+              : model->GetLanguageId(expected.language)));
+
+    const std::vector<NNetLanguageIdentifier::Result> expected_top =
+        lang_id.FindTopNMostFreqLangs(text, kNumLangs, &scratch);
+    lang_id.FindTopNMostFreqLangsCompact(text.data(), text.size(), kNumLangs,
+                                         &scratch, top_results, byte_ranges,
+                                         /*max_num_byte_ranges=*/4);
+    for (int i = 0; i < kNumLangs; ++i) {
+      const NNetLanguageIdentifier::CompactResult &top = top_results[i];
+      test_successful &= (expected_top[i].language == top.language) &&
+                         (expected_top[i].probability == top.probability) &&
+                         (expected_top[i].proportion == top.proportion);
+      test_successful &=
+          (static_cast<int>(expected_top[i].byte_ranges.size()) ==
+           top.num_byte_ranges);
+      for (int r = 0; r < top.num_byte_ranges; ++r) {
+        test_successful &= (expected_top[i].byte_ranges[r].start_index ==
+                            top.byte_ranges[r].start_index) &&
+                           (expected_top[i].byte_ranges[r].end_index ==
+                            top.byte_ranges[r].end_index);
+      }
+    }
+
+    // The scratch is now warmed up for this text.
+    int num_allocations_before = num_allocations;
+    lang_id.FindLanguageCompact(text.data(), text.size(), &scratch);
+    if (num_allocations != num_allocations_before) {
+      std::cout << "  Language of " << top_results[0].language << " text: "
+                << num_allocations - num_allocations_before << " allocations"
+                << std::endl;
+      test_successful = false;
+    }
+    num_allocations_before = num_allocations;
+    lang_id.FindTopNMostFreqLangsCompact(text.data(), text.size(), kNumLangs,
+                                         &scratch, top_results, byte_ranges,
+                                         /*max_num_byte_ranges=*/4);
+    if (num_allocations != num_allocations_before) {
+      std::cout << "  Top languages of " << top_results[0].language
+                << " text: " << num_allocations - num_allocations_before
+                << " allocations" << std::endl;
+      test_successful = false;
+    }
+  }
+
+  // The byte ranges that do not fit in the storage are dropped.
+  const std::string text = texts[1];
+  lang_id.FindTopNMostFreqLangsCompact(text.data(), text.size(), kNumLangs,
+                                       &scratch, top_results, byte_ranges,
+                                       /*max_num_byte_ranges=*/1);
+  test_successful &= (top_results[0].num_byte_ranges == 1) &&
+                     (top_results[1].num_byte_ranges == 0) &&
+                     (top_results[1].byte_ranges == nullptr) &&
+                     (top_results[2].language_id ==
+                      NNetLanguageIdentifier::kUnknownLanguageId);
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Tests that the distributions of the languages are normalized, agree with the
+// predictions, and give the top languages, with and without a restriction on
+// the languages.
+bool TestProbabilityDistribution() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+  NNetLanguageIdentifier lang_id;
+  InferenceScratch scratch;
+  const int num_languages = lang_id.model()->num_languages();
+  std::vector<float> probabilities(num_languages);
+  const int kNumTopLanguages = 3;
+  NNetLanguageIdentifier::CompactResult top_results[kNumTopLanguages];
+  bool test_successful = true;
+  for (int restricted = 0; restricted < 2; ++restricted) {
+    if (restricted) {
+      test_successful &= lang_id.SetAllowedLanguages({"en", "fr"});
+    }
+    for (const auto &lang_text : gold_lang_text) {
+      const std::string &text = lang_text.second;
+      const NNetLanguageIdentifier::CompactResult expected =
+          lang_id.FindLanguageCompact(text.data(), text.size(), &scratch);
+      const NNetLanguageIdentifier::CompactResult result =
+          lang_id.FindLanguageDistribution(text.data(), text.size(), &scratch,
+                                           probabilities.data());
+      const int num_top_languages = lang_id.FindTopKLanguages(
+          text.data(), text.size(), kNumTopLanguages, &scratch, top_results);
+      test_successful &= (result.language_id == expected.language_id) &&
+                         (result.probability == expected.probability);
+      if (expected.language_id == NNetLanguageIdentifier::kUnknownLanguageId) {
+        test_successful &= (num_top_languages == 0);
+        for (float probability : probabilities) {
+          test_successful &= (probability == 0.0f);
+        }
+        continue;
+      }
+
+      float sum = 0.0f;
+      int num_nonzero = 0;
+      for (float probability : probabilities) {
+        sum += probability;
+        if (probability > 0.0f) ++num_nonzero;
+      }
+      test_successful &= (std::abs(sum - 1.0f) < 1e-4f);
+      test_successful &= (probabilities[result.language_id] ==
+                          result.probability);
+      test_successful &=
+          (std::max_element(probabilities.begin(), probabilities.end()) -
+           probabilities.begin()) == result.language_id;
+      test_successful &= !restricted || num_nonzero <= 2;
+
+      test_successful &= (num_top_languages ==
+                          (restricted ? 2 : kNumTopLanguages));
+      test_successful &= (top_results[0].language_id == result.language_id);
+      for (int i = 0; i < num_top_languages; ++i) {
+        test_successful &= (top_results[i].probability ==
+                            probabilities[top_results[i].language_id]);
+        test_successful &= (i == 0 || top_results[i].probability <=
+                                          top_results[i - 1].probability);
+      }
+    }
+  }
+  if (test_successful) {
+    std::cout << "  Success!" << std::endl;
+  } else {
+    std::cout << "  Failure" << std::endl;
+  }
+  return test_successful;
+}
+
+// Compares the predictions of the model with int8 hidden and softmax layers
+// (see Int8QuantizedNNParams) to the ones of the float model, on the same data
+// as TestPredictions.  Returns "true" if the int8 model gets right every text
+// that the float model gets right, and "false" otherwise.
+bool TestInt8Predictions() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::pair<std::string, std::string>> gold_lang_text =
+      GetGoldLangText();
+
+  LangIdNNParams float_params;
+  Int8QuantizedNNParams int8_params(&float_params);
+  NNetLanguageIdentifier float_lang_id(/*min_num_bytes=*/0,
+                                       /*max_num_bytes=*/1000);
+  NNetLanguageIdentifier int8_lang_id(/*min_num_bytes=*/0,
+                                      /*max_num_bytes=*/1000, &int8_params);
+
+  int num_float_correct = 0;
+  int num_int8_correct = 0;
+  int num_agreements = 0;
+  int num_regressions = 0;
+  float max_probability_diff = 0.0f;
+  for (const auto &test_instance : gold_lang_text) {
+    const std::string &expected_lang = test_instance.first;
+    const std::string &text = test_instance.second;
+
+    const NNetLanguageIdentifier::Result float_result =
+        float_lang_id.FindLanguage(text);
+    const NNetLanguageIdentifier::Result int8_result =
+        int8_lang_id.FindLanguage(text);
+    const bool float_correct = (float_result.language == expected_lang);
+    const bool int8_correct = (int8_result.language == expected_lang);
+    num_float_correct += float_correct ? 1 : 0;
+    num_int8_correct += int8_correct ? 1 : 0;
+    if (float_result.language == int8_result.language) {
+      ++num_agreements;
+      const float probability_diff =
+          std::abs(float_result.probability - int8_result.probability);
+      max_probability_diff = std::max(max_probability_diff, probability_diff);
+    }
+    if (float_correct && !int8_correct) {
+      ++num_regressions;
+      std::cout << "  Regression: expected language: " << expected_lang
+                << ", int8 prediction: " << int8_result.language << std::endl;
+    }
+  }
+
+  std::cout << "  Float accuracy: " << num_float_correct << "/"
+            << gold_lang_text.size() << ", int8 accuracy: " << num_int8_correct
+            << "/" << gold_lang_text.size() << ", agreement: "
+            << num_agreements << "/" << gold_lang_text.size()
+            << ", max probability difference: " << max_probability_diff
+            << std::endl;
+  std::cout << "  Hidden and softmax weights: "
+            << int8_params.source_size_in_bytes() << " bytes (float), "
+            << int8_params.quantized_size_in_bytes() << " bytes (int8)"
+            << std::endl;
+  if (num_regressions == 0) {
+    std::cout << "  Success!" << std::endl;
+    return true;
+  } else {
+    std::cout << "  Failure: " << num_regressions << " regressions"
+              << std::endl;
+    return false;
+  }
+}
+
 }  // namespace nnet_lang_id_test
 }  // namespace chrome_lang_id
 
@@ -249,6 +1168,20 @@ bool TestMultipleLanguagesInInput() {
 int main(int argc, char **argv) {
   const bool tests_successful =
       chrome_lang_id::nnet_lang_id_test::TestPredictions() &&
-      chrome_lang_id::nnet_lang_id_test::TestMultipleLanguagesInInput();
+      chrome_lang_id::nnet_lang_id_test::TestMultipleLanguagesInInput() &&
+      chrome_lang_id::nnet_lang_id_test::TestInferenceScratch() &&
+      chrome_lang_id::nnet_lang_id_test::TestFindLanguageOfCharBuffer() &&
+      chrome_lang_id::nnet_lang_id_test::TestSharedModelAcrossThreads() &&
+      chrome_lang_id::nnet_lang_id_test::TestClone() &&
+      chrome_lang_id::nnet_lang_id_test::TestFindLanguageBatch() &&
+      chrome_lang_id::nnet_lang_id_test::TestFindTopNWithCollectedSpans() &&
+      chrome_lang_id::nnet_lang_id_test::TestStreamingLanguageDetector() &&
+      chrome_lang_id::nnet_lang_id_test::TestEarlyExit() &&
+      chrome_lang_id::nnet_lang_id_test::TestResultCache() &&
+      chrome_lang_id::nnet_lang_id_test::TestScriptFastPath() &&
+      chrome_lang_id::nnet_lang_id_test::TestAllowedLanguages() &&
+      chrome_lang_id::nnet_lang_id_test::TestCompactResults() &&
+      chrome_lang_id::nnet_lang_id_test::TestProbabilityDistribution() &&
+      chrome_lang_id::nnet_lang_id_test::TestInt8Predictions();
   return tests_successful ? 0 : 1;
 }
@@ -16,21 +16,26 @@ limitations under the License.
 #include "nnet_language_identifier.h"
 
 #include <math.h>
+#include <string.h>
 
 #include <algorithm>
 #include <limits>
+#include <memory>
+#include <numeric>
 #include <string>
+#include <unordered_map>
+#include <utility>
 
 #include "base.h"
 #include "embedding_network.h"
-#include "registry.h"
-#include "relevant_script_feature.h"
+#include "script_languages.h"
 #include "script_span/generated_ulscript.h"
 #include "script_span/getonescriptspan.h"
 #include "script_span/text_processing.h"
 #include "cld_3/protos/sentence.pb.h"
 #include "sentence_features.h"
 #include "task_context.h"
+#include "unicodetext.h"
 #include "workspace.h"
 
 namespace chrome_lang_id {
@@ -62,29 +67,151 @@ bool OrderBySecondDescending(const std::pair<string, float> &x,
   }
 }
 
+// Returns the probability above which a prediction of language is reliable.
+float ReliabilityThreshold(const char *language) {
+  if (strcmp(language, "hr") == 0 || strcmp(language, "bs") == 0) {
+    return NNetLanguageIdentifier::kReliabilityHrBsThreshold;
+  } else {
+    return NNetLanguageIdentifier::kReliabilityThreshold;
+  }
+}
+
 // Returns "true" if the languge prediction is reliable based on the
 // probability, and "false" otherwise.
-bool ResultIsReliable(const string &language, float probability) {
-  if (language == "hr" || language == "bs") {
-    return (probability >= NNetLanguageIdentifier::kReliabilityHrBsThreshold);
-  } else {
-    return (probability >= NNetLanguageIdentifier::kReliabilityThreshold);
+bool ResultIsReliable(const char *language, float probability) {
+  return (probability >= ReliabilityThreshold(language));
+}
+
+// Probability of a script-only prediction for text with at least
+// min_num_letters letters in the script of its language: the mean probability
+// that the network gives that language for the texts of nnet_lang_id_test in
+// the scripts of kScriptLanguages, mixed with Latin text down to
+// kMinScriptDominanceThreshold.  Below the smallest min_num_letters, the
+// network often predicts another language, so there is no fast path.
+struct ScriptFastPathProbability {
+  int min_num_letters;
+  float probability;
+};
+const ScriptFastPathProbability kScriptFastPathProbabilities[] = {
+    {40, 0.9999f}, {20, 0.999f}, {10, 0.998f}, {4, 0.98f},
+};
+
+// Returns the probability of a script-only prediction for text with
+// num_letters letters in the script of the language, or 0 if the text is too
+// short for the fast path.
+float GetScriptFastPathProbability(int num_letters) {
+  for (const ScriptFastPathProbability &entry : kScriptFastPathProbabilities) {
+    if (num_letters >= entry.min_num_letters) return entry.probability;
+  }
+  return 0.0f;
+}
+
+// Returns the Result with the same information as compact_result.
+NNetLanguageIdentifier::Result ToResult(
+    const NNetLanguageIdentifier::CompactResult &compact_result) {
+  NNetLanguageIdentifier::Result result;
+  result.language = compact_result.language;
+  result.probability = compact_result.probability;
+  result.is_reliable = compact_result.is_reliable;
+  result.proportion = compact_result.proportion;
+  result.byte_ranges.assign(
+      compact_result.byte_ranges,
+      compact_result.byte_ranges + compact_result.num_byte_ranges);
+  return result;
+}
+
+// Adds the prediction for a span of num_original_span_bytes bytes, at
+// [start_index, end_index) in the input, to the stats of its language.
+void AddSpanPrediction(
+    const string &language, float probability, int num_original_span_bytes,
+    int start_index, int end_index,
+    std::unordered_map<string, LangChunksStats> *lang_stats) {
+  LangChunksStats &stats = (*lang_stats)[language];
+  stats.byte_sum += num_original_span_bytes;
+  stats.prob_sum += probability * num_original_span_bytes;
+  stats.num_chunks++;
+  // Add SpanInfo. Start and end indices are relative to original input.
+  stats.byte_ranges.push_back(
+      NNetLanguageIdentifier::SpanInfo(start_index, end_index, probability));
+}
+
+// Returns the num_langs languages with the most bytes in lang_stats, padded
+// with unknown results if there are fewer languages.  total_num_bytes is the
+// number of bytes of all the spans.
+std::vector<NNetLanguageIdentifier::Result> GetTopNResults(
+    const std::unordered_map<string, LangChunksStats> &lang_stats,
+    int total_num_bytes, int num_langs) {
+  // Sort the languages based on the number of bytes associated with them.
+  // TODO(abakalov): Consider alternative possibly more efficient portable
+  // approaches for finding the top N languages. Given that on average, there
+  // aren't that many languages in the input, it's likely that the benefits will
+  // be negligible (if any).
+  std::vector<std::pair<string, float>> langs_and_byte_counts;
+  for (const auto &entry : lang_stats) {
+    langs_and_byte_counts.emplace_back(entry.first, entry.second.byte_sum);
+  }
+  std::sort(langs_and_byte_counts.begin(), langs_and_byte_counts.end(),
+            OrderBySecondDescending);
+
+  std::vector<NNetLanguageIdentifier::Result> results;
+  const float byte_sum = static_cast<float>(total_num_bytes);
+  const int num_langs_to_save =
+      std::min(num_langs, static_cast<int>(langs_and_byte_counts.size()));
+  for (int indx = 0; indx < num_langs_to_save; ++indx) {
+    NNetLanguageIdentifier::Result result;
+    const string &language = langs_and_byte_counts.at(indx).first;
+    const LangChunksStats &stats = lang_stats.at(language);
+    result.language = language;
+    result.probability = stats.prob_sum / stats.byte_sum;
+    result.proportion = stats.byte_sum / byte_sum;
+    result.is_reliable = ResultIsReliable(language.c_str(), result.probability);
+    result.byte_ranges = stats.byte_ranges;
+    results.push_back(result);
+  }
+
+  int padding_size = num_langs - langs_and_byte_counts.size();
+  while (padding_size-- > 0) {
+    results.emplace_back();
+  }
+  return results;
+}
+
+// Adds the number of letters of script_span, i.e., of its chars other than
+// spaces, to letter_counts[script], where script is the ULScript of the span,
+// or kHangulScript for the letters in Hangul of a ULScript_Hani span.
+void CountLettersByScript(const CLD2::LangSpan &script_span,
+                          int *letter_counts) {
+  if (script_span.ulscript != CLD2::ULScript_Hani) {
+    int num_letters = 0;
+    for (int i = 0; i < script_span.text_bytes; ++i) {
+      const char c = script_span.text[i];
+      if (c != ' ' && (c & 0xC0) != 0x80) ++num_letters;
+    }
+    letter_counts[script_span.ulscript] += num_letters;
+    return;
+  }
+  UnicodeText unicode_text;
+  unicode_text.PointToUTF8(script_span.text, script_span.text_bytes);
+  for (char32 codepoint : unicode_text) {
+    if (codepoint == 0x20) continue;
+    ++letter_counts[IsHangul(codepoint) ? kHangulScript
+                                        : CLD2::ULScript_Hani];
   }
 }
 
 // Finds the number of interchange-valid bytes to process.
-int FindNumValidBytesToProcess(const string &text) {
+int FindNumValidBytesToProcess(const char *text, size_t text_size) {
   // Check if the size of the input text can fit into an int. If not, focus on
   // the first std::numeric_limits<int>::max() bytes.
   const int doc_text_size =
-      (text.size() < static_cast<size_t>(std::numeric_limits<int>::max()))
-          ? static_cast<int>(text.size())
+      (text_size < static_cast<size_t>(std::numeric_limits<int>::max()))
+          ? static_cast<int>(text_size)
           : std::numeric_limits<int>::max();
 
   // Truncate the input text if it is too long and find the span containing
   // interchange-valid UTF8.
   const int num_valid_bytes = CLD2::SpanInterchangeValid(
-      text.c_str(),
+      text,
       std::min(NNetLanguageIdentifier::kMaxNumInputBytesToConsider,
                doc_text_size));
 
@@ -97,152 +224,414 @@ const int NNetLanguageIdentifier::kMaxNumBytesToConsider = 700;
 const int NNetLanguageIdentifier::kMaxNumInputBytesToConsider = 10000;
 const int NNetLanguageIdentifier::kNumSnippets = 5;
 const char NNetLanguageIdentifier::kUnknown[] = "und";
+const uint16 NNetLanguageIdentifier::kUnknownLanguageId = 0xFFFF;
 const float NNetLanguageIdentifier::kReliabilityThreshold = 0.7f;
 const float NNetLanguageIdentifier::kReliabilityHrBsThreshold = 0.5f;
+const float NNetLanguageIdentifier::kDefaultScriptDominanceThreshold = 0.9f;
+const float NNetLanguageIdentifier::kMinScriptDominanceThreshold = 0.8f;
 
-const string LanguageIdEmbeddingFeatureExtractor::ArgPrefix() const {
-  return "language_identifier";
-}
+InferenceScratch::InferenceScratch()
+    : script_scanner_(nullptr, 0, /*is_plain_text=*/true) {}
+
+InferenceScratch::~InferenceScratch() {}
 
 NNetLanguageIdentifier::NNetLanguageIdentifier()
     : NNetLanguageIdentifier(kMinNumBytesToConsider, kMaxNumBytesToConsider) {}
 
-static WholeSentenceFeature *cbog_factory() {
-  return new ContinuousBagOfNgramsFunction;
-}
-
-static WholeSentenceFeature *rsf_factory() { return new RelevantScriptFeature; }
-
-static WholeSentenceFeature *sf_factory() { return new ScriptFeature; }
-
 NNetLanguageIdentifier::NNetLanguageIdentifier(int min_num_bytes,
                                                int max_num_bytes)
-    : num_languages_(TaskContextParams::GetNumLanguages()),
-      network_(&nn_params_),
+    : NNetLanguageIdentifier(min_num_bytes, max_num_bytes,
+                             /*nn_params=*/nullptr) {}
+
+NNetLanguageIdentifier::NNetLanguageIdentifier(
+    int min_num_bytes, int max_num_bytes,
+    const EmbeddingNetworkParams *nn_params)
+    : NNetLanguageIdentifier(
+          (nn_params != nullptr) ? std::make_shared<LanguageIdModel>(nn_params)
+                                 : LanguageIdModel::BuiltIn(),
+          min_num_bytes, max_num_bytes) {}
+
+NNetLanguageIdentifier::NNetLanguageIdentifier(
+    std::shared_ptr<const LanguageIdModel> model)
+    : NNetLanguageIdentifier(std::move(model), kMinNumBytesToConsider,
+                             kMaxNumBytesToConsider) {}
+
+NNetLanguageIdentifier::NNetLanguageIdentifier(
+    std::shared_ptr<const LanguageIdModel> model, int min_num_bytes,
+    int max_num_bytes)
+    : model_(std::move(model)),
       min_num_bytes_(min_num_bytes),
       max_num_bytes_(max_num_bytes) {
+  CLD3_CHECK(model_ != nullptr);
   CLD3_CHECK(max_num_bytes_ > 0);
   CLD3_CHECK(min_num_bytes_ >= 0);
   CLD3_CHECK(min_num_bytes_ < max_num_bytes_);
 
   num_snippets_ = (max_num_bytes_ <= kNumSnippets) ? 1 : kNumSnippets;
   snippet_size_ = max_num_bytes_ / num_snippets_;
+}
+
+NNetLanguageIdentifier::~NNetLanguageIdentifier() {}
+
+std::unique_ptr<NNetLanguageIdentifier> NNetLanguageIdentifier::Clone() const {
+  std::unique_ptr<NNetLanguageIdentifier> clone(
+      new NNetLanguageIdentifier(model_, min_num_bytes_, max_num_bytes_));
+  clone->allowed_classes_ = allowed_classes_;
+  clone->script_dominance_threshold_ = script_dominance_threshold_;
+  clone->result_cache_ = result_cache_;
+  clone->early_exit_margin_ = early_exit_margin_;
+  return clone;
+}
 
-  if (WholeSentenceFeature::registry() == nullptr) {
-    // Create registry for our WholeSentenceFeature(s).
-    RegisterableClass<WholeSentenceFeature>::CreateRegistry(
-        "sentence feature function", "WholeSentenceFeature", __FILE__,
-        __LINE__);
+bool NNetLanguageIdentifier::SetAllowedLanguages(
+    const std::vector<string> &languages) {
+  std::vector<int> classes;
+  for (const string &language : languages) {
+    const int language_id = model_->GetLanguageId(language);
+    if (language_id < 0) return false;
+    if (std::find(classes.begin(), classes.end(), language_id) ==
+        classes.end()) {
+      classes.push_back(language_id);
+    }
   }
+  if (classes.empty()) return false;
+  allowed_classes_ = std::make_shared<EmbeddingNetwork::OutputSubset>(
+      model_->network(), classes);
+  return true;
+}
 
-  // Register our WholeSentenceFeature(s).
-  // Register ContinuousBagOfNgramsFunction feature function.
-  static WholeSentenceFeature::Registry::Registrar cbog_registrar(
-      WholeSentenceFeature::registry(), "continuous-bag-of-ngrams",
-      "ContinuousBagOfNgramsFunction", __FILE__, __LINE__, cbog_factory);
+int NNetLanguageIdentifier::NumOutputClasses() const {
+  return (allowed_classes_ != nullptr) ? allowed_classes_->size()
+                                       : model_->network().num_classes();
+}
 
-  // Register RelevantScriptFeature feature function.
-  static WholeSentenceFeature::Registry::Registrar rsf_registrar(
-      WholeSentenceFeature::registry(), "continuous-bag-of-relevant-scripts",
-      "RelevantScriptFeature", __FILE__, __LINE__, rsf_factory);
+bool NNetLanguageIdentifier::EnableScriptFastPath(float dominance_threshold) {
+  CLD3_CHECK(dominance_threshold >= kMinScriptDominanceThreshold);
+  CLD3_CHECK(dominance_threshold <= 1.0f);
+  if (!model_->has_built_in_languages()) return false;
+  script_dominance_threshold_ = dominance_threshold;
+  return true;
+}
 
-  // Register ScriptFeature feature function.
-  static WholeSentenceFeature::Registry::Registrar sf_registrar(
-      WholeSentenceFeature::registry(), "script", "ScriptFeature", __FILE__,
-      __LINE__, sf_factory);
+void NNetLanguageIdentifier::EnableEarlyExit(float margin) {
+  CLD3_CHECK(margin >= 0.0f);
+  early_exit_margin_ = margin;
+}
 
-  // Get the model parameters, set up and initialize the model.
-  TaskContext context;
-  TaskContextParams::ToTaskContext(&context);
-  Setup(&context);
-  Init(&context);
+NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguage(
+    const string &text) {
+  return FindLanguage(text.data(), text.size(), &scratch_);
 }
 
-NNetLanguageIdentifier::~NNetLanguageIdentifier() {}
+NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguage(
+    const string &text, InferenceScratch *scratch) const {
+  return FindLanguage(text.data(), text.size(), scratch);
+}
 
-void NNetLanguageIdentifier::Setup(TaskContext *context) {
-  feature_extractor_.Setup(context);
+NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguage(
+    const char *text, size_t text_size) {
+  return FindLanguage(text, text_size, &scratch_);
 }
 
-void NNetLanguageIdentifier::Init(TaskContext *context) {
-  feature_extractor_.Init(context);
-  feature_extractor_.RequestWorkspaces(&workspace_registry_);
+NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguage(
+    const char *text, size_t text_size, InferenceScratch *scratch) const {
+  return ToResult(FindLanguageCompact(text, text_size, scratch));
 }
 
-void NNetLanguageIdentifier::GetFeatures(
-    Sentence *sentence, std::vector<FeatureVector> *features) const {
-  // Feature workspace set.
-  WorkspaceSet workspace;
-  workspace.Reset(workspace_registry_);
-  feature_extractor_.Preprocess(&workspace, sentence);
-  feature_extractor_.ExtractFeatures(workspace, *sentence, features);
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::FindLanguageCompact(const char *text, size_t text_size,
+                                            InferenceScratch *scratch) const {
+  return FindLanguageAndProbabilities(text, text_size, scratch,
+                                      /*probabilities=*/nullptr);
 }
 
-// Returns the language name corresponding to the given id.
-string NNetLanguageIdentifier::GetLanguageName(int language_id) const {
-  CLD3_CHECK(language_id >= 0);
-  CLD3_CHECK(language_id < num_languages_);
-  return TaskContextParams::language_names(language_id);
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::FindLanguageDistribution(const char *text,
+                                                 size_t text_size,
+                                                 InferenceScratch *scratch,
+                                                 float *probabilities) const {
+  CLD3_CHECK(probabilities != nullptr);
+  return FindLanguageAndProbabilities(text, text_size, scratch, probabilities);
 }
 
-NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguage(
-    const string &text) {
-  const int num_valid_bytes = FindNumValidBytesToProcess(text);
+int NNetLanguageIdentifier::FindTopKLanguages(const char *text,
+                                              size_t text_size, int k,
+                                              InferenceScratch *scratch,
+                                              CompactResult *results) const {
+  std::vector<float> &probabilities = scratch->probabilities_;
+  probabilities.resize(model_->num_languages());
+  const CompactResult result = FindLanguageAndProbabilities(
+      text, text_size, scratch, probabilities.data());
+  if (result.language_id == kUnknownLanguageId || k <= 0) return 0;
+
+  std::vector<int> &language_order = scratch->language_order_;
+  language_order.resize(NumOutputClasses());
+  for (size_t i = 0; i < language_order.size(); ++i) {
+    language_order[i] = (allowed_classes_ != nullptr)
+                            ? allowed_classes_->class_id(i)
+                            : static_cast<int>(i);
+  }
+  const int num_results =
+      std::min(k, static_cast<int>(language_order.size()));
+  std::partial_sort(language_order.begin(),
+                    language_order.begin() + num_results,
+                    language_order.end(), [&probabilities](int x, int y) {
+                      if (probabilities[x] == probabilities[y]) return x < y;
+                      return probabilities[x] > probabilities[y];
+                    });
+  for (int i = 0; i < num_results; ++i) {
+    CompactResult &top_result = results[i];
+    top_result = CompactResult();
+    top_result.language_id = language_order[i];
+    top_result.language = model_->GetLanguageCode(language_order[i]);
+    top_result.probability = probabilities[language_order[i]];
+    top_result.is_reliable =
+        ResultIsReliable(top_result.language, top_result.probability);
+    top_result.proportion = 1.0;
+  }
+  return num_results;
+}
+
+CLD2::ULScript NNetLanguageIdentifier::CleanUpText(const char *text,
+                                                   size_t text_size,
+                                                   InferenceScratch *scratch,
+                                                   int *letter_counts) const {
+  const int num_valid_bytes = FindNumValidBytesToProcess(text, text_size);
 
   // Iterate over the input with ScriptScanner to clean up the text (e.g.,
   // removing digits, punctuation, brackets).
   // TODO(abakalov): Extract the code that does the clean-up out of
   // ScriptScanner.
-  CLD2::ScriptScanner ss(text.c_str(), num_valid_bytes, /*is_plain_text=*/true);
+  CLD2::ScriptScanner &ss = scratch->script_scanner_;
+  ss.Reset(text, num_valid_bytes);
   CLD2::LangSpan script_span;
-  string cleaned;
+  string &cleaned = scratch->cleaned_text_;
+  cleaned.clear();
+
+  // Script of all the spans, or UNKNOWN_ULSCRIPT if they are in different
+  // scripts.
+  CLD2::ULScript ulscript = CLD2::UNKNOWN_ULSCRIPT;
+  bool first_span = true;
   while (ss.GetOneScriptSpanLower(&script_span)) {
     // script_span has spaces at the beginning and the end, so there is no need
     // for a delimiter.
     cleaned.append(script_span.text, script_span.text_bytes);
+    if (letter_counts != nullptr) {
+      CountLettersByScript(script_span, letter_counts);
+    }
+    if (first_span) {
+      ulscript = script_span.ulscript;
+      first_span = false;
+    } else if (script_span.ulscript != ulscript) {
+      ulscript = CLD2::UNKNOWN_ULSCRIPT;
+    }
   }
+  return ulscript;
+}
 
-  if (static_cast<int>(cleaned.size()) < min_num_bytes_) {
-    return Result();
+void NNetLanguageIdentifier::ExtractFeatures(
+    const char *text, size_t text_size, InferenceScratch *scratch,
+    std::vector<FeatureVector> *features) const {
+  const CLD2::ULScript ulscript =
+      CleanUpText(text, text_size, scratch, /*letter_counts=*/nullptr);
+  string &cleaned = scratch->cleaned_text_;
+  int new_length = 0;
+  if (static_cast<int>(cleaned.size()) >= min_num_bytes_) {
+    const int chunk_size = 0;  // Use the default.
+    new_length = CLD2::CheapSqueezeInplace(&cleaned[0], cleaned.size(),
+                                           chunk_size);
+  }
+  if (new_length < min_num_bytes_ || new_length == 0) {
+    *features = std::vector<FeatureVector>(model_->NumEmbeddings());
+    return;
   }
+  ExtractFeaturesOfValidUTF8(cleaned.data(), new_length, ulscript, scratch,
+                             features);
+}
 
-  // Copy to a vector because a non-const char* will be needed.
-  std::vector<char> text_to_process;
-  for (size_t i = 0; i < cleaned.size(); ++i) {
-    text_to_process.push_back(cleaned[i]);
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::FindLanguageAndProbabilities(
+    const char *text, size_t text_size, InferenceScratch *scratch,
+    float *probabilities) const {
+  if (probabilities != nullptr) {
+    std::fill(probabilities, probabilities + model_->num_languages(), 0.0f);
+  }
+  // Number of letters in each script, for the script-only fast path.
+  const bool use_script_fast_path =
+      script_dominance_threshold_ > 0.0f && probabilities == nullptr;
+  int letter_counts[kHangulScript + 1];
+  if (use_script_fast_path) {
+    std::fill(letter_counts, letter_counts + kHangulScript + 1, 0);
+  }
+  const CLD2::ULScript ulscript = CleanUpText(
+      text, text_size, scratch, use_script_fast_path ? letter_counts : nullptr);
+  string &cleaned = scratch->cleaned_text_;
+  if (static_cast<int>(cleaned.size()) < min_num_bytes_) {
+    return CompactResult();
+  }
+  if (use_script_fast_path) {
+    const int *max_count =
+        std::max_element(letter_counts, letter_counts + kHangulScript + 1);
+    const int num_letters =
+        std::accumulate(letter_counts, letter_counts + kHangulScript + 1, 0);
+    const char *language = GetScriptLanguage(max_count - letter_counts);
+    const int language_id =
+        (language != nullptr) ? model_->GetLanguageId(language) : -1;
+    const float dominance =
+        (num_letters > 0) ? static_cast<float>(*max_count) / num_letters : 0.0f;
+    const float probability = GetScriptFastPathProbability(*max_count);
+    if (language_id >= 0 && dominance >= script_dominance_threshold_ &&
+        probability > 0.0f &&
+        (allowed_classes_ == nullptr ||
+         allowed_classes_->Contains(language_id))) {
+      CompactResult result;
+      result.language_id = language_id;
+      result.language = model_->GetLanguageCode(language_id);
+      result.probability = probability;
+      result.is_reliable = ResultIsReliable(result.language, probability);
+      result.proportion = 1.0;
+      return result;
+    }
   }
-  text_to_process.push_back('\0');
 
-  // Remove repetitive chunks or ones containing mostly spaces.
+  // Remove repetitive chunks or ones containing mostly spaces.  The squeezing
+  // is done in place; it may look at the null terminator of cleaned.
   const int chunk_size = 0;  // Use the default.
-  char *text_begin = &text_to_process[0];
-  const int new_length = CLD2::CheapSqueezeInplace(
-      text_begin, text_to_process.size() - 1, chunk_size);
+  char *text_begin = &cleaned[0];
+  const int new_length =
+      CLD2::CheapSqueezeInplace(text_begin, cleaned.size(), chunk_size);
   if (new_length < min_num_bytes_) {
-    return Result();
+    return CompactResult();
+  }
+  if (probabilities == nullptr) {
+    return FindLanguageOfValidUTF8(text_begin, new_length, ulscript, scratch);
+  }
+  const CompactResult result =
+      ComputeLanguageOfValidUTF8(text_begin, new_length, ulscript, scratch);
+  GetProbabilitiesFromScores(scratch->scores_.data(), probabilities);
+  return result;
+}
+
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::FindLanguageOfValidUTF8(
+    const char *text, int text_size, CLD2::ULScript ulscript,
+    InferenceScratch *scratch) const {
+  // The restricted predictions are not cached, so that sessions with and
+  // without a restriction can share a cache.
+  if (result_cache_ == nullptr || allowed_classes_ != nullptr) {
+    return ComputeLanguageOfValidUTF8(text, text_size, ulscript, scratch);
   }
 
-  const string squeezed_text_to_process =
-      SelectTextGivenBeginAndSize(text_begin, new_length);
-  return FindLanguageOfValidUTF8(squeezed_text_to_process);
+  // The script is part of the key, since it changes the features.
+  const uint64 key = ResultCache::HashText(text, text_size, ulscript);
+  ResultCache::Value value;
+  CompactResult result;
+  if (result_cache_->Lookup(key, &value)) {
+    if (value.language_id < model_->num_languages()) {
+      result.language_id = value.language_id;
+      result.language = model_->GetLanguageCode(value.language_id);
+      result.probability = value.probability;
+      result.is_reliable = value.is_reliable;
+      result.proportion = 1.0;
+      return result;
+    }
+  }
+  result = ComputeLanguageOfValidUTF8(text, text_size, ulscript, scratch);
+  value.language_id = result.language_id;
+  value.probability = result.probability;
+  value.is_reliable = result.is_reliable;
+  result_cache_->Insert(key, value);
+  return result;
 }
 
-NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguageOfValidUTF8(
-    const string &text) {
-  // Create a Sentence storing the input text.
-  Sentence sentence;
-  sentence.set_text(text);
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::ComputeLanguageOfValidUTF8(
+    const char *text, int text_size, CLD2::ULScript ulscript,
+    InferenceScratch *scratch) const {
+  if (early_exit_margin_ >= 0.0f && text_size > max_num_bytes_) {
+    return FindLanguageOfSnippets(text, text_size, ulscript, scratch);
+  }
+
+  std::vector<FeatureVector> &features = scratch->features_;
+  ExtractFeaturesOfValidUTF8(text, text_size, ulscript, scratch, &features);
 
   // Predict language.
-  // TODO(salcianu): reuse vector<FeatureVector>.
-  std::vector<FeatureVector> features(feature_extractor_.NumEmbeddings());
-  GetFeatures(&sentence, &features);
+  EmbeddingNetwork::Vector &scores = scratch->scores_;
+  model_->network().ComputeFinalScores(features, &scratch->network_scratch_,
+                                       allowed_classes_.get(), &scores);
+  return GetCompactResultFromScores(scores.data());
+}
+
+void NNetLanguageIdentifier::ExtractFeaturesOfValidUTF8(
+    const char *text, int text_size, CLD2::ULScript ulscript,
+    InferenceScratch *scratch, std::vector<FeatureVector> *features) const {
+  // Store the selected text in the Sentence.
+  std::vector<StringPiece> &snippets = scratch->snippets_;
+  SelectSnippets(text, text_size, &snippets);
+  Sentence &sentence = scratch->sentence_;
+  string *sentence_text = sentence.mutable_text();
+  if (text_size <= max_num_bytes_) {
+    sentence_text->assign(snippets[0].data(), snippets[0].size());
+  } else {
+    sentence_text->clear();
+    for (const StringPiece &snippet : snippets) {
+      sentence_text->append(snippet.data(), snippet.size());
+      sentence_text->append(" ");
+    }
+  }
+
+  if (static_cast<int>(features->size()) != model_->NumEmbeddings()) {
+    *features = std::vector<FeatureVector>(model_->NumEmbeddings());
+  }
+  model_->GetFeatures(&sentence, ulscript, &scratch->workspaces_, features);
+}
+
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::FindLanguageOfSnippets(
+    const char *text, int text_size, CLD2::ULScript ulscript,
+    InferenceScratch *scratch) const {
+  std::vector<StringPiece> &snippets = scratch->snippets_;
+  SelectSnippets(text, text_size, &snippets);
+  std::vector<FeatureVector> &features = scratch->features_;
+  if (static_cast<int>(features.size()) != model_->NumEmbeddings()) {
+    features = std::vector<FeatureVector>(model_->NumEmbeddings());
+  }
+
+  // The sentence grows by one snippet, followed by a space, at each step, so
+  // the feature functions only count the new snippet.
+  Sentence &sentence = scratch->sentence_;
+  string *sentence_text = sentence.mutable_text();
+  sentence_text->clear();
+  model_->ResetRunningFeatures(&scratch->workspaces_);
+  CompactResult result;
+  for (const StringPiece &snippet : snippets) {
+    sentence_text->append(snippet.data(), snippet.size());
+    sentence_text->append(" ");
+    model_->UpdateRunningFeatures(&sentence, ulscript, &scratch->workspaces_,
+                                  &features);
+    EmbeddingNetwork::Vector &scores = scratch->scores_;
+    model_->network().ComputeFinalScores(features, &scratch->network_scratch_,
+                                         allowed_classes_.get(), &scores);
+    result = GetCompactResultFromScores(scores.data());
+    if (result.probability >=
+        ReliabilityThreshold(result.language) + early_exit_margin_) {
+      break;
+    }
+  }
+  return result;
+}
+
+NNetLanguageIdentifier::Result NNetLanguageIdentifier::GetResultFromScores(
+    const float *scores) const {
+  return ToResult(GetCompactResultFromScores(scores));
+}
 
-  EmbeddingNetwork::Vector scores;
-  network_.ComputeFinalScores(features, &scores);
+NNetLanguageIdentifier::CompactResult
+NNetLanguageIdentifier::GetCompactResultFromScores(const float *scores) const {
+  const int num_classes = NumOutputClasses();
   int prediction_id = -1;
   float max_val = -std::numeric_limits<float>::infinity();
-  for (size_t i = 0; i < scores.size(); ++i) {
+  for (int i = 0; i < num_classes; ++i) {
     if (scores[i] > max_val) {
       prediction_id = i;
       max_val = scores[i];
@@ -250,28 +639,88 @@ NNetLanguageIdentifier::Result NNetLanguageIdentifier::FindLanguageOfValidUTF8(
   }
 
   // Compute probability.
-  Result result;
+  CompactResult result;
   float diff_sum = 0.0;
-  for (size_t i = 0; i < scores.size(); ++i) {
+  for (int i = 0; i < num_classes; ++i) {
     diff_sum += exp(scores[i] - max_val);
   }
   const float log_sum_exp = max_val + log(diff_sum);
   result.probability = exp(max_val - log_sum_exp);
 
-  result.language = GetLanguageName(prediction_id);
+  if (allowed_classes_ != nullptr) {
+    prediction_id = allowed_classes_->class_id(prediction_id);
+  }
+  result.language_id = prediction_id;
+  result.language = model_->GetLanguageCode(prediction_id);
   result.is_reliable = ResultIsReliable(result.language, result.probability);
   result.proportion = 1.0;
   return result;
 }
 
+void NNetLanguageIdentifier::GetProbabilitiesFromScores(
+    const float *scores, float *probabilities) const {
+  // Same computation as GetCompactResultFromScores(), so that the probability
+  // of the predicted language is the same.
+  const int num_classes = NumOutputClasses();
+  const float max_val = *std::max_element(scores, scores + num_classes);
+  float diff_sum = 0.0;
+  for (int i = 0; i < num_classes; ++i) {
+    diff_sum += exp(scores[i] - max_val);
+  }
+  const float log_sum_exp = max_val + log(diff_sum);
+  std::fill(probabilities, probabilities + model_->num_languages(), 0.0f);
+  for (int i = 0; i < num_classes; ++i) {
+    const int language_id =
+        (allowed_classes_ != nullptr) ? allowed_classes_->class_id(i) : i;
+    probabilities[language_id] = exp(scores[i] - log_sum_exp);
+  }
+}
+
+void NNetLanguageIdentifier::FindLanguageBatch(
+    const std::vector<StringPiece> &texts, std::vector<Result> *results,
+    Executor *executor) {
+  CLD3_CHECK(texts.size() <=
+             static_cast<size_t>(std::numeric_limits<int>::max()));
+  results->resize(texts.size());
+  if (executor == nullptr) {
+    for (size_t i = 0; i < texts.size(); ++i) {
+      (*results)[i] = FindLanguage(texts[i].data(), texts[i].size(), &scratch_);
+    }
+    return;
+  }
+
+  SetUpWorkerScratches(*executor);
+  executor->ParallelFor(
+      static_cast<int>(texts.size()),
+      [this, &texts, results](int worker, int index) {
+        (*results)[index] = FindLanguage(
+            texts[index].data(), texts[index].size(), GetWorkerScratch(worker));
+      });
+}
+
+void NNetLanguageIdentifier::SetUpWorkerScratches(const Executor &executor) {
+  while (static_cast<int>(worker_scratches_.size()) + 1 <
+         executor.num_workers()) {
+    worker_scratches_.emplace_back(new InferenceScratch);
+  }
+}
+
 std::vector<NNetLanguageIdentifier::Result>
 NNetLanguageIdentifier::FindTopNMostFreqLangs(const string &text,
                                               int num_langs) {
+  return FindTopNMostFreqLangs(text, num_langs, &scratch_);
+}
+
+std::vector<NNetLanguageIdentifier::Result>
+NNetLanguageIdentifier::FindTopNMostFreqLangs(const string &text,
+                                              int num_langs,
+                                              InferenceScratch *scratch) const {
   std::vector<Result> results;
 
   // Truncate the input text if it is too long and find the span containing
   // interchange-valid UTF8.
-  const int num_valid_bytes = FindNumValidBytesToProcess(text);
+  const int num_valid_bytes =
+      FindNumValidBytesToProcess(text.data(), text.size());
   if (num_valid_bytes == 0) {
     while (num_langs-- > 0) {
       results.emplace_back();
@@ -280,7 +729,8 @@ NNetLanguageIdentifier::FindTopNMostFreqLangs(const string &text,
   }
 
   // Process each subsequence of the same script.
-  CLD2::ScriptScanner ss(text.c_str(), num_valid_bytes, /*is_plain_text=*/true);
+  CLD2::ScriptScanner &ss = scratch->script_scanner_;
+  ss.Reset(text.c_str(), num_valid_bytes);
   CLD2::LangSpan script_span;
   std::unordered_map<string, LangChunksStats> lang_stats;
   int total_num_bytes = 0;
@@ -298,64 +748,182 @@ NNetLanguageIdentifier::FindTopNMostFreqLangs(const string &text,
     }
     total_num_bytes += num_original_span_bytes;
 
-    const string selected_text = SelectTextGivenScriptSpan(script_span);
+    const CompactResult result =
+        FindLanguageOfValidUTF8(script_span.text, script_span.text_bytes,
+                                script_span.ulscript, scratch);
+    AddSpanPrediction(result.language, result.probability,
+                      num_original_span_bytes, ss.MapBack(0),
+                      ss.MapBack(script_span.text_bytes), &lang_stats);
+  }
+  return GetTopNResults(lang_stats, total_num_bytes, num_langs);
+}
+
+std::vector<NNetLanguageIdentifier::Result>
+NNetLanguageIdentifier::FindTopNMostFreqLangs(const string &text,
+                                              int num_langs,
+                                              Executor *executor) {
+  const int num_valid_bytes =
+      FindNumValidBytesToProcess(text.data(), text.size());
+  const int total_num_bytes =
+      CollectScriptSpans(text.data(), num_valid_bytes, &scratch_);
+  std::vector<InferenceScratch::ScriptSpan> &spans = scratch_.spans_;
+  const char *span_texts = scratch_.cleaned_text_.data();
+
+  if (executor != nullptr) {
+    // The workers only use the network buffers of their scratch, so the worker
+    // #0 can read the spans from scratch_ while classifying them.
+    SetUpWorkerScratches(*executor);
+    executor->ParallelFor(
+        static_cast<int>(spans.size()),
+        [this, &spans, span_texts](int worker, int index) {
+          InferenceScratch::ScriptSpan &span = spans[index];
+          const CompactResult result = FindLanguageOfValidUTF8(
+              span_texts + span.text_begin, span.text_size, span.ulscript,
+              GetWorkerScratch(worker));
+          span.language_id = result.language_id;
+          span.probability = result.probability;
+        });
+  } else if (!spans.empty()) {
+    std::vector<std::vector<FeatureVector>> &batch_features =
+        scratch_.batch_features_;
+    batch_features.resize(spans.size());
+    for (size_t i = 0; i < spans.size(); ++i) {
+      ExtractFeaturesOfValidUTF8(span_texts + spans[i].text_begin,
+                                 spans[i].text_size, spans[i].ulscript,
+                                 &scratch_, &batch_features[i]);
+    }
+    EmbeddingNetwork::Vector &scores = scratch_.scores_;
+    model_->network().ComputeFinalScoresBatch(batch_features,
+                                              &scratch_.network_scratch_,
+                                              allowed_classes_.get(), &scores);
+    const int num_classes = NumOutputClasses();
+    for (size_t i = 0; i < spans.size(); ++i) {
+      const CompactResult result =
+          GetCompactResultFromScores(scores.data() + i * num_classes);
+      spans[i].language_id = result.language_id;
+      spans[i].probability = result.probability;
+    }
+  }
 
-    Result result = FindLanguageOfValidUTF8(selected_text);
-    string language = result.language;
-    lang_stats[language].byte_sum += num_original_span_bytes;
-    lang_stats[language].prob_sum +=
-        result.probability * num_original_span_bytes;
-    lang_stats[language].num_chunks++;
-    // Add SpanInfo. Start and end indices are relative to original input.
-    lang_stats[language].byte_ranges.push_back(SpanInfo(
-        ss.MapBack(0), ss.MapBack(script_span.text_bytes), result.probability));
+  std::unordered_map<string, LangChunksStats> lang_stats;
+  for (const InferenceScratch::ScriptSpan &span : spans) {
+    AddSpanPrediction(model_->GetLanguageCode(span.language_id),
+                      span.probability, span.num_original_bytes,
+                      span.start_index, span.end_index, &lang_stats);
   }
+  return GetTopNResults(lang_stats, total_num_bytes, num_langs);
+}
 
-  // Sort the languages based on the number of bytes associated with them.
-  // TODO(abakalov): Consider alternative possibly more efficient portable
-  // approaches for finding the top N languages. Given that on average, there
-  // aren't that many languages in the input, it's likely that the benefits will
-  // be negligible (if any).
-  std::vector<std::pair<string, float>> langs_and_byte_counts;
-  for (const auto &entry : lang_stats) {
-    langs_and_byte_counts.emplace_back(entry.first, entry.second.byte_sum);
+void NNetLanguageIdentifier::FindTopNMostFreqLangsCompact(
+    const char *text, size_t text_size, int num_langs,
+    InferenceScratch *scratch, CompactResult *results, SpanInfo *byte_ranges,
+    int max_num_byte_ranges) const {
+  const int num_valid_bytes = FindNumValidBytesToProcess(text, text_size);
+  const int total_num_bytes =
+      CollectScriptSpans(text, num_valid_bytes, scratch);
+
+  // Classify the spans, and accumulate their stats by language id.  Only the
+  // network buffers of scratch are used, so the spans stay valid.
+  std::vector<InferenceScratch::ScriptSpan> &spans = scratch->spans_;
+  std::vector<InferenceScratch::LanguageStats> &language_stats =
+      scratch->language_stats_;
+  std::vector<int> &language_ids = scratch->span_language_ids_;
+  language_stats.assign(model_->num_languages(),
+                        InferenceScratch::LanguageStats());
+  language_ids.clear();
+  const char *span_texts = scratch->cleaned_text_.data();
+  for (InferenceScratch::ScriptSpan &span : spans) {
+    const CompactResult result =
+        FindLanguageOfValidUTF8(span_texts + span.text_begin, span.text_size,
+                                span.ulscript, scratch);
+    span.language_id = result.language_id;
+    span.probability = result.probability;
+    InferenceScratch::LanguageStats &stats = language_stats[span.language_id];
+    if (stats.num_spans++ == 0) language_ids.push_back(span.language_id);
+    stats.byte_sum += span.num_original_bytes;
+    stats.prob_sum += result.probability * span.num_original_bytes;
   }
-  std::sort(langs_and_byte_counts.begin(), langs_and_byte_counts.end(),
-            OrderBySecondDescending);
+
+  // Same order as GetTopNResults: by number of bytes, then by language code.
+  std::sort(language_ids.begin(), language_ids.end(),
+            [this, &language_stats](int x, int y) {
+              if (language_stats[x].byte_sum == language_stats[y].byte_sum) {
+                return strcmp(model_->GetLanguageCode(x),
+                              model_->GetLanguageCode(y)) < 0;
+              }
+              return language_stats[x].byte_sum > language_stats[y].byte_sum;
+            });
 
   const float byte_sum = static_cast<float>(total_num_bytes);
-  const int num_langs_to_save =
-      std::min(num_langs, static_cast<int>(langs_and_byte_counts.size()));
-  for (int indx = 0; indx < num_langs_to_save; ++indx) {
-    Result result;
-    const string &language = langs_and_byte_counts.at(indx).first;
-    const LangChunksStats &stats = lang_stats.at(language);
-    result.language = language;
+  int num_byte_ranges = 0;
+  for (int i = 0; i < num_langs; ++i) {
+    CompactResult &result = results[i];
+    result = CompactResult();
+    if (i >= static_cast<int>(language_ids.size())) continue;
+    const int language_id = language_ids[i];
+    const InferenceScratch::LanguageStats &stats = language_stats[language_id];
+    result.language_id = language_id;
+    result.language = model_->GetLanguageCode(language_id);
     result.probability = stats.prob_sum / stats.byte_sum;
     result.proportion = stats.byte_sum / byte_sum;
-    result.is_reliable = ResultIsReliable(language, result.probability);
-    result.byte_ranges = stats.byte_ranges;
-    results.push_back(result);
-  }
-
-  int padding_size = num_langs - langs_and_byte_counts.size();
-  while (padding_size-- > 0) {
-    results.emplace_back();
+    result.is_reliable = ResultIsReliable(result.language, result.probability);
+    for (const InferenceScratch::ScriptSpan &span : spans) {
+      if (span.language_id != language_id) continue;
+      if (num_byte_ranges == max_num_byte_ranges) break;
+      if (result.byte_ranges == nullptr) {
+        result.byte_ranges = byte_ranges + num_byte_ranges;
+      }
+      byte_ranges[num_byte_ranges++] =
+          SpanInfo(span.start_index, span.end_index, span.probability);
+      ++result.num_byte_ranges;
+    }
   }
-  return results;
 }
 
-string NNetLanguageIdentifier::SelectTextGivenScriptSpan(
-    const CLD2::LangSpan &script_span) {
-  return SelectTextGivenBeginAndSize(script_span.text, script_span.text_bytes);
+int NNetLanguageIdentifier::CollectScriptSpans(
+    const char *text, int num_valid_bytes, InferenceScratch *scratch) const {
+  std::vector<InferenceScratch::ScriptSpan> &spans = scratch->spans_;
+  string &span_texts = scratch->cleaned_text_;
+  spans.clear();
+  span_texts.clear();
+  if (num_valid_bytes == 0) return 0;
+
+  CLD2::ScriptScanner &ss = scratch->script_scanner_;
+  ss.Reset(text, num_valid_bytes);
+  CLD2::LangSpan script_span;
+  int total_num_bytes = 0;
+  int chunk_size = 0;  // Use the default.
+  while (ss.GetOneScriptSpanLower(&script_span)) {
+    const int num_original_span_bytes = script_span.text_bytes;
+
+    // Remove repetitive chunks or ones containing mostly spaces.
+    const int new_length = CLD2::CheapSqueezeInplace(
+        script_span.text, script_span.text_bytes, chunk_size);
+    if (new_length < min_num_bytes_) {
+      continue;
+    }
+    total_num_bytes += num_original_span_bytes;
+
+    InferenceScratch::ScriptSpan span;
+    span.text_begin = span_texts.size();
+    span.text_size = new_length;
+    span.ulscript = script_span.ulscript;
+    span.num_original_bytes = num_original_span_bytes;
+    span.start_index = ss.MapBack(0);
+    span.end_index = ss.MapBack(new_length);
+    span_texts.append(script_span.text, new_length);
+    spans.push_back(span);
+  }
+  return total_num_bytes;
 }
 
-string NNetLanguageIdentifier::SelectTextGivenBeginAndSize(
-    const char *text_begin, int text_size) {
-  string output_text;
+void NNetLanguageIdentifier::SelectSnippets(
+    const char *text_begin, int text_size,
+    std::vector<StringPiece> *snippets) const {
+  snippets->clear();
 
   // If the size of the input is greater than the maximum number of bytes needed
-  // for a prediction, then concatenate snippets that are equally spread out
+  // for a prediction, then select snippets that are equally spread out
   // throughout the input.
   if (text_size > max_num_bytes_) {
     const char *snippet_begin = nullptr;
@@ -374,13 +942,11 @@ string NNetLanguageIdentifier::SelectTextGivenBeginAndSize(
       const int actual_snippet_size =
           CLD2::SpanInterchangeValid(snippet_begin, snippet_size_);
       snippet_end = snippet_begin + actual_snippet_size;
-      output_text.append(snippet_begin, actual_snippet_size);
-      output_text.append(" ");
+      snippets->emplace_back(snippet_begin, actual_snippet_size);
     }
   } else {
-    output_text.append(text_begin, text_size);
+    snippets->emplace_back(text_begin, text_size);
   }
-  return output_text;
 }
 
 }  // namespace chrome_lang_id
@@ -16,14 +16,20 @@ limitations under the License.
 #ifndef NNET_LANGUAGE_IDENTIFIER_H_
 #define NNET_LANGUAGE_IDENTIFIER_H_
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "base.h"
 #include "embedding_feature_extractor.h"
 #include "embedding_network.h"
+#include "executor.h"
 #include "lang_id_nn_params.h"
+#include "language_id_model.h"
 #include "language_identifier_features.h"
+#include "result_cache.h"
 #include "script_span/getonescriptspan.h"
+#include "script_span/stringpiece.h"
 #include "cld_3/protos/sentence.pb.h"
 #include "sentence_features.h"
 #include "task_context.h"
@@ -33,21 +39,101 @@ limitations under the License.
 
 namespace chrome_lang_id {
 
-// Specialization of the EmbeddingFeatureExtractor for extracting from
-// (Sentence, int).
-class LanguageIdEmbeddingFeatureExtractor
-    : public EmbeddingFeatureExtractor<WholeSentenceExtractor, Sentence> {
+// Buffers used by NNetLanguageIdentifier to make predictions: the script
+// scanner, the cleaned-up text, the Sentence, the workspaces, the feature
+// vectors and the network layers.  Passing the same InferenceScratch to
+// successive FindLanguage / FindTopNMostFreqLangs calls lets them reuse these
+// buffers instead of allocating new ones.  An InferenceScratch can be used with
+// any NNetLanguageIdentifier, but is not thread-safe: each thread should use
+// its own.
+class InferenceScratch {
  public:
-  const string ArgPrefix() const override;
+  InferenceScratch();
+  ~InferenceScratch();
+
+ private:
+  friend class NNetLanguageIdentifier;
+  friend class StreamingLanguageDetector;
+
+  // Scanner used to clean up the input text, re-aimed at each new input.
+  CLD2::ScriptScanner script_scanner_;
+
+  // Text cleaned up by the script scanner, squeezed in place, and the views of
+  // the snippets selected from it for a prediction.
+  string cleaned_text_;
+  std::vector<StringPiece> snippets_;
+
+  // Sentence holding the concatenated snippets, and the feature workspaces.
+  Sentence sentence_;
+  WorkspaceSet workspaces_;
+
+  // features_[i] holds the features for the embedding space #i.
+  std::vector<FeatureVector> features_;
+
+  // Intermediate layers and output scores of the network.
+  EmbeddingNetwork::Scratch network_scratch_;
+  EmbeddingNetwork::Vector scores_;
+
+  // A script span collected by FindTopNMostFreqLangs before the spans are
+  // classified: its squeezed text, which is stored in cleaned_text_, its
+  // position in the input, and its predicted language.
+  struct ScriptSpan {
+    int text_begin = 0;
+    int text_size = 0;
+    CLD2::ULScript ulscript = CLD2::UNKNOWN_ULSCRIPT;
+
+    // Number of bytes of the span before squeezing, and byte range of the span
+    // in the input.
+    int num_original_bytes = 0;
+    int start_index = 0;
+    int end_index = 0;
+
+    int language_id = 0;
+    float probability = 0.0;
+  };
+  std::vector<ScriptSpan> spans_;
+
+  // Number of spans predicted as each language, their number of bytes and the
+  // sum of their probabilities weighted by their numbers of bytes, by language
+  // id, and the ids of the languages of the spans, for
+  // FindTopNMostFreqLangsCompact.
+  struct LanguageStats {
+    int num_spans = 0;
+    int byte_sum = 0;
+    float prob_sum = 0.0;
+  };
+  std::vector<LanguageStats> language_stats_;
+  std::vector<int> span_language_ids_;
+
+  // Probabilities of the languages, by language id, and the ids of the allowed
+  // languages in decreasing order of probability, for FindTopKLanguages.
+  std::vector<float> probabilities_;
+  std::vector<int> language_order_;
+
+  // batch_features_[n] holds the features of spans_[n] when the spans are
+  // classified with one batched network call.
+  std::vector<std::vector<FeatureVector>> batch_features_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(InferenceScratch);
 };
 
-// Class for detecting the language of a document.
+// Class for detecting the language of a document.  An NNetLanguageIdentifier
+// is a lightweight session on a LanguageIdModel, which it may share with other
+// sessions: the model is immutable, and the session holds the prediction
+// parameters (min / max number of bytes) and a default InferenceScratch.
+//
+// Thread-safety: the overloads of FindLanguage and FindTopNMostFreqLangs that
+// take an InferenceScratch are const and may be called concurrently, as long
+// as each thread uses its own InferenceScratch.  The other overloads use the
+// scratch of the session, so each thread should use its own session; sessions
+// on a shared model are cheap to create.
 class NNetLanguageIdentifier {
  public:
   // Holds probability that Span, specified by start/end indices, is a given
   // language. The langauge is not stored here; it can be found in Result, which
   // holds a vector of SpanInfo.
   struct SpanInfo {
+    SpanInfo() {}
     SpanInfo(int start_index_val, int end_index_val, float probability_val)
         : start_index(start_index_val),
           end_index(end_index_val),
@@ -71,10 +157,105 @@ class NNetLanguageIdentifier {
     std::vector<SpanInfo> byte_ranges;
   };
 
+  // Same information as Result, in a form that owns no memory, for callers
+  // that make many predictions and aggregate them by language: the language is
+  // given by its id in the model (see LanguageIdModel::GetLanguageCode()) and
+  // by its code, which is a static string.
+  struct CompactResult {
+    uint16 language_id = kUnknownLanguageId;
+    const char *language = kUnknown;
+    float probability = 0.0;
+    bool is_reliable = false;
+    float proportion = 0.0;
+
+    // The num_byte_ranges byte ranges that language applies to, in the storage
+    // passed to FindTopNMostFreqLangsCompact, or nullptr.
+    const SpanInfo *byte_ranges = nullptr;
+    int num_byte_ranges = 0;
+  };
+
+  // Uses the built-in model, which is set up on the first call and then shared
+  // by all the sessions (see LanguageIdModel::BuiltIn()).
   NNetLanguageIdentifier();
   NNetLanguageIdentifier(int min_num_bytes, int max_num_bytes);
+
+  // Same as above, but uses the network parameters from nn_params instead of
+  // the built-in ones, e.g., an Int8QuantizedNNParams.  nn_params should
+  // describe a network with the same features and languages as the built-in
+  // model, and should stay alive for at least the lifetime of this object.
+  // The session sets up a model of its own.  If nn_params is nullptr, the
+  // shared built-in model is used.
+  NNetLanguageIdentifier(int min_num_bytes, int max_num_bytes,
+                         const EmbeddingNetworkParams *nn_params);
+
+  // Creates a session on a shared model, e.g., one set up from a model file
+  // (see MmapEmbeddingNetworkParams).  These constructors do not set up any
+  // feature extractor or network, so they are cheap.
+  explicit NNetLanguageIdentifier(
+      std::shared_ptr<const LanguageIdModel> model);
+  NNetLanguageIdentifier(std::shared_ptr<const LanguageIdModel> model,
+                         int min_num_bytes, int max_num_bytes);
   ~NNetLanguageIdentifier();
 
+  // Returns a new session on the same model, with the same settings (byte
+  // limits, progressive mode, allowed languages, script fast path and result
+  // cache), and buffers of its own.  This is as cheap as the constructors
+  // from a shared model: nothing is parsed or set up again.
+  std::unique_ptr<NNetLanguageIdentifier> Clone() const;
+
+  // Turns on the progressive mode for texts longer than max_num_bytes_:
+  // instead of running the network once on all the snippets, the snippets are
+  // added one at a time, and the prediction stops as soon as its probability
+  // is at least margin above the reliability threshold of the language.  The
+  // features of the snippets added so far are kept as running counts, so each
+  // step only extracts the features of the new snippet.  The prediction after
+  // the last snippet is the same as without the progressive mode, up to the
+  // rounding of the probability.  FindTopNMostFreqLangs(text, num_langs,
+  // nullptr), which batches the spans, ignores this mode.
+  void EnableEarlyExit(float margin);
+  void DisableEarlyExit() { early_exit_margin_ = -1.0f; }
+
+  // Restricts the predictions to languages, e.g., {"en", "es", "fr", "pt"}:
+  // the network only computes the softmax scores of these languages, and the
+  // probabilities are normalized over them.  Returns false, and leaves the
+  // setting unchanged, if languages is empty or has a language that is not in
+  // the model.  The restriction is per session; sessions on the same model can
+  // use different ones.
+  bool SetAllowedLanguages(const std::vector<string> &languages);
+  void ClearAllowedLanguages() { allowed_classes_.reset(); }
+
+  // Turns on the script-only fast path of FindLanguage: if at least a
+  // dominance_threshold fraction of the letters of the cleaned-up text are in
+  // a script of kScriptLanguages (see script_languages.h), i.e., a script of a
+  // single language of the built-in model, and there are enough of them, the
+  // language of that script is returned right away, without extracting
+  // features or running the network.  The probability of such a result is
+  // calibrated on the number of letters in the script, against the
+  // probabilities that the network gives the same texts, and the result is
+  // reliable under the usual thresholds.  dominance_threshold should be in
+  // [kMinScriptDominanceThreshold, 1].  Returns false, and leaves the fast
+  // path off, if the languages of the model are not those of the built-in
+  // model, for which kScriptLanguages is made.
+  // FindTopNMostFreqLangs does not use the fast path.
+  bool EnableScriptFastPath(float dominance_threshold);
+  void DisableScriptFastPath() { script_dominance_threshold_ = -1.0f; }
+
+  // Makes the predictions go through cache, which is not owned and should
+  // outlive this session (nullptr turns the cache off).  The key is the hash
+  // of the text that is classified, i.e., after cleanup and squeezing, so
+  // inputs that only differ in, e.g., punctuation, digits or repeated chunks,
+  // share an entry.  A cache may be shared by sessions on several threads, as
+  // long as they use the same model and settings.  FindTopNMostFreqLangs(text,
+  // num_langs, nullptr), which batches the spans, does not use the cache, and
+  // neither do the predictions restricted by SetAllowedLanguages().
+  void set_result_cache(ResultCache *cache) { result_cache_ = cache; }
+
+  // Returns the model used by this session, e.g., to create other sessions on
+  // it.
+  const std::shared_ptr<const LanguageIdModel> &model() const {
+    return model_;
+  }
+
   // Finds the most likely language for the given text, along with additional
   // information (e.g., probability). The prediction is based on the first N
   // bytes where N is the minumum between the number of interchange valid UTF8
@@ -82,6 +263,58 @@ class NNetLanguageIdentifier {
   // function returns kUnknown.
   Result FindLanguage(const string &text);
 
+  // Same as above, but uses the buffers from scratch.  Once scratch has served
+  // a few calls, its buffers do not need to grow anymore.
+  Result FindLanguage(const string &text, InferenceScratch *scratch) const;
+
+  // Same as above, for the text_size bytes at text, which do not need to be
+  // null-terminated.  The text is not copied before being cleaned up.
+  Result FindLanguage(const char *text, size_t text_size);
+  Result FindLanguage(const char *text, size_t text_size,
+                      InferenceScratch *scratch) const;
+
+  // Same as above, but returns a CompactResult: once scratch has served a few
+  // calls, the prediction does not allocate any memory.
+  CompactResult FindLanguageCompact(const char *text, size_t text_size,
+                                    InferenceScratch *scratch) const;
+
+  // Same as above, but also stores in probabilities[0, num_languages) the
+  // probability of each language of the model, by language id, where
+  // num_languages is model()->num_languages().  The probabilities are
+  // normalized over the languages allowed by SetAllowedLanguages(), and are 0
+  // for the other ones, or for all of them if the prediction is kUnknown.
+  // The script fast path and the result cache, which do not give the
+  // probabilities of the other languages, are not used.
+  CompactResult FindLanguageDistribution(const char *text, size_t text_size,
+                                         InferenceScratch *scratch,
+                                         float *probabilities) const;
+
+  // Stores in results[0, n) the n most likely languages for the text, in
+  // decreasing order of probability, as FindLanguageDistribution() computes
+  // them, and returns n: n is the minimum between k and the number of allowed
+  // languages, or 0 if the prediction is kUnknown.
+  int FindTopKLanguages(const char *text, size_t text_size, int k,
+                        InferenceScratch *scratch,
+                        CompactResult *results) const;
+
+  // Stores in *features the features that FindLanguageCompact() gives to the
+  // network for the text, without the script fast path, the result cache or
+  // the progressive mode, or empty feature vectors if the text is too short
+  // for a prediction.  The features point into the feature types of model(),
+  // and are meant for offline tools, e.g., to calibrate the layout of the
+  // embeddings (see embedding_reordering.h).
+  void ExtractFeatures(const char *text, size_t text_size,
+                       InferenceScratch *scratch,
+                       std::vector<FeatureVector> *features) const;
+
+  // Finds the most likely language for each of the texts, as FindLanguage
+  // does, and stores the results in *results, in the order of texts.  If
+  // executor is not nullptr, the texts are spread over its workers, each with
+  // an InferenceScratch of this session; otherwise they are processed in the
+  // calling thread.
+  void FindLanguageBatch(const std::vector<StringPiece> &texts,
+                         std::vector<Result> *results, Executor *executor);
+
   // Splits the input text (up to the first byte, if any, that is not
   // interchange valid UTF8) into spans based on the script, predicts a language
   // for each span, and returns a vector storing the top num_langs most frequent
@@ -94,9 +327,40 @@ class NNetLanguageIdentifier {
   // kMaxNumInputBytesToConsider bytes are processed.
   std::vector<Result> FindTopNMostFreqLangs(const string &text, int num_langs);
 
+  // Same as above, but uses the buffers from scratch for the prediction on
+  // each span.
+  std::vector<Result> FindTopNMostFreqLangs(const string &text, int num_langs,
+                                            InferenceScratch *scratch) const;
+
+  // Same as above, for the text_size bytes at text, but stores the num_langs
+  // results in results[0, num_langs), and their byte ranges in
+  // byte_ranges[0, max_num_byte_ranges), in the order of the results.  The
+  // byte ranges that do not fit are dropped; byte_ranges may be nullptr if
+  // max_num_byte_ranges is 0.  Once scratch has served a few calls, this does
+  // not allocate any memory.
+  void FindTopNMostFreqLangsCompact(const char *text, size_t text_size,
+                                    int num_langs, InferenceScratch *scratch,
+                                    CompactResult *results,
+                                    SpanInfo *byte_ranges,
+                                    int max_num_byte_ranges) const;
+
+  // Same as FindTopNMostFreqLangs(text, num_langs), but collects the squeezed
+  // spans of the text first, and then classifies them all at once: in parallel
+  // on the workers of executor, each with an InferenceScratch of this session,
+  // or, if executor is nullptr, with a single batched network call.  The
+  // predictions are merged in the order of the spans, so the results do not
+  // depend on the scheduling; they are the same as the sequential ones, except
+  // that the batched network call may round the probabilities slightly
+  // differently.
+  std::vector<Result> FindTopNMostFreqLangs(const string &text, int num_langs,
+                                            Executor *executor);
+
   // String returned when a language is unknown or prediction cannot be made.
   static const char kUnknown[];
 
+  // Language id of kUnknown in a CompactResult.
+  static const uint16 kUnknownLanguageId;
+
   // Min number of bytes needed to make a prediction if the default constructor
   // is called.
   static const int kMinNumBytesToConsider;
@@ -117,48 +381,107 @@ class NNetLanguageIdentifier {
   // Reliability threshold for the languages hr and bs.
   static const float kReliabilityHrBsThreshold;
 
- private:
-  // Sets up and initializes the model.
-  void Setup(TaskContext *context);
-  void Init(TaskContext *context);
-
-  // Extract features from sentence.  On return, FeatureVector features[i]
-  // contains the features for the embedding space #i.
-  void GetFeatures(Sentence *sentence,
-                   std::vector<FeatureVector> *features) const;
-
-  // Finds the most likely language for the given text. Assumes that the text is
-  // interchange valid UTF8.
-  Result FindLanguageOfValidUTF8(const string &text);
-
-  // Returns the language name corresponding to the given id.
-  string GetLanguageName(int language_id) const;
-
-  // Concatenates snippets of text equally spread out throughout the input if
-  // the size of the input is greater than the maximum number of bytes needed to
-  // make a prediction. The resulting string is used for language
-  // identification.
-  string SelectTextGivenScriptSpan(const CLD2::LangSpan &script_span);
-  string SelectTextGivenBeginAndSize(const char *text_begin, int text_size);
-
-  // Number of languages.
-  const int num_languages_;
-
-  // Typed feature extractor for embeddings.
-  LanguageIdEmbeddingFeatureExtractor feature_extractor_;
+  // Suggested and minimum dominance thresholds for EnableScriptFastPath().
+  static const float kDefaultScriptDominanceThreshold;
+  static const float kMinScriptDominanceThreshold;
 
-  // The registry of shared workspaces in the feature extractor.
-  WorkspaceRegistry workspace_registry_;
-
-  // Parameters for the neural networks.
-  LangIdNNParams nn_params_;
-
-  // Neural network to use for scoring.
-  EmbeddingNetwork network_;
-
-  // This feature function is not relevant to this class. Adding this variable
-  // ensures that the features are linked.
-  ContinuousBagOfNgramsFunction ngram_function_;
+ private:
+  friend class StreamingLanguageDetector;
+
+  // Finds the most likely language for the text_size bytes at text, using the
+  // buffers from scratch: selects snippets of the text with SelectSnippets()
+  // and copies them into the Sentence of scratch.  Assumes that the text is
+  // interchange valid UTF8, and that ulscript, unless UNKNOWN_ULSCRIPT, is the
+  // script of the whole text.
+  CompactResult FindLanguageOfValidUTF8(const char *text, int text_size,
+                                        CLD2::ULScript ulscript,
+                                        InferenceScratch *scratch) const;
+
+  // Stores in *features the features of the text_size bytes at text, using
+  // the other buffers from scratch, as FindLanguageOfValidUTF8 does before
+  // running the network.  Does not use the cleaned text, the script scanner or
+  // the spans of scratch.
+  void ExtractFeaturesOfValidUTF8(const char *text, int text_size,
+                                  CLD2::ULScript ulscript,
+                                  InferenceScratch *scratch,
+                                  std::vector<FeatureVector> *features) const;
+
+  // Stores in scratch->cleaned_text_ the text_size bytes at text, up to the
+  // first byte that is not interchange valid UTF8, cleaned up (lowercased,
+  // without digits, punctuation, etc.).  Returns the script of all the spans
+  // of the text, or UNKNOWN_ULSCRIPT if they are in different scripts.  If
+  // letter_counts is not nullptr, adds to letter_counts[s] the number of
+  // letters of the text in script s, for the script-only fast path.
+  CLD2::ULScript CleanUpText(const char *text, size_t text_size,
+                             InferenceScratch *scratch,
+                             int *letter_counts) const;
+
+  // Implements FindLanguageCompact() if probabilities is nullptr, and
+  // FindLanguageDistribution() otherwise.
+  CompactResult FindLanguageAndProbabilities(const char *text,
+                                             size_t text_size,
+                                             InferenceScratch *scratch,
+                                             float *probabilities) const;
+
+  // Same as FindLanguageOfValidUTF8, without the cache.  Leaves the scores of
+  // the prediction in scratch->scores_.
+  CompactResult ComputeLanguageOfValidUTF8(const char *text, int text_size,
+                                           CLD2::ULScript ulscript,
+                                           InferenceScratch *scratch) const;
+
+  // Same as FindLanguageOfValidUTF8, for a text longer than max_num_bytes_,
+  // in the progressive mode (see EnableEarlyExit()).
+  CompactResult FindLanguageOfSnippets(const char *text, int text_size,
+                                       CLD2::ULScript ulscript,
+                                       InferenceScratch *scratch) const;
+
+  // Returns the prediction for the unnormalized scores of the network, which
+  // are for the allowed languages only if SetAllowedLanguages() was called.
+  CompactResult GetCompactResultFromScores(const float *scores) const;
+  Result GetResultFromScores(const float *scores) const;
+
+  // Stores in probabilities[0, model_->num_languages()) the probabilities of
+  // the languages for the unnormalized scores of the network, by language id,
+  // as FindLanguageDistribution() describes them.
+  void GetProbabilitiesFromScores(const float *scores,
+                                  float *probabilities) const;
+
+  // Returns the number of scores computed by the network for one input.
+  int NumOutputClasses() const;
+
+  // Collects in scratch->spans_ the spans of the first num_valid_bytes of
+  // text in the same script, squeezed, that have at least min_num_bytes_
+  // bytes.  Returns the total number of bytes of these spans before squeezing.
+  int CollectScriptSpans(const char *text, int num_valid_bytes,
+                         InferenceScratch *scratch) const;
+
+  // SetUpWorkerScratches makes sure that there is an InferenceScratch for each
+  // worker of executor, and GetWorkerScratch returns the one of worker #worker.
+  void SetUpWorkerScratches(const Executor &executor);
+  InferenceScratch *GetWorkerScratch(int worker) {
+    return (worker == 0) ? &scratch_ : worker_scratches_[worker - 1].get();
+  }
+
+  // Selects the text used for language identification: the whole input if its
+  // size is at most the maximum number of bytes needed to make a prediction,
+  // and otherwise num_snippets_ snippets equally spread out throughout the
+  // input.  Stores views of the selected pieces of the input in *snippets.
+  // The text to process is the single piece in the former case, and the
+  // snippets each followed by a space in the latter case.
+  void SelectSnippets(const char *text_begin, int text_size,
+                      std::vector<StringPiece> *snippets) const;
+
+  // The model, possibly shared with other sessions.
+  std::shared_ptr<const LanguageIdModel> model_;
+
+  // Buffers used by the overloads of FindLanguage and FindTopNMostFreqLangs
+  // that do not take an InferenceScratch.
+  InferenceScratch scratch_;
+
+  // Buffers used by FindLanguageBatch and FindTopNMostFreqLangs for the
+  // workers #1 and up of the executor; the worker #0, i.e., the calling
+  // thread, uses scratch_.
+  std::vector<std::unique_ptr<InferenceScratch>> worker_scratches_;
 
   // Minimum number of bytes needed to make a prediction. If the default
   // constructor is called, this variable is equal to kMinNumBytesToConsider.
@@ -168,6 +491,21 @@ class NNetLanguageIdentifier {
   // constructor is called, this variable is equal to kMaxNumBytesToConsider.
   int max_num_bytes_;
 
+  // Classes of the allowed languages, or nullptr if all the languages are
+  // allowed.
+  std::shared_ptr<const EmbeddingNetwork::OutputSubset> allowed_classes_;
+
+  // Minimum fraction of the letters in a script of kScriptLanguages for the
+  // script-only fast path, or a negative value if the fast path is off.
+  float script_dominance_threshold_ = -1.0f;
+
+  // Cache of the predictions, or nullptr.
+  ResultCache *result_cache_ = nullptr;
+
+  // Margin over the reliability threshold for the progressive mode, or a
+  // negative value if the progressive mode is off.
+  float early_exit_margin_ = -1.0f;
+
   // Number of snippets to concatenate to produce the string used for language
   // identification. If max_num_bytes_ <= kNumSnippets (i.e., the maximum number
   // of bytes needed to make a prediction is smaller or equal to the number of
@@ -163,6 +163,13 @@ struct ComponentRegistry {
     return r;
   }
 
+  // Returns true if a component of the given type is registered.
+  bool IsRegistered(const char *type) const {
+    const Registrar *r = components;
+    while (r != NULL && strcmp(type, r->type()) != 0) r = r->next();
+    return r != NULL;
+  }
+
   // Finds a named component in the registry.
   T *Lookup(const char *type) const { return GetComponent(type)->object(); }
   T *Lookup(const string &type) const { return Lookup(type.c_str()); }
@@ -17,6 +17,7 @@ limitations under the License.
 
 #include <ctype.h>
 
+#include <algorithm>
 #include <string>
 
 #include "feature_extractor.h"
@@ -30,36 +31,25 @@ limitations under the License.
 #include "workspace.h"
 
 namespace chrome_lang_id {
-void RelevantScriptFeature::Setup(TaskContext *context) {
-  // Nothing.
-}
-
-void RelevantScriptFeature::Init(TaskContext *context) {
-  set_feature_type(new NumericFeatureType(name(), kNumRelevantScripts));
-}
-
-void RelevantScriptFeature::Evaluate(const WorkspaceSet &workspaces,
-                                     const Sentence &sentence,
-                                     FeatureVector *result) const {
-  const string &text = sentence.text();
-
-  // We expect kNumRelevantScripts to be small, so we stack-allocate the array
-  // of counts.  Still, if that changes, we want to find out.
-  static_assert(
-      kNumRelevantScripts < 25,
-      "switch counts to vector<int>: too big for stack-allocated int[]");
-
-  // counts[s] is the number of characters with script s.
-  // Note: {} "value-initializes" the array to zero.
-  int counts[kNumRelevantScripts]{};
-  int total_count = 0;
-  const char *const text_end = text.data() + text.size();
-  for (const char *curr = text.data(); curr < text_end;
-       curr += utils::OneCharLen(curr)) {
+namespace {
+
+// We expect kNumRelevantScripts to be small, so we stack-allocate the array
+// of counts.  Still, if that changes, we want to find out.
+static_assert(
+    kNumRelevantScripts < 25,
+    "switch counts to vector<int>: too big for stack-allocated int[]");
+
+// Adds to counts[s] the number of characters with script s in [begin, end),
+// and to *total_count their total number.  Returns the position of the first
+// partial UTF-8 character, if any, or end.
+const char *CountScripts(const char *begin, const char *end, int *counts,
+                         int *total_count) {
+  const char *curr = begin;
+  for (; curr < end; curr += utils::OneCharLen(curr)) {
     const int num_bytes = utils::OneCharLen(curr);
 
     // If a partial UTF-8 character is encountered, break out of the loop.
-    if (curr + num_bytes > text_end) {
+    if (curr + num_bytes > end) {
       break;
     }
 
@@ -73,7 +63,101 @@ void RelevantScriptFeature::Evaluate(const WorkspaceSet &workspaces,
     CLD3_DCHECK(script >= 0);
     CLD3_DCHECK(script < kNumRelevantScripts);
     counts[static_cast<int>(script)]++;
-    total_count++;
+    (*total_count)++;
+  }
+  return curr;
+}
+
+// Running counts of the scripts of the text seen so far.
+class ScriptCountsWorkspace : public Workspace {
+ public:
+  // Returns the name of this type of workspace.
+  static string TypeName() { return "ScriptCounts"; }
+
+  // Counts the scripts of the text after the bytes counted so far.
+  void Update(const string &text) {
+    CLD3_DCHECK(static_cast<int>(text.size()) >= num_counted_bytes_);
+    const char *end = CountScripts(text.data() + num_counted_bytes_,
+                                   text.data() + text.size(), counts_,
+                                   &total_count_);
+    num_counted_bytes_ = end - text.data();
+  }
+
+  // Drops the counts, as if the workspace had just been created.
+  void Reset() {
+    std::fill(counts_, counts_ + kNumRelevantScripts, 0);
+    total_count_ = 0;
+    num_counted_bytes_ = 0;
+  }
+
+  const int *counts() const { return counts_; }
+  int total_count() const { return total_count_; }
+
+ private:
+  // counts_[s] is the number of characters with script s.
+  int counts_[kNumRelevantScripts]{};
+  int total_count_ = 0;
+
+  // Number of bytes of the text counted so far.
+  int num_counted_bytes_ = 0;
+};
+
+}  // namespace
+
+void RelevantScriptFeature::Setup(TaskContext *context) {
+  // Nothing.
+}
+
+void RelevantScriptFeature::Init(TaskContext *context) {
+  set_feature_type(new NumericFeatureType(name(), kNumRelevantScripts));
+}
+
+void RelevantScriptFeature::RequestWorkspaces(WorkspaceRegistry *registry) {
+  workspace_index_ =
+      registry->Request<ScriptCountsWorkspace>("relevant-script-counts");
+  running_counts_index_ =
+      registry->Request<SingletonIntWorkspace>(kRunningCountsWorkspaceName);
+}
+
+void RelevantScriptFeature::Preprocess(WorkspaceSet *workspaces,
+                                       Sentence *sentence) const {
+  if (running_counts_index_ < 0 ||
+      !workspaces->Has<SingletonIntWorkspace>(running_counts_index_)) {
+    return;
+  }
+  if (!workspaces->Has<ScriptCountsWorkspace>(workspace_index_)) {
+    // Re-aim the workspace of the previous stream, if any.
+    ScriptCountsWorkspace *script_counts =
+        workspaces->TakeSpare<ScriptCountsWorkspace>(workspace_index_);
+    if (script_counts != nullptr) {
+      script_counts->Reset();
+    } else {
+      script_counts = new ScriptCountsWorkspace;
+    }
+    workspaces->Set(workspace_index_, script_counts);
+  }
+  workspaces->MutableGet<ScriptCountsWorkspace>(workspace_index_)
+      ->Update(sentence->text());
+}
+
+void RelevantScriptFeature::Evaluate(const WorkspaceSet &workspaces,
+                                     const Sentence &sentence,
+                                     FeatureVector *result) const {
+  // counts[s] is the number of characters with script s.
+  // Note: {} "value-initializes" the array to zero.
+  int own_counts[kNumRelevantScripts]{};
+  const int *counts = own_counts;
+  int total_count = 0;
+  if (workspace_index_ >= 0 &&
+      workspaces.Has<ScriptCountsWorkspace>(workspace_index_)) {
+    const ScriptCountsWorkspace &script_counts =
+        workspaces.Get<ScriptCountsWorkspace>(workspace_index_);
+    counts = script_counts.counts();
+    total_count = script_counts.total_count();
+  } else {
+    const string &text = sentence.text();
+    CountScripts(text.data(), text.data() + text.size(), own_counts,
+                 &total_count);
   }
 
   for (int script_id = 0; script_id < kNumRelevantScripts; ++script_id) {
@@ -34,14 +34,31 @@ namespace chrome_lang_id {
 // Hiragana characters almost always indicates Japanese, so Hiragana is a
 // "relevant" script for us.  The Latin script is used by dozens of language, so
 // Latin is not relevant in this context.
+//
+// If the kRunningCountsWorkspaceName workspace is set (see
+// language_identifier_features.h), the counts of the scripts are kept in a
+// workspace and only updated with the new text.
 class RelevantScriptFeature : public WholeSentenceFeature {
  public:
   void Setup(TaskContext *context) override;
   void Init(TaskContext *context) override;
 
+  // Requests the workspaces for running counts.
+  void RequestWorkspaces(WorkspaceRegistry *registry) override;
+
+  // With running counts, updates the counts of the scripts with the new text.
+  void Preprocess(WorkspaceSet *workspaces, Sentence *sentence) const override;
+
   // Appends the features computed from the sentence to the feature vector.
   void Evaluate(const WorkspaceSet &workspaces, const Sentence &sentence,
                 FeatureVector *result) const override;
+
+ private:
+  // Index of the workspace holding the running counts of the scripts, and of
+  // the kRunningCountsWorkspaceName workspace, or -1 if RequestWorkspaces()
+  // has not been called.
+  int workspace_index_ = -1;
+  int running_counts_index_ = -1;
 };
 
 }  // namespace chrome_lang_id
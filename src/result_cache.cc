@@ -0,0 +1,121 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "result_cache.h"
+
+#include <algorithm>
+
+#include "utils.h"
+
+namespace chrome_lang_id {
+
+const int ResultCache::kDefaultNumShards = 16;
+
+ResultCache::ResultCache(int capacity, int num_shards)
+    : capacity_(capacity),
+      num_shards_(std::max(
+          1, std::min(capacity, (num_shards > 0) ? num_shards
+                                                 : kDefaultNumShards))),
+      shards_(new Shard[num_shards_]),
+      num_hits_(0),
+      num_misses_(0) {
+  CLD3_CHECK(capacity_ > 0);
+
+  // The capacity is split as evenly as possible between the shards.
+  for (int i = 0; i < num_shards_; ++i) {
+    const int shard_capacity =
+        capacity_ / num_shards_ + ((i < capacity_ % num_shards_) ? 1 : 0);
+    shards_[i].slots.resize(shard_capacity);
+    shards_[i].index.reserve(shard_capacity);
+  }
+}
+
+ResultCache::~ResultCache() {}
+
+bool ResultCache::Lookup(uint64 key, Value *value) {
+  Shard &shard = GetShard(key);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      Slot &slot = shard.slots[it->second];
+      slot.referenced = true;
+      *value = slot.value;
+      num_hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  num_misses_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void ResultCache::Insert(uint64 key, const Value &value) {
+  Shard &shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    shard.slots[it->second].value = value;
+    return;
+  }
+
+  // Find a victim: the first slot that is free or was not referenced since
+  // the hand last passed it.  This takes at most two turns.
+  const int num_slots = shard.slots.size();
+  while (true) {
+    Slot &slot = shard.slots[shard.hand];
+    if (!slot.occupied || !slot.referenced) break;
+    slot.referenced = false;
+    shard.hand = (shard.hand + 1) % num_slots;
+  }
+  const int position = shard.hand;
+  shard.hand = (shard.hand + 1) % num_slots;
+
+  Slot &slot = shard.slots[position];
+  if (slot.occupied) shard.index.erase(slot.key);
+  slot.key = key;
+  slot.value = value;
+  slot.occupied = true;
+  slot.referenced = false;
+  shard.index[key] = position;
+}
+
+void ResultCache::Clear() {
+  for (int i = 0; i < num_shards_; ++i) {
+    Shard &shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (Slot &slot : shard.slots) {
+      slot.occupied = false;
+      slot.referenced = false;
+    }
+    shard.index.clear();
+    shard.hand = 0;
+  }
+}
+
+int ResultCache::size() const {
+  int size = 0;
+  for (int i = 0; i < num_shards_; ++i) {
+    Shard &shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    size += shard.index.size();
+  }
+  return size;
+}
+
+uint64 ResultCache::HashText(const char *text, int text_size, uint64 seed) {
+  return utils::Hash64(text, text_size, seed);
+}
+
+}  // namespace chrome_lang_id
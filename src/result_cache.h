@@ -0,0 +1,117 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "base.h"
+
+namespace chrome_lang_id {
+
+// A bounded, thread-safe cache of language predictions, keyed by a 64-bit hash
+// of the text that was classified (see HashText()).
+//
+// The entries are spread over shards, each with its own lock, by the low bits
+// of the key, so that concurrent lookups of different texts rarely contend.
+// Each shard holds a fixed number of slots, allocated up front, and evicts
+// entries with the CLOCK algorithm: a lookup marks the entry as referenced, and
+// an insertion into a full shard sweeps the slots, clearing the marks, until
+// it finds an entry that was not referenced since the last sweep.  This
+// approximates LRU without reordering a list on each hit.
+class ResultCache {
+ public:
+  // The cached part of a prediction.  The language is the id of the language
+  // in the model of the sessions that share the cache.
+  struct Value {
+    float probability = 0.0;
+    uint16 language_id = 0;
+    bool is_reliable = false;
+  };
+
+  // Creates a cache of at most capacity entries, split into num_shards shards.
+  // If num_shards <= 0, uses a default number of shards.
+  ResultCache(int capacity, int num_shards);
+  ~ResultCache();
+
+  // If there is an entry for key, copies its value to *value, marks it as
+  // referenced and returns true.  Otherwise, returns false.  Updates the hit
+  // and miss counters.
+  bool Lookup(uint64 key, Value *value);
+
+  // Adds an entry for key, or replaces the value of the existing one.
+  void Insert(uint64 key, const Value &value);
+
+  // Removes all the entries.  Does not reset the counters.
+  void Clear();
+
+  // Returns the number of entries, at most capacity().
+  int size() const;
+  int capacity() const { return capacity_; }
+
+  // Numbers of successful and failed lookups so far.
+  int64 num_hits() const { return num_hits_.load(std::memory_order_relaxed); }
+  int64 num_misses() const {
+    return num_misses_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the key for the text_size bytes at text.  seed distinguishes the
+  // predictions of the same text made in different conditions, e.g., with a
+  // different known script.
+  static uint64 HashText(const char *text, int text_size, uint64 seed);
+
+  // Default number of shards.
+  static const int kDefaultNumShards;
+
+ private:
+  struct Slot {
+    uint64 key = 0;
+    Value value;
+    bool occupied = false;
+    bool referenced = false;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+
+    // The slots of the shard, and the index in slots of each key.
+    std::vector<Slot> slots;
+    std::unordered_map<uint64, int> index;
+
+    // Position of the clock hand in slots.
+    int hand = 0;
+  };
+
+  // Returns the shard of key.
+  Shard &GetShard(uint64 key) { return shards_[key % num_shards_]; }
+
+  const int capacity_;
+  const int num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+
+  std::atomic<int64> num_hits_;
+  std::atomic<int64> num_misses_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(ResultCache);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // RESULT_CACHE_H_
@@ -0,0 +1,143 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "result_cache.h"
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+
+namespace chrome_lang_id {
+namespace result_cache_test {
+
+bool PrintAndReturnStatus(bool status) {
+  if (status) {
+    std::cout << "  Success" << std::endl;
+    return true;
+  } else {
+    std::cout << "  Failure" << std::endl;
+    return false;
+  }
+}
+
+ResultCache::Value MakeValue(int language_id, float probability) {
+  ResultCache::Value value;
+  value.language_id = language_id;
+  value.probability = probability;
+  value.is_reliable = probability >= 0.7f;
+  return value;
+}
+
+// Checks that inserted entries are found, with their latest values, and that
+// the counters count the hits and misses.
+bool TestLookupAndInsert() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  ResultCache cache(/*capacity=*/100, /*num_shards=*/4);
+  bool test_successful = true;
+  ResultCache::Value value;
+  test_successful &= !cache.Lookup(1, &value);
+  cache.Insert(1, MakeValue(1, 0.9f));
+  cache.Insert(2, MakeValue(2, 0.5f));
+  cache.Insert(2, MakeValue(3, 0.8f));
+  test_successful &= cache.Lookup(1, &value) && value.language_id == 1 &&
+                     value.probability == 0.9f && value.is_reliable;
+  test_successful &= cache.Lookup(2, &value) && value.language_id == 3;
+  test_successful &= !cache.Lookup(3, &value);
+  test_successful &= (cache.size() == 2);
+  test_successful &= (cache.num_hits() == 2) && (cache.num_misses() == 2);
+
+  cache.Clear();
+  test_successful &= !cache.Lookup(1, &value) && (cache.size() == 0);
+
+  // The same text with a different seed gives a different key.
+  const string text = " some text ";
+  test_successful &= (ResultCache::HashText(text.data(), text.size(), 0) ==
+                      ResultCache::HashText(text.data(), text.size(), 0));
+  test_successful &= (ResultCache::HashText(text.data(), text.size(), 0) !=
+                      ResultCache::HashText(text.data(), text.size(), 1));
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that the number of entries stays within the capacity, and that the
+// entries looked up since the last eviction survive the next ones.
+bool TestEviction() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const int kCapacity = 8;
+  ResultCache cache(kCapacity, /*num_shards=*/1);
+  for (uint64 key = 0; key < kCapacity; ++key) {
+    cache.Insert(key, MakeValue(1, 0.9f));
+  }
+  ResultCache::Value value;
+  bool test_successful = cache.Lookup(0, &value) && cache.Lookup(5, &value);
+
+  // Make room for half the capacity: the referenced entries are skipped.
+  for (uint64 key = 100; key < 100 + kCapacity / 2; ++key) {
+    cache.Insert(key, MakeValue(2, 0.9f));
+  }
+  test_successful &= (cache.size() == kCapacity);
+  test_successful &= cache.Lookup(0, &value) && cache.Lookup(5, &value);
+  test_successful &= cache.Lookup(100 + kCapacity / 2 - 1, &value);
+
+  for (uint64 key = 1000; key < 1000 + 10 * kCapacity; ++key) {
+    cache.Insert(key, MakeValue(3, 0.9f));
+  }
+  test_successful &= (cache.size() == kCapacity);
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that concurrent lookups and insertions of overlapping keys keep the
+// cache consistent: every hit returns the value inserted for its key.
+bool TestConcurrentAccess() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  ResultCache cache(/*capacity=*/64, /*num_shards=*/4);
+  const int kNumThreads = 4;
+  std::vector<int> num_wrong_values(kNumThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&cache, &num_wrong_values, t]() {
+      ResultCache::Value value;
+      for (int i = 0; i < 20000; ++i) {
+        const uint64 key = (i * 7 + t) % 200;
+        if (cache.Lookup(key, &value)) {
+          if (value.language_id != key) ++num_wrong_values[t];
+        } else {
+          cache.Insert(key, MakeValue(key, 0.9f));
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  bool test_successful = (cache.size() <= cache.capacity());
+  test_successful &= (cache.num_hits() + cache.num_misses() ==
+                      static_cast<int64>(kNumThreads) * 20000);
+  for (int num_wrong : num_wrong_values) test_successful &= (num_wrong == 0);
+  return PrintAndReturnStatus(test_successful);
+}
+
+}  // namespace result_cache_test
+}  // namespace chrome_lang_id
+
+// Runs the result cache tests.
+int main(int argc, char **argv) {
+  const bool tests_successful =
+      chrome_lang_id::result_cache_test::TestLookupAndInsert() &&
+      chrome_lang_id::result_cache_test::TestEviction() &&
+      chrome_lang_id::result_cache_test::TestConcurrentAccess();
+  return tests_successful ? 0 : 1;
+}
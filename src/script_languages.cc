@@ -0,0 +1,53 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "script_languages.h"
+
+namespace chrome_lang_id {
+
+bool IsHangul(char32 codepoint) {
+  return (codepoint >= 0x1100 && codepoint <= 0x11FF) ||  // Hangul Jamo
+         (codepoint >= 0xA960 && codepoint <= 0xA97F) ||  // Jamo Extended A
+         (codepoint >= 0xD7B0 && codepoint <= 0xD7FF) ||  // Jamo Extended B
+         (codepoint >= 0x3130 && codepoint <= 0x318F) ||  // Compatibility Jamo
+         (codepoint >= 0xFFA0 && codepoint <= 0xFFDC) ||  // Halfwidth Jamo
+         (codepoint >= 0xAC00 && codepoint <= 0xD7AF);    // Hangul Syllables
+}
+
+const ScriptLanguage kScriptLanguages[] = {
+    {CLD2::ULScript_Greek, "el"},     {CLD2::ULScript_Armenian, "hy"},
+    {CLD2::ULScript_Bengali, "bn"},   {CLD2::ULScript_Gurmukhi, "pa"},
+    {CLD2::ULScript_Gujarati, "gu"},  {CLD2::ULScript_Tamil, "ta"},
+    {CLD2::ULScript_Telugu, "te"},    {CLD2::ULScript_Kannada, "kn"},
+    {CLD2::ULScript_Malayalam, "ml"}, {CLD2::ULScript_Sinhala, "si"},
+    {CLD2::ULScript_Thai, "th"},      {CLD2::ULScript_Lao, "lo"},
+    {CLD2::ULScript_Myanmar, "my"},   {CLD2::ULScript_Georgian, "ka"},
+    {CLD2::ULScript_Ethiopic, "am"},  {CLD2::ULScript_Khmer, "km"},
+    {kHangulScript, "ko"},
+};
+
+const int kNumScriptLanguages =
+    sizeof(kScriptLanguages) / sizeof(kScriptLanguages[0]);
+
+const char *GetScriptLanguage(int script) {
+  for (int i = 0; i < kNumScriptLanguages; ++i) {
+    if (kScriptLanguages[i].script == script) {
+      return kScriptLanguages[i].language;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace chrome_lang_id
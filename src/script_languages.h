@@ -0,0 +1,51 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef SCRIPT_LANGUAGES_H_
+#define SCRIPT_LANGUAGES_H_
+
+#include "base.h"
+#include "script_span/generated_ulscript.h"
+
+namespace chrome_lang_id {
+
+// Script of the letters of ULScript_Hani in Hangul, with the same value as the
+// one ScriptFeature gives to text mostly in Hangul.
+const int kHangulScript = CLD2::NUM_ULSCRIPTS;
+
+// Returns true if codepoint is in one of the Hangul blocks.
+bool IsHangul(char32 codepoint);
+
+// A script whose text, among the languages of the built-in model (see
+// TaskContextParams::kLanguageNames), is always in the same language.
+struct ScriptLanguage {
+  // A ULScript, or kHangulScript.
+  int script;
+  const char *language;
+};
+
+// The scripts that identify a language on their own.  Scripts shared by
+// several languages of the model are left out, e.g., Hebrew (iw and yi),
+// Devanagari (hi, mr and ne) or Hani (zh and ja).
+extern const ScriptLanguage kScriptLanguages[];
+extern const int kNumScriptLanguages;
+
+// Returns the language of script if it is in kScriptLanguages, and nullptr
+// otherwise.
+const char *GetScriptLanguage(int script);
+
+}  // namespace chrome_lang_id
+
+#endif  // SCRIPT_LANGUAGES_H_
@@ -563,6 +563,91 @@ int SpanInterchangeValid(const char* src, int byte_length) {
   return bytes_consumed;
 }
 
+namespace {
+
+// Per-thread free list of script buffers.  Scanners are short-lived and often
+// nested (one for the document, one per snippet), so a handful of buffers per
+// thread is enough to make scanner construction allocation-free.
+class ScriptBufferPool {
+ public:
+  ScriptBufferPool() { alive_ = true; }
+  ~ScriptBufferPool() {
+    alive_ = false;
+    for (int i = 0; i < num_free_; ++i) {
+      delete[] free_[i].script_buffer;
+      delete[] free_[i].script_buffer_lower;
+    }
+  }
+
+  // Returns the pool of the current thread, or nullptr once it has been
+  // destroyed at thread exit
+  static ScriptBufferPool* Get() {
+    static thread_local ScriptBufferPool pool;
+    return alive_ ? &pool : nullptr;
+  }
+
+  void Acquire(char** script_buffer, char** script_buffer_lower) {
+    if (num_free_ > 0) {
+      --num_free_;
+      *script_buffer = free_[num_free_].script_buffer;
+      *script_buffer_lower = free_[num_free_].script_buffer_lower;
+    } else {
+      *script_buffer = new char[kMaxScriptBuffer];
+      *script_buffer_lower = new char[kMaxScriptLowerBuffer];
+    }
+  }
+
+  // Keeps the buffers for reuse, unless the pool is full
+  void Release(char* script_buffer, char* script_buffer_lower) {
+    if (num_free_ < kMaxFreeBuffers) {
+      free_[num_free_].script_buffer = script_buffer;
+      free_[num_free_].script_buffer_lower = script_buffer_lower;
+      ++num_free_;
+    } else {
+      delete[] script_buffer;
+      delete[] script_buffer_lower;
+    }
+  }
+
+ private:
+  static const int kMaxFreeBuffers = 4;
+
+  struct Buffers {
+    char* script_buffer;
+    char* script_buffer_lower;
+  };
+
+  // Trivially destructible, so that it can be checked during thread exit
+  static thread_local bool alive_;
+
+  Buffers free_[kMaxFreeBuffers];
+  int num_free_ = 0;
+};
+
+thread_local bool ScriptBufferPool::alive_ = false;
+
+void AcquireScriptBuffers(char** script_buffer, char** script_buffer_lower) {
+  ScriptBufferPool* pool = ScriptBufferPool::Get();
+  if (pool != nullptr) {
+    pool->Acquire(script_buffer, script_buffer_lower);
+  } else {
+    *script_buffer = new char[kMaxScriptBuffer];
+    *script_buffer_lower = new char[kMaxScriptLowerBuffer];
+  }
+}
+
+void ReleaseScriptBuffers(char* script_buffer, char* script_buffer_lower) {
+  ScriptBufferPool* pool = ScriptBufferPool::Get();
+  if (pool != nullptr) {
+    pool->Release(script_buffer, script_buffer_lower);
+  } else {
+    delete[] script_buffer;
+    delete[] script_buffer_lower;
+  }
+}
+
+}  // namespace
+
 ScriptScanner::ScriptScanner(const char* buffer,
                              int buffer_length,
                              bool is_plain_text)
@@ -573,8 +658,7 @@ ScriptScanner::ScriptScanner(const char* buffer,
   letters_marks_only_(true),
   one_script_only_(true),
   exit_state_(kMaxExitStateLettersMarksOnly) {
-    script_buffer_ = new char[kMaxScriptBuffer];
-    script_buffer_lower_ = new char[kMaxScriptLowerBuffer];
+    AcquireScriptBuffers(&script_buffer_, &script_buffer_lower_);
     map2original_.Clear();    // map from script_buffer_ to buffer
     map2uplow_.Clear();       // map from script_buffer_lower_ to script_buffer_
 }
@@ -592,16 +676,22 @@ ScriptScanner::ScriptScanner(const char* buffer,
   letters_marks_only_(!any_text),
   one_script_only_(!any_script),
   exit_state_(any_text ? kMaxExitStateAllText : kMaxExitStateLettersMarksOnly) {
-    script_buffer_ = new char[kMaxScriptBuffer];
-    script_buffer_lower_ = new char[kMaxScriptLowerBuffer];
+    AcquireScriptBuffers(&script_buffer_, &script_buffer_lower_);
     map2original_.Clear();    // map from script_buffer_ to buffer
     map2uplow_.Clear();       // map from script_buffer_lower_ to script_buffer_
 }
 
 
 ScriptScanner::~ScriptScanner() {
-  delete[] script_buffer_;
-  delete[] script_buffer_lower_;
+  ReleaseScriptBuffers(script_buffer_, script_buffer_lower_);
+}
+
+void ScriptScanner::Reset(const char* buffer, int buffer_length) {
+  start_byte_ = buffer;
+  next_byte_ = buffer;
+  byte_length_ = buffer_length;
+  map2original_.Clear();
+  map2uplow_.Clear();
 }
 
 
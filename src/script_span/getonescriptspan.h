@@ -61,6 +61,10 @@ int BinarySearch(const char* key, int lo, int hi, const CharIntPair* cipair);
 //  interchange valid UTF-8
 int SpanInterchangeValid(const char* src, int byte_length);
 
+// The script buffers (kMaxScriptBuffer + kMaxScriptLowerBuffer bytes) are
+// taken from a per-thread pool and returned to it by the destructor, so that
+// constructing a scanner does not allocate in steady state.  A long-lived
+// scanner can also be re-aimed at new input with Reset().
 class ScriptScanner {
  public:
   ScriptScanner(const char* buffer, int buffer_length, bool is_plain_text);
@@ -68,6 +72,10 @@ class ScriptScanner {
                 bool any_text, bool any_script);
   ~ScriptScanner();
 
+  // Restarts scanning on a new input buffer, keeping the script buffers and
+  // the is_plain_text / any_text / any_script settings
+  void Reset(const char* buffer, int buffer_length);
+
   // Copy next run of same-script non-tag letters to buffer [NUL terminated]
   bool GetOneScriptSpan(LangSpan* span);
 
@@ -99,6 +107,10 @@ class ScriptScanner {
   // Skip over tags and non-letters
   int SkipToFrontOfSpan(const char* src, int len, int* script);
 
+  // No copying: the script buffers are owned by the scanner
+  ScriptScanner(const ScriptScanner&) = delete;
+  void operator=(const ScriptScanner&) = delete;
+
   const char* start_byte_;        // Starting byte of buffer to scan
   const char* next_byte_;         // First unscanned byte
   int byte_length_;               // Bytes left
@@ -121,6 +121,43 @@ bool TestStringCut() {
   }
 }
 
+// Tests that a scanner re-aimed with Reset() finds the same lowercased spans,
+// with the same offsets, as a freshly constructed one.  Returns "true" if the
+// test is successful and "false" otherwise.
+bool TestReset() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const std::vector<std::string> texts{
+      "Text in English. Текст на Български. Also text in English.",
+      "", "12345 !!", "ΕΛΛΗΝΙΚΆ κείμενο and Latin TEXT"};
+
+  ScriptScanner reused(nullptr, 0, /*is_plain_text=*/true);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (const std::string &text : texts) {
+      ScriptScanner fresh(text.c_str(), text.size(), /*is_plain_text=*/true);
+      reused.Reset(text.c_str(), text.size());
+      LangSpan fresh_span;
+      LangSpan reused_span;
+      bool fresh_found;
+      do {
+        fresh_found = fresh.GetOneScriptSpanLower(&fresh_span);
+        const bool reused_found = reused.GetOneScriptSpanLower(&reused_span);
+        if (fresh_found != reused_found ||
+            (fresh_found &&
+             (std::string(fresh_span.text, fresh_span.text_bytes) !=
+                  std::string(reused_span.text, reused_span.text_bytes) ||
+              fresh_span.offset != reused_span.offset ||
+              fresh_span.ulscript != reused_span.ulscript))) {
+          std::cout << "  Failure" << std::endl;
+          std::cout << "  Input: " << text << std::endl;
+          return false;
+        }
+      } while (fresh_found);
+    }
+  }
+  std::cout << "  Success!" << std::endl;
+  return true;
+}
+
 }  // namespace getonescriptspan_test
 }  // namespace CLD2
 }  // namespace chrome_lang_id
@@ -130,6 +167,7 @@ int main(int argc, char **argv) {
   const bool tests_successful =
       chrome_lang_id::CLD2::getonescriptspan_test::TestInvalidUTF8Input() &&
       chrome_lang_id::CLD2::getonescriptspan_test::TestScriptDetection() &&
-      chrome_lang_id::CLD2::getonescriptspan_test::TestStringCut();
+      chrome_lang_id::CLD2::getonescriptspan_test::TestStringCut() &&
+      chrome_lang_id::CLD2::getonescriptspan_test::TestReset();
   return tests_successful ? 0 : 1;
 }
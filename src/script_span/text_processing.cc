@@ -169,8 +169,8 @@ int CheapSqueezeInplace(char *isrc, int src_len, int ichunksize) {
 
   int hash = 0;
 
-  // Allocate local prediction table.
-  int *predict_tbl = new int[kPredictionTableSize];
+  // Clear the prediction table, kept per thread to avoid reallocating it.
+  static thread_local int predict_tbl[kPredictionTableSize];
   memset(predict_tbl, 0, kPredictionTableSize * sizeof(predict_tbl[0]));
 
   int chunksize = ichunksize;
@@ -235,9 +235,6 @@ int CheapSqueezeInplace(char *isrc, int src_len, int ichunksize) {
     // Make last char clean UTF-8 by putting following space off the end
     dst[0] = ' ';
   }
-
-  // Deallocate local prediction table
-  delete[] predict_tbl;
   return static_cast<int>(dst - isrc);
 }
 
@@ -0,0 +1,64 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "simd_adders.h"
+
+namespace chrome_lang_id {
+namespace {
+
+// Queries CPUID.  Should be called only once, through GetBestAdderType().
+AdderType DetectBestAdderType() {
+#if defined(CLD3_HAVE_X86_SIMD_ADDERS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return AdderType::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return AdderType::AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return AdderType::SSE42;
+  }
+#endif  // defined(CLD3_HAVE_X86_SIMD_ADDERS)
+  return AdderType::SIMPLE;
+}
+}  // namespace
+
+AdderType GetBestAdderType() {
+  // Thread-safe initialization of function-level static (C++11).
+  static const AdderType best_adder_type = DetectBestAdderType();
+  return best_adder_type;
+}
+
+bool IsAdderTypeSupported(AdderType adder_type) {
+  return static_cast<int>(adder_type) <=
+         static_cast<int>(GetBestAdderType());
+}
+
+const char *AdderTypeName(AdderType adder_type) {
+  switch (adder_type) {
+    case AdderType::SIMPLE:
+      return "simple";
+    case AdderType::SSE42:
+      return "sse4.2";
+    case AdderType::AVX2:
+      return "avx2";
+    case AdderType::AVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+}  // namespace chrome_lang_id
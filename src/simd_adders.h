@@ -0,0 +1,298 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Vectorized versions of SimpleAdder (see simple_adder.h).  Each class below
+// implements the same LazyAdd / LazyScaleAdd / Finalize contract, so any of
+// them can be used as the ScaleAdderClass template argument of
+// EmbeddingNetwork::FinishComputeFinalScores.
+//
+// The code is compiled with per-function target attributes, so the library
+// itself does not need to be built with -msse4.2 / -mavx2 / -mavx512f.  Use
+// GetBestAdderType() to find out, at runtime, which adders the CPU supports.
+//
+// Each adder also provides Int8DotImpl, the int32-accumulating dot product
+// used for int8 weights; its results are exact, hence identical for all
+// adders.
+//
+// Accuracy: SseAdder performs exactly the same operations as SimpleAdder and
+// produces bit-identical results.  Avx2Adder and Avx512Adder use fused
+// multiply-add, which rounds once instead of twice; each output element
+// differs from the SimpleAdder result by at most 1e-5 relative to the sum of
+// the absolute values of the added terms (kSimdAdderRelativeTolerance).
+
+#ifndef SIMD_ADDERS_H_
+#define SIMD_ADDERS_H_
+
+#include "base.h"
+#include "simple_adder.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CLD3_HAVE_X86_SIMD_ADDERS 1
+#include <immintrin.h>
+#define CLD3_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define CLD3_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define CLD3_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+namespace chrome_lang_id {
+
+// Documented bound on the difference between the output of any adder in this
+// file and the output of SimpleAdder; see comment at the top of the file.
+static constexpr float kSimdAdderRelativeTolerance = 1e-5f;
+
+// Adder implementations, from slowest to fastest.
+enum class AdderType { SIMPLE = 0, SSE42, AVX2, AVX512 };
+
+// Returns the fastest adder type supported by the CPU we are running on.  The
+// CPUID check is performed only once per process.
+AdderType GetBestAdderType();
+
+// Returns true if the CPU we are running on supports adder_type.
+bool IsAdderTypeSupported(AdderType adder_type);
+
+// Returns a human-readable name for adder_type, e.g., "avx2".
+const char *AdderTypeName(AdderType adder_type);
+
+#if defined(CLD3_HAVE_X86_SIMD_ADDERS)
+
+// Base class for the SIMD adders: bookkeeping shared with SimpleAdder.
+class SimdAdderBase {
+ public:
+  SimdAdderBase(float *dest, int num_floats)
+      : dest_(dest), num_floats_(num_floats) {}
+
+  ~SimdAdderBase() {
+    // Should call Finalize function before destruction.
+    CLD3_DCHECK(dest_ == nullptr);
+  }
+
+  // Caller must call this function before calling deconstruct this object.
+  void Finalize() { dest_ = nullptr; }
+
+ protected:
+  float *dest_;
+  int num_floats_;
+};
+
+// Adder using 128-bit SSE registers (4 floats at a time).
+class SseAdder : public SimdAdderBase {
+ public:
+  static constexpr const int kNumFloatsPerBatch = 4;
+
+  SseAdder(float *dest, int num_floats) : SimdAdderBase(dest, num_floats) {}
+
+  CLD3_TARGET_SSE42 void LazyAdd(const float *source) const {
+    AddImpl(source, num_floats_, dest_);
+  }
+
+  CLD3_TARGET_SSE42 void LazyScaleAdd(const float *source,
+                                      const float scale) const {
+    ScaleAddImpl(source, num_floats_, scale, dest_);
+  }
+
+  // Implements dest += source.
+  CLD3_TARGET_SSE42 static void AddImpl(const float *__restrict source,
+                                        uint32 size, float *__restrict dest) {
+    uint32 i = 0;
+    for (; i + kNumFloatsPerBatch <= size; i += kNumFloatsPerBatch) {
+      _mm_storeu_ps(dest + i,
+                    _mm_add_ps(_mm_loadu_ps(dest + i), _mm_loadu_ps(source + i)));
+    }
+    SimpleAdder::AddImpl(source + i, size - i, dest + i);
+  }
+
+  // Implements dest += scale * source.
+  CLD3_TARGET_SSE42 static void ScaleAddImpl(const float *__restrict source,
+                                             uint32 size, const float scale,
+                                             float *__restrict dest) {
+    const __m128 scale4 = _mm_set1_ps(scale);
+    uint32 i = 0;
+    for (; i + kNumFloatsPerBatch <= size; i += kNumFloatsPerBatch) {
+      const __m128 product = _mm_mul_ps(_mm_loadu_ps(source + i), scale4);
+      _mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), product));
+    }
+    SimpleAdder::ScaleAddImpl(source + i, size - i, scale, dest + i);
+  }
+
+  // Returns the dot product of the int8 arrays a and b: 8 elements at a time,
+  // sign-extended to int16 and multiplied and added in pairs (pmaddwd).
+  CLD3_TARGET_SSE42 static int32 Int8DotImpl(const int8 *__restrict a,
+                                             const int8 *__restrict b,
+                                             uint32 size) {
+    __m128i sum4 = _mm_setzero_si128();
+    uint32 i = 0;
+    for (; i + 8 <= size; i += 8) {
+      const __m128i a8 = _mm_cvtepi8_epi16(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + i)));
+      const __m128i b8 = _mm_cvtepi8_epi16(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + i)));
+      sum4 = _mm_add_epi32(sum4, _mm_madd_epi16(a8, b8));
+    }
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0x4e));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0xb1));
+    return _mm_cvtsi128_si32(sum4) +
+           SimpleAdder::Int8DotImpl(a + i, b + i, size - i);
+  }
+};
+
+// Adder using 256-bit AVX registers and FMA (8 floats at a time).
+class Avx2Adder : public SimdAdderBase {
+ public:
+  static constexpr const int kNumFloatsPerBatch = 8;
+
+  Avx2Adder(float *dest, int num_floats) : SimdAdderBase(dest, num_floats) {}
+
+  CLD3_TARGET_AVX2 void LazyAdd(const float *source) const {
+    AddImpl(source, num_floats_, dest_);
+  }
+
+  CLD3_TARGET_AVX2 void LazyScaleAdd(const float *source,
+                                     const float scale) const {
+    ScaleAddImpl(source, num_floats_, scale, dest_);
+  }
+
+  // Implements dest += source.
+  CLD3_TARGET_AVX2 static void AddImpl(const float *__restrict source,
+                                       uint32 size, float *__restrict dest) {
+    uint32 i = 0;
+    for (; i + kNumFloatsPerBatch <= size; i += kNumFloatsPerBatch) {
+      _mm256_storeu_ps(dest + i, _mm256_add_ps(_mm256_loadu_ps(dest + i),
+                                               _mm256_loadu_ps(source + i)));
+    }
+    SimpleAdder::AddImpl(source + i, size - i, dest + i);
+  }
+
+  // Implements dest += scale * source.
+  CLD3_TARGET_AVX2 static void ScaleAddImpl(const float *__restrict source,
+                                            uint32 size, const float scale,
+                                            float *__restrict dest) {
+    const __m256 scale8 = _mm256_set1_ps(scale);
+    uint32 i = 0;
+    for (; i + kNumFloatsPerBatch <= size; i += kNumFloatsPerBatch) {
+      _mm256_storeu_ps(dest + i,
+                       _mm256_fmadd_ps(_mm256_loadu_ps(source + i), scale8,
+                                       _mm256_loadu_ps(dest + i)));
+    }
+    SimpleAdder::ScaleAddImpl(source + i, size - i, scale, dest + i);
+  }
+
+  // Returns the dot product of the int8 arrays a and b: 16 elements at a
+  // time, sign-extended to int16 and multiplied and added in pairs.
+  CLD3_TARGET_AVX2 static int32 Int8DotImpl(const int8 *__restrict a,
+                                            const int8 *__restrict b,
+                                            uint32 size) {
+    __m256i sum8 = _mm256_setzero_si256();
+    uint32 i = 0;
+    for (; i + 16 <= size; i += 16) {
+      const __m256i a16 = _mm256_cvtepi8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+      const __m256i b16 = _mm256_cvtepi8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+      sum8 = _mm256_add_epi32(sum8, _mm256_madd_epi16(a16, b16));
+    }
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(sum8),
+                                 _mm256_extracti128_si256(sum8, 1));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0x4e));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0xb1));
+    return _mm_cvtsi128_si32(sum4) +
+           SimpleAdder::Int8DotImpl(a + i, b + i, size - i);
+  }
+};
+
+// Adder using 512-bit AVX-512 registers (16 floats at a time).  The tail is
+// handled with a masked load/store instead of a scalar loop.
+class Avx512Adder : public SimdAdderBase {
+ public:
+  static constexpr const int kNumFloatsPerBatch = 16;
+
+  Avx512Adder(float *dest, int num_floats)
+      : SimdAdderBase(dest, num_floats) {}
+
+  CLD3_TARGET_AVX512 void LazyAdd(const float *source) const {
+    AddImpl(source, num_floats_, dest_);
+  }
+
+  CLD3_TARGET_AVX512 void LazyScaleAdd(const float *source,
+                                       const float scale) const {
+    ScaleAddImpl(source, num_floats_, scale, dest_);
+  }
+
+  // Implements dest += source.
+  CLD3_TARGET_AVX512 static void AddImpl(const float *__restrict source,
+                                         uint32 size, float *__restrict dest) {
+    uint32 i = 0;
+    for (; i + kNumFloatsPerBatch <= size; i += kNumFloatsPerBatch) {
+      _mm512_storeu_ps(dest + i, _mm512_add_ps(_mm512_loadu_ps(dest + i),
+                                               _mm512_loadu_ps(source + i)));
+    }
+    if (i < size) {
+      const __mmask16 mask = (1u << (size - i)) - 1;
+      const __m512 sum = _mm512_add_ps(_mm512_maskz_loadu_ps(mask, dest + i),
+                                       _mm512_maskz_loadu_ps(mask, source + i));
+      _mm512_mask_storeu_ps(dest + i, mask, sum);
+    }
+  }
+
+  // Implements dest += scale * source.
+  CLD3_TARGET_AVX512 static void ScaleAddImpl(const float *__restrict source,
+                                              uint32 size, const float scale,
+                                              float *__restrict dest) {
+    const __m512 scale16 = _mm512_set1_ps(scale);
+    uint32 i = 0;
+    for (; i + kNumFloatsPerBatch <= size; i += kNumFloatsPerBatch) {
+      _mm512_storeu_ps(dest + i,
+                       _mm512_fmadd_ps(_mm512_loadu_ps(source + i), scale16,
+                                       _mm512_loadu_ps(dest + i)));
+    }
+    if (i < size) {
+      const __mmask16 mask = (1u << (size - i)) - 1;
+      const __m512 sum =
+          _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, source + i), scale16,
+                          _mm512_maskz_loadu_ps(mask, dest + i));
+      _mm512_mask_storeu_ps(dest + i, mask, sum);
+    }
+  }
+
+  // Returns the dot product of the int8 arrays a and b.  AVX-512F has no
+  // 512-bit pmaddwd (that needs AVX-512BW), and widening to int32 costs more
+  // than it saves, so this uses 256-bit registers, as Avx2Adder does; every
+  // AVX-512F CPU supports AVX2.
+  CLD3_TARGET_AVX512 static int32 Int8DotImpl(const int8 *__restrict a,
+                                              const int8 *__restrict b,
+                                              uint32 size) {
+    __m256i sum8 = _mm256_setzero_si256();
+    uint32 i = 0;
+    for (; i + 16 <= size; i += 16) {
+      const __m256i a16 = _mm256_cvtepi8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+      const __m256i b16 = _mm256_cvtepi8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+      sum8 = _mm256_add_epi32(sum8, _mm256_madd_epi16(a16, b16));
+    }
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(sum8),
+                                 _mm256_extracti128_si256(sum8, 1));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0x4e));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0xb1));
+    return _mm_cvtsi128_si32(sum4) +
+           SimpleAdder::Int8DotImpl(a + i, b + i, size - i);
+  }
+};
+
+#endif  // defined(CLD3_HAVE_X86_SIMD_ADDERS)
+
+}  // namespace chrome_lang_id
+
+#endif  // SIMD_ADDERS_H_
@@ -0,0 +1,153 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "simd_adders.h"
+
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "base.h"
+#include "simple_adder.h"
+
+namespace chrome_lang_id {
+namespace simd_adders_test {
+
+bool PrintAndReturnStatus(bool status) {
+  if (status) {
+    std::cout << "  Success" << std::endl;
+    return true;
+  } else {
+    std::cout << "  Failure" << std::endl;
+    return false;
+  }
+}
+
+// Runs kNumRows LazyScaleAdd steps (and one LazyAdd step) with both
+// SimpleAdder and ADDER over random data of the given size, and checks that the
+// results agree within kSimdAdderRelativeTolerance.
+template <typename ADDER>
+bool AdderMatchesSimpleAdder(int size) {
+  static const int kNumRows = 80;
+  std::mt19937 rng(size);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  std::vector<float> rows(kNumRows * size);
+  std::vector<float> scales(kNumRows);
+  for (float &value : rows) value = dist(rng);
+  for (float &value : scales) value = dist(rng);
+
+  std::vector<float> expected(size, 0.5f);
+  std::vector<float> actual(size, 0.5f);
+  std::vector<float> abs_sum(size, 0.5f);
+  SimpleAdder simple_adder(expected.data(), size);
+  ADDER adder(actual.data(), size);
+  for (int r = 0; r < kNumRows; ++r) {
+    simple_adder.LazyScaleAdd(rows.data() + r * size, scales[r]);
+    adder.LazyScaleAdd(rows.data() + r * size, scales[r]);
+    for (int i = 0; i < size; ++i) {
+      abs_sum[i] += std::abs(rows[r * size + i] * scales[r]);
+    }
+  }
+  simple_adder.LazyAdd(rows.data());
+  adder.LazyAdd(rows.data());
+  simple_adder.Finalize();
+  adder.Finalize();
+
+  for (int i = 0; i < size; ++i) {
+    const float tolerance =
+        kSimdAdderRelativeTolerance * (abs_sum[i] + std::abs(rows[i]));
+    if (std::abs(expected[i] - actual[i]) > tolerance) {
+      std::cout << "  size " << size << ", element " << i << ": expected "
+                << expected[i] << ", got " << actual[i] << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks that ADDER::Int8DotImpl gives exactly the same results as
+// SimpleAdder::Int8DotImpl on random data of the given size, including the
+// extreme values.
+template <typename ADDER>
+bool Int8AdderMatchesSimpleAdder(int size) {
+  std::mt19937 rng(size);
+  std::uniform_int_distribution<int> dist(-127, 127);
+  std::vector<int8> a(size);
+  std::vector<int8> b(size);
+  for (int8 &value : a) value = static_cast<int8>(dist(rng));
+  for (int8 &value : b) value = static_cast<int8>(dist(rng));
+  const std::vector<int8> extremes(size, -127);
+  const std::vector<const std::vector<int8> *> others = {&a, &b, &extremes};
+  for (const std::vector<int8> *other : others) {
+    if (ADDER::Int8DotImpl(a.data(), other->data(), size) !=
+            SimpleAdder::Int8DotImpl(a.data(), other->data(), size) ||
+        ADDER::Int8DotImpl(extremes.data(), other->data(), size) !=
+            SimpleAdder::Int8DotImpl(extremes.data(), other->data(), size)) {
+      std::cout << "  Int8DotImpl mismatch for size " << size << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks ADDER on sizes that exercise both the vectorized loop and the tail.
+template <typename ADDER>
+bool TestAdder(AdderType adder_type) {
+  std::cout << "Running " << __FUNCTION__ << "<" << AdderTypeName(adder_type)
+            << ">" << std::endl;
+  if (!IsAdderTypeSupported(adder_type)) {
+    std::cout << "  Skipped: not supported by this CPU" << std::endl;
+    return true;
+  }
+  bool test_successful = true;
+  for (int size : {1, 3, 4, 7, 8, 15, 16, 17, 31, 80, 109, 208}) {
+    test_successful &= AdderMatchesSimpleAdder<ADDER>(size);
+    test_successful &= Int8AdderMatchesSimpleAdder<ADDER>(size);
+  }
+  return PrintAndReturnStatus(test_successful);
+}
+
+// Checks that the adder types are ordered consistently with
+// GetBestAdderType().
+bool TestBestAdderType() {
+  std::cout << "Running " << __FUNCTION__ << std::endl;
+  const AdderType best = GetBestAdderType();
+  std::cout << "  Best adder on this CPU: " << AdderTypeName(best)
+            << std::endl;
+  return PrintAndReturnStatus(IsAdderTypeSupported(AdderType::SIMPLE) &&
+                              IsAdderTypeSupported(best));
+}
+
+}  // namespace simd_adders_test
+}  // namespace chrome_lang_id
+
+// Runs the SIMD adder tests.
+int main(int argc, char **argv) {
+  using chrome_lang_id::AdderType;
+  bool tests_successful =
+      chrome_lang_id::simd_adders_test::TestBestAdderType();
+#if defined(CLD3_HAVE_X86_SIMD_ADDERS)
+  tests_successful =
+      tests_successful &&
+      chrome_lang_id::simd_adders_test::TestAdder<chrome_lang_id::SseAdder>(
+          AdderType::SSE42) &&
+      chrome_lang_id::simd_adders_test::TestAdder<chrome_lang_id::Avx2Adder>(
+          AdderType::AVX2) &&
+      chrome_lang_id::simd_adders_test::TestAdder<chrome_lang_id::Avx512Adder>(
+          AdderType::AVX512);
+#endif  // defined(CLD3_HAVE_X86_SIMD_ADDERS)
+  return tests_successful ? 0 : 1;
+}
@@ -62,6 +62,17 @@ class SimpleAdder {
     }
   }
 
+  // Returns the dot product of the int8 arrays a and b, accumulated in int32.
+  // Used for int8 weights.
+  CLD3_ATTRIBUTE_ALWAYS_INLINE static int32 Int8DotImpl(
+      const int8 *__restrict a, const int8 *__restrict b, uint32 size) {
+    int32 sum = 0;
+    for (uint32 i = 0; i < size; ++i) {
+      sum += a[i] * b[i];
+    }
+    return sum;
+  }
+
  private:
   float *dest_;
   int num_floats_;
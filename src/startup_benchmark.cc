@@ -0,0 +1,144 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Startup benchmark: measures the time from nothing to the first result of an
+// NNetLanguageIdentifier, for each way of getting a session: setting up a
+// model of its own (which parses the FML), setting one up from a model file
+// (with or without opening and mapping the file), sharing the built-in model,
+// or cloning a session.  The time of one prediction on a session that is
+// already warm is given for comparison.
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "base.h"
+#include "lang_id_nn_params.h"
+#include "language_id_model.h"
+#include "mmap_embedding_network_params.h"
+#include "model_file.h"
+#include "nnet_language_identifier.h"
+
+namespace chrome_lang_id {
+namespace startup_benchmark {
+
+// Number of sessions created for each way of getting one.
+const int kNumRepetitions = 50;
+
+// Model file written for the benchmark, in the working directory.
+const char kModelPath[] = "startup_benchmark.cld3";
+
+const char kText[] =
+    "This is the first request of the day, and we want to know its language "
+    "as soon as possible.";
+
+// Returns the time, in microseconds, to run first_result once.
+double TimeOnce(const std::function<string()> &first_result) {
+  const auto start = std::chrono::steady_clock::now();
+  const string language = first_result();
+  const auto end = std::chrono::steady_clock::now();
+  if (language != "en") std::cout << "  Unexpected language: " << language;
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Returns the average time, in microseconds, to run first_result.
+double TimeAverage(const std::function<string()> &first_result) {
+  double total = 0.0;
+  for (int i = 0; i < kNumRepetitions; ++i) total += TimeOnce(first_result);
+  return total / kNumRepetitions;
+}
+
+void RunBenchmarks() {
+  std::string error;
+  LangIdNNParams nn_params;
+  if (!model_file::WriteModelFile(nn_params, model_file::GetBuiltInModelSpec(),
+                                  kModelPath, &error)) {
+    std::cout << "Cannot write the model file: " << error << std::endl;
+    return;
+  }
+
+  std::cout << "Startup benchmark: time to the first result, "
+            << kNumRepetitions << " repetitions" << std::endl;
+
+  // The first session of the process also registers the feature functions.
+  std::cout << "  first session in the process:  "
+            << TimeOnce([&nn_params]() {
+                 NNetLanguageIdentifier lang_id(0, 1000, &nn_params);
+                 return lang_id.FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+  std::cout << "  own model (FML):               "
+            << TimeAverage([&nn_params]() {
+                 NNetLanguageIdentifier lang_id(0, 1000, &nn_params);
+                 return lang_id.FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+  std::cout << "  model file (open and set up):  "
+            << TimeAverage([]() {
+                 const std::unique_ptr<MmapEmbeddingNetworkParams> params =
+                     MmapEmbeddingNetworkParams::Open(kModelPath, nullptr);
+                 NNetLanguageIdentifier lang_id(
+                     std::make_shared<LanguageIdModel>(*params), 0, 1000);
+                 return lang_id.FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+  const std::unique_ptr<MmapEmbeddingNetworkParams> params =
+      MmapEmbeddingNetworkParams::Open(kModelPath, nullptr);
+  std::cout << "  model file (already open):     "
+            << TimeAverage([&params]() {
+                 NNetLanguageIdentifier lang_id(
+                     std::make_shared<LanguageIdModel>(*params), 0, 1000);
+                 return lang_id.FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+
+  // Set up the shared model before timing the sessions on it.
+  const std::shared_ptr<const LanguageIdModel> built_in_model =
+      LanguageIdModel::BuiltIn();
+  std::cout << "  shared built-in model:         "
+            << TimeAverage([]() {
+                 NNetLanguageIdentifier lang_id(0, 1000);
+                 return lang_id.FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+
+  NNetLanguageIdentifier prototype(0, 1000);
+  prototype.EnableScriptFastPath(
+      NNetLanguageIdentifier::kDefaultScriptDominanceThreshold);
+  std::cout << "  Clone():                       "
+            << TimeAverage([&prototype]() {
+                 return prototype.Clone()->FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+
+  prototype.FindLanguage(kText);
+  std::cout << "  prediction on a warm session:  "
+            << TimeAverage([&prototype]() {
+                 return prototype.FindLanguage(kText).language;
+               })
+            << " us" << std::endl;
+  std::remove(kModelPath);
+}
+
+}  // namespace startup_benchmark
+}  // namespace chrome_lang_id
+
+int main(int argc, char **argv) {
+  chrome_lang_id::startup_benchmark::RunBenchmarks();
+  return 0;
+}
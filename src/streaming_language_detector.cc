@@ -0,0 +1,189 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "streaming_language_detector.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "script_span/getonescriptspan.h"
+#include "script_span/utf8statetable.h"
+#include "cld_3/protos/sentence.pb.h"
+
+namespace chrome_lang_id {
+namespace {
+
+// Returns true if c is an ASCII whitespace char, which always ends a token.
+bool IsAsciiSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+// Returns true if c is the first byte of a UTF8 char.
+bool IsCharBoundary(char c) { return (c & 0xC0) != 0x80; }
+
+}  // namespace
+
+const int StreamingLanguageDetector::kMaxRunBytes = 256;
+
+StreamingLanguageDetector::StreamingLanguageDetector()
+    : StreamingLanguageDetector(std::make_shared<LanguageIdModel>()) {}
+
+StreamingLanguageDetector::StreamingLanguageDetector(
+    std::shared_ptr<const LanguageIdModel> model)
+    : StreamingLanguageDetector(
+          std::move(model), NNetLanguageIdentifier::kMinNumBytesToConsider) {}
+
+StreamingLanguageDetector::StreamingLanguageDetector(
+    std::shared_ptr<const LanguageIdModel> model, int min_num_bytes)
+    : identifier_(std::move(model), min_num_bytes,
+                  std::max(NNetLanguageIdentifier::kMaxNumBytesToConsider,
+                           min_num_bytes + 1)) {
+  scratch_.features_ =
+      std::vector<FeatureVector>(identifier_.model()->NumEmbeddings());
+  Reset();
+}
+
+StreamingLanguageDetector::~StreamingLanguageDetector() {}
+
+void StreamingLanguageDetector::Reset() {
+  pending_.clear();
+  scan_position_ = 0;
+  cut_position_ = 0;
+  run_begin_ = 0;
+  num_input_bytes_ = 0;
+  ulscript_ = CLD2::UNKNOWN_ULSCRIPT;
+  has_spans_ = false;
+  has_mixed_scripts_ = false;
+  num_predicted_bytes_ = 0;
+  done_ = false;
+  result_ = NNetLanguageIdentifier::Result();
+  scratch_.sentence_.mutable_text()->clear();
+  identifier_.model()->ResetRunningFeatures(&scratch_.workspaces_);
+}
+
+bool StreamingLanguageDetector::Append(const char *data, size_t size) {
+  if (!done_) {
+    const size_t num_bytes_left =
+        NNetLanguageIdentifier::kMaxNumInputBytesToConsider - num_input_bytes_;
+    const size_t num_bytes = std::min(size, num_bytes_left);
+    pending_.append(data, num_bytes);
+    num_input_bytes_ += num_bytes;
+    const bool end_of_input = (num_bytes == num_bytes_left);
+    ProcessPending(end_of_input);
+    if (end_of_input) done_ = true;
+    UpdateResult();
+  }
+  return done_ || result_.is_reliable;
+}
+
+void StreamingLanguageDetector::Finish() {
+  if (done_) return;
+  ProcessPending(/*end_of_input=*/true);
+  done_ = true;
+  UpdateResult();
+}
+
+void StreamingLanguageDetector::ProcessPending(bool end_of_input) {
+  // Find the cut points in the new bytes.  Tokens end at whitespace, so the
+  // text before a whitespace can be cleaned up separately from the text after
+  // it.  Runs without whitespace are cut every kMaxRunBytes bytes, and the
+  // text before such a cut is cleaned up on its own, wherever the chunks end.
+  int processed = 0;
+  const int size = pending_.size();
+  for (; scan_position_ < size && !done_; ++scan_position_) {
+    const char c = pending_[scan_position_];
+    if (IsAsciiSpace(c)) {
+      cut_position_ = scan_position_ + 1;
+      run_begin_ = scan_position_ + 1;
+    } else if (scan_position_ - run_begin_ >= kMaxRunBytes &&
+               IsCharBoundary(c)) {
+      ProcessText(processed, scan_position_);
+      processed = scan_position_;
+      cut_position_ = scan_position_;
+      run_begin_ = scan_position_;
+    }
+  }
+  if (!done_) {
+    const int end = end_of_input ? size : cut_position_;
+    if (end > processed) {
+      ProcessText(processed, end);
+      processed = end;
+    }
+  }
+  if (done_) {
+    pending_.clear();
+    return;
+  }
+
+  pending_.erase(0, processed);
+  scan_position_ -= processed;
+  cut_position_ -= processed;
+  run_begin_ -= processed;
+}
+
+void StreamingLanguageDetector::ProcessText(int begin, int end) {
+  const char *text = pending_.data() + begin;
+  const int num_valid_bytes = CLD2::SpanInterchangeValid(text, end - begin);
+  if (num_valid_bytes < end - begin) done_ = true;
+  if (num_valid_bytes == 0) return;
+
+  // Clean up the text (e.g., remove digits and punctuation) as FindLanguage
+  // does.
+  CLD2::ScriptScanner &ss = scratch_.script_scanner_;
+  ss.Reset(text, num_valid_bytes);
+  CLD2::LangSpan script_span;
+  string *cleaned = scratch_.sentence_.mutable_text();
+  while (ss.GetOneScriptSpanLower(&script_span)) {
+    // script_span has spaces at the beginning and the end.  Drop the leading
+    // one after a space, so that the cleaned-up text does not depend on where
+    // the input was cut.
+    const char *span_text = script_span.text;
+    int span_size = script_span.text_bytes;
+    if (span_size > 0 && span_text[0] == ' ' && !cleaned->empty() &&
+        cleaned->back() == ' ') {
+      ++span_text;
+      --span_size;
+    }
+    cleaned->append(span_text, span_size);
+
+    if (!has_spans_) {
+      ulscript_ = script_span.ulscript;
+      has_spans_ = true;
+    } else if (script_span.ulscript != ulscript_) {
+      has_mixed_scripts_ = true;
+    }
+  }
+}
+
+void StreamingLanguageDetector::UpdateResult() {
+  Sentence &sentence = scratch_.sentence_;
+  const int num_bytes = sentence.text().size();
+  if (num_bytes == num_predicted_bytes_ ||
+      num_bytes < identifier_.min_num_bytes_) {
+    return;
+  }
+  num_predicted_bytes_ = num_bytes;
+
+  const LanguageIdModel &model = *identifier_.model();
+  model.UpdateRunningFeatures(
+      &sentence, has_mixed_scripts_ ? CLD2::UNKNOWN_ULSCRIPT : ulscript_,
+      &scratch_.workspaces_, &scratch_.features_);
+  model.network().ComputeFinalScores(
+      scratch_.features_, &scratch_.network_scratch_, &scratch_.scores_);
+  result_ = identifier_.GetResultFromScores(scratch_.scores_.data());
+}
+
+}  // namespace chrome_lang_id
@@ -0,0 +1,140 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef STREAMING_LANGUAGE_DETECTOR_H_
+#define STREAMING_LANGUAGE_DETECTOR_H_
+
+#include <memory>
+#include <string>
+
+#include "base.h"
+#include "language_id_model.h"
+#include "nnet_language_identifier.h"
+#include "script_span/generated_ulscript.h"
+
+namespace chrome_lang_id {
+
+// Detects the language of a document that arrives in chunks, e.g., the body of
+// an HTTP response, without buffering the whole document.
+//
+// The chunks may split tokens and UTF8 chars anywhere.  The detector only holds
+// back the bytes after the last whitespace of the input (or, for long runs
+// without whitespace, after the last char boundary every kMaxRunBytes bytes):
+// the text before is cleaned up right away, and the feature functions keep
+// running counts over the cleaned-up text (see kRunningCountsWorkspaceName), so
+// each chunk only costs the counting of its own text plus one run of the
+// network.  The cut points do not depend on how the input is split into
+// chunks, so neither does the prediction.
+//
+// As with NNetLanguageIdentifier::FindLanguage, only the first
+// kMaxNumInputBytesToConsider bytes of the input are considered, up to the
+// first byte that is not interchange valid UTF8.  Unlike FindLanguage, the
+// prediction is made on all the cleaned-up text seen so far, rather than on
+// snippets of at most max_num_bytes bytes, and repetitive chunks are not
+// squeezed out.
+//
+// A StreamingLanguageDetector is not thread-safe, but detectors on a shared
+// LanguageIdModel may be used concurrently.
+class StreamingLanguageDetector {
+ public:
+  // Uses a new model with the built-in network parameters.
+  StreamingLanguageDetector();
+
+  // Uses a model shared with other detectors or identifiers.  The prediction
+  // requires at least min_num_bytes bytes of cleaned-up text; until then, the
+  // result is kUnknown.
+  explicit StreamingLanguageDetector(
+      std::shared_ptr<const LanguageIdModel> model);
+  StreamingLanguageDetector(std::shared_ptr<const LanguageIdModel> model,
+                            int min_num_bytes);
+  ~StreamingLanguageDetector();
+
+  // Feeds the next size bytes of the input and updates the result.  Returns
+  // true if the caller can stop feeding the input, i.e., if the result is
+  // reliable or done() is true.
+  bool Append(const char *data, size_t size);
+  bool Append(const string &data) { return Append(data.data(), data.size()); }
+
+  // Marks the end of the input: the bytes held back are processed, and the
+  // result is updated.
+  void Finish();
+
+  // Starts over with a new document.  Keeps the buffers.
+  void Reset();
+
+  // Returns the prediction for the input seen so far.  The proportion is 1 and
+  // there are no byte ranges.
+  const NNetLanguageIdentifier::Result &result() const { return result_; }
+
+  // Returns true if the rest of the input would be ignored: Finish() has been
+  // called, kMaxNumInputBytesToConsider bytes have been fed, or the input is
+  // not interchange valid UTF8.
+  bool done() const { return done_; }
+
+  // Maximum number of bytes without whitespace held back before the detector
+  // cuts the text at a char boundary.
+  static const int kMaxRunBytes;
+
+ private:
+  // Processes the bytes of pending_ up to the last cut point, or all of them
+  // if end_of_input is true.
+  void ProcessPending(bool end_of_input);
+
+  // Cleans up the text of pending_ in [begin, end) and appends it to the text
+  // of the sentence.  Sets done_ if the text is not all interchange valid UTF8.
+  void ProcessText(int begin, int end);
+
+  // Updates result_ if the text of the sentence grew since the last update.
+  void UpdateResult();
+
+  // Session whose model, minimum number of bytes and result computation are
+  // used.
+  NNetLanguageIdentifier identifier_;
+
+  // The sentence (all the cleaned-up text so far), the workspaces with the
+  // running counts, and the other buffers.
+  InferenceScratch scratch_;
+
+  // Bytes of the input not processed yet.
+  string pending_;
+
+  // Position in pending_ of the next byte to scan for cut points, of the last
+  // cut point, and of the beginning of the current run without whitespace.
+  int scan_position_ = 0;
+  int cut_position_ = 0;
+  int run_begin_ = 0;
+
+  // Number of bytes of the input fed so far, up to
+  // kMaxNumInputBytesToConsider.
+  int num_input_bytes_ = 0;
+
+  // Script of all the spans of the cleaned-up text, if there are spans and
+  // they have the same script.
+  CLD2::ULScript ulscript_ = CLD2::UNKNOWN_ULSCRIPT;
+  bool has_spans_ = false;
+  bool has_mixed_scripts_ = false;
+
+  // Size of the text of the sentence when result_ was last updated.
+  int num_predicted_bytes_ = 0;
+
+  bool done_ = false;
+  NNetLanguageIdentifier::Result result_;
+
+  CLD3_DISALLOW_COPY_AND_ASSIGN(StreamingLanguageDetector);
+};
+
+}  // namespace chrome_lang_id
+
+#endif  // STREAMING_LANGUAGE_DETECTOR_H_
@@ -130,6 +130,11 @@ inline uint32 DecodeFixed32(const char *ptr) {
           (static_cast<uint32>(static_cast<unsigned char>(ptr[3])) << 24));
 }
 
+inline uint64 DecodeFixed64(const char *ptr) {
+  return static_cast<uint64>(DecodeFixed32(ptr)) |
+         (static_cast<uint64>(DecodeFixed32(ptr + 4)) << 32);
+}
+
 // 0xff is in case char is signed.
 static inline uint32 ByteAs32(char c) { return static_cast<uint32>(c) & 0xff; }
 }  // namespace
@@ -182,6 +187,38 @@ uint32 Hash32WithDefaultSeed(const string &input) {
   return Hash32(input.data(), input.size(), 0xBEEF);
 }
 
+uint64 Hash64(const char *data, size_t n, uint64 seed) {
+  const uint64 m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+
+  uint64 h = seed ^ (n * m);
+
+  // Mix 8 bytes at a time into the hash
+  while (n >= 8) {
+    uint64 k = DecodeFixed64(data);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+    data += 8;
+    n -= 8;
+  }
+
+  // Handle the last few bytes of the input array
+  if (n > 0) {
+    for (size_t i = n; i > 0; --i) {
+      h ^= static_cast<uint64>(ByteAs32(data[i - 1])) << (8 * (i - 1));
+    }
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
 PunctuationUtil::CharacterRange PunctuationUtil::kPunctuation[] = {
     {33, 35},       {37, 42},       {44, 47},       {58, 59},
     {63, 64},       {91, 93},       {95, 95},       {123, 123},
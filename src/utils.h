@@ -58,6 +58,10 @@ uint32 Hash32(const char *data, size_t n, uint32 seed);
 
 uint32 Hash32WithDefaultSeed(const string &input);
 
+// 64-bit variant of Hash32 (MurmurHash64A), for keys that should practically
+// never collide, e.g., whole texts.
+uint64 Hash64(const char *data, size_t n, uint64 seed);
+
 // Deletes all the elements in an STL container and clears the container. This
 // function is suitable for use with a vector, set, hash_set, or any other STL
 // container which defines sensible begin(), end(), and clear() methods.
@@ -23,6 +23,7 @@ limitations under the License.
 #include <stddef.h>
 #include <string>
 #include <typeindex>
+#include <typeinfo>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -53,6 +54,21 @@ class WorkspaceRegistry {
   WorkspaceRegistry();
   ~WorkspaceRegistry();
 
+  // Returns the index of a named workspace of type W, adding it to the
+  // registry if needed.  Feature functions that request the same type and name
+  // share the workspace.
+  template <class W>
+  int Request(const string &name) {
+    const std::type_index id = std::type_index(typeid(W));
+    workspace_types_[id] = W::TypeName();
+    std::vector<string> &names = workspace_names_[id];
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name) return i;
+    }
+    names.push_back(name);
+    return names.size() - 1;
+  }
+
   const std::unordered_map<std::type_index, std::vector<std::string>>
       &WorkspaceNames() const {
     return workspace_names_;
@@ -79,24 +95,127 @@ class WorkspaceSet {
   WorkspaceSet();
   ~WorkspaceSet();
 
+  // Returns true if a workspace of type W has been set at index.
+  template <class W>
+  bool Has(int index) const {
+    const auto it = workspaces_.find(std::type_index(typeid(W)));
+    CLD3_DCHECK(it != workspaces_.end());
+    CLD3_DCHECK(index >= 0 && index < static_cast<int>(it->second.size()));
+    return it->second[index].workspace != nullptr;
+  }
+
+  // Returns the workspace of type W at index.  The workspace must be set.
+  template <class W>
+  const W &Get(int index) const {
+    CLD3_DCHECK(Has<W>(index));
+    const Workspace *workspace =
+        workspaces_.find(std::type_index(typeid(W)))->second[index].workspace;
+    return static_cast<const W &>(*workspace);
+  }
+
+  // Mutable version of Get(), for use during preprocessing.
+  template <class W>
+  W *MutableGet(int index) {
+    CLD3_DCHECK(Has<W>(index));
+    Workspace *workspace =
+        workspaces_[std::type_index(typeid(W))][index].workspace;
+    return static_cast<W *>(workspace);
+  }
+
+  // Sets the workspace of type W at index, taking ownership of workspace and
+  // deleting the previous one, if any.
+  template <class W>
+  void Set(int index, W *workspace) {
+    std::vector<Slot> &slots = workspaces_[std::type_index(typeid(W))];
+    CLD3_DCHECK(index >= 0 && index < static_cast<int>(slots.size()));
+    if (slots[index].workspace != nullptr) {
+      CLD3_DCHECK(slots[index].workspace != workspace);
+      delete slots[index].workspace;
+    }
+    slots[index].workspace = workspace;
+  }
+
+  // Returns the spare workspace of type W at index, i.e., the one set before
+  // the last call to Recycle(), or nullptr if there is none.  The caller takes
+  // ownership of it, and typically re-aims it at a new object and Set()s it
+  // back.
+  template <class W>
+  W *TakeSpare(int index) {
+    std::vector<Slot> &slots = workspaces_[std::type_index(typeid(W))];
+    CLD3_DCHECK(index >= 0 && index < static_cast<int>(slots.size()));
+    Workspace *spare = slots[index].spare;
+    slots[index].spare = nullptr;
+    return static_cast<W *>(spare);
+  }
+
+  // Deallocates the current workspaces and makes room for the workspaces in
+  // registry.  Resetting a WorkspaceSet repeatedly with the same registry
+  // reuses the existing storage instead of allocating new one.
   void Reset(const WorkspaceRegistry &registry) {
     // Deallocate current workspaces.
     for (auto &it : workspaces_) {
-      for (size_t index = 0; index < it.second.size(); ++index) {
-        delete it.second[index];
+      for (Slot &slot : it.second) {
+        delete slot.workspace;
+        delete slot.spare;
+        slot.workspace = nullptr;
+        slot.spare = nullptr;
       }
     }
-    workspaces_.clear();
+    Resize(registry);
+  }
 
-    // Allocate space for new workspaces.
-    for (auto &it : registry.WorkspaceNames()) {
-      workspaces_[it.first].resize(it.second.size());
+  // Like Reset(), but keeps the current workspaces as spares, for TakeSpare().
+  // A spare is deallocated when a newer one replaces it, or by Reset().
+  void Recycle(const WorkspaceRegistry &registry) {
+    for (auto &it : workspaces_) {
+      for (Slot &slot : it.second) {
+        if (slot.workspace == nullptr) continue;
+        delete slot.spare;
+        slot.spare = slot.workspace;
+        slot.workspace = nullptr;
+      }
     }
+    Resize(registry);
   }
 
  private:
+  // A workspace and the spare kept by Recycle(), each of them owned or
+  // nullptr.
+  struct Slot {
+    Workspace *workspace = nullptr;
+    Workspace *spare = nullptr;
+  };
+
+  // Makes room for the workspaces in registry, deallocating those that do not
+  // fit in it.
+  void Resize(const WorkspaceRegistry &registry) {
+    for (auto &it : registry.WorkspaceNames()) {
+      std::vector<Slot> &slots = workspaces_[it.first];
+      for (size_t index = it.second.size(); index < slots.size(); ++index) {
+        delete slots[index].workspace;
+        delete slots[index].spare;
+      }
+      slots.resize(it.second.size());
+    }
+
+    // Drop the workspace types that are not in registry.
+    if (workspaces_.size() != registry.WorkspaceNames().size()) {
+      for (auto it = workspaces_.begin(); it != workspaces_.end();) {
+        if (registry.WorkspaceNames().count(it->first) == 0) {
+          for (Slot &slot : it->second) {
+            delete slot.workspace;
+            delete slot.spare;
+          }
+          it = workspaces_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+
   // The set of workspaces, indexed as workspaces_[typeid][index].
-  std::unordered_map<std::type_index, std::vector<Workspace *>> workspaces_;
+  std::unordered_map<std::type_index, std::vector<Slot>> workspaces_;
 };
 
 // A workspace that wraps around a single int.